@@ -0,0 +1,58 @@
+#pragma once
+
+extern "C" {
+#include <base/hash.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// A weighted consistent hash ring in the style of ketama. Each member owns
+// points on a 32-bit ring in proportion to its weight, and a key belongs to
+// the member owning the first point at or after the key's hash. Adding or
+// removing a member only moves the keys that member gains or loses.
+//
+// A member's points depend only on its id, and lowering its weight drops its
+// last points, so reweighting a member only moves keys to or from that
+// member.
+class HashRing {
+ public:
+  // the points given to a member of weight 1.0.
+  static constexpr unsigned int kPointsPerWeight = 160;
+
+  struct Member {
+    // a stable identity, such as the backend's address.
+    uint64_t id;
+    // the share of keys relative to the other members (0 for none).
+    double weight;
+  };
+
+  HashRing() {}
+
+  explicit HashRing(const std::vector<Member> &members) {
+    for (unsigned int i = 0; i < members.size(); i++) {
+      unsigned int npoints =
+          std::lround(std::max(0.0, members[i].weight) * kPointsPerWeight);
+      uint64_t seed = hash_city_one(members[i].id);
+      for (unsigned int p = 0; p < npoints; p++)
+        points_.emplace_back(hash_city_one(seed + p) >> 32, i);
+    }
+    std::sort(points_.begin(), points_.end());
+  }
+
+  // Returns the index (into the members given at construction) of the member
+  // that owns @hash. The ring must not be empty.
+  unsigned int Lookup(uint32_t hash) const {
+    auto it = std::lower_bound(points_.begin(), points_.end(),
+                               std::make_pair(hash, 0U));
+    if (it == points_.end()) it = points_.begin();
+    return it->second;
+  }
+
+  bool empty() const { return points_.empty(); }
+
+ private:
+  std::vector<std::pair<uint32_t, unsigned int>> points_;
+};
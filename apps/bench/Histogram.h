@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// A log-linear histogram in the style of HdrHistogram: values are bucketed
+// by power of two, and each power of two is split into 2^kSubBits linear
+// sub-buckets, bounding the relative error to about 3%.
+class Histogram {
+ public:
+  Histogram() : counts_(kNrBuckets, 0) {}
+
+  void Record(uint64_t v) {
+    counts_[Index(v)]++;
+    count_++;
+    sum_ += v;
+    min_ = std::min(min_, v);
+    max_ = std::max(max_, v);
+  }
+
+  void Merge(const Histogram &h) {
+    for (size_t i = 0; i < kNrBuckets; i++) counts_[i] += h.counts_[i];
+    count_ += h.count_;
+    sum_ += h.sum_;
+    min_ = std::min(min_, h.min_);
+    max_ = std::max(max_, h.max_);
+  }
+
+  // Removes the values of @h, an earlier snapshot of this histogram. min()
+  // and max() still cover the values removed.
+  void Subtract(const Histogram &h) {
+    for (size_t i = 0; i < kNrBuckets; i++) counts_[i] -= h.counts_[i];
+    count_ -= h.count_;
+    sum_ -= h.sum_;
+  }
+
+  // Returns the value at percentile @p (0 to 100).
+  uint64_t Percentile(double p) const {
+    if (!count_) return 0;
+    uint64_t target = std::ceil(p / 100.0 * count_), seen = 0;
+    target = std::max<uint64_t>(target, 1);
+    for (size_t i = 0; i < kNrBuckets; i++) {
+      seen += counts_[i];
+      if (seen >= target) return std::min(Value(i), max_);
+    }
+    return max_;
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const {
+    return count_ ? static_cast<double>(sum_) / count_ : 0;
+  }
+
+  // Calls @fn(value, count) for every non-empty bucket.
+  void ForEachBucket(std::function<void(uint64_t, uint64_t)> fn) const {
+    for (size_t i = 0; i < kNrBuckets; i++)
+      if (counts_[i]) fn(Value(i), counts_[i]);
+  }
+
+ private:
+  static constexpr int kSubBits = 5;
+  static constexpr size_t kSubBuckets = 1 << kSubBits;
+  static constexpr size_t kNrBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  static size_t Index(uint64_t v) {
+    if (v < kSubBuckets) return v;
+    int shift = 63 - __builtin_clzll(v) - kSubBits;
+    return ((shift + 1) << kSubBits) + ((v >> shift) - kSubBuckets);
+  }
+
+  // Returns the middle of bucket @i.
+  static uint64_t Value(size_t i) {
+    if (i < kSubBuckets) return i;
+    int shift = (i >> kSubBits) - 1;
+    uint64_t lo = (kSubBuckets + (i & (kSubBuckets - 1))) << shift;
+    return lo + ((1UL << shift) >> 1);
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
@@ -1,6 +1,7 @@
 
 extern "C" {
 #include <base/byteorder.h>
+#include <base/hash.h>
 #include <base/log.h>
 #include <runtime/runtime.h>
 #include <runtime/smalloc.h>
@@ -11,80 +12,249 @@ extern "C" {
 #include "net.h"
 #include "sync.h"
 #include "thread.h"
+#include "timer.h"
 
+#include <algorithm>
 #include <cstring>
 #include <memory>
-#include <unordered_map>
 #include <vector>
 
 #include "RpcManager.h"
 
 template <class T>
 struct RequestTracker {
-  rt::WaitGroup *wg;
+  typename RpcEndpoint<T>::Callback done;
+  void *arg;
   uint32_t prev_reqid;
   Rpc<T> *rpc;
+  uint64_t start_us;
 };
 
+// A connection with many requests in flight. Each request takes a slot in a
+// fixed table and uses its index as the request id on the wire, so the
+// receive thread finds its tracker directly.
+//
+// Sends are combined: a submitter queues its request and, unless another
+// thread is already writing, writes every queued request with one writev()
+// (and so in as few segments as possible) until the queue is empty.
 template <class T>
 class RpcEndpointConnection {
  public:
-  RpcEndpointConnection(std::unique_ptr<rt::TcpConn> conn);
-  int SubmitRequest(rt::WaitGroup *wg, Rpc<T> *rpc);
+  RpcEndpointConnection(std::unique_ptr<rt::TcpConn> conn,
+                        unsigned int max_inflight);
+  int SubmitRequest(Rpc<T> *rpc, typename RpcEndpoint<T>::Callback done,
+                    void *arg);
+
+  uint64_t Outstanding() const {
+    return outstanding_.load(std::memory_order_relaxed);
+  }
+  void Stats(RpcEndpointStats *st);
 
  private:
+  // the most vectors handed to one writev().
+  static constexpr int kMaxBatchIov = 64;
+
+  void ReceiveLoop();
+  void Flush();
+
   std::unique_ptr<rt::TcpConn> conn_;
+  std::atomic<uint64_t> outstanding_{0};
+
+  // protects the slots, the send queue and the counters below
   rt::Mutex lock_;
-  std::unordered_map<uint64_t, RequestTracker<T>> reqs_;
-  size_t req_id_ctr_{0};
+  rt::CondVar slot_cv_;
+  std::vector<RequestTracker<T>> slots_;
+  std::vector<uint32_t> free_slots_;
+  std::vector<struct iovec> pending_;
+  bool flushing_{false};
+  uint64_t writes_{0};
+  uint64_t sent_{0};
+
+  rt::Spin hist_lock_;
+  Histogram hist_;
 };
 
 template <class T>
 RpcEndpointConnection<T>::RpcEndpointConnection(
-    std::unique_ptr<rt::TcpConn> conn)
-    : conn_(std::move(conn)) {
-  rt::Thread([=] {
-    while (true) {
-      T hdr;
-      ssize_t rret = conn_->ReadFull(&hdr, sizeof(hdr));
-      if (rret != static_cast<ssize_t>(sizeof(hdr))) BUG();
-
-      uint32_t reqid = hdr.get_reqid();
-      lock_.Lock();
-      RequestTracker<T> &rr = reqs_.at(reqid);
-      RequestTracker<T> req = rr;
-      BUG_ON(reqs_.erase(reqid) != 1);
-      lock_.Unlock();
-
-      hdr.set_reqid(req.prev_reqid);
-      req.rpc->rsp = hdr;
-
-      BUG_ON(hdr.get_body_len() > req.rpc->rsp_body_len);
-      if (hdr.get_body_len() > 0) {
-        rret = conn_->ReadFull(req.rpc->rsp_body, hdr.get_body_len());
-        if (rret <= 0) BUG();
-      }
-
-      req.wg->Done();
+    std::unique_ptr<rt::TcpConn> conn, unsigned int max_inflight)
+    : conn_(std::move(conn)), slots_(max_inflight) {
+  free_slots_.reserve(max_inflight);
+  for (unsigned int i = max_inflight; i > 0; i--) free_slots_.push_back(i - 1);
+  rt::Thread([this] { ReceiveLoop(); }).Detach();
+}
+
+template <class T>
+void RpcEndpointConnection<T>::ReceiveLoop() {
+  while (true) {
+    T hdr;
+    ssize_t rret = conn_->ReadFull(&hdr, sizeof(hdr));
+    if (rret != static_cast<ssize_t>(sizeof(hdr))) BUG();
+
+    uint32_t slot = hdr.get_reqid();
+    BUG_ON(slot >= slots_.size());
+    // the slot is not reused until it is freed below
+    RequestTracker<T> req = slots_[slot];
+
+    hdr.set_reqid(req.prev_reqid);
+    req.rpc->rsp = hdr;
+
+    BUG_ON(hdr.get_body_len() > req.rpc->rsp_body_len);
+    if (hdr.get_body_len() > 0) {
+      rret = conn_->ReadFull(req.rpc->rsp_body, hdr.get_body_len());
+      if (rret <= 0) BUG();
     }
-  })
-      .Detach();
+
+    {
+      rt::SpinGuard g(&hist_lock_);
+      hist_.Record(rt::MicroTime() - req.start_us);
+    }
+
+    lock_.Lock();
+    free_slots_.push_back(slot);
+    // each free slot can admit one waiter, even if others are queued
+    slot_cv_.Signal();
+    lock_.Unlock();
+    outstanding_.fetch_sub(1, std::memory_order_relaxed);
+
+    req.done(req.rpc, req.arg);
+  }
+}
+
+template <class T>
+int RpcEndpointConnection<T>::SubmitRequest(
+    Rpc<T> *r, typename RpcEndpoint<T>::Callback done, void *arg) {
+  uint32_t prev_reqid = r->req.get_reqid();
+  uint64_t now = rt::MicroTime();
+
+  outstanding_.fetch_add(1, std::memory_order_relaxed);
+  lock_.Lock();
+  while (free_slots_.empty()) slot_cv_.Wait(&lock_);
+  uint32_t slot = free_slots_.back();
+  free_slots_.pop_back();
+  slots_[slot] = {done, arg, prev_reqid, r, now};
+  r->req.set_reqid(slot);
+
+  pending_.push_back({&r->req, sizeof(r->req)});
+  if (r->req_body_len) pending_.push_back({r->req_body, r->req_body_len});
+  sent_++;
+
+  // somebody else is writing and will pick this request up
+  if (flushing_) {
+    lock_.Unlock();
+    return 0;
+  }
+  flushing_ = true;
+  Flush();
+  flushing_ = false;
+  lock_.Unlock();
+  return 0;
+}
+
+// Writes the send queue until it is empty. Called with the lock held, which
+// is dropped while writing.
+template <class T>
+void RpcEndpointConnection<T>::Flush() {
+  std::vector<struct iovec> batch;
+
+  while (!pending_.empty()) {
+    batch.swap(pending_);
+    writes_ += (batch.size() + kMaxBatchIov - 1) / kMaxBatchIov;
+    lock_.Unlock();
+
+    for (size_t i = 0; i < batch.size(); i += kMaxBatchIov) {
+      int n = std::min<size_t>(kMaxBatchIov, batch.size() - i);
+      ssize_t len = 0;
+      for (int j = 0; j < n; j++) len += batch[i + j].iov_len;
+      ssize_t wret = WritevFull_(conn_.get(), &batch[i], n);
+      if (wret != len) BUG();
+    }
+    batch.clear();
+
+    lock_.Lock();
+  }
+}
+
+template <class T>
+void RpcEndpointConnection<T>::Stats(RpcEndpointStats *st) {
+  st->outstanding += Outstanding();
+  {
+    rt::MutexGuard g(&lock_);
+    st->writes += writes_;
+    st->sent += sent_;
+  }
+  rt::SpinGuard g(&hist_lock_);
+  st->latency.Merge(hist_);
 }
 
 template <class T>
-RpcEndpoint<T> *RpcEndpoint<T>::Create(netaddr remote) {
-  std::vector<std::unique_ptr<rt::TcpConn>> conns;
-  for (int i = 0; i < runtime_max_cores(); i++) {
-    rt::TcpConn *c = rt::TcpConn::DialAffinity(i, remote);
-    if (!c) return nullptr;
-    conns.emplace_back(c);
+RpcEndpoint<T>::RpcEndpoint(netaddr remote, const RpcEndpointConfig &cfg)
+    : remote_(remote), cfg_(cfg) {
+  if (cfg_.max_conns == 0) cfg_.max_conns = runtime_max_cores();
+  cfg_.min_conns = std::max(1U, std::min(cfg_.min_conns, cfg_.max_conns));
+  conns_.reset(new std::atomic<RpcEndpointConnection<T> *>[cfg_.max_conns]);
+  for (unsigned int i = 0; i < cfg_.max_conns; i++) conns_[i] = nullptr;
+}
+
+template <class T>
+RpcEndpoint<T> *RpcEndpoint<T>::Create(netaddr remote,
+                                       const RpcEndpointConfig &cfg) {
+  auto ep = new RpcEndpoint<T>(remote, cfg);
+  for (unsigned int i = 0; i < ep->cfg_.min_conns; i++) {
+    if (!ep->Dial()) {
+      delete ep;
+      return nullptr;
+    }
   }
+  return ep;
+}
+
+// Adds a connection to the pool. Called by one thread at a time.
+template <class T>
+bool RpcEndpoint<T>::Dial() {
+  unsigned int n = nconns_.load(std::memory_order_relaxed);
+  if (n == cfg_.max_conns) return false;
+
+  // spread the connections' affinity over the cores
+  rt::TcpConn *c = rt::TcpConn::DialAffinity(n % runtime_max_cores(), remote_);
+  if (!c) return false;
 
-  std::vector<RpcEndpointConnection<T> *> epcs;
-  for (auto &w : conns)
-    epcs.push_back(new RpcEndpointConnection<T>(std::move(w)));
+  conns_[n].store(new RpcEndpointConnection<T>(std::unique_ptr<rt::TcpConn>(c),
+                                               cfg_.max_inflight),
+                  std::memory_order_relaxed);
+  nconns_.store(n + 1, std::memory_order_release);
+  return true;
+}
+
+// Picks the less loaded of the connection with this core's affinity and a
+// random other one (the power of two choices), which comes close to the least
+// loaded connection without scanning them all.
+template <class T>
+RpcEndpointConnection<T> *RpcEndpoint<T>::PickConnection() {
+  unsigned int n = nconns_.load(std::memory_order_acquire);
+  RpcEndpointConnection<T> *a =
+      conns_[get_current_affinity() % n].load(std::memory_order_relaxed);
+  if (n == 1) return a;
+
+  RpcEndpointConnection<T> *b =
+      conns_[rand_crc32c(n) % n].load(std::memory_order_relaxed);
+  return b->Outstanding() < a->Outstanding() ? b : a;
+}
+
+// Dials another connection in the background if even the chosen (least
+// loaded) connection is backed up.
+template <class T>
+void RpcEndpoint<T>::MaybeGrow(RpcEndpointConnection<T> *least) {
+  if (least->Outstanding() < cfg_.grow_outstanding) return;
+  if (nconns_.load(std::memory_order_relaxed) == cfg_.max_conns) return;
+  if (dialing_.exchange(true, std::memory_order_acquire)) return;
 
-  return new RpcEndpoint<T>(epcs);
+  rt::Thread([this] {
+    if (!Dial() && nconns_.load(std::memory_order_relaxed) < cfg_.max_conns) {
+      log_warn_ratelimited("rpc: couldn't grow the connection pool");
+    }
+    dialing_.store(false, std::memory_order_release);
+  })
+      .Detach();
 }
 
 template <class T>
@@ -100,27 +270,25 @@ int RpcEndpoint<T>::SubmitRequestBlocking(Rpc<T> *req) {
 
 template <class T>
 int RpcEndpoint<T>::SubmitRequestAsync(rt::WaitGroup *wg, Rpc<T> *r) {
-  int idx = get_current_affinity();
-  return connections_.at(idx)->SubmitRequest(wg, r);
+  return SubmitRequestAsync(
+      r, [](Rpc<T> *, void *arg) { static_cast<rt::WaitGroup *>(arg)->Done(); },
+      wg);
 }
 
 template <class T>
-int RpcEndpointConnection<T>::SubmitRequest(rt::WaitGroup *wg, Rpc<T> *r) {
-  struct iovec iov[2];
-  iov[0].iov_base = &r->req;
-  iov[0].iov_len = sizeof(r->req);
-  iov[1].iov_base = r->req_body;
-  iov[1].iov_len = r->req_body_len;
-
-  uint32_t prev_reqid = r->req.get_reqid();
-  rt::ScopedLock<rt::Mutex> l(&lock_);
-  r->req.set_reqid(req_id_ctr_);
-  reqs_[req_id_ctr_++] = {wg, prev_reqid, r};
-
-  ssize_t wret = WritevFull_(conn_.get(), iov, 2);
-  if (wret != static_cast<ssize_t>(sizeof(T) + r->req_body_len)) BUG();
+int RpcEndpoint<T>::SubmitRequestAsync(Rpc<T> *r, Callback done, void *arg) {
+  RpcEndpointConnection<T> *c = PickConnection();
+  MaybeGrow(c);
+  return c->SubmitRequest(r, done, arg);
+}
 
-  return 0;
+template <class T>
+RpcEndpointStats RpcEndpoint<T>::Stats() {
+  RpcEndpointStats st{};
+  st.conns = nconns_.load(std::memory_order_acquire);
+  for (unsigned int i = 0; i < st.conns; i++)
+    conns_[i].load(std::memory_order_relaxed)->Stats(&st);
+  return st;
 }
 
 ssize_t WritevFull_(rt::TcpConn *c, const struct iovec *iov, int iovcnt) {
@@ -5,10 +5,15 @@ extern "C" {
 #include <runtime/smalloc.h>
 }
 
+#include "Histogram.h"
 #include "net.h"
 #include "sync.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <memory>
+#include <vector>
 
 template <class ProtoHdr>
 struct Rpc {
@@ -21,19 +26,66 @@ struct Rpc {
   size_t rsp_body_len;
 };
 
+struct RpcEndpointConfig {
+  // the connections dialed up front.
+  unsigned int min_conns{1};
+  // the most connections to grow to (0 means one per runtime core).
+  unsigned int max_conns{0};
+  // dial another connection once the least loaded one has this many
+  // requests outstanding.
+  unsigned int grow_outstanding{4};
+  // the requests in flight on one connection before submitters block.
+  unsigned int max_inflight{1024};
+};
+
+struct RpcEndpointStats {
+  unsigned int conns;
+  // requests sent but not yet answered.
+  uint64_t outstanding;
+  // the writev() calls made to send requests, and the requests they carried.
+  uint64_t writes;
+  uint64_t sent;
+  // microseconds from submission to the response body being read.
+  Histogram latency;
+};
+
 template <class T>
 class RpcEndpointConnection;
+
+// A client for one backend. Requests are pipelined over a pool of
+// connections and matched to responses by the header's request id, so a
+// response may complete a different thread's request than the last one sent.
 template <class T>
 class RpcEndpoint {
  public:
+  // Called from a connection's receive thread once the response is read, so
+  // it must not block.
+  using Callback = void (*)(Rpc<T> *r, void *arg);
+
+  // Sends a request and parks until its response has arrived.
   int SubmitRequestBlocking(Rpc<T> *r);
+  // Sends a request and calls wg->Done() once its response has arrived.
   int SubmitRequestAsync(rt::WaitGroup *wg, Rpc<T> *r);
-  static RpcEndpoint *Create(netaddr remote);
+  // Sends a request and calls @done(@r, @arg) once its response has arrived.
+  int SubmitRequestAsync(Rpc<T> *r, Callback done, void *arg);
+
+  RpcEndpointStats Stats();
+
+  static RpcEndpoint *Create(netaddr remote, const RpcEndpointConfig &cfg = {});
 
  private:
-  RpcEndpoint(std::vector<RpcEndpointConnection<T> *> connections)
-      : connections_(std::move(connections)) {}
-  std::vector<RpcEndpointConnection<T> *> connections_;
+  RpcEndpoint(netaddr remote, const RpcEndpointConfig &cfg);
+
+  RpcEndpointConnection<T> *PickConnection();
+  void MaybeGrow(RpcEndpointConnection<T> *least);
+  bool Dial();
+
+  const netaddr remote_;
+  RpcEndpointConfig cfg_;
+  // connections are only ever added, so readers need no lock
+  std::unique_ptr<std::atomic<RpcEndpointConnection<T> *>[]> conns_;
+  std::atomic<unsigned int> nconns_{0};
+  std::atomic<bool> dialing_{false};
 };
 
 ssize_t WritevFull_(rt::TcpConn *c, const struct iovec *iov, int iovcnt);
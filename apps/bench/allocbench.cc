@@ -0,0 +1,201 @@
+// allocbench.cc - container-heavy workloads with glibc against the
+// allocators in bindings/cc/alloc.h
+//
+// Each thread churns its own container (inserting and erasing keys so that
+// nodes are allocated and freed at a steady rate), and all threads run at
+// once. The same workload runs with std::allocator (glibc),
+// rt::PoolAllocator (tcache pools), rt::SmallocAllocator, and std::pmr
+// containers on rt::SmallocResource.
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "alloc.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the operations per thread in each run.
+uint64_t ops;
+// the thread counts to sweep.
+std::vector<int> thread_counts = {1, 4, 16};
+
+// the keys live in each container at steady state.
+constexpr uint64_t kLiveKeys = 4096;
+
+template <typename K, typename V, template <typename> class A>
+using Map = std::map<K, V, std::less<K>, A<std::pair<const K, V>>>;
+template <typename K, typename V, template <typename> class A>
+using HashMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                   A<std::pair<const K, V>>>;
+template <typename T, template <typename> class A>
+using List = std::list<T, A<T>>;
+
+// Replaces a random live key with a new one, one insert and one erase.
+template <typename M>
+uint64_t MapChurn(M *m) {
+  std::mt19937_64 rg(rt::MicroTime());
+  std::vector<uint64_t> live(kLiveKeys);
+  uint64_t sum = 0;
+
+  for (uint64_t &k : live) {
+    k = rg();
+    (*m)[k] = k;
+  }
+  for (uint64_t i = 0; i < ops; i++) {
+    uint64_t &k = live[i % kLiveKeys];
+    auto it = m->find(k);
+    if (it != m->end()) {
+      sum += it->second;
+      m->erase(it);
+    }
+    k = rg();
+    (*m)[k] = i;
+  }
+  return sum;
+}
+
+// A FIFO of short strings, as in a request log: push one, pop one.
+template <typename L>
+uint64_t ListChurn(L *l) {
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < kLiveKeys; i++) l->emplace_back(40, 'x');
+  for (uint64_t i = 0; i < ops; i++) {
+    sum += l->front().size();
+    l->pop_front();
+    l->emplace_back(40 + i % 64, 'x');
+  }
+  return sum;
+}
+
+// Runs @work on @threads threads at once and returns millions of
+// operations per second.
+double RunOne(int threads, const std::function<uint64_t()> &work) {
+  std::vector<rt::Thread> ths;
+  rt::WaitGroup start(1);
+  std::vector<uint64_t> sums(threads);
+
+  for (int i = 0; i < threads; i++) {
+    ths.emplace_back([&, i] {
+      start.Wait();
+      sums[i] = work();
+    });
+  }
+  uint64_t begin = rt::MicroTime();
+  start.Done();
+  for (auto &t : ths) t.Join();
+  uint64_t elapsed = rt::MicroTime() - begin;
+  return static_cast<double>(ops) * threads / elapsed;
+}
+
+void PrintResult(const char *workload, const char *alloc, int threads,
+                 double mops) {
+  std::cout << std::setprecision(2) << std::fixed << workload << ", " << alloc
+            << ", " << threads << ", " << mops << std::endl;
+}
+
+template <template <typename> class A>
+void RunAllocator(const char *name, int threads) {
+  PrintResult("map", name, threads, RunOne(threads, [] {
+                Map<uint64_t, uint64_t, A> m;
+                return MapChurn(&m);
+              }));
+  PrintResult("unordered_map", name, threads, RunOne(threads, [] {
+                HashMap<uint64_t, uint64_t, A> m;
+                return MapChurn(&m);
+              }));
+  PrintResult("list", name, threads, RunOne(threads, [] {
+                using String =
+                    std::basic_string<char, std::char_traits<char>, A<char>>;
+                List<String, A> l;
+                return ListChurn(&l);
+              }));
+}
+
+void RunPmr(int threads) {
+  std::pmr::memory_resource *r = rt::SmallocResource::Get();
+  const char *name = "pmr_smalloc";
+
+  PrintResult("map", name, threads, RunOne(threads, [r] {
+                std::pmr::map<uint64_t, uint64_t> m(r);
+                return MapChurn(&m);
+              }));
+  PrintResult("unordered_map", name, threads, RunOne(threads, [r] {
+                std::pmr::unordered_map<uint64_t, uint64_t> m(r);
+                return MapChurn(&m);
+              }));
+  PrintResult("list", name, threads, RunOne(threads, [r] {
+                std::pmr::list<std::pmr::string> l(r);
+                return ListChurn(&l);
+              }));
+}
+
+void MainHandler(void *arg) {
+  std::cout << "workload, allocator, threads, mops" << std::endl;
+  for (int threads : thread_counts) {
+    RunAllocator<std::allocator>("glibc", threads);
+    RunAllocator<rt::PoolAllocator>("tcache_pool", threads);
+    RunAllocator<rt::SmallocAllocator>("smalloc", threads);
+    RunPmr(threads);
+  }
+}
+
+int ParseThreads(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  thread_counts.clear();
+  while (std::getline(ss, tok, ',')) {
+    int n = std::stoi(tok);
+    if (n <= 0) return -EINVAL;
+    thread_counts.push_back(n);
+  }
+  return thread_counts.empty() ? -EINVAL : 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [ops_per_thread] [threads,...]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ops = std::stoul(argv[2], nullptr, 0);
+  if (ops == 0 || (argc > 3 && ParseThreads(argv[3]))) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -0,0 +1,181 @@
+// cachebench.cc - throughput of rt::ConcurrentHashMap and rt::LruCache
+// under Zipfian keys
+//
+// Every thread draws keys from the same Zipf distribution, so a few hot
+// keys (and the shards they live in) see most of the traffic. The map runs
+// a read-mostly mix of lookups and assignments over a preloaded key space;
+// the cache holds a fraction of the key space and runs look-aside, filling
+// the cache on a miss. Thread counts double up to the runtime's core count.
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "concurrent_map.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the number of distinct keys.
+uint64_t nkeys;
+// the Zipf skew (0 is uniform).
+double zipf_s;
+// the operations per thread in each run.
+uint64_t ops;
+
+// the share of map operations that are writes, in percent.
+constexpr unsigned int kWritePercent = 5;
+// the share of the key space the cache can hold, in percent.
+constexpr unsigned int kCachePercent = 10;
+
+// Draws ranks in [0, nkeys) with P(k) proportional to 1 / (k + 1)^s, by
+// inverting a precomputed CDF. Ranks are scattered over the key space so
+// that hot keys don't land next to each other.
+class Zipf {
+ public:
+  Zipf(uint64_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for (double &c : cdf_) c /= sum;
+  }
+
+  template <typename G>
+  uint64_t operator()(G &g) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(g);
+    auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+    return Key(std::min<uint64_t>(it - cdf_.begin(), cdf_.size() - 1));
+  }
+
+  static uint64_t Key(uint64_t rank) { return rank * 0x9e3779b97f4a7c15ULL; }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+// Runs @work(thread index) on @threads threads at once and returns millions
+// of operations per second.
+double RunOne(int threads, const std::function<void(int)> &work) {
+  std::vector<rt::Thread> ths;
+  rt::WaitGroup start(1);
+
+  for (int i = 0; i < threads; i++) {
+    ths.emplace_back([&, i] {
+      start.Wait();
+      work(i);
+    });
+  }
+  uint64_t begin = rt::MicroTime();
+  start.Done();
+  for (auto &t : ths) t.Join();
+  uint64_t elapsed = rt::MicroTime() - begin;
+  return static_cast<double>(ops) * threads / elapsed;
+}
+
+void PrintResult(const char *workload, int threads, double mops,
+                 const rt::CacheStats &st) {
+  uint64_t evictions = 0, resizes = 0;
+  for (const auto &s : st.shards) {
+    evictions += s.evictions;
+    resizes += s.resizes;
+  }
+  double lookups = static_cast<double>(st.hits + st.misses);
+  std::cout << std::setprecision(2) << std::fixed << workload << ", "
+            << threads << ", " << mops << ", "
+            << (lookups ? st.hits / lookups : 0) << ", " << evictions << ", "
+            << resizes << std::endl;
+}
+
+void RunMap(const Zipf &zipf, int threads) {
+  rt::ConcurrentHashMap<uint64_t, uint64_t> m;
+  for (uint64_t i = 0; i < nkeys; i++) m.InsertOrAssign(Zipf::Key(i), i);
+
+  double mops = RunOne(threads, [&](int idx) {
+    std::mt19937_64 rg(idx + 1);
+    uint64_t v;
+    for (uint64_t i = 0; i < ops; i++) {
+      uint64_t k = zipf(rg);
+      if (rg() % 100 < kWritePercent)
+        m.InsertOrAssign(k, i);
+      else
+        m.Find(k, &v);
+    }
+  });
+  PrintResult("map", threads, mops, m.Stats());
+}
+
+void RunCache(const Zipf &zipf, int threads) {
+  rt::LruCache<uint64_t, uint64_t> c(
+      std::max<uint64_t>(1, nkeys * kCachePercent / 100));
+
+  double mops = RunOne(threads, [&](int idx) {
+    std::mt19937_64 rg(idx + 1);
+    uint64_t v;
+    for (uint64_t i = 0; i < ops; i++) {
+      uint64_t k = zipf(rg);
+      if (!c.Get(k, &v)) c.Put(k, k);
+    }
+  });
+  PrintResult("lru_cache", threads, mops, c.Stats());
+}
+
+void MainHandler(void *arg) {
+  Zipf zipf(nkeys, zipf_s);
+  int cores = rt::RuntimeMaxCores();
+
+  std::cout << "# keys " << nkeys << ", zipf " << zipf_s << ", cores "
+            << cores << std::endl;
+  std::cout << "workload, threads, mops, hit_ratio, evictions, resizes"
+            << std::endl;
+  for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+    RunMap(zipf, threads);
+    RunCache(zipf, threads);
+    if (threads == cores) break;
+  }
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [keys] [zipf_s] [ops_per_thread]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 5) {
+    Usage();
+    return -EINVAL;
+  }
+
+  nkeys = std::stoul(argv[2], nullptr, 0);
+  zipf_s = std::stod(argv[3], nullptr);
+  ops = std::stoul(argv[4], nullptr, 0);
+  if (nkeys == 0 || zipf_s < 0 || ops == 0) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
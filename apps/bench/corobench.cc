@@ -0,0 +1,299 @@
+// corobench.cc - memory per in-flight request and throughput of coroutines
+// (rt::Task) against one uthread per request
+//
+// Each request fills a small buffer, waits for an I/O to complete, and
+// checksums the buffer. The I/O is either a simulated device that completes
+// requests after a fixed latency, or a one block read of the default storage
+// volume (NVMe or emulated). Memory is the growth in resident set size while
+// the requests are in flight, so it includes stacks (uthreads) or frames
+// and resume threads (coroutines), but it is approximate: allocator caches
+// keep memory from earlier runs.
+
+extern "C" {
+#include <base/log.h>
+#include <runtime/storage.h>
+}
+
+#include "coro.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// use the default storage volume rather than the simulated device.
+bool use_storage;
+// the duration of each run in seconds.
+int seconds;
+// the latency of the simulated device in microseconds.
+uint64_t device_us;
+// the numbers of in-flight requests to sweep.
+std::vector<int> inflights = {1, 64, 1024, 8192};
+
+// the request state that lives across the I/O.
+constexpr size_t kReqBytes = 512;
+
+// A device that completes each request after a fixed latency, polled by one
+// thread. Requests come from blocked uthreads or suspended coroutines.
+class SimDevice {
+ public:
+  SimDevice() : stop_(false), poller_([this] { Poll(); }) {}
+  ~SimDevice() {
+    rt::write_once(stop_, true);
+    poller_.Join();
+  }
+
+  // Blocks the calling uthread until the request completes.
+  void Wait() {
+    lock_.Lock();
+    reqs_.push_back({rt::MicroTime() + device_us, thread_self(), nullptr});
+    lock_.UnlockAndPark();
+  }
+
+  // Suspends the calling coroutine until the request completes.
+  auto CoWait() {
+    struct Awaiter {
+      SimDevice *dev;
+      bool await_ready() const { return false; }
+      void await_suspend(std::coroutine_handle<> h) {
+        rt::ScopedLock<rt::Spin> l(&dev->lock_);
+        dev->reqs_.push_back({rt::MicroTime() + device_us, nullptr, h});
+      }
+      void await_resume() const {}
+    };
+    return Awaiter{this};
+  }
+
+ private:
+  struct request {
+    uint64_t deadline_us;
+    thread_t *th;
+    std::coroutine_handle<> h;
+  };
+
+  void Poll() {
+    std::vector<request> done;
+    while (!rt::read_once(stop_)) {
+      uint64_t now = rt::MicroTime();
+      {
+        rt::ScopedLock<rt::Spin> l(&lock_);
+        while (!reqs_.empty() && reqs_.front().deadline_us <= now) {
+          done.push_back(reqs_.front());
+          reqs_.pop_front();
+        }
+      }
+      for (const request &r : done) {
+        if (r.h)
+          rt::Schedule(r.h);
+        else
+          thread_ready(r.th);
+      }
+      done.clear();
+      rt::Sleep(std::max<uint64_t>(device_us / 4, 1));
+    }
+  }
+
+  bool stop_;
+  rt::Spin lock_;
+  std::deque<request> reqs_;
+  rt::Thread poller_;
+};
+
+SimDevice *dev;
+
+struct result {
+  double rps;
+  double bytes_per_req;
+};
+
+size_t ResidentBytes() {
+  std::ifstream f("/proc/self/statm");
+  size_t size, resident;
+  f >> size >> resident;
+  return resident * getpagesize();
+}
+
+uint64_t Checksum(const char *buf) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kReqBytes; i++) sum += buf[i];
+  return sum;
+}
+
+// One request, issued from a uthread.
+void Request(uint64_t seq) {
+  char buf[kReqBytes];
+  memset(buf, static_cast<int>(seq), sizeof(buf));
+  if (use_storage) {
+    std::unique_ptr<char[]> blk(new char[storage_block_size()]);
+    if (unlikely(storage_read(blk.get(), seq % storage_num_blocks(), 1)))
+      panic("storage read failed");
+  } else {
+    dev->Wait();
+  }
+  rt::access_once(buf[0]) += Checksum(buf) & 1;
+}
+
+// One request, issued from a coroutine.
+rt::Task<void> CoRequest(uint64_t seq) {
+  char buf[kReqBytes];
+  memset(buf, static_cast<int>(seq), sizeof(buf));
+  if (use_storage) {
+    std::unique_ptr<char[]> blk(new char[storage_block_size()]);
+    int ret = co_await rt::AsyncStorageRead(blk.get(),
+                                            seq % storage_num_blocks(), 1);
+    if (unlikely(ret)) panic("storage read failed");
+  } else {
+    co_await dev->CoWait();
+  }
+  rt::access_once(buf[0]) += Checksum(buf) & 1;
+}
+
+// Runs @n closed-loop request loops for the configured time. @spawn starts
+// one loop that counts completions into its slot and calls Done() on the
+// wait group when @stop is set.
+template <typename Spawn>
+result RunOne(int n, Spawn spawn) {
+  std::vector<uint64_t> counts(n);
+  std::atomic<bool> stop{false};
+  rt::WaitGroup wg(n);
+
+  size_t base = ResidentBytes();
+  uint64_t start = rt::MicroTime();
+  for (int i = 0; i < n; i++) spawn(i, &counts[i], &stop, &wg);
+
+  // measure memory halfway through, once every request is in flight
+  rt::Sleep(seconds * rt::kSeconds / 2);
+  size_t mid = ResidentBytes();
+  rt::Sleep(seconds * rt::kSeconds / 2);
+  stop = true;
+  wg.Wait();
+  double elapsed = static_cast<double>(rt::MicroTime() - start) / rt::kSeconds;
+
+  uint64_t total = 0;
+  for (uint64_t c : counts) total += c;
+  return {total / elapsed,
+          mid > base ? static_cast<double>(mid - base) / n : 0};
+}
+
+result RunThreads(int n) {
+  return RunOne(n, [](int i, uint64_t *count, std::atomic<bool> *stop,
+                      rt::WaitGroup *wg) {
+    rt::Spawn([=] {
+      uint64_t seq = static_cast<uint64_t>(i) << 32;
+      while (!stop->load(std::memory_order_relaxed)) {
+        Request(seq++);
+        (*count)++;
+      }
+      wg->Done();
+    });
+  });
+}
+
+rt::Task<void> CoLoop(int i, uint64_t *count, std::atomic<bool> *stop,
+                      rt::WaitGroup *wg) {
+  uint64_t seq = static_cast<uint64_t>(i) << 32;
+  while (!stop->load(std::memory_order_relaxed)) {
+    co_await CoRequest(seq++);
+    (*count)++;
+  }
+  wg->Done();
+}
+
+result RunCoroutines(int n) {
+  return RunOne(n, [](int i, uint64_t *count, std::atomic<bool> *stop,
+                      rt::WaitGroup *wg) {
+    rt::CoSpawn(CoLoop(i, count, stop, wg));
+  });
+}
+
+void PrintResult(const char *model, int n, const result &r) {
+  std::cout << std::setprecision(1) << std::fixed << model << ", " << n << ", "
+            << r.rps << ", " << r.bytes_per_req << std::endl;
+}
+
+void MainHandler(void *arg) {
+  if (use_storage && storage_num_blocks() == 0)
+    panic("corobench: storage is not enabled");
+
+  std::unique_ptr<SimDevice> d;
+  if (!use_storage) {
+    d.reset(new SimDevice());
+    dev = d.get();
+  }
+
+  std::cout << "model, inflight, rps, bytes_per_inflight_req" << std::endl;
+  for (int n : inflights) {
+    PrintResult("coroutine", n, RunCoroutines(n));
+    PrintResult("uthread", n, RunThreads(n));
+  }
+}
+
+int ParseInflights(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  inflights.clear();
+  while (std::getline(ss, tok, ',')) {
+    int n = std::stoi(tok);
+    if (n <= 0) return -EINVAL;
+    inflights.push_back(n);
+  }
+  return inflights.empty() ? -EINVAL : 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [device|storage] [seconds] [device_us] "
+               "[inflight,...]\n"
+            << "\tdevice: a simulated device with a fixed latency of "
+               "device_us\n"
+            << "\tstorage: one block reads of the default volume (device_us "
+               "is ignored)"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 5) {
+    Usage();
+    return -EINVAL;
+  }
+
+  std::string mode = argv[2];
+  if (mode.compare("storage") == 0) {
+    use_storage = true;
+  } else if (mode.compare("device") != 0) {
+    Usage();
+    return -EINVAL;
+  }
+  seconds = std::stoi(argv[3], nullptr, 0);
+  device_us = std::stoul(argv[4], nullptr, 0);
+  if (argc > 5 && ParseInflights(argv[5])) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -0,0 +1,232 @@
+// execbench.cc - goodput and memory under overload with a uthread per
+// request against rt::Executor
+//
+// An open-loop generator offers Poisson arrivals at a multiple of what the
+// runtime's cores can serve (2x by default). Each request busy-spins for a
+// fixed service time. Goodput counts requests that finish within the SLO
+// (measured from arrival) during the run; memory is the growth in resident
+// set size by the end of the run, which for a uthread per request is mostly
+// the stacks of the backlog.
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "executor.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the service time of a request in us.
+uint64_t service_us;
+// the offered load as a multiple of capacity.
+double load_factor;
+// the duration of each run in seconds.
+int seconds;
+// the latency within which a request counts towards goodput, in us.
+uint64_t slo_us;
+
+struct counters {
+  std::atomic<uint64_t> good{0};
+  std::atomic<uint64_t> late{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> outstanding{0};
+  std::atomic<uint64_t> peak_outstanding{0};
+};
+
+size_t ResidentBytes() {
+  std::ifstream f("/proc/self/statm");
+  size_t size, resident;
+  f >> size >> resident;
+  return resident * getpagesize();
+}
+
+void Serve(uint64_t arrival_us, uint64_t end_us, counters *c) {
+  rt::Delay(service_us);
+  uint64_t now = rt::MicroTime();
+  if (now - arrival_us <= slo_us && now <= end_us)
+    c->good.fetch_add(1, std::memory_order_relaxed);
+  else
+    c->late.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Runs the generator for the configured time. @submit starts one request
+// and returns false if it was refused. Every request, served or not, calls
+// Done() on the wait group exactly once.
+void Generate(double rps, counters *c, rt::WaitGroup *wg,
+              const std::function<bool(uint64_t, uint64_t)> &submit,
+              uint64_t *end_us) {
+  std::mt19937 rg(1);
+  std::exponential_distribution<double> rd(rps / rt::kSeconds);
+
+  uint64_t start = rt::MicroTime();
+  *end_us = start + seconds * rt::kSeconds;
+  double next = start;
+  while (next < *end_us) {
+    rt::SleepUntil(static_cast<uint64_t>(next));
+    uint64_t now = rt::MicroTime();
+    while (next <= now && next < *end_us) {
+      wg->Add(1);
+      uint64_t n = c->outstanding.fetch_add(1, std::memory_order_relaxed) + 1;
+      if (n > c->peak_outstanding.load(std::memory_order_relaxed))
+        c->peak_outstanding.store(n, std::memory_order_relaxed);
+      if (!submit(static_cast<uint64_t>(next), *end_us)) {
+        c->dropped.fetch_add(1, std::memory_order_relaxed);
+        c->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        wg->Done();
+      }
+      next += rd(rg);
+    }
+  }
+}
+
+void PrintResult(const char *model, const counters &c, size_t base,
+                 size_t end, const rt::ExecutorStats *st) {
+  double goodput = static_cast<double>(c.good) / seconds;
+  double mem = end > base ? static_cast<double>(end - base) / (1 << 20) : 0;
+  std::cout << std::setprecision(1) << std::fixed << model << ", " << goodput
+            << ", " << c.late << ", " << c.dropped << ", "
+            << c.peak_outstanding << ", " << mem << ", "
+            << (st ? st->workers : 0) << ", "
+            << (st && st->completed ? st->wait_us / st->completed : 0)
+            << std::endl;
+}
+
+// A uthread per request, as the servers do today.
+void RunSpawn(double rps) {
+  counters c;
+  rt::WaitGroup wg;
+  uint64_t end_us;
+
+  size_t base = ResidentBytes();
+  Generate(rps, &c, &wg,
+           [&](uint64_t arrival_us, uint64_t deadline_us) {
+             rt::Spawn([&c, &wg, arrival_us, deadline_us] {
+               Serve(arrival_us, deadline_us, &c);
+               c.outstanding.fetch_sub(1, std::memory_order_relaxed);
+               wg.Done();
+             });
+             return true;
+           },
+           &end_us);
+  size_t end = ResidentBytes();
+  wg.Wait();
+  PrintResult("spawn", c, base, end, nullptr);
+}
+
+void RunExecutor(const char *model, double rps,
+                 const rt::ExecutorConfig &cfg) {
+  counters c;
+  rt::WaitGroup wg;
+  uint64_t end_us;
+  size_t base, end;
+  rt::ExecutorStats st;
+
+  {
+    rt::Executor ex(cfg);
+    base = ResidentBytes();
+    Generate(rps, &c, &wg,
+             [&](uint64_t arrival_us, uint64_t deadline_us) {
+               return ex.Submit(
+                   [&c, &wg, arrival_us, deadline_us] {
+                     Serve(arrival_us, deadline_us, &c);
+                     c.outstanding.fetch_sub(1, std::memory_order_relaxed);
+                     wg.Done();
+                   },
+                   [&c, &wg] {
+                     c.dropped.fetch_add(1, std::memory_order_relaxed);
+                     c.outstanding.fetch_sub(1, std::memory_order_relaxed);
+                     wg.Done();
+                   });
+             },
+             &end_us);
+    end = ResidentBytes();
+    wg.Wait();
+    st = ex.Stats();
+  }
+  PrintResult(model, c, base, end, &st);
+}
+
+void MainHandler(void *arg) {
+  unsigned int cores = rt::RuntimeMaxCores();
+  double capacity = static_cast<double>(cores) * rt::kSeconds / service_us;
+  double rps = capacity * load_factor;
+
+  // enough workers to keep every core busy, and a queue that holds about
+  // one SLO's worth of work
+  rt::ExecutorConfig cfg;
+  cfg.max_inflight = cores;
+  cfg.queue_capacity = std::max<size_t>(1, cores * slo_us / service_us);
+
+  std::cout << "# cores " << cores << ", capacity " << capacity
+            << " rps, offered " << rps << " rps" << std::endl;
+  std::cout << "model, goodput, late, dropped, peak_outstanding, rss_mb, "
+               "workers, avg_queue_wait_us"
+            << std::endl;
+
+  RunSpawn(rps);
+
+  cfg.policy = rt::ExecutorPolicy::kReject;
+  RunExecutor("reject", rps, cfg);
+
+  cfg.policy = rt::ExecutorPolicy::kShedOldest;
+  RunExecutor("shed_oldest", rps, cfg);
+
+  cfg.max_wait_us = slo_us - service_us;
+  RunExecutor("shed_deadline", rps, cfg);
+
+  cfg.policy = rt::ExecutorPolicy::kReject;
+  cfg.max_wait_us = 0;
+  cfg.queue_capacity = cores * 64;
+  cfg.max_runtime_queue_us = slo_us / 4;
+  RunExecutor("admission", rps, cfg);
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [service_us] [load_factor] [seconds] "
+               "[slo_us]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 6) {
+    Usage();
+    return -EINVAL;
+  }
+
+  service_us = std::stoul(argv[2], nullptr, 0);
+  load_factor = std::stod(argv[3], nullptr);
+  seconds = std::stoi(argv[4], nullptr, 0);
+  slo_us = std::stoul(argv[5], nullptr, 0);
+  if (service_us == 0 || load_factor <= 0 || seconds <= 0 ||
+      slo_us <= service_us) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
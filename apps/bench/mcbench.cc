@@ -0,0 +1,273 @@
+// mcbench.cc - a closed-loop memcached load generator with Zipfian keys,
+// for driving memcached_router with skewed traffic
+//
+// Each thread has its own connection and one request outstanding. Keys are
+// drawn from one Zipf distribution over the key space, so a few hot keys
+// get most of the requests; a fixed share of the requests are SETs. Every
+// key is SET once before the run, so a GET miss means an eviction.
+
+extern "C" {
+#include <base/byteorder.h>
+#include <base/log.h>
+#include <net/ip.h>
+}
+
+#include "net.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the router (or memcached server) to load.
+netaddr raddr;
+// the number of threads (and connections).
+int threads;
+// the number of distinct keys.
+uint64_t nkeys;
+// the Zipf skew (0 is uniform).
+double zipf_s;
+// the share of requests that are GETs, in percent.
+unsigned int get_percent;
+// the duration of the run in seconds.
+int seconds;
+
+constexpr size_t kValueLen = 64;
+constexpr size_t kMaxBody = 1024;
+
+// memcached binary protocol
+constexpr uint8_t kMagicRequest = 0x80;
+constexpr uint8_t kOpGet = 0x00;
+constexpr uint8_t kOpSet = 0x01;
+
+struct McHdr {
+  uint8_t magic;
+  uint8_t opcode;
+  uint16_t key_length;
+  uint8_t extras_length;
+  uint8_t data_type;
+  uint16_t vbucket_id_or_status;
+  uint32_t total_body_length;
+  uint32_t opaque;
+  uint64_t cas;
+} __packed;
+static_assert(sizeof(McHdr) == 24);
+
+// Draws ranks in [0, n) with P(k) proportional to 1 / (k + 1)^s, by
+// inverting a precomputed CDF.
+class Zipf {
+ public:
+  Zipf(uint64_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+      cdf_[i] = sum;
+    }
+    for (double &c : cdf_) c /= sum;
+  }
+
+  template <typename G>
+  uint64_t operator()(G &g) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(g);
+    auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+    return std::min<uint64_t>(it - cdf_.begin(), cdf_.size() - 1);
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+struct WorkerResult {
+  uint64_t gets{0};
+  uint64_t get_hits{0};
+  std::vector<uint64_t> latencies;
+};
+
+class Client {
+ public:
+  explicit Client(rt::TcpConn *c) : c_(c), opaque_(0) {
+    memset(value_, 'v', sizeof(value_));
+  }
+
+  // Sends a GET or SET of key @rank and reads the response. Returns the
+  // response status, or < 0 on a connection error.
+  int Request(uint8_t opcode, uint64_t rank) {
+    char key[32];
+    size_t keylen = snprintf(key, sizeof(key), "key:%lu", rank);
+    uint32_t extras[2] = {0, 0};  // flags and expiration, for SET
+    McHdr h = {};
+    struct iovec iov[4];
+    int iovcnt = 0;
+
+    h.magic = kMagicRequest;
+    h.opcode = opcode;
+    h.key_length = hton16(keylen);
+    h.opaque = ++opaque_;
+    iov[iovcnt++] = {&h, sizeof(h)};
+    if (opcode == kOpSet) {
+      h.extras_length = sizeof(extras);
+      iov[iovcnt++] = {extras, sizeof(extras)};
+    }
+    iov[iovcnt++] = {key, keylen};
+    if (opcode == kOpSet) iov[iovcnt++] = {value_, sizeof(value_)};
+    size_t body_len = h.extras_length + keylen +
+                      (opcode == kOpSet ? sizeof(value_) : 0);
+    h.total_body_length = hton32(body_len);
+
+    ssize_t ret = c_->WritevFull(iov, iovcnt);
+    if (ret != static_cast<ssize_t>(sizeof(h) + body_len)) return -EIO;
+
+    ret = c_->ReadFull(&h, sizeof(h));
+    if (ret != static_cast<ssize_t>(sizeof(h))) return -EIO;
+    body_len = ntoh32(h.total_body_length);
+    if (body_len > sizeof(body_)) return -EIO;
+    ret = body_len ? c_->ReadFull(body_, body_len) : 0;
+    if (ret != static_cast<ssize_t>(body_len)) return -EIO;
+    if (h.opaque != opaque_) return -EIO;
+    return ntoh16(h.vbucket_id_or_status);
+  }
+
+ private:
+  std::unique_ptr<rt::TcpConn> c_;
+  uint32_t opaque_;
+  char value_[kValueLen];
+  unsigned char body_[kMaxBody];
+};
+
+std::unique_ptr<Client> Connect() {
+  rt::TcpConn *c = rt::TcpConn::Dial({0, 0}, raddr);
+  if (unlikely(c == nullptr)) panic("couldn't connect");
+  return std::make_unique<Client>(c);
+}
+
+void Preload() {
+  std::vector<rt::Thread> ths;
+  for (int i = 0; i < threads; i++) {
+    ths.emplace_back([i] {
+      auto c = Connect();
+      for (uint64_t k = i; k < nkeys; k += threads) {
+        if (c->Request(kOpSet, k) != 0) panic("preload failed");
+      }
+    });
+  }
+  for (auto &t : ths) t.Join();
+}
+
+void Worker(int idx, const Zipf &zipf, uint64_t end_us, WorkerResult *res) {
+  auto c = Connect();
+  std::mt19937_64 rg(idx + 1);
+
+  while (true) {
+    uint64_t start = rt::MicroTime();
+    if (start >= end_us) break;
+    uint64_t k = zipf(rg);
+    bool get = rg() % 100 < get_percent;
+    int status = c->Request(get ? kOpGet : kOpSet, k);
+    if (unlikely(status < 0)) panic("connection failed");
+    res->latencies.push_back(rt::MicroTime() - start);
+    if (get) {
+      res->gets++;
+      if (status == 0) res->get_hits++;
+    }
+  }
+}
+
+void MainHandler(void *arg) {
+  Zipf zipf(nkeys, zipf_s);
+  std::vector<WorkerResult> results(threads);
+  std::vector<rt::Thread> ths;
+
+  Preload();
+
+  uint64_t start = rt::MicroTime();
+  uint64_t end_us = start + seconds * rt::kSeconds;
+  for (int i = 0; i < threads; i++)
+    ths.emplace_back([&, i] { Worker(i, zipf, end_us, &results[i]); });
+  for (auto &t : ths) t.Join();
+  uint64_t elapsed = rt::MicroTime() - start;
+
+  std::vector<uint64_t> lat;
+  uint64_t gets = 0, hits = 0;
+  for (auto &r : results) {
+    lat.insert(lat.end(), r.latencies.begin(), r.latencies.end());
+    gets += r.gets;
+    hits += r.get_hits;
+  }
+  std::sort(lat.begin(), lat.end());
+  auto pct = [&lat](double p) {
+    if (lat.empty()) return static_cast<uint64_t>(0);
+    return lat[std::min<size_t>(lat.size() - 1, p / 100 * lat.size())];
+  };
+
+  std::cout << "threads, keys, zipf_s, get_percent, rps, p50_us, p99_us, "
+               "get_hit_rate"
+            << std::endl;
+  std::cout << std::setprecision(3) << std::fixed << threads << ", " << nkeys
+            << ", " << zipf_s << ", " << get_percent << ", "
+            << static_cast<double>(lat.size()) * rt::kSeconds / elapsed
+            << ", " << pct(50) << ", " << pct(99) << ", "
+            << (gets ? static_cast<double>(hits) / gets : 0) << std::endl;
+}
+
+int StringToAddr(const char *str, netaddr *addr) {
+  uint8_t a, b, c, d;
+  uint16_t p;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu:%hu", &a, &b, &c, &d, &p) != 5)
+    return -EINVAL;
+
+  addr->ip = MAKE_IP_ADDR(a, b, c, d);
+  addr->port = p;
+  return 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [router_addr] [threads] [keys] [zipf_s] "
+               "[get_percent] [seconds]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 8) {
+    Usage();
+    return -EINVAL;
+  }
+
+  if (StringToAddr(argv[2], &raddr)) {
+    Usage();
+    return -EINVAL;
+  }
+  threads = std::stoi(argv[3], nullptr, 0);
+  nkeys = std::stoul(argv[4], nullptr, 0);
+  zipf_s = std::stod(argv[5], nullptr);
+  get_percent = std::stoul(argv[6], nullptr, 0);
+  seconds = std::stoi(argv[7], nullptr, 0);
+  if (threads <= 0 || nkeys == 0 || zipf_s < 0 || get_percent > 100 ||
+      seconds <= 0) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
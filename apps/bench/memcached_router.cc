@@ -8,23 +8,153 @@ extern "C" {
 #include <runtime/storage.h>
 }
 
+#include "concurrent_map.h"
 #include "net.h"
+#include "runtime.h"
 #include "sync.h"
 #include "thread.h"
+#include "timer.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "HashRing.h"
 #include "RpcManager.h"
 
 #define MAX_REQUEST_BODY 1024
+#define STATS_INTERVAL_US (1 * rt::kSeconds)
+#define HEALTH_INTERVAL_US (200 * 1000)
 
 static netaddr listenaddr;
-static std::vector<netaddr> memcached_addrs;
-static std::vector<RpcEndpoint<MemcachedHdr> *> memcached_endpoints;
+static uint16_t admin_port;
 
 static bool use_pooled_connections;
 static bool use_affinity_dial;
+static bool track_health = true;
+
+/*
+ * A memcached server. Backends are never freed, so a request routed to one
+ * just before it leaves the ring can still use it.
+ */
+struct Backend {
+  Backend(netaddr a, double w) : addr(a), weight(w) {}
+
+  const netaddr addr;
+  /* the configured weight, and the share of it that health tracking allows
+     (0 while ejected) */
+  double weight;
+  double health{1.0};
+  bool member{true};
+  uint64_t ejected_until_us{0};
+  /* pooled connections only */
+  RpcEndpoint<MemcachedHdr> *ep{nullptr};
+  Histogram last_latency;
+};
+
+struct RcuHead {
+  rcu_head rcu;
+};
+
+/* the backends taking keys and their ring, published with RCU */
+struct Membership : RcuHead {
+  std::vector<Backend *> members;
+  HashRing ring;
+};
+static std::atomic<Membership *> membership;
+
+/* serializes membership changes and protects the fields of all backends */
+static rt::Mutex membership_lock;
+/* every backend ever added, members or not */
+static std::vector<Backend *> backends;
+
+/* health tracking: a backend's p99 latency relative to the median backend's
+   makes it slow (halving its health) or ejects it for a while */
+constexpr uint64_t kHealthMinSamples = 100;
+constexpr double kSlowRatio = 2.0;
+constexpr double kEjectRatio = 10.0;
+constexpr double kMinHealth = 1.0 / 16;
+constexpr double kHealthStep = 0.125;
+constexpr uint64_t kEjectUs = 5 * rt::kSeconds;
+
+/* hot key handling (pooled connections only) */
+static bool coalesce_gets;
+static size_t cache_capacity;
+static uint64_t cache_ttl_us = 1000;
+
+/* memcached binary protocol opcodes and status */
+constexpr uint8_t kOpGet = 0x00;
+constexpr uint8_t kOpGetQ = 0x09;
+constexpr uint8_t kOpNoop = 0x0a;
+constexpr uint8_t kOpGetK = 0x0c;
+constexpr uint8_t kOpGetKQ = 0x0d;
+constexpr uint8_t kOpFlush = 0x08;
+constexpr uint8_t kOpFlushQ = 0x18;
+constexpr uint16_t kStatusOk = 0x0000;
+
+/* router counters, kept per core */
+enum {
+  kCtrRequests = 0,
+  kCtrCacheHits,
+  kCtrCacheMisses,
+  kCtrCoalesced,
+  kNrCounters,
+};
+
+struct alignas(CACHE_LINE_SIZE) CoreCounters {
+  std::atomic<uint64_t> c[kNrCounters];
+};
+static CoreCounters core_counters[rt::kCoreLimit];
+
+static inline void count(int ctr) {
+  core_counters[get_current_affinity()].c[ctr].fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+static uint64_t sum_counter(int ctr) {
+  uint64_t sum = 0;
+  for (auto &cc : core_counters)
+    sum += cc.c[ctr].load(std::memory_order_relaxed);
+  return sum;
+}
+
+/* a GET response kept in the hot key cache: header, then body */
+struct CachedResponse {
+  uint64_t expires_us;
+  uint64_t flush_epoch;
+  std::shared_ptr<const std::string> rsp;
+};
+static rt::LruCache<std::string, CachedResponse> *hot_cache;
+/* bumped by FLUSH, which empties the cache by outdating every entry */
+static std::atomic<uint64_t> flush_epoch;
+
+/* a backend GET that concurrent GETs for the same key wait for */
+struct Flight {
+  rt::WaitGroup done{1};
+  unsigned int followers{0};
+  MemcachedHdr rsp;
+  unsigned char body[MAX_REQUEST_BODY];
+};
+
+/*
+ * Keys hash to shards that hold the GETs in flight and a generation that
+ * every write to a key in the shard bumps. A GET only fills the cache if
+ * the generation is unchanged since it was sent, so a response that raced
+ * with a write is never cached.
+ */
+struct alignas(CACHE_LINE_SIZE) KeyShard {
+  rt::Mutex lock;
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+  uint64_t generation{0};
+};
+constexpr size_t kNrKeyShards = 64;
+static KeyShard key_shards[kNrKeyShards];
 
 class MemcachedRequestContext : public RequestContext {
  public:
@@ -38,15 +168,220 @@ class MemcachedRequestContext : public RequestContext {
   unsigned char request_body[MAX_REQUEST_BODY];
 };
 
-static inline unsigned int route(unsigned char *key, size_t keylen) {
-  return jenkins_hash(key, keylen) % memcached_addrs.size();
+static std::string addr_to_str(netaddr addr) {
+  char ip[IP_ADDR_STR_LEN];
+  return std::string(ip_addr_to_str(addr.ip, ip)) + ":" +
+         std::to_string(addr.port);
+}
+
+/* Parses "ip:port" with an optional "@weight". */
+static int parse_backend(const std::string &str, netaddr *addr,
+                         double *weight) {
+  size_t at = str.find('@');
+  *weight = 1.0;
+  if (at != std::string::npos) {
+    *weight = strtod(str.c_str() + at + 1, NULL);
+    if (*weight <= 0) return -EINVAL;
+  }
+  return StringToAddr(str.substr(0, at).c_str(), addr);
+}
+
+static Backend *find_backend(netaddr addr) {
+  for (Backend *b : backends) {
+    if (b->addr.ip == addr.ip && b->addr.port == addr.port) return b;
+  }
+  return nullptr;
+}
+
+/*
+ * Rebuilds the ring from the members' effective weights and publishes it.
+ * Fails, leaving the old ring in place, if no backend would take keys. Must
+ * be called with the membership lock held.
+ */
+static int publish_membership() {
+  auto m = new Membership();
+  std::vector<HashRing::Member> ring_members;
+
+  for (Backend *b : backends) {
+    double w = b->weight * b->health;
+    if (!b->member || w <= 0) continue;
+    m->members.push_back(b);
+    ring_members.push_back(
+        {(static_cast<uint64_t>(b->addr.ip) << 16) | b->addr.port, w});
+  }
+  m->ring = HashRing(ring_members);
+  if (m->ring.empty()) {
+    delete m;
+    return -EINVAL;
+  }
+
+  Membership *old = membership.exchange(m, std::memory_order_acq_rel);
+  if (old) {
+    rcu_free(&old->rcu, [](rcu_head *h) {
+      delete static_cast<Membership *>(reinterpret_cast<RcuHead *>(h));
+    });
+  }
+  return 0;
+}
+
+static Backend *route(unsigned char *key, size_t keylen) {
+  uint32_t hash = jenkins_hash(key, keylen);
+
+  rcu_read_lock();
+  Membership *m = membership.load(std::memory_order_acquire);
+  Backend *b = m->members[m->ring.Lookup(hash)];
+  rcu_read_unlock();
+  return b;
+}
+
+static inline bool is_read(uint8_t opcode) {
+  return opcode == kOpGet || opcode == kOpGetQ || opcode == kOpGetK ||
+         opcode == kOpGetKQ || opcode == kOpNoop;
+}
+
+static KeyShard *key_shard(const std::string &key) {
+  return &key_shards[std::hash<std::string>()(key) % kNrKeyShards];
+}
+
+static void forward(MemcachedRequestContext *ctx, Backend *backend) {
+  backend->ep->SubmitRequestBlocking(&ctx->r);
+}
+
+/* Drops cached and in-flight GETs of @key ahead of (and after) a write. */
+static void invalidate(const std::string &key) {
+  KeyShard *s = key_shard(key);
+  {
+    rt::MutexGuard g(&s->lock);
+    s->generation++;
+    s->flights.erase(key);
+  }
+  if (hot_cache) hot_cache->Erase(key);
+}
+
+static bool cache_lookup(const std::string &key, MemcachedRequestContext *ctx) {
+  CachedResponse cr;
+  if (!hot_cache->Get(key, &cr) || cr.expires_us <= rt::MicroTime() ||
+      cr.flush_epoch != flush_epoch.load(std::memory_order_relaxed))
+    return false;
+
+  uint32_t opaque = ctx->r.req.opaque;
+  memcpy(&ctx->r.rsp, cr.rsp->data(), sizeof(ctx->r.rsp));
+  memcpy(ctx->request_body, cr.rsp->data() + sizeof(ctx->r.rsp),
+         cr.rsp->size() - sizeof(ctx->r.rsp));
+  ctx->r.rsp.opaque = opaque;
+  return true;
+}
+
+/*
+ * Must be called with the key's shard locked. @epoch is the flush epoch from
+ * before the response was fetched, so a FLUSH that raced with the fetch
+ * outdates the entry.
+ */
+static void cache_fill(const std::string &key, MemcachedRequestContext *ctx,
+                       uint64_t epoch) {
+  if (ctx->r.rsp.vbucket_id_or_status != hton16(kStatusOk)) return;
+
+  size_t body_len = ntoh32(ctx->r.rsp.total_body_length);
+  auto rsp = std::make_shared<std::string>(
+      reinterpret_cast<const char *>(&ctx->r.rsp), sizeof(ctx->r.rsp));
+  rsp->append(reinterpret_cast<const char *>(ctx->request_body), body_len);
+  hot_cache->Put(key, {rt::MicroTime() + cache_ttl_us, epoch, std::move(rsp)});
+}
+
+/*
+ * Serves a GET from the hot key cache, or by joining a GET for the same key
+ * that is already in flight, or else from the backend.
+ */
+static void handle_get(MemcachedRequestContext *ctx, Backend *backend,
+                       std::string key) {
+  if (hot_cache) {
+    if (cache_lookup(key, ctx)) {
+      count(kCtrCacheHits);
+      return;
+    }
+    count(kCtrCacheMisses);
+  }
+
+  KeyShard *s = key_shard(key);
+  std::shared_ptr<Flight> f;
+  bool leader = true;
+  uint64_t gen, epoch;
+  {
+    rt::MutexGuard g(&s->lock);
+    gen = s->generation;
+    epoch = flush_epoch.load(std::memory_order_relaxed);
+    if (coalesce_gets) {
+      auto it = s->flights.find(key);
+      if (it != s->flights.end()) {
+        f = it->second;
+        f->followers++;
+        leader = false;
+      } else {
+        f = std::make_shared<Flight>();
+        s->flights.emplace(key, f);
+      }
+    }
+  }
+
+  /* somebody else is fetching this key: wait for their response */
+  if (!leader) {
+    uint32_t opaque = ctx->r.req.opaque;
+    f->done.Wait();
+    ctx->r.rsp = f->rsp;
+    ctx->r.rsp.opaque = opaque;
+    memcpy(ctx->request_body, f->body, ntoh32(f->rsp.total_body_length));
+    count(kCtrCoalesced);
+    return;
+  }
+
+  forward(ctx, backend);
+
+  unsigned int followers = 0;
+  {
+    rt::MutexGuard g(&s->lock);
+    if (hot_cache && s->generation == gen) cache_fill(key, ctx, epoch);
+    if (f) {
+      /* a write may have already replaced our flight */
+      auto it = s->flights.find(key);
+      if (it != s->flights.end() && it->second == f) s->flights.erase(it);
+      followers = f->followers;
+    }
+  }
+  if (!f) return;
+
+  /* no more followers can join, so pass the response on */
+  if (followers) {
+    f->rsp = ctx->r.rsp;
+    memcpy(f->body, ctx->request_body, ntoh32(ctx->r.rsp.total_body_length));
+  }
+  f->done.Done();
 }
 
 void HandleRequest(MemcachedRequestContext *ctx) {
+  uint8_t opcode = ctx->r.req.opcode;
   unsigned char *key = ctx->request_body + ctx->r.req.extras_length;
-  int server_idx = route(key, ntoh16(ctx->r.req.key_length));
-
-  memcached_endpoints[server_idx]->SubmitRequestBlocking(&ctx->r);
+  size_t keylen = ntoh16(ctx->r.req.key_length);
+  Backend *backend = route(key, keylen);
+  bool hot_keys = coalesce_gets || hot_cache != nullptr;
+
+  count(kCtrRequests);
+  if (hot_keys && opcode == kOpGet) {
+    handle_get(ctx, backend,
+               std::string(reinterpret_cast<char *>(key), keylen));
+  } else if (hot_keys && !is_read(opcode) && keylen) {
+    std::string k(reinterpret_cast<char *>(key), keylen);
+    invalidate(k);
+    forward(ctx, backend);
+    invalidate(k);
+  } else if (hot_keys && (opcode == kOpFlush || opcode == kOpFlushQ)) {
+    /* like writes, outdate the cache both before and after the backend
+     * flushes, so no GET fetched in between survives it */
+    flush_epoch.fetch_add(1, std::memory_order_relaxed);
+    forward(ctx, backend);
+    flush_epoch.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    forward(ctx, backend);
+  }
 
   struct iovec out_vec[2];
   out_vec[0].iov_base = &ctx->r.rsp;
@@ -94,35 +429,35 @@ void OnetoOneHandler(std::unique_ptr<rt::TcpConn> conn) {
   iov[0].iov_len = sizeof(h);
   iov[1].iov_base = body;
 
-  std::vector<std::unique_ptr<rt::TcpConn>> backends;
-  for (auto &addr : memcached_addrs) {
-    rt::TcpConn *c;
-    if (use_affinity_dial) {
-      c = conn->DialAffinity(addr);
-    } else {
-      c = rt::TcpConn::Dial({0, 0}, addr);
-    }
-    if (!c) {
-      log_err("couldn't connect");
-      exit(1);
-    }
-    backends.emplace_back(c);
-  }
+  /* dialed on first use, as backends may join at any time */
+  std::unordered_map<Backend *, std::unique_ptr<rt::TcpConn>> backend_conns;
 
   while (true) {
     ssize_t body_len = pull_memcached_req(conn.get(), &h, body);
     if (unlikely(body_len < 0)) return;
 
     unsigned char *key = body + h.extras_length;
-    unsigned int srv_idx = route(key, ntoh16(h.key_length));
+    Backend *backend = route(key, ntoh16(h.key_length));
+
+    std::unique_ptr<rt::TcpConn> &bc = backend_conns[backend];
+    if (unlikely(!bc)) {
+      if (use_affinity_dial)
+        bc.reset(conn->DialAffinity(backend->addr));
+      else
+        bc.reset(rt::TcpConn::Dial({0, 0}, backend->addr));
+      if (!bc) {
+        log_err("couldn't connect to %s", addr_to_str(backend->addr).c_str());
+        return;
+      }
+    }
 
     iov[1].iov_len = body_len;
-    if (unlikely(WritevFull_(backends[srv_idx].get(), iov, 2) <= 0)) {
+    if (unlikely(WritevFull_(bc.get(), iov, 2) <= 0)) {
       log_err("error writing to backend");
       return;
     }
 
-    body_len = pull_memcached_req(backends[srv_idx].get(), &h, body);
+    body_len = pull_memcached_req(bc.get(), &h, body);
     iov[1].iov_len = body_len;
 
     if (unlikely(WritevFull_(conn.get(), iov, 2) <= 0)) {
@@ -155,15 +490,299 @@ void ClientHandler(std::shared_ptr<rt::TcpConn> conn) {
   }
 }
 
+// Prints, over each interval: member backends, requests/s from clients,
+// requests/s sent to backends, p50 and p99 backend latency in us,
+// connections, requests sent per writev(), the hot key cache's hit rate, the
+// share of requests that joined another's GET, the busiest backend's share
+// of the backend requests, and the members ejected for being slow.
+void StatsReporter() {
+  RpcEndpointStats last{};
+  std::vector<uint64_t> last_backend;
+  uint64_t last_ctr[kNrCounters] = {};
+
+  printf("backends, rps, backend_rps, p50_us, p99_us, conns, reqs_per_write, "
+         "hit_rate, coalesced, max_backend_share, ejected\n");
+  while (true) {
+    rt::Sleep(STATS_INTERVAL_US);
+
+    std::vector<Backend *> bs;
+    unsigned int members = 0, ejected = 0;
+    {
+      rt::MutexGuard g(&membership_lock);
+      bs = backends;
+      for (Backend *b : bs) {
+        members += b->member;
+        ejected += b->member && b->health == 0;
+      }
+    }
+    last_backend.resize(bs.size());
+
+    /* removed backends still count, as they may finish requests */
+    RpcEndpointStats cur{};
+    uint64_t max_backend = 0;
+    for (size_t i = 0; i < bs.size(); i++) {
+      RpcEndpointStats st = bs[i]->ep->Stats();
+      cur.conns += st.conns;
+      cur.writes += st.writes;
+      cur.sent += st.sent;
+      cur.latency.Merge(st.latency);
+      max_backend = std::max(max_backend,
+                             st.latency.count() - last_backend[i]);
+      last_backend[i] = st.latency.count();
+    }
+
+    uint64_t ctr[kNrCounters];
+    for (int i = 0; i < kNrCounters; i++) {
+      uint64_t v = sum_counter(i);
+      ctr[i] = v - last_ctr[i];
+      last_ctr[i] = v;
+    }
+
+    Histogram delta = cur.latency;
+    delta.Subtract(last.latency);
+    uint64_t writes = cur.writes - last.writes;
+    uint64_t lookups = ctr[kCtrCacheHits] + ctr[kCtrCacheMisses];
+    if (ctr[kCtrRequests]) {
+      printf("%u, %.0f, %.0f, %lu, %lu, %u, %.2f, %.3f, %.3f, %.3f, %u\n",
+             members,
+             static_cast<double>(ctr[kCtrRequests]) * rt::kSeconds /
+                 STATS_INTERVAL_US,
+             static_cast<double>(delta.count()) * rt::kSeconds /
+                 STATS_INTERVAL_US,
+             delta.Percentile(50), delta.Percentile(99), cur.conns,
+             writes ? static_cast<double>(cur.sent - last.sent) / writes : 0,
+             lookups ? static_cast<double>(ctr[kCtrCacheHits]) / lookups : 0,
+             static_cast<double>(ctr[kCtrCoalesced]) / ctr[kCtrRequests],
+             delta.count() ? static_cast<double>(max_backend) / delta.count()
+                           : 0,
+             ejected);
+      fflush(stdout);
+    }
+    last = std::move(cur);
+  }
+}
+
+/*
+ * Adjusts the members' health from their p99 latency over the last
+ * interval, relative to the median member's: a slow member's health halves
+ * (down to kMinHealth), a very slow one is ejected for kEjectUs and then
+ * returns at kMinHealth, and any other member recovers by kHealthStep. A
+ * member's share of keys is its weight times its health.
+ */
+static void update_health() {
+  uint64_t now = rt::MicroTime();
+  std::vector<std::pair<Backend *, uint64_t>> sampled;
+  std::vector<uint64_t> p99s;
+  unsigned int active = 0;
+  bool changed = false;
+
+  for (Backend *b : backends) {
+    if (!b->member) continue;
+
+    Histogram cur = b->ep->Stats().latency;
+    Histogram delta = cur;
+    delta.Subtract(b->last_latency);
+    b->last_latency = std::move(cur);
+
+    if (b->health == 0 && now >= b->ejected_until_us) {
+      log_info("router: %s returns after ejection",
+               addr_to_str(b->addr).c_str());
+      b->health = kMinHealth;
+      changed = true;
+    }
+    if (b->health > 0) active++;
+    if (delta.count() >= kHealthMinSamples) {
+      sampled.emplace_back(b, delta.Percentile(99));
+      p99s.push_back(sampled.back().second);
+    } else if (b->health > 0 && b->health < 1.0) {
+      /* too little traffic to judge, so give it more */
+      b->health = std::min(1.0, b->health + kHealthStep);
+      changed = true;
+    }
+  }
+
+  /* there is nothing to compare against */
+  if (sampled.size() < 2) {
+    for (auto &[b, p99] : sampled) {
+      if (b->health < 1.0) {
+        b->health = std::min(1.0, b->health + kHealthStep);
+        changed = true;
+      }
+    }
+    if (changed) publish_membership();
+    return;
+  }
+
+  auto mid = p99s.begin() + (p99s.size() - 1) / 2;
+  std::nth_element(p99s.begin(), mid, p99s.end());
+  double median = std::max<uint64_t>(*mid, 1);
+
+  for (auto &[b, p99] : sampled) {
+    double ratio = p99 / median;
+    double health = b->health;
+
+    if (ratio >= kEjectRatio && active > 1) {
+      log_info("router: ejecting %s (p99 %lu us, median %.0f us)",
+               addr_to_str(b->addr).c_str(), p99, median);
+      health = 0;
+      b->ejected_until_us = now + kEjectUs;
+      active--;
+    } else if (ratio >= kSlowRatio) {
+      health = std::max(kMinHealth, health / 2);
+    } else {
+      health = std::min(1.0, health + kHealthStep);
+    }
+    if (health != b->health) {
+      b->health = health;
+      changed = true;
+    }
+  }
+  if (changed) publish_membership();
+}
+
+void HealthChecker() {
+  while (true) {
+    rt::Sleep(HEALTH_INTERVAL_US);
+    rt::MutexGuard g(&membership_lock);
+    update_health();
+  }
+}
+
+/* Adds a backend (or rejoins a removed one). Called with the lock held. */
+static std::string admin_add(netaddr addr, double weight) {
+  Backend *b = find_backend(addr);
+  if (b && b->member) return "error: already a member";
+
+  if (!b) {
+    b = new Backend(addr, weight);
+    if (use_pooled_connections) {
+      b->ep = RpcEndpoint<MemcachedHdr>::Create(addr);
+      if (!b->ep) {
+        delete b;
+        return "error: couldn't connect";
+      }
+      b->last_latency = b->ep->Stats().latency;
+    }
+    backends.push_back(b);
+  }
+  b->member = true;
+  b->weight = weight;
+  b->health = 1.0;
+  publish_membership();
+  return "ok";
+}
+
+/*
+ * Handles one admin command:
+ *   add ip:port[@weight]   adds a backend
+ *   remove ip:port         removes a backend
+ *   weight ip:port weight  sets a backend's weight
+ *   list                   shows each member's weight and health
+ */
+static std::string admin_command(const std::string &line) {
+  std::istringstream in(line);
+  std::string cmd, arg;
+  netaddr addr;
+  double weight;
+
+  in >> cmd >> arg;
+  rt::MutexGuard g(&membership_lock);
+
+  if (cmd == "list") {
+    std::ostringstream out;
+    for (Backend *b : backends) {
+      if (b->member)
+        out << addr_to_str(b->addr) << " " << b->weight << " " << b->health
+            << "\n";
+    }
+    return out.str() + "ok";
+  }
+
+  if (parse_backend(arg, &addr, &weight)) return "error: bad backend";
+  if (cmd == "add") return admin_add(addr, weight);
+
+  Backend *b = find_backend(addr);
+  if (!b || !b->member) return "error: not a member";
+
+  if (cmd == "remove") {
+    b->member = false;
+    if (publish_membership()) {
+      b->member = true;
+      return "error: can't remove the last backend";
+    }
+    return "ok";
+  }
+
+  if (cmd == "weight") {
+    double old = b->weight;
+    if (!(in >> b->weight) || b->weight < 0) {
+      b->weight = old;
+      return "error: bad weight";
+    }
+    if (publish_membership()) {
+      b->weight = old;
+      return "error: no backend would take keys";
+    }
+    return "ok";
+  }
+
+  return "error: unknown command";
+}
+
+/* Serves admin commands, one per line, each answered by "ok" or an error. */
+void AdminHandler(std::unique_ptr<rt::TcpConn> c) {
+  std::string buf;
+  char tmp[256];
+
+  while (true) {
+    size_t nl;
+    while ((nl = buf.find('\n')) == std::string::npos) {
+      ssize_t ret = c->Read(tmp, sizeof(tmp));
+      if (ret <= 0) return;
+      buf.append(tmp, ret);
+    }
+
+    std::string reply = admin_command(buf.substr(0, nl)) + "\n";
+    buf.erase(0, nl + 1);
+    if (c->WriteFull(reply.data(), reply.size()) < 0) return;
+  }
+}
+
+void AdminServer() {
+  std::unique_ptr<rt::TcpQueue> q(
+      rt::TcpQueue::Listen({listenaddr.ip, admin_port}, 16));
+  if (q == nullptr) panic("couldn't listen for admin connections");
+
+  while (true) {
+    rt::TcpConn *c = q->Accept();
+    if (c == nullptr) panic("couldn't accept an admin connection");
+    rt::Thread([=] { AdminHandler(std::unique_ptr<rt::TcpConn>(c)); })
+        .Detach();
+  }
+}
+
 void ServerHandler(void *arg) {
-  /* dial memcached connections */
+  {
+    rt::MutexGuard g(&membership_lock);
+
+    /* dial memcached connections */
+    if (use_pooled_connections) {
+      for (Backend *b : backends) {
+        b->ep = RpcEndpoint<MemcachedHdr>::Create(b->addr);
+        if (b->ep == nullptr) BUG();
+      }
+    }
+    if (publish_membership()) panic("no backend takes keys");
+  }
+
   if (use_pooled_connections) {
-    for (auto &w : memcached_addrs) {
-      auto ep = RpcEndpoint<MemcachedHdr>::Create(w);
-      if (ep == nullptr) BUG();
-      memcached_endpoints.push_back(ep);
+    if (cache_capacity) {
+      hot_cache = new rt::LruCache<std::string, CachedResponse>(cache_capacity);
     }
+    if (track_health) rt::Thread(HealthChecker).Detach();
+    rt::Thread(StatsReporter).Detach();
   }
+  if (admin_port) rt::Thread(AdminServer).Detach();
 
   std::unique_ptr<rt::TcpQueue> q(rt::TcpQueue::Listen(listenaddr, 4096));
   if (q == nullptr) panic("couldn't listen for connections");
@@ -181,15 +800,53 @@ void ServerHandler(void *arg) {
   }
 }
 
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-s] [-c cache_entries] [-t cache_ttl_us] [-a port] "
+          "[-n] [cfg] listenaddr use_pool use_affinity_dial "
+          "memcached_addr[@weight]...\n"
+          "  -s  collapse concurrent GETs of a key into one backend GET\n"
+          "  -c  cache up to this many hot keys in the router\n"
+          "  -t  how long a cached key stays valid (default %lu us)\n"
+          "  -a  accept membership changes on this port\n"
+          "  -n  don't down-weight or eject slow backends\n"
+          "(-s, -c and health tracking need use_pool)\n",
+          prog, cache_ttl_us);
+}
+
 int main(int argc, char *argv[]) {
+  const char *prog = argv[0];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "sc:t:a:n")) != -1) {
+    switch (opt) {
+      case 's':
+        coalesce_gets = true;
+        break;
+      case 'c':
+        cache_capacity = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        cache_ttl_us = strtoul(optarg, NULL, 0);
+        break;
+      case 'a':
+        admin_port = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        track_health = false;
+        break;
+      default:
+        usage(prog);
+        return -EINVAL;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc < 6) {
-    fprintf(stderr,
-            "usage: %s [cfg] listenaddr use_pool use_affinity_dial "
-            "memcached_addrs... \n",
-            argv[0]);
+    usage(prog);
     return -EINVAL;
   }
-
   if (StringToAddr(argv[2], &listenaddr)) {
     printf("failed to parse addr %s\n", argv[2]);
     return -EINVAL;
@@ -197,17 +854,20 @@ int main(int argc, char *argv[]) {
 
   use_pooled_connections = !!atoi(argv[3]);
   use_affinity_dial = !!atoi(argv[4]);
+  if ((coalesce_gets || cache_capacity) && !use_pooled_connections) {
+    usage(prog);
+    return -EINVAL;
+  }
+  track_health &= use_pooled_connections;
 
   for (int i = 5; i < argc; i++) {
     netaddr addr;
-    if (StringToAddr(argv[i], &addr)) {
-      printf("failed to parse addr %s\n", argv[i]);
+    double weight;
+    if (parse_backend(argv[i], &addr, &weight)) {
+      printf("failed to parse backend %s\n", argv[i]);
       return -EINVAL;
     }
-    // Duplicate the servers for now...
-    // for (int j = 0; j < 400; j++) {
-    memcached_addrs.push_back(addr);
-    // }
+    backends.push_back(new Backend(addr, weight));
   }
 
   int ret = runtime_init(argv[1], ServerHandler, NULL);
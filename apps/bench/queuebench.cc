@@ -0,0 +1,219 @@
+// queuebench.cc - throughput of the queues in bindings/cc/queue.h against a
+// mutex and condition variable queue, across producer/consumer counts
+//
+// Producers push a fixed number of items in total and consumers pop them
+// until the queue is closed and drained. Every queue blocks when full or
+// empty, so each run measures the same handoff, and the consumers' sum is
+// checked against what was pushed.
+
+extern "C" {
+#include <base/log.h>
+}
+
+#include "queue.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the number of items pushed per run.
+uint64_t items;
+// the capacity of each queue.
+size_t capacity;
+// the (producers, consumers) pairs to sweep.
+std::vector<std::pair<int, int>> configs = {
+    {1, 1}, {1, 4}, {4, 1}, {4, 4}, {8, 8}};
+
+// the items moved per call in batch mode.
+constexpr size_t kBatch = 16;
+
+// A bounded queue with a mutex and condition variables, as apps hand-roll
+// it today (see apps/netbench/interference.cc).
+class CondVarQueue {
+ public:
+  explicit CondVarQueue(size_t capacity)
+      : closed_(false), head_(0), tail_(0), q_(capacity) {}
+
+  bool Push(uint64_t v) {
+    rt::ScopedLock<rt::Mutex> l(&m_);
+    while (head_ - tail_ == q_.size() && !closed_) not_full_.Wait(&m_);
+    if (closed_) return false;
+    q_[head_++ % q_.size()] = v;
+    not_empty_.Signal();
+    return true;
+  }
+
+  bool Pop(uint64_t *v) {
+    rt::ScopedLock<rt::Mutex> l(&m_);
+    while (head_ == tail_ && !closed_) not_empty_.Wait(&m_);
+    if (head_ == tail_) return false;
+    *v = q_[tail_++ % q_.size()];
+    not_full_.Signal();
+    return true;
+  }
+
+  void Close() {
+    rt::ScopedLock<rt::Mutex> l(&m_);
+    closed_ = true;
+    not_full_.SignalAll();
+    not_empty_.SignalAll();
+  }
+
+ private:
+  bool closed_;
+  uint64_t head_;
+  uint64_t tail_;
+  std::vector<uint64_t> q_;
+  rt::Mutex m_;
+  rt::CondVar not_full_;
+  rt::CondVar not_empty_;
+};
+
+// Pushes and pops one item at a time.
+template <typename Q>
+struct Single {
+  static void Produce(Q *q, uint64_t first, uint64_t n) {
+    for (uint64_t i = first; i < first + n; i++)
+      if (unlikely(!q->Push(i))) panic("push failed");
+  }
+
+  static uint64_t Consume(Q *q) {
+    uint64_t v, sum = 0;
+    while (q->Pop(&v)) sum += v;
+    return sum;
+  }
+};
+
+// Pushes and pops up to kBatch items at a time.
+template <typename Q>
+struct Batch {
+  static void Produce(Q *q, uint64_t first, uint64_t n) {
+    uint64_t buf[kBatch];
+    for (uint64_t i = first; i < first + n;) {
+      size_t k = std::min<uint64_t>(kBatch, first + n - i);
+      for (size_t j = 0; j < k; j++) buf[j] = i + j;
+      if (unlikely(q->PushBatch(buf, k) != k)) panic("push failed");
+      i += k;
+    }
+  }
+
+  static uint64_t Consume(Q *q) {
+    uint64_t buf[kBatch], sum = 0;
+    size_t k;
+    while ((k = q->PopBatch(buf, kBatch)) > 0)
+      for (size_t j = 0; j < k; j++) sum += buf[j];
+    return sum;
+  }
+};
+
+// Returns the throughput in millions of items per second.
+template <typename Q, template <typename> class Mode>
+double RunOne(int producers, int consumers) {
+  Q q(capacity);
+  std::vector<uint64_t> sums(consumers);
+  std::vector<rt::Thread> cths, pths;
+
+  uint64_t start = rt::MicroTime();
+  for (int i = 0; i < consumers; i++)
+    cths.emplace_back([&, i] { sums[i] = Mode<Q>::Consume(&q); });
+  uint64_t per = items / producers;
+  for (int i = 0; i < producers; i++) {
+    uint64_t n = i == producers - 1 ? items - per * i : per;
+    pths.emplace_back([&q, i, per, n] { Mode<Q>::Produce(&q, per * i, n); });
+  }
+  for (auto &t : pths) t.Join();
+  q.Close();
+  for (auto &t : cths) t.Join();
+  uint64_t elapsed = rt::MicroTime() - start;
+
+  uint64_t sum = 0;
+  for (uint64_t s : sums) sum += s;
+  if (unlikely(sum != items * (items - 1) / 2))
+    panic("queuebench: items lost or duplicated");
+  return static_cast<double>(items) / elapsed;
+}
+
+void PrintResult(const char *queue, int producers, int consumers,
+                 double mops) {
+  std::cout << std::setprecision(2) << std::fixed << queue << ", "
+            << producers << ", " << consumers << ", " << mops << std::endl;
+}
+
+void MainHandler(void *arg) {
+  using Spsc = rt::BlockingQueue<rt::SpscQueue<uint64_t>>;
+  using Mpsc = rt::BlockingQueue<rt::MpscQueue<uint64_t>>;
+  using Mpmc = rt::BlockingQueue<rt::MpmcQueue<uint64_t>>;
+
+  std::cout << "queue, producers, consumers, mops" << std::endl;
+  for (auto [p, c] : configs) {
+    PrintResult("condvar", p, c, RunOne<CondVarQueue, Single>(p, c));
+    if (p == 1 && c == 1) {
+      PrintResult("spsc", p, c, RunOne<Spsc, Single>(p, c));
+      PrintResult("spsc_batch", p, c, RunOne<Spsc, Batch>(p, c));
+    }
+    if (c == 1) {
+      PrintResult("mpsc", p, c, RunOne<Mpsc, Single>(p, c));
+      PrintResult("mpsc_batch", p, c, RunOne<Mpsc, Batch>(p, c));
+    }
+    PrintResult("mpmc", p, c, RunOne<Mpmc, Single>(p, c));
+    PrintResult("mpmc_batch", p, c, RunOne<Mpmc, Batch>(p, c));
+  }
+}
+
+int ParseConfigs(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  configs.clear();
+  while (std::getline(ss, tok, ',')) {
+    size_t colon = tok.find(':');
+    if (colon == std::string::npos) return -EINVAL;
+    int p = std::stoi(tok.substr(0, colon));
+    int c = std::stoi(tok.substr(colon + 1));
+    if (p <= 0 || c <= 0) return -EINVAL;
+    configs.emplace_back(p, c);
+  }
+  return configs.empty() ? -EINVAL : 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [items] [capacity] "
+               "[producers:consumers,...]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 4) {
+    Usage();
+    return -EINVAL;
+  }
+
+  items = std::stoul(argv[2], nullptr, 0);
+  capacity = std::stoul(argv[3], nullptr, 0);
+  if (items == 0 || capacity == 0 || (argc > 4 && ParseConfigs(argv[4]))) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -0,0 +1,147 @@
+// ringbench.cc - how many keys move when memcached_router's membership
+// changes, with the consistent hash ring (HashRing.h) against the modulo
+// hashing it replaced
+//
+// For each backend count, it hashes a set of keys the way the router does
+// and reports the share of keys that map to a different backend after one
+// backend joins, one leaves, and one drops to half weight, next to the ideal
+// share. It also reports the busiest backend's load relative to a perfectly
+// even split. This runs without the runtime.
+
+extern "C" {
+#include <base/hash.h>
+#include <net/ip.h>
+}
+
+#include "HashRing.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// the number of keys to hash.
+uint64_t nkeys;
+// the backend counts to sweep.
+const std::vector<unsigned int> backend_counts = {2, 4, 16, 64};
+
+std::vector<uint32_t> KeyHashes() {
+  std::vector<uint32_t> hashes(nkeys);
+  char key[32];
+  for (uint64_t i = 0; i < nkeys; i++) {
+    size_t len = snprintf(key, sizeof(key), "key:%lu", i);
+    hashes[i] = jenkins_hash(key, len);
+  }
+  return hashes;
+}
+
+// Backends are identified by address, as in the router.
+uint64_t BackendId(unsigned int i) {
+  uint32_t ip = MAKE_IP_ADDR(10, 0, i / 256, i % 256);
+  return (static_cast<uint64_t>(ip) << 16) | 11211;
+}
+
+// Maps every key to a backend id with @lookup.
+using Lookup = std::function<uint64_t(uint32_t)>;
+
+std::vector<uint64_t> Assign(const std::vector<uint32_t> &hashes,
+                             const Lookup &lookup) {
+  std::vector<uint64_t> ids(hashes.size());
+  for (size_t i = 0; i < hashes.size(); i++) ids[i] = lookup(hashes[i]);
+  return ids;
+}
+
+double Moved(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b) {
+  uint64_t moved = 0;
+  for (size_t i = 0; i < a.size(); i++) moved += a[i] != b[i];
+  return static_cast<double>(moved) / a.size();
+}
+
+// Returns the busiest backend's share of keys over the share it would have
+// if keys were split evenly (1 is perfect).
+double MaxLoad(const std::vector<uint64_t> &ids, unsigned int n) {
+  std::vector<uint64_t> sorted = ids;
+  std::sort(sorted.begin(), sorted.end());
+  uint64_t max = 0;
+  for (auto it = sorted.begin(); it != sorted.end();) {
+    auto end = std::upper_bound(it, sorted.end(), *it);
+    max = std::max<uint64_t>(max, end - it);
+    it = end;
+  }
+  return static_cast<double>(max) * n / ids.size();
+}
+
+Lookup RingLookup(std::vector<HashRing::Member> members) {
+  auto ring = std::make_shared<HashRing>(members);
+  return [ring, members](uint32_t h) { return members[ring->Lookup(h)].id; };
+}
+
+Lookup ModuloLookup(std::vector<HashRing::Member> members) {
+  return [members](uint32_t h) { return members[h % members.size()].id; };
+}
+
+void PrintResult(const char *scheme, const char *change, unsigned int n,
+                 double moved, double ideal, double max_load) {
+  std::cout << std::setprecision(4) << std::fixed << scheme << ", " << change
+            << ", " << n << ", " << moved << ", " << ideal << ", " << max_load
+            << std::endl;
+}
+
+void Run(const std::vector<uint32_t> &hashes, unsigned int n) {
+  std::vector<HashRing::Member> base, grown, shrunk, reweighted;
+  for (unsigned int i = 0; i < n; i++) base.push_back({BackendId(i), 1.0});
+  grown = base;
+  grown.push_back({BackendId(n), 1.0});
+  // drop a backend from the middle, as a failure would
+  shrunk = base;
+  shrunk.erase(shrunk.begin() + n / 2);
+  reweighted = base;
+  reweighted[n / 2].weight = 0.5;
+
+  struct {
+    const char *name;
+    Lookup (*make)(std::vector<HashRing::Member>);
+    bool weighted;
+  } schemes[] = {{"ring", RingLookup, true}, {"modulo", ModuloLookup, false}};
+
+  for (auto &sc : schemes) {
+    std::vector<uint64_t> before = Assign(hashes, sc.make(base));
+    double load = MaxLoad(before, n);
+    PrintResult(sc.name, "add", n,
+                Moved(before, Assign(hashes, sc.make(grown))), 1.0 / (n + 1),
+                load);
+    PrintResult(sc.name, "remove", n,
+                Moved(before, Assign(hashes, sc.make(shrunk))), 1.0 / n, load);
+    if (!sc.weighted) continue;
+    PrintResult(sc.name, "half_weight", n,
+                Moved(before, Assign(hashes, sc.make(reweighted))), 0.5 / n,
+                load);
+  }
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: [keys]" << std::endl;
+    return -EINVAL;
+  }
+  nkeys = std::strtoul(argv[1], nullptr, 0);
+  if (nkeys == 0) {
+    std::cerr << "usage: [keys]" << std::endl;
+    return -EINVAL;
+  }
+
+  std::vector<uint32_t> hashes = KeyHashes();
+  std::cout << "scheme, change, backends, moved, ideal, max_load"
+            << std::endl;
+  for (unsigned int n : backend_counts) Run(hashes, n);
+  return 0;
+}
@@ -1,254 +1,470 @@
+// storage_bench.cc - a storage benchmark producing latency/throughput curves
+//
+// Runs open-loop (Poisson arrivals at a list of offered loads) or closed-loop
+// (a fixed number of outstanding I/Os per thread, for a list of depths)
+// experiments against the default volume or a single device, with a
+// configurable read/write mix, request size distribution, and LBA pattern.
+// Works with NVMe devices or the emulated backend.
+
 extern "C" {
 #include <base/log.h>
-#include <runtime/storage.h>
 }
 
-#include "net.h"
+#include "Histogram.h"
 #include "runtime.h"
+#include "storage.h"
 #include "sync.h"
 #include "thread.h"
 #include "timer.h"
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace {
 
 using namespace std::chrono;
-using sec = duration<double, std::micro>;
 
 // <- ARGUMENTS FOR EXPERIMENT ->
-// the number of worker threads to spawn.
-int threads;
-size_t block_count;
-size_t pct_set;
-double total_block_count = 547002288.0;
-size_t us_per_sample;
-size_t nsamples;
-
-// The maximum lateness to tolerate before dropping egress samples.
+// open-loop (Poisson arrivals) or closed-loop.
+bool open_loop = true;
+// the number of load generator threads.
+int threads = 8;
+// offered loads (IOPS) for open-loop, or depths per thread for closed-loop.
+std::vector<double> loads;
+// how long to run each load point.
+uint64_t duration_us = 2000000;
+// the percentage of operations that are reads.
+unsigned int read_pct = 100;
+// request sizes in blocks and their relative weights.
+std::vector<uint32_t> sizes = {8};
+std::vector<double> size_weights = {1.0};
+// the Zipf exponent for LBA selection (0 is uniform).
+double zipf_theta = 0.0;
+// the device to use (-1 is the default volume).
+int dev = -1;
+// where to write JSON results (empty means no JSON output).
+std::string json_path;
+
+enum { kRead = 0, kWrite, kNrOps };
+const char *op_names[kNrOps] = {"read", "write"};
+
+// The maximum lateness for open-loop arrivals before counting them as late.
 constexpr uint64_t kMaxCatchUpUS = 5;
 
-struct work_unit {
-  double start_us;
-  size_t lba;
-  bool is_set;
-  double duration_us;
+// Samples ranks in [1, n] from a Zipf distribution in O(1) per sample using
+// rejection-inversion (Hormann and Derflinger), so it works for large devices.
+class ZipfGenerator {
+ public:
+  ZipfGenerator(uint64_t n, double theta) : n_(n), theta_(theta) {
+    h_x1_ = HIntegral(1.5) - 1.0;
+    h_n_ = HIntegral(n_ + 0.5);
+    s_ = 2.0 - HIntegralInverse(HIntegral(2.5) - H(2.0));
+  }
+
+  template <class URNG>
+  uint64_t operator()(URNG &g) {
+    std::uniform_real_distribution<double> ud(0.0, 1.0);
+    while (true) {
+      double u = h_n_ + ud(g) * (h_x1_ - h_n_);
+      double x = HIntegralInverse(u);
+      double k = std::floor(x + 0.5);
+      k = std::min(std::max(k, 1.0), static_cast<double>(n_));
+      if (k - x <= s_ || u >= HIntegral(k + 0.5) - H(k))
+        return static_cast<uint64_t>(k);
+    }
+  }
+
+ private:
+  static double Helper1(double x) {
+    if (std::abs(x) > 1e-8) return std::log1p(x) / x;
+    return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+  }
+
+  static double Helper2(double x) {
+    if (std::abs(x) > 1e-8) return std::expm1(x) / x;
+    return 1.0 + x * 0.5 * (1.0 + x * 1.0 / 3.0 * (1.0 + 0.25 * x));
+  }
+
+  double H(double x) const { return std::exp(-theta_ * std::log(x)); }
+
+  double HIntegral(double x) const {
+    double lx = std::log(x);
+    return Helper2((1.0 - theta_) * lx) * lx;
+  }
+
+  double HIntegralInverse(double x) const {
+    double t = std::max(x * (1.0 - theta_), -1.0);
+    return std::exp(Helper1(t) * x);
+  }
+
+  uint64_t n_;
+  double theta_;
+  double h_x1_, h_n_, s_;
 };
 
-struct uptime {
-  uint64_t idle;
-  uint64_t busy;
+// Generates a stream of operations (type, LBA, and size).
+class OpGenerator {
+ public:
+  OpGenerator(uint64_t seed, uint64_t num_blocks)
+      : rg_(seed),
+        sd_(size_weights.begin(), size_weights.end()),
+        max_blocks_(*std::max_element(sizes.begin(), sizes.end())),
+        units_(num_blocks / max_blocks_),
+        zipf_(units_, zipf_theta) {}
+
+  struct op {
+    int type;
+    uint64_t lba;
+    uint32_t lba_count;
+  };
+
+  op Next() {
+    op o;
+    o.type = rg_() % 100 < read_pct ? kRead : kWrite;
+    o.lba_count = sizes[sd_(rg_)];
+
+    uint64_t unit;
+    if (zipf_theta > 0.0) {
+      // scatter hot ranks across the device
+      unit = Scramble(zipf_(rg_) - 1) % units_;
+    } else {
+      unit = std::uniform_int_distribution<uint64_t>(0, units_ - 1)(rg_);
+    }
+    o.lba = unit * max_blocks_;
+    return o;
+  }
+
+ private:
+  static uint64_t Scramble(uint64_t v) {
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdUL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53UL;
+    v ^= v >> 33;
+    return v;
+  }
+
+  std::mt19937_64 rg_;
+  std::discrete_distribution<size_t> sd_;
+  uint32_t max_blocks_;
+  uint64_t units_;
+  ZipfGenerator zipf_;
 };
 
-uptime ReadUptime() {
-    std::ifstream file("/proc/stat");
-    std::string line;
-    std::getline(file, line);
-    std::istringstream ss(line);
-    std::string tmp;
-    uint64_t user, nice, system, idle, iowait, irq, softirq, steal, guest,
-             guest_nice;
-    ss >> tmp >> user >> nice >> system >> idle >> iowait >> irq >> softirq
-       >> steal >> guest >> guest_nice;
-    return {idle + iowait,
-                user + nice + system + irq + softirq + steal};
+int DoIO(int type, void *buf, uint64_t lba, uint32_t lba_count) {
+  if (dev < 0) {
+    if (type == kRead) return Storage::Read(buf, lba, lba_count);
+    return Storage::Write(buf, lba, lba_count);
+  }
+
+  StorageDevice d(dev);
+  if (type == kRead) return d.Read(buf, lba, lba_count);
+  return d.Write(buf, lba, lba_count);
 }
 
+uint32_t BlockSize() {
+  return dev < 0 ? Storage::get_block_size()
+                 : Storage::GetDevice(dev).get_block_size();
+}
 
-template <class Arrival, class Service>
-std::vector<work_unit> GenerateWork(Arrival a, Service s, double cur_us,
-                                    double last_us) {
-  std::vector<work_unit> w;
-  while (cur_us < last_us) {
-    cur_us += a();
-    auto set = s() % 100 < pct_set;
-    w.emplace_back(work_unit{cur_us, s() & ~0x7, set, 0});
-  }
-  return w;
+uint64_t NumBlocks() {
+  return dev < 0 ? Storage::get_num_blocks()
+                 : Storage::GetDevice(dev).get_num_blocks();
 }
 
+struct result {
+  double load;
+  double iops;
+  double mbps;
+  uint64_t errors;
+  uint64_t late;
+  Histogram hist[kNrOps];
+};
+
+struct thread_result {
+  uint64_t errors = 0;
+  uint64_t late = 0;
+  uint64_t bytes = 0;
+  Histogram hist[kNrOps];
+};
 
-std::vector<work_unit> ClientWorker(
-    rt::WaitGroup *starter, std::function<std::vector<work_unit>()> wf) {
-  std::vector<work_unit> w(wf());
-  std::vector<time_point<steady_clock>> timings;
-  timings.reserve(w.size());
+struct open_op {
+  uint64_t start_ns;
+  uint64_t lat_ns;
+  OpGenerator::op op;
+  int ret;
+};
+
+// Issues Poisson arrivals at @rate IOPS, each in its own uthread, and measures
+// latency from the scheduled arrival time (avoiding coordinated omission).
+void OpenLoopWorker(int tid, double rate, rt::WaitGroup *starter,
+                    thread_result *res) {
+  OpGenerator gen(rand() + tid, NumBlocks());
+  std::mt19937 rg(rand());
+  std::exponential_distribution<double> ad(rate / 1e9);
+  // generate the schedule up front
+  std::vector<open_op> w;
+  double t = 0;
+  while (true) {
+    t += ad(rg);
+    if (t >= duration_us * 1000.0) break;
+    w.push_back(open_op{static_cast<uint64_t>(t), 0, gen.Next(), 0});
+  }
 
-  // Start the receiver thread.
-  // Synchronized start of load generation.
   starter->Done();
   starter->Wait();
-  barrier();
   auto expstart = steady_clock::now();
-  barrier();
-
-  auto wsize = w.size();
-  rt::WaitGroup wg(wsize);
-  int dropped = 0;
-
-  for (unsigned int i = 0; i < wsize; ++i) {
-    barrier();
-    auto now = steady_clock::now();
-    barrier();
-    if (duration_cast<sec>(now - expstart).count() < w[i].start_us)
-      rt::Sleep(w[i].start_us - duration_cast<sec>(now - expstart).count());
-    now = steady_clock::now();
-    if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-        kMaxCatchUpUS) {
-      dropped++;
-      continue;
-    }
 
-    barrier();
-    timings[i] = steady_clock::now();
-    barrier();
-    rt::Spawn([&, i] {
-      int ret;
-      unsigned char dat[block_count * 512];
-
-      auto now = steady_clock::now();
-
-      if (duration_cast<sec>(now - expstart).count() - w[i].start_us >
-          kMaxCatchUpUS) {
-        wg.Done();
-        return;
-      }
-
-      if (w[i].is_set) {
-        ret = storage_write(dat, w[i].lba, block_count);
-      } else {
-        ret = storage_read(dat, w[i].lba, block_count);
-      }
-
-      barrier();
-      auto ts = steady_clock::now();
-      barrier();
-      if (ret == 0)
-        w[i].duration_us = duration_cast<sec>(ts - timings[i]).count();
+  rt::WaitGroup wg(w.size());
+  for (auto &o : w) {
+    uint64_t now =
+        duration_cast<nanoseconds>(steady_clock::now() - expstart).count();
+    if (now < o.start_ns) {
+      rt::Sleep((o.start_ns - now) / 1000);
+      now = duration_cast<nanoseconds>(steady_clock::now() - expstart).count();
+    }
+    if (now > o.start_ns + kMaxCatchUpUS * 1000) res->late++;
+
+    rt::Spawn([&, p = &o] {
+      // requests overlap, so each needs its own buffer
+      std::unique_ptr<char[]> buf(new char[p->op.lba_count * BlockSize()]);
+      p->ret = DoIO(p->op.type, buf.get(), p->op.lba, p->op.lba_count);
+      p->lat_ns =
+          duration_cast<nanoseconds>(steady_clock::now() - expstart).count() -
+          p->start_ns;
       wg.Done();
     });
   }
-
-  wg.Add(-1 * dropped);
   wg.Wait();
 
-  return w;
+  for (auto &o : w) {
+    if (o.ret) {
+      res->errors++;
+      continue;
+    }
+    res->hist[o.op.type].Record(o.lat_ns);
+    res->bytes += static_cast<uint64_t>(o.op.lba_count) * BlockSize();
+  }
+}
+
+// Keeps one I/O outstanding until the experiment ends.
+void ClosedLoopWorker(int tid, rt::WaitGroup *starter, thread_result *res) {
+  OpGenerator gen(rand() + tid, NumBlocks());
+  uint32_t max_blocks = *std::max_element(sizes.begin(), sizes.end());
+  std::unique_ptr<char[]> buf(new char[max_blocks * BlockSize()]);
+
+  starter->Done();
+  starter->Wait();
+  auto end = steady_clock::now() + microseconds(duration_us);
+
+  while (true) {
+    auto op = gen.Next();
+    auto start = steady_clock::now();
+    if (start >= end) break;
+    int ret = DoIO(op.type, buf.get(), op.lba, op.lba_count);
+    auto finish = steady_clock::now();
+    if (ret) {
+      res->errors++;
+      continue;
+    }
+    res->hist[op.type].Record(
+        duration_cast<nanoseconds>(finish - start).count());
+    res->bytes += static_cast<uint64_t>(op.lba_count) * BlockSize();
+  }
 }
 
-std::vector<work_unit> RunExperiment(
-    int threads, double *reqs_per_sec, double *cpu_usage, uint64_t *start_wct,
-    std::function<std::vector<work_unit>()> wf) {
-  // Launch a worker thread for each connection.
-  rt::WaitGroup starter(threads + 1);
+result RunExperiment(double load) {
+  int nworkers = open_loop ? threads : threads * static_cast<int>(load);
+  std::vector<thread_result> res(nworkers);
+  rt::WaitGroup starter(nworkers + 1);
   std::vector<rt::Thread> th;
-  std::unique_ptr<std::vector<work_unit>> samples[threads];
-  for (int i = 0; i < threads; ++i) {
+
+  for (int i = 0; i < nworkers; ++i) {
     th.emplace_back(rt::Thread([&, i] {
-      auto v = ClientWorker(&starter, wf);
-      samples[i].reset(new std::vector<work_unit>(std::move(v)));
+      if (open_loop)
+        OpenLoopWorker(i, load / threads, &starter, &res[i]);
+      else
+        ClosedLoopWorker(i, &starter, &res[i]);
     }));
   }
 
-  // Give the workers time to initialize, then start recording.
   starter.Done();
   starter.Wait();
-
-  // |--- start experiment duration timing ---|
-  barrier();
   auto start = steady_clock::now();
-  auto start_sys = system_clock::now();
-  barrier();
-  uptime u1 = ReadUptime();
-
-  // Wait for the workers to finish.
   for (auto &t : th) t.Join();
-
-  // |--- end experiment duration timing ---|
-  barrier();
-  auto finish = steady_clock::now();
-  barrier();
-  uptime u2 = ReadUptime();
-
-  // Aggregate all the samples together.
-  std::vector<work_unit> w;
-  for (int i = 0; i < threads; ++i) {
-    auto &v = *samples[i];
-    w.insert(w.end(), v.begin(), v.end());
+  double elapsed =
+      duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+  result r{};
+  r.load = load;
+  uint64_t bytes = 0;
+  for (auto &tr : res) {
+    r.errors += tr.errors;
+    r.late += tr.late;
+    bytes += tr.bytes;
+    for (int op = 0; op < kNrOps; op++) r.hist[op].Merge(tr.hist[op]);
   }
+  r.iops = (r.hist[kRead].count() + r.hist[kWrite].count()) / elapsed;
+  r.mbps = bytes / elapsed / 1e6;
+  return r;
+}
 
-  // Remove requests that did not complete.
-  w.erase(std::remove_if(w.begin(), w.end(),
-                         [](const work_unit &s) { return s.duration_us == 0; }),
-          w.end());
-
-  // Report results.
-  double elapsed = duration_cast<sec>(finish - start).count();
-  if (reqs_per_sec != nullptr)
-    *reqs_per_sec = static_cast<double>(w.size()) / elapsed * 1000000;
-  uint64_t idle = u2.idle - u1.idle;
-  uint64_t busy = u2.busy - u1.busy;
-  if (cpu_usage != nullptr)
-    *cpu_usage = static_cast<double>(busy) /
-                 static_cast<double>(idle + busy);
-  if (start_wct != nullptr)
-    *start_wct = duration_cast<sec>(start_sys.time_since_epoch()).count() / 1000000;
-  return w;
+void PrintResult(const result &r) {
+  Histogram all;
+  for (int op = 0; op < kNrOps; op++) all.Merge(r.hist[op]);
+
+  // load,iops,MB/s,errors,late,samples,min,mean,p50,p90,p99,p999,p9999,max
+  std::cout << std::setprecision(4) << std::fixed << r.load << "," << r.iops
+            << "," << r.mbps << "," << r.errors << "," << r.late << ","
+            << all.count() << "," << all.min() / 1e3 << ","
+            << all.mean() / 1e3 << "," << all.Percentile(50) / 1e3 << ","
+            << all.Percentile(90) / 1e3 << "," << all.Percentile(99) / 1e3
+            << "," << all.Percentile(99.9) / 1e3 << ","
+            << all.Percentile(99.99) / 1e3 << "," << all.max() / 1e3
+            << std::endl;
 }
 
-void PrintStatResults(std::vector<work_unit> w, double offered_rps, double rps,
-                      double cpu_usage, uint64_t start_wct) {
-  std::sort(w.begin(), w.end(), [](const work_unit &s1, work_unit &s2) {
-    return s1.duration_us < s2.duration_us;
+void WriteHistogramJSON(std::ostream &os, const Histogram &h) {
+  os << "{\"samples\":" << h.count() << ",\"min_us\":" << h.min() / 1e3
+     << ",\"mean_us\":" << h.mean() / 1e3;
+  for (double p : {50.0, 90.0, 99.0, 99.9, 99.99}) {
+    std::ostringstream name;
+    name << "p" << p;
+    std::string s = name.str();
+    s.erase(std::remove(s.begin(), s.end(), '.'), s.end());
+    os << ",\"" << s << "_us\":" << h.Percentile(p) / 1e3;
+  }
+  os << ",\"max_us\":" << h.max() / 1e3 << ",\"buckets_ns\":[";
+  bool first = true;
+  h.ForEachBucket([&](uint64_t v, uint64_t c) {
+    os << (first ? "" : ",") << "[" << v << "," << c << "]";
+    first = false;
   });
-  double sum = std::accumulate(
-      w.begin(), w.end(), 0.0,
-      [](double s, const work_unit &c) { return s + c.duration_us; });
-  double mean = sum / w.size();
-  double count = static_cast<double>(w.size());
-  double p90 = w[count * 0.9].duration_us;
-  double p99 = w[count * 0.99].duration_us;
-  double p999 = w[count * 0.999].duration_us;
-  double p9999 = w[count * 0.9999].duration_us;
-  double min = w[0].duration_us;
-  double max = w[w.size() - 1].duration_us;
-  std::cout  //<<
-             //"#threads,offered_rps,rps,cpu_usage,samples,min,mean,p90,p99,p999,p9999,max"
-             //<< std::endl
-      << std::setprecision(4) << std::fixed << threads << "," << offered_rps
-      << "," << rps << "," << cpu_usage << "," << w.size() << "," << min << ","
-      << mean << "," << p90 << "," << p99 << "," << p999 << "," << p9999 << ","
-      << max << "," << start_wct << std::endl;
+  os << "]}";
 }
 
-void SteadyStateExperiment(int threads, double offered_rps,
-                           double service_time) {
-  double rps, cpu_usage;
-  uint64_t start_wct;
-  std::vector<work_unit> w = RunExperiment(threads, &rps, &cpu_usage, &start_wct, [=] {
-    std::mt19937 rg(rand());
-    std::mt19937 dg(rand());
-    std::exponential_distribution<double> rd(
-        1.0 / (1000000.0 / (offered_rps / static_cast<double>(threads))));
-    std::uniform_int_distribution<size_t> wd(0.0, total_block_count);
-    return GenerateWork(std::bind(rd, rg), std::bind(wd, dg), 0, us_per_sample);
-  });
+void WriteJSON(const std::vector<result> &results) {
+  std::ofstream os(json_path);
+  if (!os) {
+    log_err("storage_bench: couldn't open %s", json_path.c_str());
+    return;
+  }
 
-  // Print the results.
-  PrintStatResults(w, offered_rps, rps, cpu_usage, start_wct);
+  os << std::setprecision(6) << std::fixed;
+  os << "{\"config\":{\"mode\":\"" << (open_loop ? "open" : "closed")
+     << "\",\"threads\":" << threads << ",\"duration_us\":" << duration_us
+     << ",\"read_pct\":" << read_pct << ",\"zipf_theta\":" << zipf_theta
+     << ",\"dev\":" << dev << ",\"block_size\":" << BlockSize()
+     << ",\"num_blocks\":" << NumBlocks() << ",\"sizes\":[";
+  for (size_t i = 0; i < sizes.size(); i++)
+    os << (i ? "," : "") << "[" << sizes[i] << "," << size_weights[i] << "]";
+  os << "]},\"results\":[";
+  for (size_t i = 0; i < results.size(); i++) {
+    const result &r = results[i];
+    os << (i ? "," : "") << "{\"" << (open_loop ? "offered_iops" : "depth")
+       << "\":" << r.load << ",\"iops\":" << r.iops << ",\"mbps\":" << r.mbps
+       << ",\"errors\":" << r.errors << ",\"late\":" << r.late;
+    for (int op = 0; op < kNrOps; op++) {
+      os << ",\"" << op_names[op] << "\":";
+      WriteHistogramJSON(os, r.hist[op]);
+    }
+    os << "}";
+  }
+  os << "]}" << std::endl;
 }
 
 void ClientHandler(void *arg) {
-  double max_pps = 600000;
-  double step = max_pps / nsamples;
-  for (double i = step; i <= max_pps; i += step) {
-    SteadyStateExperiment(threads, i, 0);
+  if (Storage::get_num_devices() == 0) {
+    log_err("storage_bench: storage is not enabled");
+    return;
+  }
+  if (dev >= static_cast<int>(Storage::get_num_devices())) {
+    log_err("storage_bench: no device %d", dev);
+    return;
   }
+  uint32_t max_blocks = *std::max_element(sizes.begin(), sizes.end());
+  if (NumBlocks() < max_blocks) {
+    log_err("storage_bench: requests are larger than the device");
+    return;
+  }
+
+  std::vector<result> results;
+  std::cout << "#load,iops,mbps,errors,late,samples,min,mean,p50,p90,p99,"
+               "p999,p9999,max"
+            << std::endl;
+  for (double load : loads) {
+    results.push_back(RunExperiment(load));
+    PrintResult(results.back());
+  }
+
+  if (!json_path.empty()) WriteJSON(results);
+}
+
+std::vector<std::string> split(const std::string &text, char sep) {
+  std::vector<std::string> tokens;
+  std::string::size_type start = 0, end = 0;
+  while ((end = text.find(sep, start)) != std::string::npos) {
+    tokens.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  tokens.push_back(text.substr(start));
+  return tokens;
+}
+
+int ParseArg(const std::string &arg) {
+  auto kv = split(arg, '=');
+  if (kv.size() != 2) return -EINVAL;
+  const std::string &k = kv[0], &v = kv[1];
+
+  if (k == "mode") {
+    if (v != "open" && v != "closed") return -EINVAL;
+    open_loop = v == "open";
+  } else if (k == "threads") {
+    threads = std::stoi(v, nullptr, 0);
+  } else if (k == "loads") {
+    loads.clear();
+    for (auto &t : split(v, ':')) loads.push_back(std::stod(t));
+  } else if (k == "duration_us") {
+    duration_us = std::stoull(v, nullptr, 0);
+  } else if (k == "read_pct") {
+    read_pct = std::stoi(v, nullptr, 0);
+  } else if (k == "sizes") {
+    sizes.clear();
+    size_weights.clear();
+    for (auto &t : split(v, ',')) {
+      auto sw = split(t, ':');
+      sizes.push_back(std::stoul(sw[0], nullptr, 0));
+      size_weights.push_back(sw.size() > 1 ? std::stod(sw[1]) : 1.0);
+    }
+  } else if (k == "lba") {
+    auto dist = split(v, ':');
+    if (dist[0] == "uniform") {
+      zipf_theta = 0.0;
+    } else if (dist[0] == "zipf") {
+      zipf_theta = dist.size() > 1 ? std::stod(dist[1]) : 0.99;
+      if (zipf_theta <= 0.0) return -EINVAL;
+    } else {
+      return -EINVAL;
+    }
+  } else if (k == "dev") {
+    dev = std::stoi(v, nullptr, 0);
+  } else if (k == "json") {
+    json_path = v;
+  } else {
+    return -EINVAL;
+  }
+
+  return 0;
 }
 
 }  // anonymous namespace
@@ -256,18 +472,39 @@ void ClientHandler(void *arg) {
 int main(int argc, char *argv[]) {
   int ret;
 
-  if (argc < 7) {
-    std::cerr << "usage: [cfg_file] [#threads] [block_count] [pct_set]"
-              << " [us_per_sample] [nsamples]"
-              << std::endl;
+  if (argc < 2) {
+    std::cerr << "usage: [cfg_file] [key=value]...\n"
+              << "  mode=open|closed     Poisson arrivals or fixed depth\n"
+              << "  threads=N            load generator threads\n"
+              << "  loads=L1:L2:...      offered IOPS (open) or depth per "
+                 "thread (closed)\n"
+              << "  duration_us=N        time per load point\n"
+              << "  read_pct=N           percentage of reads\n"
+              << "  sizes=B:W,...        request sizes in blocks with weights\n"
+              << "  lba=uniform|zipf[:theta]\n"
+              << "  dev=N                device index (-1 is default volume)\n"
+              << "  json=PATH            write results as JSON" << std::endl;
     return -EINVAL;
   }
 
-  threads = std::stoi(argv[2], nullptr, 0);
-  block_count = std::stoi(argv[3], nullptr, 0);
-  pct_set = std::stoi(argv[4], nullptr, 0);
-  us_per_sample = std::stoi(argv[5], nullptr, 0);
-  nsamples = std::stoi(argv[6], nullptr, 0);
+  for (int i = 2; i < argc; i++) {
+    try {
+      ret = ParseArg(argv[i]);
+    } catch (const std::exception &e) {
+      ret = -EINVAL;
+    }
+    if (ret) {
+      std::cerr << "invalid argument: " << argv[i] << std::endl;
+      return ret;
+    }
+  }
+
+  if (loads.empty()) loads = {open_loop ? 100000.0 : 1.0};
+  if (threads <= 0 || read_pct > 100 || sizes.empty() ||
+      *std::min_element(sizes.begin(), sizes.end()) == 0) {
+    std::cerr << "invalid configuration" << std::endl;
+    return -EINVAL;
+  }
 
   ret = runtime_init(argv[1], ClientHandler, NULL);
   if (ret) {
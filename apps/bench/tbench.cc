@@ -2,7 +2,9 @@
 #include "thread.h"
 #include "sync.h"
 
+#include <array>
 #include <chrono>
+#include <functional>
 #include <iostream>
 
 namespace {
@@ -17,6 +19,43 @@ void BenchSpawnJoin() {
   }
 }
 
+// A capture too large for std::function's small buffer.
+using LargeCapture = std::array<unsigned long, 32>;
+
+void BenchSpawnJoinLargeCapture() {
+  LargeCapture cap = {};
+  for (int i = 0; i < kMeasureRounds; ++i) {
+    cap[0] = i;
+    auto th = rt::Thread([cap](){ rt::read_once(cap[0]); });
+    th.Join();
+  }
+}
+
+// The same, type-erased through std::function like the old interface did.
+void BenchSpawnJoinLargeCaptureFunction() {
+  LargeCapture cap = {};
+  for (int i = 0; i < kMeasureRounds; ++i) {
+    cap[0] = i;
+    std::function<void()> func([cap](){ rt::read_once(cap[0]); });
+    auto th = rt::Thread(std::move(func));
+    th.Join();
+  }
+}
+
+void BenchSpawnLargeCapture() {
+  LargeCapture cap = {};
+  rt::WaitGroup wg(kMeasureRounds);
+  for (int i = 0; i < kMeasureRounds; ++i) {
+    cap[0] = i;
+    rt::Spawn([cap, &wg](){
+      rt::read_once(cap[0]);
+      wg.Done();
+    });
+    if (i % 64 == 0) rt::Yield();
+  }
+  wg.Wait();
+}
+
 void BenchUncontendedMutex() {
   rt::Mutex m;
   volatile unsigned long foo = 0;
@@ -78,6 +117,24 @@ void MainHandler(void *arg) {
   PrintResult("SpawnJoin",
 	std::chrono::duration_cast<us>(finish - start));
 
+  start = std::chrono::steady_clock::now();
+  BenchSpawnJoinLargeCapture();
+  finish = std::chrono::steady_clock::now();
+  PrintResult("SpawnJoinLargeCapture",
+    std::chrono::duration_cast<us>(finish - start));
+
+  start = std::chrono::steady_clock::now();
+  BenchSpawnJoinLargeCaptureFunction();
+  finish = std::chrono::steady_clock::now();
+  PrintResult("SpawnJoinLargeCaptureFunction",
+    std::chrono::duration_cast<us>(finish - start));
+
+  start = std::chrono::steady_clock::now();
+  BenchSpawnLargeCapture();
+  finish = std::chrono::steady_clock::now();
+  PrintResult("SpawnLargeCapture",
+    std::chrono::duration_cast<us>(finish - start));
+
   start = std::chrono::steady_clock::now();
   BenchUncontendedMutex();
   finish = std::chrono::steady_clock::now();
@@ -68,3 +68,26 @@ typedef struct __attribute__((__packed__)) {
   unsigned int lba_count;
   uint64_t tsc;
 } binary_header_blk_t;
+
+/*
+ * GET responses are streamed as one or more frames, each a response header
+ * (with lba_count set to the frame length) followed by a chunk header and
+ * the chunk's compressed, AES-256-GCM encrypted data. Frames may arrive out
+ * of order; the request is complete once the frame marked CHUNK_LAST arrives.
+ */
+
+#define CHUNK_LAST 0x01
+#define CHUNK_ERROR 0x02
+
+#define CHUNK_IV_LEN 12
+#define CHUNK_TAG_LEN 16
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t index;
+  uint32_t nchunks;
+  uint32_t flags;
+  uint32_t raw_len;
+  uint32_t data_len;
+  unsigned char iv[CHUNK_IV_LEN];
+  unsigned char tag[CHUNK_TAG_LEN];
+} chunk_hdr_t;
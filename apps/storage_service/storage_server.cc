@@ -7,6 +7,7 @@ extern "C" {
 #include <openssl/conf.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 }
 
 #include <fcntl.h>
@@ -20,43 +21,98 @@ extern "C" {
 
 #include <snappy.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
 #include <memory>
 #include <new>
+#include <string>
+#include <vector>
 
 #include "reflex.h"
 
 constexpr unsigned int kSectorSize = 512;
 constexpr uint64_t kStorageServicePort = 5000;
+// the largest GET or SET a client may request.
+constexpr size_t kMaxRequestSize = 16 * MB;
 
-static unsigned char iv[16];
+// GET responses are split into chunks of this size (a multiple of
+// kSectorSize) that are read, compressed and encrypted in parallel.
+static size_t chunk_size = 64 * KB;
 
-class SharedTcpStream {
+static unsigned char aes_key[32];
+
+// GCM IVs are a random per-process salt followed by a global counter, so
+// they are never reused with the same key.
+static uint32_t iv_salt;
+static std::atomic<uint64_t> iv_counter;
+
+// A pool of AES-256-GCM contexts with the key schedule already expanded.
+class CipherPool {
  public:
-  SharedTcpStream(std::shared_ptr<rt::TcpConn> c) : c_(c) {
-    int ret;
+  EVP_CIPHER_CTX *Get() {
+    {
+      rt::SpinGuard g(&lock_);
+      if (!free_.empty()) {
+        EVP_CIPHER_CTX *ctx = free_.back();
+        free_.pop_back();
+        return ctx;
+      }
+    }
 
     preempt_disable();
-    aes_ctx_ = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
     preempt_enable();
-    if (!aes_ctx_)
-      throw std::bad_alloc();
-
-    memset(aes_key_, 0xcc, sizeof(aes_key_));
-    ret = EVP_EncryptInit_ex(aes_ctx_, EVP_aes_256_cbc(), NULL, aes_key_, iv);
-    if (ret != 1)
-      panic("AES init %d", ret);
+    if (!ctx) throw std::bad_alloc();
 
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, aes_key, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHUNK_IV_LEN,
+                            NULL) != 1)
+      panic("AES-GCM init");
+    return ctx;
   }
 
-  ~SharedTcpStream() {
-    preempt_disable();
-    EVP_CIPHER_CTX_free(aes_ctx_);
-    preempt_enable();
+  void Put(EVP_CIPHER_CTX *ctx) {
+    rt::SpinGuard g(&lock_);
+    free_.push_back(ctx);
   }
 
+ private:
+  rt::Spin lock_;
+  std::vector<EVP_CIPHER_CTX *> free_;
+};
+
+static CipherPool cipher_pool;
+
+// Encrypts a chunk in place, filling in its IV and authentication tag.
+static int EncryptChunk(char *buf, size_t len, chunk_hdr_t *ch) {
+  uint64_t ctr = iv_counter.fetch_add(1, std::memory_order_relaxed);
+  int outl;
+
+  memcpy(ch->iv, &iv_salt, sizeof(iv_salt));
+  memcpy(ch->iv + sizeof(iv_salt), &ctr, sizeof(ctr));
+
+  EVP_CIPHER_CTX *ctx = cipher_pool.Get();
+  int ret = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, ch->iv) != 1 ||
+            EVP_EncryptUpdate(ctx, (unsigned char *)buf, &outl,
+                              (unsigned char *)buf, len) != 1 ||
+            EVP_EncryptFinal_ex(ctx, (unsigned char *)buf + outl, &outl) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHUNK_TAG_LEN,
+                                ch->tag) != 1;
+  cipher_pool.Put(ctx);
+  return ret ? -EINVAL : 0;
+}
+
+class SharedTcpStream {
+ public:
+  // A null connection discards all output (used for benchmarking).
+  SharedTcpStream(std::shared_ptr<rt::TcpConn> c) : c_(c) {}
+
   ssize_t WriteFull(const void *buf, size_t len) {
     rt::ScopedLock<rt::Mutex> lock(&sendMutex);
+    if (!c_) return len;
     return c_->WriteFull(buf, len);
   }
   ssize_t WritevFull(const struct iovec *iov, int iovcnt) {
@@ -64,23 +120,15 @@ class SharedTcpStream {
     return WritevFullLocked(iov, iovcnt);
   }
 
-  ssize_t EncryptStream(char *plaintext, size_t size, char *ciphertext) {
-    int ret;
-    int len;
-
-    if (size % 16 != 0)
-      return -EINVAL;
-
-    ret = EVP_EncryptUpdate(aes_ctx_, (unsigned char *)ciphertext, &len, (unsigned char *)plaintext, size);
-    if (ret != 1)
-      return -EINVAL;
-
-    return len;
-  }
-
   ssize_t WritevFullLocked(const struct iovec *iov, int iovcnt) {
     int i = 0;
     ssize_t sent = 0;
+
+    if (!c_) {
+      for (i = 0; i < iovcnt; i++) sent += iov[i].iov_len;
+      return sent;
+    }
+
     struct iovec vs[iovcnt];
     memcpy(vs, iov, sizeof(*iov) * iovcnt);
     while (iovcnt) {
@@ -102,8 +150,6 @@ class SharedTcpStream {
 
   rt::Mutex sendMutex;
  private:
-  EVP_CIPHER_CTX *aes_ctx_;
-  unsigned char aes_key_[32];
   std::shared_ptr<rt::TcpConn> c_;
 };
 
@@ -141,6 +187,10 @@ class RequestContext {
   char *buf{nullptr};
   size_t bufsz{0};
 
+  // GET response progress (sent is protected by conn->sendMutex)
+  unsigned int nchunks{0};
+  unsigned int sent{0};
+
   void *operator new(size_t size) {
     void *p = smalloc(size);
     if (unlikely(p == nullptr)) throw std::bad_alloc();
@@ -149,75 +199,122 @@ class RequestContext {
   void operator delete(void *p) { sfree(p); }
 };
 
+// Streams one chunk's frame to the connection as soon as it is ready.
+static void SendChunk(RequestContext *ctx, chunk_hdr_t *ch, char *data) {
+  binary_header_blk_t hdr = ctx->header;
+  hdr.lba_count = sizeof(*ch) + ch->data_len;
 
-static void DoRequest(RequestContext *ctx, char *read_buf, char *compress_buf)
-{
-  size_t input_length = ctx->header.lba_count * kSectorSize;
-  ssize_t ret = storage_read(read_buf, ctx->header.lba, ctx->header.lba_count);
-  if (unlikely(ret != 0)) {
-    log_warn_ratelimited("storage ret: %ld", ret);
-    return;
-  }
-
-  size_t compressed_length;
-  snappy::RawCompress(read_buf, input_length,
-                      compress_buf, &compressed_length);
-
-  rt::ScopedLock<rt::Mutex> l(&ctx->conn->sendMutex);
-
-  ssize_t encrypt_len = ctx->conn->EncryptStream(compress_buf, align_up(compressed_length, 16), read_buf);
-  if (unlikely(encrypt_len < 0))
-    panic("encrypt");
-
-  barrier();
-  ctx->header.tsc = rdtsc();
-  ctx->header.lba_count = (size_t)encrypt_len;
-  struct iovec response[2] = {
+  struct iovec response[3] = {
       {
-          .iov_base = &ctx->header,
-          .iov_len = sizeof(ctx->header),
+          .iov_base = &hdr,
+          .iov_len = sizeof(hdr),
       },
       {
-          .iov_base = read_buf,
-          .iov_len = (size_t)encrypt_len,
+          .iov_base = ch,
+          .iov_len = sizeof(*ch),
+      },
+      {
+          .iov_base = data,
+          .iov_len = ch->data_len,
       },
   };
-  ssize_t wret = ctx->conn->WritevFullLocked(response, 2);
-  if (wret != static_cast<ssize_t>(sizeof(ctx->header) + encrypt_len)) {
+
+  rt::ScopedLock<rt::Mutex> l(&ctx->conn->sendMutex);
+  if (++ctx->sent == ctx->nchunks) ch->flags |= CHUNK_LAST;
+  barrier();
+  hdr.tsc = rdtsc();
+  ssize_t wret = ctx->conn->WritevFullLocked(response, 3);
+  if (wret != static_cast<ssize_t>(sizeof(hdr) + hdr.lba_count)) {
     if (wret != -EPIPE && wret != -ECONNRESET)
       log_err_ratelimited("WritevFull failed: ret = %ld", wret);
   }
 }
 
+static uint32_t ChunkSectors(RequestContext *ctx, unsigned int idx) {
+  uint32_t chunk_sectors = chunk_size / kSectorSize;
+  return std::min(chunk_sectors, ctx->header.lba_count - idx * chunk_sectors);
+}
 
-#define ON_STACK_THRESH (32 * KB)
+static void DoChunk(RequestContext *ctx, unsigned int idx, char *read_buf,
+                    char *compress_buf) {
+  uint64_t lba = ctx->header.lba + (uint64_t)idx * (chunk_size / kSectorSize);
+  uint32_t lba_count = ChunkSectors(ctx, idx);
+  chunk_hdr_t ch = {};
+  size_t compressed_length;
 
-void HandleGetRequestSmall(RequestContext *ctx) {
-  size_t input_length = ctx->header.lba_count * kSectorSize;
-  ssize_t max_buf_sz = snappy::MaxCompressedLength(input_length);
-  max_buf_sz = align_up(max_buf_sz + 16, 16);
+  ch.index = idx;
+  ch.nchunks = ctx->nchunks;
+  ch.raw_len = lba_count * kSectorSize;
 
-  char read_buf[max_buf_sz];
-  char compress_buf[max_buf_sz];
+  if (lba_count) {
+    ssize_t ret = storage_read(read_buf, lba, lba_count);
+    if (unlikely(ret != 0)) {
+      log_warn_ratelimited("storage ret: %ld", ret);
+      ch.flags |= CHUNK_ERROR;
+      SendChunk(ctx, &ch, compress_buf);
+      return;
+    }
+  }
 
-  DoRequest(ctx, read_buf, compress_buf);
+  snappy::RawCompress(read_buf, ch.raw_len, compress_buf, &compressed_length);
+  if (unlikely(EncryptChunk(compress_buf, compressed_length, &ch)))
+    panic("encrypt");
+  ch.data_len = compressed_length;
+
+  SendChunk(ctx, &ch, compress_buf);
 }
 
-void HandleGetRequest(RequestContext *ctx) {
-  size_t input_length = ctx->header.lba_count * kSectorSize;
-  ssize_t max_buf_sz = snappy::MaxCompressedLength(input_length);
-  max_buf_sz = align_up(max_buf_sz + 16, 16);
+#define ON_STACK_THRESH (32 * KB)
+// snappy::MaxCompressedLength(ON_STACK_THRESH)
+#define ON_STACK_COMPRESS_SZ (32 + ON_STACK_THRESH + ON_STACK_THRESH / 6)
+
+static void HandleChunkSmall(RequestContext *ctx, unsigned int idx,
+                             size_t input_length) {
+  char read_buf[ON_STACK_THRESH];
+  char compress_buf[ON_STACK_COMPRESS_SZ];
+
+  BUG_ON(input_length > sizeof(read_buf));
+  BUG_ON(snappy::MaxCompressedLength(input_length) > sizeof(compress_buf));
+  DoChunk(ctx, idx, read_buf, compress_buf);
+}
 
-  char *read_buf, *compress_buf;
-  read_buf = allocate_buf(max_buf_sz);
-  compress_buf = allocate_buf(max_buf_sz);
+static void HandleChunk(RequestContext *ctx, unsigned int idx) {
+  size_t input_length = ChunkSectors(ctx, idx) * kSectorSize;
+  if (input_length <= ON_STACK_THRESH) {
+    HandleChunkSmall(ctx, idx, input_length);
+    return;
+  }
 
-  DoRequest(ctx, read_buf, compress_buf);
+  size_t max_buf_sz = snappy::MaxCompressedLength(input_length);
+  char *read_buf = allocate_buf(input_length);
+  char *compress_buf = allocate_buf(max_buf_sz);
 
+  DoChunk(ctx, idx, read_buf, compress_buf);
 
-  free_buf(read_buf, max_buf_sz);
+  free_buf(read_buf, input_length);
   free_buf(compress_buf, max_buf_sz);
+}
+
+// Splits a GET into chunks, processes them in parallel uthreads, and streams
+// each one to the connection as it completes.
+void HandleGetRequest(RequestContext *ctx) {
+  uint32_t chunk_sectors = chunk_size / kSectorSize;
 
+  ctx->nchunks = std::max(div_up(ctx->header.lba_count, chunk_sectors), 1U);
+  if (ctx->nchunks == 1) {
+    HandleChunk(ctx, 0);
+    return;
+  }
+
+  rt::WaitGroup wg(ctx->nchunks - 1);
+  for (unsigned int i = 1; i < ctx->nchunks; i++) {
+    rt::Spawn([ctx, i, &wg] {
+      HandleChunk(ctx, i);
+      wg.Done();
+    });
+  }
+  HandleChunk(ctx, 0);
+  wg.Wait();
 }
 
 void HandleSetRequest(RequestContext *ctx) {
@@ -259,6 +356,15 @@ void ServerWorker(std::shared_ptr<rt::TcpConn> c) {
       return;
     }
 
+    if (h->lba_count > kMaxRequestSize / kSectorSize ||
+        h->lba_count > storage_num_blocks() ||
+        h->lba > storage_num_blocks() - h->lba_count) {
+      log_err("request out of range: lba %lu, lba_count %u", h->lba,
+              h->lba_count);
+      delete ctx;
+      return;
+    }
+
     size_t payload_size = h->lba_count * kSectorSize;
 
     /* spawn thread to handle storage request + response */
@@ -279,12 +385,7 @@ void ServerWorker(std::shared_ptr<rt::TcpConn> c) {
           .Detach();
     } else {
       rt::Thread([=] {
-        size_t payload_size = ctx->header.lba_count * kSectorSize;
-        if (payload_size > ON_STACK_THRESH) {
-          HandleGetRequest(ctx);
-        } else {
-          HandleGetRequestSmall(ctx);
-        }
+        HandleGetRequest(ctx);
         delete ctx;
       })
           .Detach();
@@ -307,15 +408,103 @@ void MainHandler(void *arg) {
   }
 }
 
+/*
+ * Benchmark: measures GET throughput and latency versus request size, with
+ * the response pipeline writing to a null connection.
+ */
+
+constexpr int kBenchRequesters = 16;
+constexpr uint64_t kBenchDurationUS = 2000000;
+
+static void BenchSize(uint32_t lba_count) {
+  using namespace std::chrono;
+  std::vector<std::vector<double>> lat(kBenchRequesters);
+  auto conn = std::make_shared<SharedTcpStream>(nullptr);
+  uint64_t span = storage_num_blocks() - lba_count;
+  rt::WaitGroup wg(kBenchRequesters);
+
+  auto start = steady_clock::now();
+  auto end = start + microseconds(kBenchDurationUS);
+  for (int i = 0; i < kBenchRequesters; i++) {
+    rt::Spawn([&, i] {
+      uint64_t lba = (uint64_t)i * lba_count * 7919;
+      while (true) {
+        auto rstart = steady_clock::now();
+        if (rstart >= end) break;
+
+        auto ctx = new RequestContext(conn);
+        ctx->header.magic = sizeof(binary_header_blk_t);
+        ctx->header.opcode = CMD_GET;
+        ctx->header.lba = (lba % span) & ~0x7UL;
+        ctx->header.lba_count = lba_count;
+        HandleGetRequest(ctx);
+        delete ctx;
+
+        lat[i].push_back(
+            duration_cast<duration<double, std::micro>>(steady_clock::now() -
+                                                        rstart)
+                .count());
+        lba += lba_count * 7919;
+      }
+      wg.Done();
+    });
+  }
+  wg.Wait();
+  double secs =
+      duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (auto &v : lat) all.insert(all.end(), v.begin(), v.end());
+  std::sort(all.begin(), all.end());
+  if (all.empty()) return;
+
+  double mb = (double)all.size() * lba_count * kSectorSize / MB;
+  std::cout << std::setprecision(2) << std::fixed << chunk_size / KB << ","
+            << lba_count * kSectorSize / KB << "," << all.size() << ","
+            << mb / secs << "," << all[all.size() / 2] << ","
+            << all[all.size() * 99 / 100] << std::endl;
+}
+
+void BenchHandler(void *arg) {
+  if (kSectorSize != storage_block_size())
+    panic("storage not enabled");
+
+  // compare chunked pipelining against one chunk per request
+  size_t chunk_sizes[] = {chunk_size, 16 * MB};
+  std::cout << "#chunk_kb,request_kb,requests,mbps,p50_us,p99_us"
+            << std::endl;
+  for (size_t cs : chunk_sizes) {
+    chunk_size = cs;
+    for (uint32_t kb = 4; kb <= 4096; kb *= 4)
+      BenchSize(kb * KB / kSectorSize);
+  }
+}
+
 int main(int argc, char *argv[]) {
   int ret;
+  bool bench = false;
 
   if (argc < 2) {
-    std::cerr << "usage: [cfg_file]" << std::endl;
+    std::cerr << "usage: [cfg_file] [chunk_kb] [bench]" << std::endl;
+    return -EINVAL;
+  }
+
+  if (argc > 2) {
+    chunk_size = std::stoul(argv[2], nullptr, 0) * KB;
+    if (chunk_size == 0 || chunk_size > 16 * MB) {
+      std::cerr << "invalid chunk size" << std::endl;
+      return -EINVAL;
+    }
+  }
+  if (argc > 3) bench = std::string(argv[3]) == "bench";
+
+  memset(aes_key, 0xcc, sizeof(aes_key));
+  if (RAND_bytes((unsigned char *)&iv_salt, sizeof(iv_salt)) != 1) {
+    std::cerr << "couldn't generate an IV salt" << std::endl;
     return -EINVAL;
   }
 
-  ret = runtime_init(argv[1], MainHandler, NULL);
+  ret = runtime_init(argv[1], bench ? BenchHandler : MainHandler, NULL);
   if (ret) {
     std::cerr << "failed to start runtime" << std::endl;
     return ret;
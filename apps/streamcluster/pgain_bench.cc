@@ -0,0 +1,434 @@
+// pgain_bench.cc - streamcluster's pgain() with static partitioning across a
+// fixed thread pool against the same loop written with parallel.h
+//
+// pgain() evaluates opening a new center at point x: it indexes the current
+// centers, computes what every point would save by switching to x, decides
+// which centers to close, and applies the result. streamcluster splits the
+// points into one block per thread and separates the phases with barriers,
+// so each pgain() runs at the pace of its slowest block and uses exactly the
+// threads it was started with. The parallel.h version splits the work lazily
+// over uthreads, so it uses whatever cores the IOKernel grants at the time.
+
+extern "C" {
+#include <base/log.h>
+#include <runtime/sync.h>
+}
+
+#include "parallel.h"
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <string.h>
+
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+// <- ARGUMENTS FOR EXPERIMENT ->
+// the number of points.
+long npoints;
+// the dimensions of each point.
+int dim;
+// the number of initial centers.
+long ncenters;
+// the number of candidate centers evaluated.
+int iters;
+
+constexpr int kCacheLine = 64;
+
+struct Point {
+  float weight;
+  float *coord;
+  long assign;
+  float cost;
+};
+
+// One copy of the clustering state, so each version starts from the same
+// solution.
+struct Instance {
+  std::vector<Point> p;
+  std::unique_ptr<bool[]> is_center;
+  std::unique_ptr<bool[]> switch_membership;
+  std::unique_ptr<int[]> center_table;
+  long numcenters;
+};
+
+std::vector<float> coords;
+
+float Dist(const Point &p1, const Point &p2) {
+  float result = 0.0;
+  for (int i = 0; i < dim; i++)
+    result += (p1.coord[i] - p2.coord[i]) * (p1.coord[i] - p2.coord[i]);
+  return result;
+}
+
+// Random points, each assigned to the nearest of the first ncenters points.
+Instance MakeInstance() {
+  Instance in;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> u(0.0, 1.0);
+
+  coords.resize(npoints * dim);
+  for (float &c : coords) c = u(rng);
+
+  in.p.resize(npoints);
+  in.is_center.reset(new bool[npoints]());
+  in.switch_membership.reset(new bool[npoints]());
+  in.center_table.reset(new int[npoints]());
+  for (long i = 0; i < npoints; i++) {
+    in.p[i].weight = 1.0;
+    in.p[i].coord = &coords[i * dim];
+  }
+  for (long c = 0; c < ncenters; c++) in.is_center[c] = true;
+  in.numcenters = ncenters;
+
+  rt::ParallelFor(0L, npoints, [&](long i) {
+    Point &pt = in.p[i];
+    pt.assign = 0;
+    pt.cost = Dist(pt, in.p[0]) * pt.weight;
+    for (long c = 1; c < ncenters; c++) {
+      float d = Dist(pt, in.p[c]) * pt.weight;
+      if (d < pt.cost) {
+        pt.assign = c;
+        pt.cost = d;
+      }
+    }
+  });
+  return in;
+}
+
+Instance CopyInstance(const Instance &from) {
+  Instance in;
+  in.p = from.p;
+  in.is_center.reset(new bool[npoints]);
+  memcpy(in.is_center.get(), from.is_center.get(), npoints * sizeof(bool));
+  in.switch_membership.reset(new bool[npoints]());
+  in.center_table.reset(new int[npoints]());
+  in.numcenters = from.numcenters;
+  return in;
+}
+
+double TotalCost(const Instance &in) {
+  return rt::ParallelReduce(
+      0L, npoints, 0.0,
+      [&](long lo, long hi, double acc) {
+        for (long i = lo; i < hi; i++) acc += in.p[i].cost;
+        return acc;
+      },
+      [](double a, double b) { return a + b; });
+}
+
+// <- STATIC PARTITIONING (ported from streamcluster.cpp) ->
+
+struct StaticShared {
+  int nproc;
+  barrier_t barrier;
+  double *work_mem;
+  double gl_cost_of_opening_x;
+  int gl_number_of_centers_to_close;
+};
+
+double PGainStatic(long x, Instance *in, double z, StaticShared *sh,
+                   int pid) {
+  int nproc = sh->nproc;
+  Point *p = in->p.data();
+  bool *is_center = in->is_center.get();
+  bool *switch_membership = in->switch_membership.get();
+  int *center_table = in->center_table.get();
+
+  barrier_wait(&sh->barrier);
+
+  // my block
+  long bsize = npoints / nproc;
+  long k1 = bsize * pid;
+  long k2 = k1 + bsize;
+  if (pid == nproc - 1) k2 = npoints;
+
+  int number_of_centers_to_close = 0;
+
+  // each thread takes a cache line aligned block of work_mem
+  int stride = in->numcenters + 2;
+  int cl = kCacheLine / sizeof(double);
+  if (stride % cl != 0) stride = cl * (stride / cl + 1);
+  int K = stride - 2;
+
+  double cost_of_opening_x = 0;
+
+  if (pid == 0) {
+    sh->work_mem =
+        static_cast<double *>(malloc(stride * (nproc + 1) * sizeof(double)));
+    sh->gl_cost_of_opening_x = 0;
+    sh->gl_number_of_centers_to_close = 0;
+  }
+  barrier_wait(&sh->barrier);
+  double *work_mem = sh->work_mem;
+
+  // index the centers: count per block, prefix on one thread, then offset
+  int count = 0;
+  for (long i = k1; i < k2; i++) {
+    if (is_center[i]) center_table[i] = count++;
+  }
+  work_mem[pid * stride] = count;
+  barrier_wait(&sh->barrier);
+
+  if (pid == 0) {
+    int accum = 0;
+    for (int q = 0; q < nproc; q++) {
+      int tmp = static_cast<int>(work_mem[q * stride]);
+      work_mem[q * stride] = accum;
+      accum += tmp;
+    }
+  }
+  barrier_wait(&sh->barrier);
+
+  for (long i = k1; i < k2; i++) {
+    if (is_center[i])
+      center_table[i] += static_cast<int>(work_mem[pid * stride]);
+  }
+
+  memset(switch_membership + k1, 0, (k2 - k1) * sizeof(bool));
+  memset(work_mem + pid * stride, 0, stride * sizeof(double));
+  if (pid == 0) memset(work_mem + nproc * stride, 0, stride * sizeof(double));
+  barrier_wait(&sh->barrier);
+
+  double *lower = &work_mem[pid * stride];
+  double *gl_lower = &work_mem[nproc * stride];
+
+  for (long i = k1; i < k2; i++) {
+    float x_cost = Dist(p[i], p[x]) * p[i].weight;
+    float current_cost = p[i].cost;
+
+    if (x_cost < current_cost) {
+      switch_membership[i] = 1;
+      cost_of_opening_x += x_cost - current_cost;
+    } else {
+      lower[center_table[p[i].assign]] += current_cost - x_cost;
+    }
+  }
+  barrier_wait(&sh->barrier);
+
+  for (long i = k1; i < k2; i++) {
+    if (is_center[i]) {
+      double low = z;
+      for (int q = 0; q < nproc; q++)
+        low += work_mem[center_table[i] + q * stride];
+      gl_lower[center_table[i]] = low;
+      if (low > 0) {
+        ++number_of_centers_to_close;
+        cost_of_opening_x -= low;
+      }
+    }
+  }
+  work_mem[pid * stride + K] = number_of_centers_to_close;
+  work_mem[pid * stride + K + 1] = cost_of_opening_x;
+  barrier_wait(&sh->barrier);
+
+  if (pid == 0) {
+    sh->gl_cost_of_opening_x = z;
+    for (int q = 0; q < nproc; q++) {
+      sh->gl_number_of_centers_to_close +=
+          static_cast<int>(work_mem[q * stride + K]);
+      sh->gl_cost_of_opening_x += work_mem[q * stride + K + 1];
+    }
+  }
+  barrier_wait(&sh->barrier);
+
+  if (sh->gl_cost_of_opening_x < 0) {
+    for (long i = k1; i < k2; i++) {
+      bool close_center = gl_lower[center_table[p[i].assign]] > 0;
+      if (switch_membership[i] || close_center) {
+        p[i].cost = p[i].weight * Dist(p[i], p[x]);
+        p[i].assign = x;
+      }
+    }
+    for (long i = k1; i < k2; i++) {
+      if (is_center[i] && gl_lower[center_table[i]] > 0) is_center[i] = false;
+    }
+    if (x >= k1 && x < k2) is_center[x] = true;
+
+    if (pid == 0)
+      in->numcenters += 1 - sh->gl_number_of_centers_to_close;
+  } else {
+    if (pid == 0) sh->gl_cost_of_opening_x = 0;
+  }
+  barrier_wait(&sh->barrier);
+  double ret = -sh->gl_cost_of_opening_x;
+  barrier_wait(&sh->barrier);
+  if (pid == 0) free(work_mem);
+
+  return ret;
+}
+
+// <- LAZY SPLITTING (parallel.h) ->
+
+// What opening x would save: the cost change of points that switch to x,
+// and per center, what its remaining members would lose by moving to x.
+struct Gain {
+  double cost;
+  std::vector<double> lower;
+};
+
+double PGainParallel(long x, Instance *in, double z) {
+  Point *p = in->p.data();
+  bool *is_center = in->is_center.get();
+  bool *switch_membership = in->switch_membership.get();
+  int *center_table = in->center_table.get();
+
+  // index the centers; center_table[c] - 1 is center c's slot
+  rt::ParallelScan(is_center, is_center + npoints, center_table, 0,
+                   [](int a, int b) { return a + b; });
+  int K = center_table[npoints - 1];
+
+  rt::ParallelForRange(0L, npoints, [&](long lo, long hi) {
+    memset(switch_membership + lo, 0, (hi - lo) * sizeof(bool));
+  });
+
+  Gain g = rt::ParallelReduce(
+      0L, npoints, Gain{0, std::vector<double>(K, 0)},
+      [&](long lo, long hi, Gain acc) {
+        for (long i = lo; i < hi; i++) {
+          float x_cost = Dist(p[i], p[x]) * p[i].weight;
+          float current_cost = p[i].cost;
+
+          if (x_cost < current_cost) {
+            switch_membership[i] = 1;
+            acc.cost += x_cost - current_cost;
+          } else {
+            acc.lower[center_table[p[i].assign] - 1] += current_cost - x_cost;
+          }
+        }
+        return acc;
+      },
+      [](Gain a, Gain b) {
+        a.cost += b.cost;
+        for (size_t k = 0; k < a.lower.size(); k++) a.lower[k] += b.lower[k];
+        return a;
+      });
+
+  // the centers are few, so deciding which ones close is done serially
+  // over the slots rather than by scanning every point
+  int number_of_centers_to_close = 0;
+  double cost_of_opening_x = z + g.cost;
+  for (double &low : g.lower) {
+    low += z;
+    if (low > 0) {
+      ++number_of_centers_to_close;
+      cost_of_opening_x -= low;
+    }
+  }
+  if (cost_of_opening_x >= 0) return 0;
+
+  const std::vector<double> &gl_lower = g.lower;
+  rt::ParallelFor(0L, npoints, [&](long i) {
+    bool close_center = gl_lower[center_table[p[i].assign] - 1] > 0;
+    if (switch_membership[i] || close_center) {
+      p[i].cost = p[i].weight * Dist(p[i], p[x]);
+      p[i].assign = x;
+    }
+    if (is_center[i] && gl_lower[center_table[i] - 1] > 0)
+      is_center[i] = false;
+  });
+  is_center[x] = true;
+  in->numcenters += 1 - number_of_centers_to_close;
+  return -cost_of_opening_x;
+}
+
+// <- DRIVER ->
+
+struct result {
+  double us_per_pgain;
+  long numcenters;
+  double cost;
+};
+
+result RunStatic(const Instance &init, const std::vector<long> &xs, double z,
+                 int nproc) {
+  Instance in = CopyInstance(init);
+  StaticShared sh;
+  sh.nproc = nproc;
+  barrier_init(&sh.barrier, nproc);
+
+  uint64_t start = rt::MicroTime();
+  std::vector<rt::Thread> ths;
+  for (int pid = 0; pid < nproc; pid++) {
+    ths.emplace_back(rt::Thread([&, pid] {
+      for (long x : xs) PGainStatic(x, &in, z, &sh, pid);
+    }));
+  }
+  for (auto &t : ths) t.Join();
+  double us = static_cast<double>(rt::MicroTime() - start) / xs.size();
+  return {us, in.numcenters, TotalCost(in)};
+}
+
+result RunParallel(const Instance &init, const std::vector<long> &xs,
+                   double z) {
+  Instance in = CopyInstance(init);
+
+  uint64_t start = rt::MicroTime();
+  for (long x : xs) PGainParallel(x, &in, z);
+  double us = static_cast<double>(rt::MicroTime() - start) / xs.size();
+  return {us, in.numcenters, TotalCost(in)};
+}
+
+void PrintResult(const char *model, int nproc, const result &r) {
+  std::cout << std::setprecision(1) << std::fixed << model << ", " << nproc
+            << ", " << r.us_per_pgain << ", " << r.numcenters << ", "
+            << std::setprecision(3) << r.cost << std::endl;
+}
+
+void MainHandler(void *arg) {
+  Instance init = MakeInstance();
+
+  // a facility cost that makes some candidates worth opening
+  double z = TotalCost(init) / ncenters / 4;
+
+  std::mt19937 rng(2);
+  std::uniform_int_distribution<long> pick(0, npoints - 1);
+  std::vector<long> xs(iters);
+  for (long &x : xs) x = pick(rng);
+
+  int nproc = rt::RuntimeMaxCores();
+  std::cout << "model, threads, us_per_pgain, numcenters, cost" << std::endl;
+  PrintResult("static", nproc, RunStatic(init, xs, z, nproc));
+  PrintResult("parallel", nproc, RunParallel(init, xs, z));
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] [points] [dim] [centers] [iters]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 6) {
+    Usage();
+    return -EINVAL;
+  }
+
+  npoints = std::stol(argv[2], nullptr, 0);
+  dim = std::stoi(argv[3], nullptr, 0);
+  ncenters = std::stol(argv[4], nullptr, 0);
+  iters = std::stoi(argv[5], nullptr, 0);
+  if (npoints <= 0 || dim <= 0 || ncenters <= 0 || ncenters > npoints ||
+      iters <= 0) {
+    Usage();
+    return -EINVAL;
+  }
+
+  ret = runtime_init(argv[1], MainHandler, NULL);
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -16,6 +16,8 @@ use Transport;
 
 const REFLEX_HDR_SZ: usize = 32;
 const REFLEX_MAGIC: u16 = REFLEX_HDR_SZ as u16;
+const CHUNK_HDR_SZ: usize = 48;
+const CHUNK_LAST: u32 = 0x01;
 
 // FIXME - these may be specific to our device
 const NUM_SECTORS: u64 = 547002288;
@@ -166,19 +168,33 @@ impl LoadgenProtocol for ReflexProtocol {
     }
 
     fn read_response(&self, mut sock: &Connection, scratch: &mut [u8]) -> io::Result<(usize, u64)> {
-        sock.read_exact(&mut scratch[..REFLEX_HDR_SZ])?;
-        let hdr = PacketHeader::read(&mut &scratch[..])?;
-        if hdr.opcode == Opcode::Get as u16 {
+        loop {
+            sock.read_exact(&mut scratch[..REFLEX_HDR_SZ])?;
+            let hdr = PacketHeader::read(&mut &scratch[..])?;
+            if hdr.opcode != Opcode::Get as u16 {
+                return Ok((hdr.req_handle - 1, hdr.tsc));
+            }
+
+            // GET responses are streamed as chunk frames, the request is
+            // complete once the frame marked last arrives
             let mut to_read = hdr.lba_count as usize;
+            if to_read < CHUNK_HDR_SZ {
+                return Err(Error::new(ErrorKind::Other, "short chunk frame"));
+            }
+            sock.read_exact(&mut scratch[..CHUNK_HDR_SZ])?;
+            let flags = (&scratch[8..12]).read_u32::<LittleEndian>()?;
+            to_read -= CHUNK_HDR_SZ;
             while to_read > 0 {
                 let rlen = min(to_read, scratch.len());
                 sock.read_exact(&mut scratch[..rlen])?;
                 to_read -= rlen;
             }
-        }
 
-        // TODO: more error checking?
+            // TODO: more error checking?
 
-        Ok((hdr.req_handle - 1, hdr.tsc))
+            if flags & CHUNK_LAST != 0 {
+                return Ok((hdr.req_handle - 1, hdr.tsc));
+            }
+        }
     }
 }
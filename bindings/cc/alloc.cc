@@ -0,0 +1,54 @@
+#include "alloc.h"
+
+#include "sync.h"
+
+#include <atomic>
+#include <cstdio>
+
+namespace rt {
+namespace {
+
+constexpr size_t kPoolClasses =
+    TcachePool::kMaxItemSize / alloc_internal::kAlign;
+
+std::atomic<TcachePool *> pools[kPoolClasses];
+// serializes pool creation, which is too slow to do under a Spin.
+Mutex pools_lock;
+
+}  // anonymous namespace
+
+SmallocResource *SmallocResource::Get() {
+  static SmallocResource r;
+  return &r;
+}
+
+TcachePool::TcachePool(size_t size) : size_(size), tc_(nullptr) {
+  snprintf(name_, sizeof(name_), "rt::TcachePool (%zu B)", size);
+  for (PerCore &c : pts_) c.pt.tc = nullptr;
+
+  // slab and tcache creation take base spinlocks, so don't get preempted
+  Preempt p;
+  PreemptGuard g(&p);
+  if (slab_create(&slab_, name_, size, SLAB_FLAG_FALSE_OKAY)) BUG();
+  tc_ = slab_create_tcache(&slab_, TCACHE_DEFAULT_MAG_SIZE);
+  if (unlikely(tc_ == nullptr)) BUG();
+}
+
+TcachePool *TcachePool::ForSize(size_t size) {
+  BUG_ON(size > kMaxItemSize);
+  size_t idx = size ? (size - 1) / alloc_internal::kAlign : 0;
+
+  TcachePool *p = pools[idx].load(std::memory_order_acquire);
+  if (likely(p)) return p;
+
+  // pools can't be torn down, so only one thread may build each
+  MutexGuard l(&pools_lock);
+  p = pools[idx].load(std::memory_order_relaxed);
+  if (!p) {
+    p = new TcachePool((idx + 1) * alloc_internal::kAlign);
+    pools[idx].store(p, std::memory_order_release);
+  }
+  return p;
+}
+
+}  // namespace rt
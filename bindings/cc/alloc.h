@@ -0,0 +1,204 @@
+// alloc.h - allocators backed by the runtime's smalloc and tcache
+//
+// These allocate from per-core caches with preemption disabled, instead of
+// going through glibc, so they must only be used from runtime threads.
+
+#pragma once
+
+extern "C" {
+#include <asm/cpu.h>
+#include <base/stddef.h>
+#include <base/slab.h>
+#include <base/tcache.h>
+#include <runtime/preempt.h>
+#include <runtime/smalloc.h>
+#include <runtime/thread.h>
+}
+
+#include "runtime.h"
+
+#include <memory_resource>
+#include <new>
+
+namespace rt {
+namespace alloc_internal {
+
+// smalloc() and tcache items are 16 byte aligned.
+constexpr size_t kAlign = 16;
+
+inline bool UseSmalloc(size_t bytes, size_t align) {
+  return bytes <= SMALLOC_MAX_SIZE && align <= kAlign;
+}
+
+}  // namespace alloc_internal
+
+// A std::pmr memory resource backed by smalloc(). Allocations too large or
+// too aligned for smalloc() go to @upstream.
+class SmallocResource : public std::pmr::memory_resource {
+ public:
+  explicit SmallocResource(
+      std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+      : upstream_(upstream) {}
+
+  // A shared instance, e.g. for std::pmr::set_default_resource().
+  static SmallocResource *Get();
+
+ protected:
+  void *do_allocate(size_t bytes, size_t align) override {
+    if (!alloc_internal::UseSmalloc(bytes, align))
+      return upstream_->allocate(bytes, align);
+    void *p = smalloc(bytes ? bytes : 1);
+    if (unlikely(p == nullptr)) throw std::bad_alloc();
+    return p;
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t align) override {
+    if (!alloc_internal::UseSmalloc(bytes, align))
+      return upstream_->deallocate(p, bytes, align);
+    sfree(p);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  std::pmr::memory_resource *upstream_;
+};
+
+// A standard allocator backed by smalloc(), for containers that take an
+// allocator type rather than a memory resource.
+template <typename T>
+class SmallocAllocator {
+ public:
+  using value_type = T;
+
+  SmallocAllocator() noexcept {}
+  template <typename U>
+  SmallocAllocator(const SmallocAllocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    if (unlikely(n > SIZE_MAX / sizeof(T))) throw std::bad_array_new_length();
+    size_t bytes = n * sizeof(T);
+    if (!alloc_internal::UseSmalloc(bytes, alignof(T)))
+      return static_cast<T *>(
+          ::operator new(bytes, std::align_val_t(alignof(T))));
+    void *p = smalloc(bytes ? bytes : 1);
+    if (unlikely(p == nullptr)) throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, size_t n) noexcept {
+    size_t bytes = n * sizeof(T);
+    if (!alloc_internal::UseSmalloc(bytes, alignof(T)))
+      return ::operator delete(p, std::align_val_t(alignof(T)));
+    sfree(p);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const SmallocAllocator<T> &, const SmallocAllocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const SmallocAllocator<T> &, const SmallocAllocator<U> &) {
+  return false;
+}
+
+// A pool of fixed-size items: a slab with a tcache in front of it, and a
+// per-core handle to the tcache set up the first time each core uses it.
+// Pools are never destroyed (the tcache has no teardown), so share them
+// through ForSize().
+class TcachePool {
+ public:
+  // The largest item size served by ForSize().
+  static constexpr size_t kMaxItemSize = 1024;
+
+  // Gets the shared pool for items of @size bytes (<= kMaxItemSize), which
+  // is rounded up to a multiple of 16 bytes.
+  static TcachePool *ForSize(size_t size);
+
+  void *Alloc() {
+    preempt_disable();
+    void *p = tcache_alloc(Local());
+    preempt_enable();
+    return p;
+  }
+
+  void Free(void *p) {
+    preempt_disable();
+    tcache_free(Local(), p);
+    preempt_enable();
+  }
+
+  size_t ItemSize() const { return size_; }
+
+ private:
+  explicit TcachePool(size_t size);
+
+  // Must be called with preemption disabled.
+  tcache_perthread *Local() {
+    tcache_perthread *pt = &pts_[get_current_affinity()].pt;
+    if (unlikely(pt->tc == nullptr)) tcache_init_perthread(tc_, pt);
+    return pt;
+  }
+
+  struct alignas(CACHE_LINE_SIZE) PerCore {
+    tcache_perthread pt;
+  };
+
+  size_t size_;
+  char name_[32];
+  struct slab slab_;
+  struct tcache *tc_;
+  PerCore pts_[kCoreLimit];
+};
+
+// A standard allocator for node-based containers (std::map, std::set,
+// std::list, std::unordered_map, ...). Single nodes come from the shared
+// TcachePool for their size; anything else, such as a hash table's bucket
+// array, falls back to SmallocAllocator.
+template <typename T>
+class PoolAllocator {
+ public:
+  using value_type = T;
+
+  PoolAllocator() noexcept {}
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    if (n == 1 && kPooled) {
+      void *p = Pool()->Alloc();
+      if (unlikely(p == nullptr)) throw std::bad_alloc();
+      return static_cast<T *>(p);
+    }
+    return SmallocAllocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) noexcept {
+    if (n == 1 && kPooled) return Pool()->Free(p);
+    SmallocAllocator<T>().deallocate(p, n);
+  }
+
+ private:
+  static constexpr bool kPooled = sizeof(T) <= TcachePool::kMaxItemSize &&
+                                  alignof(T) <= alloc_internal::kAlign;
+
+  static TcachePool *Pool() {
+    static TcachePool *pool = TcachePool::ForSize(sizeof(T));
+    return pool;
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) {
+  return false;
+}
+
+}  // namespace rt
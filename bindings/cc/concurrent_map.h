@@ -0,0 +1,643 @@
+// concurrent_map.h - a sharded concurrent hash map and an approximate LRU
+// cache with RCU reads
+//
+// Both split their keys across shards (by default four per core the runtime
+// may run on). Writers take a per-shard spinlock; readers take no lock at
+// all, only an RCU read section, and walk the same hash chains. Entries are
+// immutable once published: an update links in a new entry and frees the
+// old one after a grace period, so values must be copyable and should be
+// cheap to copy. Both must be used from runtime threads.
+
+#pragma once
+
+extern "C" {
+#include <asm/cpu.h>
+#include <base/compiler.h>
+#include <base/hash.h>
+#include <runtime/rcu.h>
+#include <runtime/thread.h>
+}
+
+#include "alloc.h"
+#include "runtime.h"
+#include "sync.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rt {
+
+// The counters of one shard.
+struct CacheShardStats {
+  // entries in the shard
+  size_t size;
+  // entries added or replaced
+  uint64_t inserts;
+  // entries removed by Erase()
+  uint64_t erases;
+  // entries removed to make room (LruCache only)
+  uint64_t evictions;
+  // times the shard's hash table grew (ConcurrentHashMap only)
+  uint64_t resizes;
+};
+
+struct CacheStats {
+  // lookups that found (or didn't find) a key, over all shards
+  uint64_t hits;
+  uint64_t misses;
+  std::vector<CacheShardStats> shards;
+};
+
+namespace cmap_internal {
+
+// An object freed after an RCU grace period.
+struct RcuObject {
+  rcu_head rcu;
+};
+
+template <typename T>
+void RcuDelete(T *obj) {
+  rcu_free(&obj->rcu, [](rcu_head *h) {
+    delete static_cast<T *>(reinterpret_cast<RcuObject *>(h));
+  });
+}
+
+template <typename K, typename V>
+struct Node : RcuObject {
+  Node(uint64_t h, const K &k, const V &v)
+      : next(nullptr), hash(h), key(k), val(v), ref(false), slot(0) {}
+
+  // nodes are small and churn, so they come from a tcache pool
+  static void *operator new(size_t size) {
+    return PoolAllocator<Node>().allocate(1);
+  }
+  static void operator delete(void *p) {
+    PoolAllocator<Node>().deallocate(static_cast<Node *>(p), 1);
+  }
+
+  std::atomic<Node *> next;
+  const uint64_t hash;
+  const K key;
+  const V val;
+  // the CLOCK reference bit (LruCache only)
+  std::atomic<bool> ref;
+  // the index in the CLOCK ring (LruCache only, changed under the lock)
+  size_t slot;
+};
+
+template <typename K, typename V>
+struct Table : RcuObject {
+  explicit Table(size_t nbuckets)
+      : mask(nbuckets - 1), buckets(new std::atomic<Node<K, V> *>[nbuckets]) {
+    for (size_t i = 0; i < nbuckets; i++)
+      buckets[i].store(nullptr, std::memory_order_relaxed);
+  }
+
+  const size_t mask;
+  std::unique_ptr<std::atomic<Node<K, V> *>[]> buckets;
+};
+
+inline size_t RoundUpPow2(size_t n) {
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+// Four shards per core, so that writers to a hot shard rarely collide.
+inline size_t DefaultShards() { return RoundUpPow2(4 * RuntimeMaxCores()); }
+
+// One shard: a chained hash table whose chains readers may walk under RCU
+// while a writer holding the lock changes them.
+template <typename K, typename V, typename Eq>
+class Shard {
+ public:
+  using NodeT = Node<K, V>;
+  using TableT = Table<K, V>;
+
+  explicit Shard(size_t nbuckets)
+      : table_(new TableT(nbuckets)),
+        next_(nullptr),
+        copied_(0),
+        growing_(false),
+        size_(0),
+        inserts_(0),
+        erases_(0),
+        evictions_(0),
+        resizes_(0) {}
+
+  // Frees everything at once; there must be no readers left.
+  ~Shard() {
+    TableT *t = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= t->mask; i++) {
+      NodeT *n = t->buckets[i].load(std::memory_order_relaxed);
+      while (n) {
+        NodeT *next = n->next.load(std::memory_order_relaxed);
+        delete n;
+        n = next;
+      }
+    }
+    delete t;
+  }
+
+  // Finds a key. Must be called in an RCU read section (or with the lock
+  // held); the node stays valid until the section ends.
+  NodeT *Find(uint64_t h, const K &k) {
+    TableT *t = table_.load(std::memory_order_acquire);
+    NodeT *n = t->buckets[h & t->mask].load(std::memory_order_acquire);
+    for (; n; n = n->next.load(std::memory_order_acquire)) {
+      if (n->hash == h && Eq()(n->key, k)) return n;
+    }
+    return nullptr;
+  }
+
+  // Doubles the buckets. Readers may still be on the old chains, so the
+  // nodes are copied rather than relinked, and the old ones are freed after
+  // a grace period. The lock is taken for one bucket at a time, and writers
+  // to buckets already copied update both tables, so writers to the shard
+  // aren't stalled behind the whole copy.
+  void Grow() {
+    TableT *t;
+    {
+      ScopedLock<Spin> l(&lock);
+      if (!NeedsGrow()) return;
+      growing_ = true;
+      t = table_.load(std::memory_order_relaxed);
+    }
+
+    TableT *nt = new TableT(2 * (t->mask + 1));
+    {
+      ScopedLock<Spin> l(&lock);
+      next_ = nt;
+      copied_ = 0;
+    }
+    for (size_t i = 0; i <= t->mask; i++) {
+      ScopedLock<Spin> l(&lock);
+      NodeT *n = t->buckets[i].load(std::memory_order_relaxed);
+      for (; n; n = n->next.load(std::memory_order_relaxed)) {
+        NodeT *c = new NodeT(n->hash, n->key, n->val);
+        std::atomic<NodeT *> *b = &nt->buckets[c->hash & nt->mask];
+        c->next.store(b->load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+        b->store(c, std::memory_order_relaxed);
+      }
+      copied_ = i + 1;
+    }
+    {
+      ScopedLock<Spin> l(&lock);
+      table_.store(nt, std::memory_order_release);
+      next_ = nullptr;
+      growing_ = false;
+    }
+    resizes_.fetch_add(1, std::memory_order_relaxed);
+
+    // writers moved to the new table, so the old chains no longer change
+    for (size_t i = 0; i <= t->mask; i++) {
+      NodeT *n = t->buckets[i].load(std::memory_order_relaxed);
+      while (n) {
+        NodeT *next = n->next.load(std::memory_order_relaxed);
+        RcuDelete(n);
+        n = next;
+      }
+    }
+    RcuDelete(t);
+  }
+
+  // <- The rest must be called with the lock held ->
+
+  // Returns the link that points to the key's node, or the null link at the
+  // end of its chain.
+  std::atomic<NodeT *> *FindLink(uint64_t h, const K &k) {
+    return FindLink(table_.load(std::memory_order_relaxed), h, k);
+  }
+
+  // Publishes @n at @link (from FindLink()), replacing the node there, if
+  // any. Returns the replaced node, which the caller must RcuDelete().
+  NodeT *Publish(std::atomic<NodeT *> *link, NodeT *n) {
+    NodeT *old = link->load(std::memory_order_relaxed);
+    n->next.store(old ? old->next.load(std::memory_order_relaxed) : nullptr,
+                  std::memory_order_relaxed);
+    link->store(n, std::memory_order_release);
+    inserts_.fetch_add(1, std::memory_order_relaxed);
+    if (!old) size_++;
+    if (Migrated(n->hash)) {
+      NodeT *c = new NodeT(n->hash, n->key, n->val);
+      delete Replace(FindLink(next_, c->hash, c->key), c);
+    }
+    return old;
+  }
+
+  // Unlinks the node at @link (from FindLink()). Readers already on it can
+  // still follow its next pointer; the caller must RcuDelete() it.
+  NodeT *Unlink(std::atomic<NodeT *> *link) {
+    NodeT *n = link->load(std::memory_order_relaxed);
+    link->store(n->next.load(std::memory_order_relaxed),
+                std::memory_order_release);
+    size_--;
+    if (Migrated(n->hash))
+      delete Replace(FindLink(next_, n->hash, n->key), nullptr);
+    return n;
+  }
+
+  // Returns true if the chains average more than two nodes and nobody is
+  // growing the table yet; the caller should then call Grow() once it has
+  // dropped the lock.
+  bool NeedsGrow() {
+    TableT *t = table_.load(std::memory_order_relaxed);
+    return !growing_ && size_ > 2 * (t->mask + 1);
+  }
+
+  CacheShardStats Stats() {
+    ScopedLock<Spin> l(&lock);
+    return {size_, inserts_.load(std::memory_order_relaxed),
+            erases_.load(std::memory_order_relaxed),
+            evictions_.load(std::memory_order_relaxed),
+            resizes_.load(std::memory_order_relaxed)};
+  }
+
+  // May be called without the lock for an approximate count.
+  size_t Size() { return ACCESS_ONCE(size_); }
+  void CountErase() { erases_.fetch_add(1, std::memory_order_relaxed); }
+  void CountEviction() { evictions_.fetch_add(1, std::memory_order_relaxed); }
+
+  alignas(CACHE_LINE_SIZE) Spin lock;
+
+ private:
+  static std::atomic<NodeT *> *FindLink(TableT *t, uint64_t h, const K &k) {
+    std::atomic<NodeT *> *link = &t->buckets[h & t->mask];
+    NodeT *n;
+    while ((n = link->load(std::memory_order_relaxed)) != nullptr) {
+      if (n->hash == h && Eq()(n->key, k)) break;
+      link = &n->next;
+    }
+    return link;
+  }
+
+  // Puts @n (or nothing, if null) in place of the node at @link in a table
+  // readers can't see yet. Returns the replaced node, to delete right away.
+  static NodeT *Replace(std::atomic<NodeT *> *link, NodeT *n) {
+    NodeT *old = link->load(std::memory_order_relaxed);
+    NodeT *next = old ? old->next.load(std::memory_order_relaxed) : nullptr;
+    if (n)
+      n->next.store(next, std::memory_order_relaxed);
+    else
+      n = next;
+    link->store(n, std::memory_order_relaxed);
+    return old;
+  }
+
+  // Returns true if a key with hash @h was already copied by Grow(), so a
+  // change to it must be made in both tables.
+  bool Migrated(uint64_t h) {
+    return next_ &&
+           (h & table_.load(std::memory_order_relaxed)->mask) < copied_;
+  }
+
+  std::atomic<TableT *> table_;
+  // the table Grow() is filling and how many old buckets it has copied
+  // (changed under the lock)
+  TableT *next_;
+  size_t copied_;
+  bool growing_;
+  size_t size_;
+  std::atomic<uint64_t> inserts_;
+  std::atomic<uint64_t> erases_;
+  std::atomic<uint64_t> evictions_;
+  std::atomic<uint64_t> resizes_;
+};
+
+// Hit and miss counters, one set per core, so that reads never write to a
+// shared cache line.
+class ReadCounters {
+ public:
+  ReadCounters() : cores_(new PerCore[kCoreLimit]()) {}
+
+  // Must be called with preemption disabled (e.g. in an RCU read section).
+  void Count(bool hit) {
+    PerCore &c = cores_[get_current_affinity()];
+    if (hit)
+      c.hits++;
+    else
+      c.misses++;
+  }
+
+  void Sum(uint64_t *hits, uint64_t *misses) const {
+    *hits = *misses = 0;
+    for (unsigned int i = 0; i < kCoreLimit; i++) {
+      *hits += ACCESS_ONCE(cores_[i].hits);
+      *misses += ACCESS_ONCE(cores_[i].misses);
+    }
+  }
+
+ private:
+  struct alignas(CACHE_LINE_SIZE) PerCore {
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  std::unique_ptr<PerCore[]> cores_;
+};
+
+// Spreads the key's hash so both the shard (top bits) and the bucket
+// (bottom bits) are well mixed, even for an identity std::hash.
+template <typename Hash, typename K>
+uint64_t HashKey(const K &k) {
+  return hash_city_one(static_cast<uint64_t>(Hash()(k)));
+}
+
+}  // namespace cmap_internal
+
+// A concurrent hash map with lock-free reads.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Eq = std::equal_to<K>>
+class ConcurrentHashMap {
+ public:
+  // Makes a map with @shards shards (rounded up to a power of two), or the
+  // default for the runtime's core count if 0.
+  explicit ConcurrentHashMap(size_t shards = 0) {
+    size_t n = cmap_internal::RoundUpPow2(
+        shards ? shards : cmap_internal::DefaultShards());
+    shard_bits_ = __builtin_ctzl(n);
+    for (size_t i = 0; i < n; i++)
+      shards_.emplace_back(new ShardT(kInitialBuckets));
+  }
+
+  // Disable move and copy.
+  ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+  ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+  // Copies the value of @k to @out. Returns false if @k is absent.
+  bool Find(const K &k, V *out) {
+    return Visit(k, [out](const V &v) { *out = v; });
+  }
+
+  // Calls @fn(const V &) on the value of @k, without copying it. @fn runs
+  // in an RCU read section, so it must not block. Returns false if @k is
+  // absent.
+  template <typename F>
+  bool Visit(const K &k, F fn) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    rcu_read_lock();
+    NodeT *n = ShardFor(h)->Find(h, k);
+    if (n) fn(n->val);
+    reads_.Count(n != nullptr);
+    rcu_read_unlock();
+    return n != nullptr;
+  }
+
+  // Adds @k unless it is present. Returns true if it was added.
+  bool Insert(const K &k, const V &v) {
+    return Write(k, [&v](const V *old, V *out) {
+      if (old) return false;
+      *out = v;
+      return true;
+    });
+  }
+
+  // Sets the value of @k, adding it if absent.
+  void InsertOrAssign(const K &k, const V &v) {
+    Write(k, [&v](const V *old, V *out) {
+      *out = v;
+      return true;
+    });
+  }
+
+  // Replaces the value of @k with a copy changed by @fn(V &); an absent key
+  // starts from V(). @fn runs with the shard locked, so it must not block.
+  template <typename F>
+  void Update(const K &k, F fn) {
+    Write(k, [&fn](const V *old, V *out) {
+      if (old) *out = *old;
+      fn(*out);
+      return true;
+    });
+  }
+
+  // Removes @k. Returns false if it was absent.
+  bool Erase(const K &k) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    ShardT *s = ShardFor(h);
+    NodeT *n = nullptr;
+    {
+      ScopedLock<Spin> l(&s->lock);
+      std::atomic<NodeT *> *link = s->FindLink(h, k);
+      if (link->load(std::memory_order_relaxed)) {
+        n = s->Unlink(link);
+        s->CountErase();
+      }
+    }
+    if (n) cmap_internal::RcuDelete(n);
+    return n != nullptr;
+  }
+
+  // The number of entries, which may be stale by the time it is returned.
+  size_t Size() {
+    size_t n = 0;
+    for (auto &s : shards_) n += s->Size();
+    return n;
+  }
+
+  CacheStats Stats() {
+    CacheStats st;
+    reads_.Sum(&st.hits, &st.misses);
+    for (auto &s : shards_) st.shards.push_back(s->Stats());
+    return st;
+  }
+
+ private:
+  using ShardT = cmap_internal::Shard<K, V, Eq>;
+  using NodeT = typename ShardT::NodeT;
+
+  static constexpr size_t kInitialBuckets = 16;
+
+  ShardT *ShardFor(uint64_t h) {
+    return shards_[shard_bits_ ? h >> (64 - shard_bits_) : 0].get();
+  }
+
+  // Calls @fn(old, &val) with the shard locked, where @old is the current
+  // value or nullptr, and publishes val if @fn returns true.
+  template <typename F>
+  bool Write(const K &k, F fn) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    ShardT *s = ShardFor(h);
+    NodeT *old;
+    bool grow;
+    {
+      ScopedLock<Spin> l(&s->lock);
+      std::atomic<NodeT *> *link = s->FindLink(h, k);
+      NodeT *cur = link->load(std::memory_order_relaxed);
+      V v{};
+      if (!fn(cur ? &cur->val : nullptr, &v)) return false;
+      old = s->Publish(link, new NodeT(h, k, v));
+      grow = !old && s->NeedsGrow();
+    }
+    if (old) cmap_internal::RcuDelete(old);
+    if (grow) s->Grow();
+    return true;
+  }
+
+  unsigned int shard_bits_;
+  std::vector<std::unique_ptr<ShardT>> shards_;
+  cmap_internal::ReadCounters reads_;
+};
+
+// A fixed-capacity concurrent cache with lock-free reads that evicts in
+// approximately least-recently-used order (CLOCK): a hit sets the entry's
+// reference bit, and each shard's clock hand evicts the first entry whose
+// bit is clear, clearing bits as it passes.
+template <typename K, typename V, typename Hash = std::hash<K>,
+          typename Eq = std::equal_to<K>>
+class LruCache {
+ public:
+  // Makes a cache that holds about @capacity entries (split evenly across
+  // the shards), with @shards shards as for ConcurrentHashMap.
+  explicit LruCache(size_t capacity, size_t shards = 0) {
+    size_t n = cmap_internal::RoundUpPow2(
+        shards ? shards : cmap_internal::DefaultShards());
+    shard_bits_ = __builtin_ctzl(n);
+    shard_capacity_ = std::max<size_t>(1, (capacity + n - 1) / n);
+    for (size_t i = 0; i < n; i++) {
+      shards_.emplace_back(new Shard(shard_capacity_));
+    }
+  }
+
+  // Disable move and copy.
+  LruCache(const LruCache&) = delete;
+  LruCache& operator=(const LruCache&) = delete;
+
+  // Copies the value of @k to @out and marks it recently used. Returns false
+  // if @k is absent.
+  bool Get(const K &k, V *out) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    rcu_read_lock();
+    NodeT *n = ShardFor(h)->map.Find(h, k);
+    if (n) {
+      // avoid dirtying the line when the bit is already set
+      if (!n->ref.load(std::memory_order_relaxed))
+        n->ref.store(true, std::memory_order_relaxed);
+      *out = n->val;
+    }
+    reads_.Count(n != nullptr);
+    rcu_read_unlock();
+    return n != nullptr;
+  }
+
+  // Sets the value of @k, evicting an entry if the shard is full.
+  void Put(const K &k, const V &v) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    Shard *s = ShardFor(h);
+    NodeT *n = new NodeT(h, k, v);
+    NodeT *old, *victim = nullptr;
+    {
+      ScopedLock<Spin> l(&s->map.lock);
+      std::atomic<NodeT *> *link = s->map.FindLink(h, k);
+      if (!link->load(std::memory_order_relaxed) &&
+          s->map.Size() == shard_capacity_) {
+        victim = s->Evict();
+        // the victim may have preceded our key in the chain
+        link = s->map.FindLink(h, k);
+      }
+      old = s->map.Publish(link, n);
+      if (old) {
+        n->slot = old->slot;
+        n->ref.store(true, std::memory_order_relaxed);
+      } else if (victim) {
+        n->slot = victim->slot;
+      } else {
+        n->slot = s->ring.size();
+        s->ring.push_back(nullptr);
+      }
+      s->ring[n->slot] = n;
+    }
+    if (old) cmap_internal::RcuDelete(old);
+    if (victim) cmap_internal::RcuDelete(victim);
+  }
+
+  // Removes @k. Returns false if it was absent.
+  bool Erase(const K &k) {
+    uint64_t h = cmap_internal::HashKey<Hash>(k);
+    Shard *s = ShardFor(h);
+    NodeT *n = nullptr;
+    {
+      ScopedLock<Spin> l(&s->map.lock);
+      std::atomic<NodeT *> *link = s->map.FindLink(h, k);
+      if (link->load(std::memory_order_relaxed)) {
+        n = s->map.Unlink(link);
+        s->map.CountErase();
+        s->RemoveSlot(n->slot);
+      }
+    }
+    if (n) cmap_internal::RcuDelete(n);
+    return n != nullptr;
+  }
+
+  // The number of entries, which may be stale by the time it is returned.
+  size_t Size() {
+    size_t n = 0;
+    for (auto &s : shards_) n += s->map.Size();
+    return n;
+  }
+
+  CacheStats Stats() {
+    CacheStats st;
+    reads_.Sum(&st.hits, &st.misses);
+    for (auto &s : shards_) st.shards.push_back(s->map.Stats());
+    return st;
+  }
+
+ private:
+  using MapShard = cmap_internal::Shard<K, V, Eq>;
+  using NodeT = typename MapShard::NodeT;
+
+  struct Shard {
+    explicit Shard(size_t capacity)
+        : map(cmap_internal::RoundUpPow2(capacity)), hand(0) {
+      ring.reserve(capacity);
+    }
+
+    // Unlinks the entry under the clock hand, sweeping past (and clearing)
+    // referenced ones. Returns it; its slot is reused by the caller.
+    NodeT *Evict() {
+      while (true) {
+        if (hand >= ring.size()) hand = 0;
+        NodeT *n = ring[hand++];
+        if (n->ref.load(std::memory_order_relaxed)) {
+          n->ref.store(false, std::memory_order_relaxed);
+          continue;
+        }
+        map.Unlink(map.FindLink(n->hash, n->key));
+        map.CountEviction();
+        return n;
+      }
+    }
+
+    // Fills the hole at @slot with the last entry of the ring.
+    void RemoveSlot(size_t slot) {
+      NodeT *last = ring.back();
+      ring.pop_back();
+      if (slot < ring.size()) {
+        ring[slot] = last;
+        last->slot = slot;
+      }
+    }
+
+    // fixed buckets: the capacity is known, so the table never grows
+    MapShard map;
+    std::vector<NodeT *> ring;
+    size_t hand;
+  };
+
+  Shard *ShardFor(uint64_t h) {
+    return shards_[shard_bits_ ? h >> (64 - shard_bits_) : 0].get();
+  }
+
+  unsigned int shard_bits_;
+  size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  cmap_internal::ReadCounters reads_;
+};
+
+}  // namespace rt
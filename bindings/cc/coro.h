@@ -0,0 +1,662 @@
+// coro.h - C++20 coroutines that run on the runtime's threads
+//
+// A coroutine (rt::Task) runs on an ordinary uthread, but when it waits for
+// I/O, a timer, a lock, or a channel it gives that uthread and its stack
+// back. What waits in its place is a lazily stacked thread (see
+// thread_create_lazy()) that resumes it, queued wherever a blocked uthread
+// would be, so resuming goes through the runqueues and work stealing like any
+// other wakeup. A suspended operation costs its coroutine frame (from the
+// per-kthread smalloc caches) and a struct thread rather than a whole stack.
+//
+// Needs -std=gnu++20 (the rest of the bindings build with gnu++17), and
+// -Wno-volatile for the runtime headers.
+
+#pragma once
+
+extern "C" {
+#include <base/assert.h>
+#include <base/stddef.h>
+#include <base/time.h>
+#include <runtime/smalloc.h>
+#include <runtime/storage.h>
+#include <runtime/tcp.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/udp.h>
+}
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "net.h"
+#include "sync.h"
+
+namespace rt {
+
+template <typename T>
+class Task;
+
+namespace coro_internal {
+
+// The entry point of a thread that resumes a coroutine.
+inline void ResumeTrampoline(void *arg) {
+  std::coroutine_handle<>::from_address(arg).resume();
+}
+
+// Allocates coroutine frames from the per-kthread smalloc caches.
+struct FrameAllocator {
+  static void *operator new(size_t size) {
+    void *p = smalloc(size);
+    if (unlikely(!p)) throw std::bad_alloc();
+    return p;
+  }
+  static void operator delete(void *p) { sfree(p); }
+};
+
+// A coroutine waiting in a WaitList. Lives in the waiting coroutine's frame.
+struct Waiter {
+  std::coroutine_handle<> h;
+  Waiter *next;
+};
+
+// A FIFO of waiting coroutines, protected by its owner's lock.
+class WaitList {
+ public:
+  WaitList() : head_(nullptr), tail_(nullptr) {}
+
+  bool Empty() const { return head_ == nullptr; }
+
+  void Push(Waiter *w) {
+    w->next = nullptr;
+    if (tail_)
+      tail_->next = w;
+    else
+      head_ = w;
+    tail_ = w;
+  }
+
+  Waiter *Pop() {
+    Waiter *w = head_;
+    if (w) {
+      head_ = w->next;
+      if (!head_) tail_ = nullptr;
+    }
+    return w;
+  }
+
+ private:
+  Waiter *head_;
+  Waiter *tail_;
+};
+
+}  // namespace coro_internal
+
+// Resumes a suspended coroutine on a new (lazily stacked) thread, placed on
+// the local runqueue where other cores can steal it. Returns false if out of
+// memory, leaving @h suspended.
+inline bool TrySchedule(std::coroutine_handle<> h) {
+  thread_t *th = thread_create_lazy(coro_internal::ResumeTrampoline,
+                                    h.address());
+  if (unlikely(!th)) return false;
+  thread_ready(th);
+  return true;
+}
+
+// Like TrySchedule(), but throws std::bad_alloc if out of memory.
+inline void Schedule(std::coroutine_handle<> h) {
+  if (unlikely(!TrySchedule(h))) throw std::bad_alloc();
+}
+
+namespace coro_internal {
+
+// Resumes a coroutine taken off a wait list. Nobody else will resume it, so
+// if out of memory it runs right here instead.
+inline void Wake(std::coroutine_handle<> h) {
+  if (unlikely(!TrySchedule(h))) h.resume();
+}
+
+}  // namespace coro_internal
+
+// Goes to the back of the runqueue, e.g. to let other work (or other cores)
+// in during a long computation. Usage: co_await rt::CoYield();
+struct CoYield {
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> h) { Schedule(h); }
+  void await_resume() const noexcept {}
+};
+
+namespace coro_internal {
+
+// Resumes whoever awaited the task once it finishes.
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+  template <typename P>
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<P> h) noexcept {
+    std::coroutine_handle<> next = h.promise().continuation_;
+    return next ? next : std::noop_coroutine();
+  }
+  void await_resume() const noexcept {}
+};
+
+class PromiseBase : public FrameAllocator {
+ public:
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() { exception_ = std::current_exception(); }
+
+  std::coroutine_handle<> continuation_;
+
+ protected:
+  void Rethrow() {
+    if (exception_) std::rethrow_exception(exception_);
+  }
+
+ private:
+  std::exception_ptr exception_;
+};
+
+template <typename T>
+class Promise : public PromiseBase {
+ public:
+  Task<T> get_return_object() noexcept;
+  template <typename U>
+  void return_value(U &&val) {
+    val_.emplace(std::forward<U>(val));
+  }
+  T Result() {
+    Rethrow();
+    return std::move(*val_);
+  }
+
+ private:
+  std::optional<T> val_;
+};
+
+template <>
+class Promise<void> : public PromiseBase {
+ public:
+  Task<void> get_return_object() noexcept;
+  void return_void() const noexcept {}
+  void Result() { Rethrow(); }
+};
+
+}  // namespace coro_internal
+
+// A coroutine that produces a T. It starts when first awaited, and resumes
+// its awaiter directly (without going through the runqueue) when it's done.
+// Use CoSpawn() to start one from a plain thread.
+template <typename T = void>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = coro_internal::Promise<T>;
+
+  Task() : h_(nullptr) {}
+  explicit Task(std::coroutine_handle<promise_type> h) : h_(h) {}
+  ~Task() {
+    if (h_) h_.destroy();
+  }
+
+  // disable copy.
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  // allow move.
+  Task(Task &&t) noexcept : h_(std::exchange(t.h_, nullptr)) {}
+  Task &operator=(Task &&t) noexcept {
+    if (h_) h_.destroy();
+    h_ = std::exchange(t.h_, nullptr);
+    return *this;
+  }
+
+  // Runs the task to completion, then returns its value (or rethrows).
+  auto operator co_await() noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> h;
+      bool await_ready() const noexcept { return h.done(); }
+      std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<> awaiting) noexcept {
+        h.promise().continuation_ = awaiting;
+        return h;
+      }
+      T await_resume() { return h.promise().Result(); }
+    };
+    return Awaiter{h_};
+  }
+
+ private:
+  std::coroutine_handle<promise_type> h_;
+};
+
+namespace coro_internal {
+
+template <typename T>
+Task<T> Promise<T>::get_return_object() noexcept {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() noexcept {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// A coroutine that starts on the runqueue and frees itself when done.
+struct Detached {
+  struct promise_type : FrameAllocator {
+    Detached get_return_object() const noexcept { return {}; }
+    CoYield initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+};
+
+inline Detached RunDetached(Task<void> t) { co_await t; }
+
+// Lets a thread block until a task finishes.
+template <typename T>
+struct SyncState {
+  Spin lock;
+  ThreadWaker waker;
+  bool done = false;
+  std::optional<std::conditional_t<std::is_void_v<T>, char, T>> val;
+  std::exception_ptr exception;
+};
+
+template <typename T>
+Detached RunSync(Task<T> t, SyncState<T> *st) {
+  try {
+    if constexpr (std::is_void_v<T>)
+      co_await t;
+    else
+      st->val.emplace(co_await t);
+  } catch (...) {
+    st->exception = std::current_exception();
+  }
+
+  // the waiter can't return (and free @st) until we drop the lock
+  ScopedLock<Spin> l(&st->lock);
+  st->done = true;
+  st->waker.Wake();
+}
+
+}  // namespace coro_internal
+
+// Starts a task in the background. It runs until it finishes; an exception
+// escaping it terminates the program.
+inline void CoSpawn(Task<void> &&t) { coro_internal::RunDetached(std::move(t)); }
+
+// Blocks the calling thread (not a coroutine!) until a task finishes, then
+// returns its value (or rethrows).
+template <typename T>
+T SyncWait(Task<T> &&t) {
+  coro_internal::SyncState<T> st;
+  coro_internal::RunSync(std::move(t), &st);
+
+  st.lock.Lock();
+  while (!st.done) {
+    st.waker.Arm();
+    st.lock.UnlockAndPark();
+    st.lock.Lock();
+  }
+  st.lock.Unlock();
+
+  if (st.exception) std::rethrow_exception(st.exception);
+  if constexpr (!std::is_void_v<T>) return std::move(*st.val);
+}
+
+// Suspends until a microsecond deadline. Usage: co_await rt::CoSleepUntil(d);
+class CoSleepUntil {
+ public:
+  explicit CoSleepUntil(uint64_t deadline_us) : deadline_us_(deadline_us) {}
+
+  bool await_ready() const { return deadline_us_ <= microtime(); }
+  bool await_suspend(std::coroutine_handle<> h) {
+    thread_t *th = thread_create_lazy(coro_internal::ResumeTrampoline,
+                                      h.address());
+    if (unlikely(!th)) {
+      // out of memory, sleep on this thread instead
+      timer_sleep_until(deadline_us_);
+      return false;
+    }
+    timer_init(&e_, Fire, reinterpret_cast<unsigned long>(th));
+    timer_start(&e_, deadline_us_);
+    return true;
+  }
+  void await_resume() const {}
+
+ private:
+  static void Fire(unsigned long arg) {
+    thread_ready(reinterpret_cast<thread_t *>(arg));
+  }
+
+  uint64_t deadline_us_;
+  timer_entry e_;
+};
+
+// Suspends for a microsecond duration. Usage: co_await rt::CoSleep(us);
+class CoSleep : public CoSleepUntil {
+ public:
+  explicit CoSleep(uint64_t duration_us)
+      : CoSleepUntil(microtime() + duration_us) {}
+};
+
+// A mutex that suspends the coroutine, rather than the thread, while it is
+// held elsewhere. Ownership passes to waiters in FIFO order.
+class CoMutex {
+ public:
+  CoMutex() : held_(false) {}
+  ~CoMutex() { assert(waiters_.Empty()); }
+
+  // disable move and copy.
+  CoMutex(const CoMutex &) = delete;
+  CoMutex &operator=(const CoMutex &) = delete;
+
+  // Acquires the mutex. Usage: co_await m.Lock();
+  auto Lock() { return LockAwaiter{{}, this}; }
+
+  // Acquires the mutex if it's free. Returns true if successful.
+  bool TryLock() {
+    ScopedLock<Spin> l(&lock_);
+    if (held_) return false;
+    held_ = true;
+    return true;
+  }
+
+  // Releases the mutex, handing it to the longest waiting coroutine.
+  void Unlock() {
+    coro_internal::Waiter *w;
+    {
+      ScopedLock<Spin> l(&lock_);
+      w = waiters_.Pop();
+      if (!w) held_ = false;
+    }
+    if (w) coro_internal::Wake(w->h);
+  }
+
+ private:
+  struct LockAwaiter : coro_internal::Waiter {
+    CoMutex *m;
+
+    bool await_ready() { return m->TryLock(); }
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+      ScopedLock<Spin> l(&m->lock_);
+      if (!m->held_) {
+        m->held_ = true;
+        return false;
+      }
+      h = awaiting;
+      m->waiters_.Push(this);
+      return true;
+    }
+    void await_resume() const {}
+  };
+
+  Spin lock_;
+  bool held_;
+  coro_internal::WaitList waiters_;
+};
+
+// A bounded FIFO channel between coroutines. Senders suspend while it's
+// full, receivers while it's empty.
+template <typename T>
+class Channel {
+ public:
+  explicit Channel(size_t capacity) : cap_(capacity), closed_(false) {
+    assert(cap_ > 0);
+  }
+  ~Channel() { assert(senders_.Empty() && receivers_.Empty()); }
+
+  // disable move and copy.
+  Channel(const Channel &) = delete;
+  Channel &operator=(const Channel &) = delete;
+
+  // Sends a value. co_await ch.Send(v) returns false if the channel closed.
+  auto Send(T val) { return SendAwaiter{{}, this, std::move(val), false}; }
+
+  // Receives a value. co_await ch.Recv() returns std::nullopt once the
+  // channel is closed and drained.
+  auto Recv() { return RecvAwaiter{{}, this, std::nullopt}; }
+
+  // Closes the channel, failing waiting and future senders. Receivers still
+  // get the values already sent.
+  void Close() {
+    coro_internal::WaitList senders, receivers;
+    {
+      ScopedLock<Spin> l(&lock_);
+      closed_ = true;
+      std::swap(senders, senders_);
+      std::swap(receivers, receivers_);
+    }
+    while (coro_internal::Waiter *w = senders.Pop())
+      coro_internal::Wake(w->h);
+    while (coro_internal::Waiter *w = receivers.Pop())
+      coro_internal::Wake(w->h);
+  }
+
+ private:
+  struct SendAwaiter : coro_internal::Waiter {
+    Channel *ch;
+    T val;
+    bool ok;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+      h = awaiting;
+      return ch->SendOrWait(this);
+    }
+    bool await_resume() const { return ok; }
+  };
+
+  struct RecvAwaiter : coro_internal::Waiter {
+    Channel *ch;
+    std::optional<T> val;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+      h = awaiting;
+      return ch->RecvOrWait(this);
+    }
+    std::optional<T> await_resume() { return std::move(val); }
+  };
+
+  // Returns true if @s must wait for room.
+  bool SendOrWait(SendAwaiter *s) {
+    RecvAwaiter *r;
+    {
+      ScopedLock<Spin> l(&lock_);
+      if (closed_) return false;
+      r = static_cast<RecvAwaiter *>(receivers_.Pop());
+      if (r) {
+        r->val.emplace(std::move(s->val));
+      } else if (buf_.size() < cap_) {
+        buf_.push_back(std::move(s->val));
+      } else {
+        senders_.Push(s);
+        return true;
+      }
+    }
+    s->ok = true;
+    if (r) coro_internal::Wake(r->h);
+    return false;
+  }
+
+  // Returns true if @r must wait for a value.
+  bool RecvOrWait(RecvAwaiter *r) {
+    SendAwaiter *s;
+    {
+      ScopedLock<Spin> l(&lock_);
+      s = static_cast<SendAwaiter *>(senders_.Pop());
+      if (!buf_.empty()) {
+        r->val.emplace(std::move(buf_.front()));
+        buf_.pop_front();
+        if (s) buf_.push_back(std::move(s->val));
+      } else if (s) {
+        r->val.emplace(std::move(s->val));
+      } else if (!closed_) {
+        receivers_.Push(r);
+        return true;
+      }
+    }
+    if (s) {
+      s->ok = true;
+      coro_internal::Wake(s->h);
+    }
+    return false;
+  }
+
+  const size_t cap_;
+  Spin lock_;
+  bool closed_;
+  std::deque<T> buf_;
+  coro_internal::WaitList senders_;
+  coro_internal::WaitList receivers_;
+};
+
+namespace coro_internal {
+
+// Reaches the connections behind the C++ wrappers.
+struct ConnAccess {
+  static tcpconn_t *Get(TcpConn *c) { return c->c_; }
+  static udpconn_t *Get(UdpConn *c) { return c->c_; }
+};
+
+// Suspends until @notify reports the socket ready, then runs @op, which won't
+// block unless another thread got there first.
+template <typename Notify, typename Op>
+class IoAwaiter {
+ public:
+  IoAwaiter(Notify notify, Op op) : notify_(notify), op_(op) {}
+
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    // don't suspend if already ready (1) or out of memory (< 0), in which
+    // case @op blocks this thread instead
+    return notify_(ResumeTrampoline, h.address()) == 0;
+  }
+  ssize_t await_resume() { return op_(); }
+
+ private:
+  Notify notify_;
+  Op op_;
+};
+
+// Suspends until an asynchronous storage request completes.
+template <typename Start>
+class StorageAwaiter {
+ public:
+  explicit StorageAwaiter(Start start) : start_(start), status_(0) {}
+
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    int ret = start_(&status_, ResumeTrampoline, h.address());
+    if (unlikely(ret)) {
+      status_ = ret;
+      return false;
+    }
+    return true;
+  }
+  int await_resume() const { return status_; }
+
+ private:
+  Start start_;
+  int status_;
+};
+
+}  // namespace coro_internal
+
+// Reads from a TCP connection, like TcpConn::Read().
+// Usage: ssize_t n = co_await rt::AsyncRead(c, buf, len);
+inline auto AsyncRead(TcpConn *c, void *buf, size_t len) {
+  tcpconn_t *tc = coro_internal::ConnAccess::Get(c);
+  return coro_internal::IoAwaiter(
+      [tc](thread_fn_t fn, void *arg) { return tcp_read_notify(tc, fn, arg); },
+      [tc, buf, len] { return tcp_read(tc, buf, len); });
+}
+
+// Writes to a TCP connection, like TcpConn::Write() (could be partial).
+inline auto AsyncWrite(TcpConn *c, const void *buf, size_t len) {
+  tcpconn_t *tc = coro_internal::ConnAccess::Get(c);
+  return coro_internal::IoAwaiter(
+      [tc](thread_fn_t fn, void *arg) {
+        return tcp_write_notify(tc, fn, arg);
+      },
+      [tc, buf, len] { return tcp_write(tc, buf, len); });
+}
+
+// Reads exactly @len bytes, like TcpConn::ReadFull().
+inline Task<ssize_t> AsyncReadFull(TcpConn *c, void *buf, size_t len) {
+  char *pos = static_cast<char *>(buf);
+  size_t n = 0;
+  while (n < len) {
+    ssize_t ret = co_await AsyncRead(c, pos + n, len - n);
+    if (ret <= 0) co_return ret;
+    n += ret;
+  }
+  co_return n;
+}
+
+// Writes exactly @len bytes, like TcpConn::WriteFull().
+inline Task<ssize_t> AsyncWriteFull(TcpConn *c, const void *buf, size_t len) {
+  const char *pos = static_cast<const char *>(buf);
+  size_t n = 0;
+  while (n < len) {
+    ssize_t ret = co_await AsyncWrite(c, pos + n, len - n);
+    if (ret < 0) co_return ret;
+    n += ret;
+  }
+  co_return n;
+}
+
+// Reads a datagram, like UdpConn::ReadFrom().
+inline auto AsyncReadFrom(UdpConn *c, void *buf, size_t len, netaddr *raddr) {
+  udpconn_t *uc = coro_internal::ConnAccess::Get(c);
+  return coro_internal::IoAwaiter(
+      [uc](thread_fn_t fn, void *arg) { return udp_read_notify(uc, fn, arg); },
+      [uc, buf, len, raddr] { return udp_read_from(uc, buf, len, raddr); });
+}
+
+// Writes a datagram, like UdpConn::WriteTo().
+inline auto AsyncWriteTo(UdpConn *c, const void *buf, size_t len,
+                         const netaddr *raddr) {
+  udpconn_t *uc = coro_internal::ConnAccess::Get(c);
+  return coro_internal::IoAwaiter(
+      [uc](thread_fn_t fn, void *arg) {
+        return udp_write_notify(uc, fn, arg);
+      },
+      [uc, buf, len, raddr] { return udp_write_to(uc, buf, len, raddr); });
+}
+
+// Reads a datagram from a dialed UDP connection, like UdpConn::Read().
+inline auto AsyncRead(UdpConn *c, void *buf, size_t len) {
+  return AsyncReadFrom(c, buf, len, nullptr);
+}
+
+// Writes a datagram to a dialed UDP connection, like UdpConn::Write().
+inline auto AsyncWrite(UdpConn *c, const void *buf, size_t len) {
+  return AsyncWriteTo(c, buf, len, nullptr);
+}
+
+// Reads contiguous blocks of the default volume, like Storage::Read().
+// Usage: int ret = co_await rt::AsyncStorageRead(dst, lba, lba_count);
+inline auto AsyncStorageRead(void *dst, uint64_t lba, uint32_t lba_count) {
+  return coro_internal::StorageAwaiter(
+      [=](int *status, thread_fn_t fn, void *arg) {
+        return storage_read_async(dst, lba, lba_count, status, fn, arg);
+      });
+}
+
+// Writes contiguous blocks of the default volume, like Storage::Write().
+inline auto AsyncStorageWrite(const void *src, uint64_t lba,
+                              uint32_t lba_count) {
+  return coro_internal::StorageAwaiter(
+      [=](int *status, thread_fn_t fn, void *arg) {
+        return storage_write_async(src, lba, lba_count, status, fn, arg);
+      });
+}
+
+}  // namespace rt
@@ -0,0 +1,126 @@
+#include "executor.h"
+
+#include "runtime.h"
+#include "thread.h"
+#include "timer.h"
+
+namespace rt {
+
+Executor::Executor(const ExecutorConfig &cfg)
+    : cfg_(cfg),
+      q_(cfg.queue_capacity),
+      workers_(0),
+      idle_(0),
+      running_(0),
+      submitted_(0),
+      rejected_(0),
+      shed_(0),
+      completed_(0),
+      wait_us_(0) {
+  BUG_ON(cfg.max_inflight == 0 || cfg.queue_capacity == 0);
+}
+
+Executor::~Executor() {
+  q_.Close();
+  workers_wg_.Wait();
+}
+
+bool Executor::Submit(Task task, Task shed) {
+  submitted_.fetch_add(1, std::memory_order_relaxed);
+
+  if (cfg_.max_runtime_queue_us &&
+      RuntimeQueueUS() > cfg_.max_runtime_queue_us) {
+    rejected_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  if (!Enqueue(Item{std::move(task), std::move(shed), MicroTime()})) {
+    rejected_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  MaybeStartWorker();
+  return true;
+}
+
+bool Executor::Enqueue(Item &&it) {
+  switch (cfg_.policy) {
+    case ExecutorPolicy::kReject:
+      return q_.TryPush(std::move(it));
+
+    case ExecutorPolicy::kShedOldest:
+      while (!q_.TryPush(std::move(it))) {
+        Item old;
+        if (q_.TryPop(&old)) Shed(&old);
+      }
+      return true;
+
+    case ExecutorPolicy::kBlock:
+      return q_.Push(std::move(it));
+  }
+  return false;
+}
+
+// Starts another worker if tasks are queued beyond what idle workers will
+// take, up to max_inflight. The counters are read without a lock, so this
+// can briefly under- or over-estimate; a task then waits for the next free
+// worker, and a spare worker just parks.
+void Executor::MaybeStartWorker() {
+  if (q_.Size() <= idle_.load(std::memory_order_relaxed)) return;
+
+  size_t n = workers_.load(std::memory_order_relaxed);
+  do {
+    if (n >= cfg_.max_inflight) return;
+  } while (!workers_.compare_exchange_weak(n, n + 1,
+                                           std::memory_order_relaxed));
+
+  workers_wg_.Add(1);
+  Spawn([this] {
+    Worker();
+    workers_wg_.Done();
+  });
+}
+
+void Executor::Shed(Item *it) {
+  shed_.fetch_add(1, std::memory_order_relaxed);
+  if (it->shed) it->shed();
+}
+
+void Executor::Worker() {
+  Item it;
+
+  while (true) {
+    idle_.fetch_add(1, std::memory_order_relaxed);
+    bool ok = q_.Pop(&it);
+    idle_.fetch_sub(1, std::memory_order_relaxed);
+    if (!ok) return;
+
+    uint64_t wait = MicroTime() - it.enqueue_us;
+    if (cfg_.max_wait_us && wait > cfg_.max_wait_us) {
+      Shed(&it);
+    } else {
+      running_.fetch_add(1, std::memory_order_relaxed);
+      it.task();
+      running_.fetch_sub(1, std::memory_order_relaxed);
+      completed_.fetch_add(1, std::memory_order_relaxed);
+      wait_us_.fetch_add(wait, std::memory_order_relaxed);
+    }
+
+    // release the captures now rather than when the next task arrives
+    it = Item();
+  }
+}
+
+ExecutorStats Executor::Stats() const {
+  ExecutorStats s;
+  s.submitted = submitted_.load(std::memory_order_relaxed);
+  s.rejected = rejected_.load(std::memory_order_relaxed);
+  s.shed = shed_.load(std::memory_order_relaxed);
+  s.completed = completed_.load(std::memory_order_relaxed);
+  s.wait_us = wait_us_.load(std::memory_order_relaxed);
+  s.queued = q_.Size();
+  s.running = running_.load(std::memory_order_relaxed);
+  s.workers = workers_.load(std::memory_order_relaxed);
+  return s;
+}
+
+}  // namespace rt
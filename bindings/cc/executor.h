@@ -0,0 +1,109 @@
+// executor.h - a bounded pool of worker threads with admission control
+
+#pragma once
+
+#include "queue.h"
+#include "sync.h"
+
+#include <atomic>
+#include <functional>
+
+namespace rt {
+
+// What Submit() does when the executor's queue is full.
+enum class ExecutorPolicy {
+  // fail the new task
+  kReject,
+  // shed the oldest queued task to make room
+  kShedOldest,
+  // park the submitter until there is room
+  kBlock,
+};
+
+struct ExecutorConfig {
+  // the most tasks running at once (one worker thread each)
+  size_t max_inflight = 64;
+  // the most tasks waiting for a worker
+  size_t queue_capacity = 1024;
+  ExecutorPolicy policy = ExecutorPolicy::kReject;
+  // reject new tasks while the runtime's queueing delay (RuntimeQueueUS())
+  // exceeds this, or 0 to admit regardless
+  uint64_t max_runtime_queue_us = 0;
+  // shed tasks that waited in the queue longer than this, or 0 to never
+  uint64_t max_wait_us = 0;
+};
+
+// A snapshot of an executor's counters.
+struct ExecutorStats {
+  // tasks passed to Submit()
+  uint64_t submitted;
+  // tasks refused by Submit() (queue full or runtime overloaded)
+  uint64_t rejected;
+  // tasks dropped after being queued (to make room or for waiting too long)
+  uint64_t shed;
+  // tasks that ran to completion
+  uint64_t completed;
+  // the total time completed tasks waited in the queue
+  uint64_t wait_us;
+  // tasks queued right now
+  size_t queued;
+  // tasks running right now
+  size_t running;
+  // worker threads started
+  size_t workers;
+};
+
+// Runs tasks on at most max_inflight worker threads, which are started on
+// demand and then reused, so a task runs on a worker's stack instead of
+// getting a thread (and stack) of its own. Tasks beyond that wait in a
+// bounded queue; Submit() applies the configured policy when it is full,
+// and admission control refuses work while the runtime itself is backed up.
+class Executor {
+ public:
+  using Task = std::function<void()>;
+
+  explicit Executor(const ExecutorConfig &cfg);
+  // Runs the queued tasks, then waits for the workers to exit.
+  ~Executor();
+
+  // Disable move and copy.
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  // Queues @task. @shed, if set, is called instead of @task if the task is
+  // dropped after being queued, so the caller can still reply. Returns false
+  // if the task was rejected (neither is called).
+  bool Submit(Task task, Task shed = nullptr);
+
+  // Gets a snapshot of the counters.
+  ExecutorStats Stats() const;
+
+  const ExecutorConfig &Config() const { return cfg_; }
+
+ private:
+  struct Item {
+    Task task;
+    Task shed;
+    uint64_t enqueue_us;
+  };
+
+  bool Enqueue(Item &&it);
+  void MaybeStartWorker();
+  void Shed(Item *it);
+  void Worker();
+
+  const ExecutorConfig cfg_;
+  BlockingQueue<MpmcQueue<Item>> q_;
+  WaitGroup workers_wg_;
+
+  std::atomic<size_t> workers_;
+  std::atomic<size_t> idle_;
+  std::atomic<size_t> running_;
+  std::atomic<uint64_t> submitted_;
+  std::atomic<uint64_t> rejected_;
+  std::atomic<uint64_t> shed_;
+  std::atomic<uint64_t> completed_;
+  std::atomic<uint64_t> wait_us_;
+};
+
+}  // namespace rt
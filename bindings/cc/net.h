@@ -10,6 +10,10 @@ extern "C" {
 
 namespace rt {
 
+namespace coro_internal {
+struct ConnAccess;
+}  // namespace coro_internal
+
 class NetConn {
  public:
   virtual ~NetConn(){};
@@ -19,6 +23,8 @@ class NetConn {
 
 // UDP Connections.
 class UdpConn : public NetConn {
+  friend struct coro_internal::ConnAccess;
+
  public:
   ~UdpConn() { udp_close(c_); }
 
@@ -88,6 +94,7 @@ class UdpConn : public NetConn {
 // TCP connections.
 class TcpConn : public NetConn {
   friend class TcpQueue;
+  friend struct coro_internal::ConnAccess;
 
  public:
   ~TcpConn() { tcp_close(c_); }
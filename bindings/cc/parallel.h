@@ -0,0 +1,275 @@
+// parallel.h - parallel loops, reductions, scans and sorts over uthreads
+//
+// Work is divided by lazy binary splitting: a task processes its range one
+// grain at a time, and before each grain it hands the upper half of what is
+// left to a new uthread, but only while fewer such halves are waiting to
+// start than the runtime has active cores. Parallelism therefore follows the
+// cores the IOKernel grants (or revokes) while a call runs, and load
+// balancing comes from the scheduler's work stealing rather than from a
+// fixed partition. All calls must be made from a runtime thread and block
+// until the work is done.
+
+#pragma once
+
+#include "runtime.h"
+#include "sync.h"
+#include "thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace rt {
+namespace parallel_internal {
+
+// The grains per core a range is divided into by default.
+constexpr size_t kGrainsPerCore = 16;
+
+// The scan blocks per active core.
+constexpr size_t kScanBlocksPerCore = 4;
+
+// Ranges shorter than this are sorted serially.
+constexpr ptrdiff_t kSortCutoff = 2048;
+
+// The state shared by the tasks of one parallel call.
+struct Context {
+  Context() : unstarted(0) {}
+
+  // tasks spawned but not yet running
+  std::atomic<int> unstarted;
+  // tasks not yet finished (besides the caller)
+  WaitGroup wg;
+};
+
+// Returns true if a task should hand off part of its range. A waiting task
+// per active core is enough to keep every core that runs out of work busy.
+inline bool ShouldSplit(Context *ctx) {
+  return ctx->unstarted.load(std::memory_order_relaxed) <
+         static_cast<int>(RuntimeActiveCores());
+}
+
+// Spawns @func as a task of @ctx.
+template <typename F>
+void SpawnTask(Context *ctx, F &&func) {
+  ctx->unstarted.fetch_add(1, std::memory_order_relaxed);
+  ctx->wg.Add(1);
+  Spawn([ctx, func = std::forward<F>(func)]() mutable {
+    ctx->unstarted.fetch_sub(1, std::memory_order_relaxed);
+    func();
+    ctx->wg.Done();
+  });
+}
+
+template <typename Index>
+Index DefaultGrain(Index begin, Index end, size_t grain) {
+  if (grain) return static_cast<Index>(grain);
+  size_t n = static_cast<size_t>(end - begin);
+  return static_cast<Index>(
+      std::max<size_t>(1, n / (kGrainsPerCore * RuntimeMaxCores())));
+}
+
+// Runs @body over [@lo, @hi). A body provides operator()(lo, hi) to process
+// a subrange, Fork() to make a body for a split-off subrange, and Finish()
+// to publish its results once its task is done.
+template <typename Index, typename Body>
+void RunTask(Context *ctx, Index lo, Index hi, Index grain, Body body) {
+  while (hi - lo > grain) {
+    if (ShouldSplit(ctx)) {
+      Index mid = lo + (hi - lo) / 2;
+      SpawnTask(ctx, [ctx, mid, hi, grain, child = body.Fork()]() mutable {
+        RunTask(ctx, mid, hi, grain, std::move(child));
+      });
+      hi = mid;
+    } else {
+      body(lo, lo + grain);
+      lo += grain;
+    }
+  }
+  if (lo < hi) body(lo, hi);
+  body.Finish();
+}
+
+template <typename Index, typename Body>
+void Run(Index begin, Index end, size_t grain, Body body) {
+  if (begin >= end) return;
+  Context ctx;
+  RunTask(&ctx, begin, end, DefaultGrain(begin, end, grain), std::move(body));
+  ctx.wg.Wait();
+}
+
+// Calls a shared function on each subrange.
+template <typename Index, typename F>
+class RangeBody {
+ public:
+  explicit RangeBody(const F *f) : f_(f) {}
+  void operator()(Index lo, Index hi) { (*f_)(lo, hi); }
+  RangeBody Fork() const { return RangeBody(f_); }
+  void Finish() {}
+
+ private:
+  const F *f_;
+};
+
+// Folds each subrange into a task-local value, then joins it into a shared
+// result when the task is done.
+template <typename Index, typename T, typename F, typename Join>
+class ReduceBody {
+ public:
+  struct Shared {
+    Shared(const T &identity, const F &f, const Join &join)
+        : result(identity), identity(identity), f(f), join(join) {}
+
+    Spin lock;
+    T result;
+    const T &identity;
+    const F &f;
+    const Join &join;
+  };
+
+  explicit ReduceBody(Shared *s) : s_(s), acc_(s->identity) {}
+  void operator()(Index lo, Index hi) {
+    acc_ = s_->f(lo, hi, std::move(acc_));
+  }
+  ReduceBody Fork() const { return ReduceBody(s_); }
+  void Finish() {
+    ScopedLock<Spin> l(&s_->lock);
+    s_->result = s_->join(std::move(s_->result), std::move(acc_));
+  }
+
+ private:
+  Shared *s_;
+  T acc_;
+};
+
+template <typename It, typename Compare>
+It MedianOfThree(It a, It b, It c, Compare &comp) {
+  if (comp(*a, *b)) {
+    if (comp(*b, *c)) return b;
+    return comp(*a, *c) ? c : a;
+  }
+  if (comp(*a, *c)) return a;
+  return comp(*b, *c) ? c : b;
+}
+
+// Quicksorts [@first, @last), handing the upper partition to a new task
+// while ShouldSplit() allows; otherwise the smaller partition is sorted
+// serially and the larger one stays splittable.
+template <typename It, typename Compare>
+void SortTask(Context *ctx, It first, It last, Compare comp) {
+  using T = typename std::iterator_traits<It>::value_type;
+
+  while (last - first > kSortCutoff) {
+    It m = MedianOfThree(first, first + (last - first) / 2, last - 1, comp);
+    T pivot = *m;
+
+    // three-way partition so runs of equal keys always make progress
+    It lt = std::partition(first, last,
+                           [&](const T &v) { return comp(v, pivot); });
+    It gt = std::partition(lt, last,
+                           [&](const T &v) { return !comp(pivot, v); });
+
+    if (ShouldSplit(ctx)) {
+      SpawnTask(ctx, [ctx, gt, last, comp] { SortTask(ctx, gt, last, comp); });
+      last = lt;
+    } else if (lt - first < last - gt) {
+      std::sort(first, lt, comp);
+      first = gt;
+    } else {
+      std::sort(gt, last, comp);
+      last = lt;
+    }
+  }
+  std::sort(first, last, comp);
+}
+
+}  // namespace parallel_internal
+
+// Calls @f(lo, hi) on disjoint subranges that cover [@begin, @end). @grain is
+// the fewest indices a call gets unless the range ends (0 picks a default).
+template <typename Index, typename F>
+void ParallelForRange(Index begin, Index end, const F &f, size_t grain = 0) {
+  static_assert(std::is_integral_v<Index>, "index must be an integer");
+  parallel_internal::Run(begin, end, grain,
+                         parallel_internal::RangeBody<Index, F>(&f));
+}
+
+// Calls @f(i) for each i in [@begin, @end), in no particular order.
+template <typename Index, typename F>
+void ParallelFor(Index begin, Index end, const F &f, size_t grain = 0) {
+  ParallelForRange(
+      begin, end,
+      [&f](Index lo, Index hi) {
+        for (Index i = lo; i < hi; ++i) f(i);
+      },
+      grain);
+}
+
+// Reduces [@begin, @end). @f(lo, hi, acc) folds a subrange into @acc and
+// returns it, starting from @identity; @join(a, b) combines two partial
+// results. Partial results are joined in no particular order, so @join
+// must be associative and commutative.
+template <typename Index, typename T, typename F, typename Join>
+T ParallelReduce(Index begin, Index end, const T &identity, const F &f,
+                 const Join &join, size_t grain = 0) {
+  static_assert(std::is_integral_v<Index>, "index must be an integer");
+  using Body = parallel_internal::ReduceBody<Index, T, F, Join>;
+  typename Body::Shared s(identity, f, join);
+  parallel_internal::Run(begin, end, grain, Body(&s));
+  return std::move(s.result);
+}
+
+// Stores the inclusive scan of [@first, @last) under @op (which must be
+// associative) to @d_first, and returns the end of the output. The input is
+// divided into a few blocks per active core: block totals are computed in
+// parallel, prefixed serially, then each block is scanned in parallel.
+template <typename InputIt, typename OutputIt, typename T, typename Op>
+OutputIt ParallelScan(InputIt first, InputIt last, OutputIt d_first,
+                      const T &identity, const Op &op) {
+  size_t n = static_cast<size_t>(last - first);
+  size_t blocks = std::min<size_t>(
+      n, parallel_internal::kScanBlocksPerCore * RuntimeActiveCores());
+  if (blocks <= 1) {
+    T acc = identity;
+    for (InputIt it = first; it != last; ++it, ++d_first)
+      *d_first = acc = op(acc, *it);
+    return d_first;
+  }
+
+  size_t bsize = (n + blocks - 1) / blocks;
+  blocks = (n + bsize - 1) / bsize;
+  std::vector<T> sums(blocks, identity);
+  ParallelFor<size_t>(0, blocks, [&](size_t b) {
+    InputIt it = first + b * bsize, end = first + std::min(n, (b + 1) * bsize);
+    T acc = identity;
+    for (; it != end; ++it) acc = op(acc, *it);
+    sums[b] = std::move(acc);
+  }, 1);
+
+  T acc = identity;
+  for (T &s : sums) {
+    T next = op(acc, s);
+    s = std::move(acc);
+    acc = std::move(next);
+  }
+
+  ParallelFor<size_t>(0, blocks, [&](size_t b) {
+    size_t i = b * bsize, end = std::min(n, (b + 1) * bsize);
+    T acc = sums[b];
+    for (; i < end; ++i) d_first[i] = acc = op(acc, first[i]);
+  }, 1);
+  return d_first + n;
+}
+
+// Sorts [@first, @last) by @comp. Not stable.
+template <typename RandomIt, typename Compare = std::less<>>
+void ParallelSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+  parallel_internal::Context ctx;
+  parallel_internal::SortTask(&ctx, first, last, comp);
+  ctx.wg.Wait();
+}
+
+}  // namespace rt
@@ -0,0 +1,502 @@
+// queue.h - bounded lock-free queues, with optional uthread blocking
+//
+// SpscQueue, MpscQueue and MpmcQueue are fixed-size rings that never block:
+// TryPush() fails when full and TryPop() fails when empty. The producer and
+// consumer indexes live on separate cache lines. MpscQueue and MpmcQueue
+// follow Vyukov's bounded queue, where each slot carries a sequence number
+// that says whose turn it is, so a slot is never read before it is written.
+//
+// BlockingQueue wraps any of them. Pushes and pops stay lock-free while the
+// ring is neither full nor empty; only then does a thread park, and the
+// other side takes a lock to wake it only if someone is parked.
+
+#pragma once
+
+extern "C" {
+#include <asm/cpu.h>
+#include <base/stddef.h>
+}
+
+#include "sync.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace rt {
+namespace queue_internal {
+
+inline size_t RoundUpCapacity(size_t capacity) {
+  size_t n = 1;
+  while (n < capacity) n <<= 1;
+  return n;
+}
+
+// A ring of slots with sequence numbers (Vyukov). Slot i holds position pos
+// when its sequence is pos + 1, and is free for position pos when its
+// sequence is pos. Producers always claim positions with a CAS; consumers do
+// so only if @kMultiConsumer.
+template <typename T, bool kMultiConsumer>
+class SeqRing {
+ public:
+  using value_type = T;
+
+  // Makes a queue with room for at least @capacity elements.
+  explicit SeqRing(size_t capacity)
+      : head_(0),
+        tail_(0),
+        mask_(RoundUpCapacity(capacity) - 1),
+        slots_(new Slot[mask_ + 1]) {
+    for (uint64_t i = 0; i <= mask_; ++i)
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // Disable move and copy.
+  SeqRing(const SeqRing&) = delete;
+  SeqRing& operator=(const SeqRing&) = delete;
+
+  // Enqueues @v. Returns false (leaving @v untouched) if the queue is full.
+  template <typename U>
+  bool TryPush(U &&v) {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Slot *s;
+    while (true) {
+      s = &slots_[pos & mask_];
+      int64_t diff = static_cast<int64_t>(
+          s->seq.load(std::memory_order_acquire) - pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    s->val = std::forward<U>(v);
+    s->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Dequeues into @v. Returns false if the queue is empty.
+  bool TryPop(T *v) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    Slot *s;
+    while (true) {
+      s = &slots_[pos & mask_];
+      int64_t diff = static_cast<int64_t>(
+          s->seq.load(std::memory_order_acquire) - (pos + 1));
+      if (diff == 0) {
+        if (!kMultiConsumer) {
+          tail_.store(pos + 1, std::memory_order_relaxed);
+          break;
+        }
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    *v = std::move(s->val);
+    s->seq.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Enqueues up to @n elements moved from @items, in order, with a single
+  // claim of the producer index. Returns the number enqueued.
+  size_t TryPushBatch(T *items, size_t n) {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    size_t k;
+    while (true) {
+      k = Count(&head_, &pos, n, 0);
+      if (k == 0) return 0;
+      if (head_.compare_exchange_weak(pos, pos + k,
+                                      std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; ++i) {
+      Slot *s = &slots_[(pos + i) & mask_];
+      s->val = std::move(items[i]);
+      s->seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return k;
+  }
+
+  // Dequeues up to @n elements into @items, in order, with a single claim of
+  // the consumer index. Returns the number dequeued.
+  size_t TryPopBatch(T *items, size_t n) {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    size_t k;
+    while (true) {
+      k = Count(&tail_, &pos, n, 1);
+      if (k == 0) return 0;
+      if (!kMultiConsumer) {
+        tail_.store(pos + k, std::memory_order_relaxed);
+        break;
+      }
+      if (tail_.compare_exchange_weak(pos, pos + k,
+                                      std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; ++i) {
+      Slot *s = &slots_[(pos + i) & mask_];
+      items[i] = std::move(s->val);
+      s->seq.store(pos + i + mask_ + 1, std::memory_order_release);
+    }
+    return k;
+  }
+
+  // Returns true if a push would (momentarily) succeed.
+  bool CanPush() {
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    return Count(&head_, &pos, 1, 0) != 0;
+  }
+
+  // Returns true if a pop would (momentarily) succeed.
+  bool CanPop() {
+    uint64_t pos = tail_.load(std::memory_order_relaxed);
+    return Count(&tail_, &pos, 1, 1) != 0;
+  }
+
+  // The number of elements, which may be stale by the time it is returned.
+  size_t Size() const {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    T val;
+  };
+
+  // Counts up to @n slots from *@pos whose sequence is pos + @off, i.e.
+  // that are ready to be claimed. Reloads *@pos from @idx if it is stale.
+  size_t Count(std::atomic<uint64_t> *idx, uint64_t *pos, size_t n,
+               uint64_t off) {
+    while (true) {
+      size_t k = 0;
+      for (; k < n && k <= mask_; ++k) {
+        uint64_t seq = slots_[(*pos + k) & mask_].seq.load(
+            std::memory_order_acquire);
+        if (seq != *pos + k + off) break;
+      }
+      if (k > 0) return k;
+
+      // the first slot isn't ready: either the queue is full (or empty), or
+      // someone else claimed *pos already
+      uint64_t seq = slots_[*pos & mask_].seq.load(std::memory_order_acquire);
+      if (static_cast<int64_t>(seq - (*pos + off)) < 0) return 0;
+      *pos = idx->load(std::memory_order_relaxed);
+    }
+  }
+
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head_;
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail_;
+  alignas(CACHE_LINE_SIZE) const uint64_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+};
+
+}  // namespace queue_internal
+
+// A bounded queue for one producer thread and one consumer thread. Each
+// side caches the other's index, so it touches the other's cache line only
+// when the ring looks full (or empty).
+template <typename T>
+class SpscQueue {
+ public:
+  using value_type = T;
+
+  // Makes a queue with room for at least @capacity elements.
+  explicit SpscQueue(size_t capacity)
+      : head_(0),
+        tail_cache_(0),
+        tail_(0),
+        head_cache_(0),
+        mask_(queue_internal::RoundUpCapacity(capacity) - 1),
+        slots_(new T[mask_ + 1]) {}
+
+  // Disable move and copy.
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Enqueues @v. Returns false (leaving @v untouched) if the queue is full.
+  template <typename U>
+  bool TryPush(U &&v) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_cache_ > mask_) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      if (head - tail_cache_ > mask_) return false;
+    }
+    slots_[head & mask_] = std::forward<U>(v);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Dequeues into @v. Returns false if the queue is empty.
+  bool TryPop(T *v) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_cache_) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      if (tail == head_cache_) return false;
+    }
+    *v = std::move(slots_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Enqueues up to @n elements moved from @items, in order. Returns the
+  // number enqueued.
+  size_t TryPushBatch(T *items, size_t n) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    size_t room = mask_ + 1 - (head - tail_cache_);
+    if (room < n) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      room = mask_ + 1 - (head - tail_cache_);
+    }
+    size_t k = std::min(n, room);
+    for (size_t i = 0; i < k; ++i)
+      slots_[(head + i) & mask_] = std::move(items[i]);
+    head_.store(head + k, std::memory_order_release);
+    return k;
+  }
+
+  // Dequeues up to @n elements into @items, in order. Returns the number
+  // dequeued.
+  size_t TryPopBatch(T *items, size_t n) {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    size_t avail = head_cache_ - tail;
+    if (avail < n) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      avail = head_cache_ - tail;
+    }
+    size_t k = std::min(n, avail);
+    for (size_t i = 0; i < k; ++i)
+      items[i] = std::move(slots_[(tail + i) & mask_]);
+    tail_.store(tail + k, std::memory_order_release);
+    return k;
+  }
+
+  // Returns true if a push would succeed (called by the producer).
+  bool CanPush() {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    return head - tail_.load(std::memory_order_acquire) <= mask_;
+  }
+
+  // Returns true if a pop would succeed (called by the consumer).
+  bool CanPop() {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    return head_.load(std::memory_order_acquire) != tail;
+  }
+
+  // The number of elements, which may be stale by the time it is returned.
+  size_t Size() const {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    return head > tail ? head - tail : 0;
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+ private:
+  // the producer's cache line
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head_;
+  uint64_t tail_cache_;
+  // the consumer's cache line
+  alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail_;
+  uint64_t head_cache_;
+  alignas(CACHE_LINE_SIZE) const uint64_t mask_;
+  std::unique_ptr<T[]> slots_;
+};
+
+// A bounded queue for many producer threads and one consumer thread.
+template <typename T>
+using MpscQueue = queue_internal::SeqRing<T, false>;
+
+// A bounded queue for many producer and many consumer threads.
+template <typename T>
+using MpmcQueue = queue_internal::SeqRing<T, true>;
+
+// Adds blocking to SpscQueue, MpscQueue or MpmcQueue: Push() parks while the
+// queue is full and Pop() parks while it is empty, until Close(). A pusher
+// or popper wakes a parked thread on the other side only if there is one,
+// which it learns from a counter without taking the lock.
+template <typename Queue>
+class BlockingQueue {
+ public:
+  using value_type = typename Queue::value_type;
+
+  // Makes a queue with room for at least @capacity elements.
+  explicit BlockingQueue(size_t capacity) : closed_(false), q_(capacity) {}
+
+  // Disable move and copy.
+  BlockingQueue(const BlockingQueue&) = delete;
+  BlockingQueue& operator=(const BlockingQueue&) = delete;
+
+  // Enqueues @v, parking while the queue is full. Returns false if the
+  // queue is closed.
+  template <typename U>
+  bool Push(U &&v) {
+    while (!closed_.load(std::memory_order_relaxed)) {
+      if (q_.TryPush(std::forward<U>(v))) {
+        Wake(&consumers_, 1);
+        return true;
+      }
+      Wait(&producers_, [this] { return q_.CanPush(); });
+    }
+    return false;
+  }
+
+  // Dequeues into @v, parking while the queue is empty. Returns false once
+  // the queue is closed and drained.
+  bool Pop(value_type *v) {
+    while (true) {
+      if (q_.TryPop(v)) {
+        Wake(&producers_, 1);
+        return true;
+      }
+      if (!Wait(&consumers_, [this] { return q_.CanPop(); }))
+        return q_.TryPop(v);
+    }
+  }
+
+  // Enqueues @n elements moved from @items, parking whenever the queue is
+  // full. Returns the number enqueued, which is less than @n only if the
+  // queue is closed.
+  size_t PushBatch(value_type *items, size_t n) {
+    size_t done = 0;
+    while (done < n && !closed_.load(std::memory_order_relaxed)) {
+      size_t k = q_.TryPushBatch(items + done, n - done);
+      if (k) {
+        Wake(&consumers_, k);
+        done += k;
+        continue;
+      }
+      Wait(&producers_, [this] { return q_.CanPush(); });
+    }
+    return done;
+  }
+
+  // Dequeues up to @n elements into @items, parking until there is at least
+  // one. Returns the number dequeued, or 0 once the queue is closed and
+  // drained.
+  size_t PopBatch(value_type *items, size_t n) {
+    while (true) {
+      size_t k = q_.TryPopBatch(items, n);
+      if (k) {
+        Wake(&producers_, k);
+        return k;
+      }
+      if (!Wait(&consumers_, [this] { return q_.CanPop(); }))
+        return q_.TryPopBatch(items, n);
+    }
+  }
+
+  // Like Push() but never parks. Returns false if the queue is full.
+  template <typename U>
+  bool TryPush(U &&v) {
+    if (!q_.TryPush(std::forward<U>(v))) return false;
+    Wake(&consumers_, 1);
+    return true;
+  }
+
+  // Like Pop() but never parks. Returns false if the queue is empty.
+  bool TryPop(value_type *v) {
+    if (!q_.TryPop(v)) return false;
+    Wake(&producers_, 1);
+    return true;
+  }
+
+  // Closes the queue, failing pushes and waking every parked thread. Pops
+  // still drain what is left.
+  void Close() {
+    ScopedLock<Spin> l(&lock_);
+    closed_.store(true, std::memory_order_relaxed);
+    Wake(&producers_, SIZE_MAX, true);
+    Wake(&consumers_, SIZE_MAX, true);
+  }
+
+  // The number of elements, which may be stale by the time it is returned.
+  size_t Size() const { return q_.Size(); }
+
+  size_t Capacity() const { return q_.Capacity(); }
+
+ private:
+  struct Waiter {
+    ThreadWaker waker;
+    Waiter *next;
+  };
+
+  // The threads parked on one side of the queue, in FIFO order.
+  struct WaitList {
+    WaitList() : nwaiting(0), head(nullptr), tail(nullptr) {}
+
+    // parked threads (changes only under the lock)
+    std::atomic<size_t> nwaiting;
+    Waiter *head;
+    Waiter *tail;
+  };
+
+  // Parks on @wl unless @ready() or the queue is closed. Returns false if
+  // the queue is closed.
+  template <typename Ready>
+  bool Wait(WaitList *wl, Ready ready) {
+    lock_.Lock();
+    wl->nwaiting.fetch_add(1, std::memory_order_relaxed);
+    // pairs with the fence in Wake(): either we see the other side's update
+    // or it sees us waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (closed_.load(std::memory_order_relaxed) || ready()) {
+      wl->nwaiting.fetch_sub(1, std::memory_order_relaxed);
+      bool closed = closed_.load(std::memory_order_relaxed);
+      lock_.Unlock();
+      return !closed;
+    }
+
+    Waiter w;
+    w.next = nullptr;
+    w.waker.Arm();
+    if (wl->tail)
+      wl->tail->next = &w;
+    else
+      wl->head = &w;
+    wl->tail = &w;
+    lock_.UnlockAndPark();
+    return !closed_.load(std::memory_order_relaxed);
+  }
+
+  // Wakes up to @n threads parked on @wl.
+  void Wake(WaitList *wl, size_t n, bool locked = false) {
+    if (!locked) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (wl->nwaiting.load(std::memory_order_relaxed) == 0) return;
+      lock_.Lock();
+    }
+    while (n-- && wl->head) {
+      Waiter *w = wl->head;
+      wl->head = w->next;
+      if (!wl->head) wl->tail = nullptr;
+      wl->nwaiting.fetch_sub(1, std::memory_order_relaxed);
+      // the waiter may return as soon as it is ready, so don't touch it after
+      ThreadWaker waker = std::move(w->waker);
+      waker.Wake();
+    }
+    if (!locked) lock_.Unlock();
+  }
+
+  std::atomic<bool> closed_;
+  Spin lock_;
+  WaitList producers_;
+  WaitList consumers_;
+  Queue q_;
+};
+
+}  // namespace rt
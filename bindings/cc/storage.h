@@ -6,7 +6,38 @@ extern "C" {
 #include <runtime/storage.h>
 }
 
-// TODO: this should be per-device.
+// A handle to a single storage device.
+class StorageDevice {
+ public:
+  explicit StorageDevice(unsigned int id) : id_(id) {}
+
+  // Write contiguous storage blocks.
+  int Write(const void *src, uint64_t lba, uint32_t lba_count) const {
+    return storage_dev_write(id_, src, lba, lba_count);
+  }
+
+  // Read contiguous storage blocks.
+  int Read(void *dst, uint64_t lba, uint32_t lba_count) const {
+    return storage_dev_read(id_, dst, lba, lba_count);
+  }
+
+  // Make all completed writes durable.
+  int Flush() const { return storage_dev_flush(id_); }
+
+  // Returns the size of each block.
+  uint32_t get_block_size() const { return storage_dev_block_size(id_); }
+
+  // Returns the capacity of the device in blocks.
+  uint64_t get_num_blocks() const { return storage_dev_num_blocks(id_); }
+
+  // Returns the index of the device.
+  unsigned int get_id() const { return id_; }
+
+ private:
+  unsigned int id_;
+};
+
+// The default volume (the first device, or a stripe across all devices).
 class Storage {
  public:
   // Write contiguous storage blocks.
@@ -19,9 +50,56 @@ class Storage {
     return storage_read(dst, lba, lba_count);
   }
 
+  // Make all completed writes durable.
+  static int Flush() { return storage_flush(); }
+
   // Returns the size of each block.
   static uint32_t get_block_size() { return storage_block_size(); }
 
   // Returns the capacity of the device in blocks.
   static uint64_t get_num_blocks() { return storage_num_blocks(); }
+
+  // Returns the number of attached devices.
+  static unsigned int get_num_devices() { return storage_num_devices(); }
+
+  // Returns a handle to an individual device.
+  static StorageDevice GetDevice(unsigned int id) { return StorageDevice(id); }
+};
+
+// A stream with sequential read-ahead and write coalescing. Not thread-safe.
+class StorageStream {
+ public:
+  // Creates a stream over a device (or the default volume if @dev is -1).
+  // Returns nullptr on failure.
+  static StorageStream *Create(int dev, uint32_t ra_max_blocks,
+                               uint32_t wb_blocks) {
+    storage_stream_t *s;
+    if (storage_stream_create(dev, ra_max_blocks, wb_blocks, &s))
+      return nullptr;
+    return new StorageStream(s);
+  }
+
+  ~StorageStream() { storage_stream_destroy(s_); }
+
+  // Read contiguous storage blocks.
+  int Read(void *dst, uint64_t lba, uint32_t lba_count) {
+    return storage_stream_read(s_, dst, lba, lba_count);
+  }
+
+  // Write contiguous storage blocks (may be buffered until Flush()).
+  int Write(const void *src, uint64_t lba, uint32_t lba_count) {
+    return storage_stream_write(s_, src, lba, lba_count);
+  }
+
+  // Submit buffered writes and make them durable.
+  int Flush() { return storage_stream_flush(s_); }
+
+ private:
+  StorageStream(storage_stream_t *s) : s_(s) {}
+
+  // disable move and copy.
+  StorageStream(const StorageStream&) = delete;
+  StorageStream& operator=(const StorageStream&) = delete;
+
+  storage_stream_t *s_;
 };
@@ -8,13 +8,8 @@ void ThreadTrampoline(void *arg) {
   (*static_cast<std::function<void()> *>(arg))();
 }
 
-// A helper to jump from a C function to a C++ std::function. This variant
-// can wait for the thread to be joined.
-void ThreadTrampolineWithJoin(void *arg) {
-  thread_internal::join_data *d =
-      static_cast<thread_internal::join_data *>(arg);
-  d->func_();
-  d->func_.~function<void()>();
+// Finishes a joinable thread, waiting for the joiner if it hasn't arrived.
+void JoinFinish(join_data *d) {
   spin_lock_np(&d->lock_);
   if (d->done_) {
     spin_unlock_np(&d->lock_);
@@ -32,28 +27,6 @@ Thread::~Thread() {
   if (unlikely(join_data_ != nullptr)) BUG();
 }
 
-Thread::Thread(const std::function<void()> &func) {
-  thread_internal::join_data *buf;
-  thread_t *th =
-      thread_create_with_buf(thread_internal::ThreadTrampolineWithJoin,
-                             reinterpret_cast<void **>(&buf), sizeof(*buf));
-  if (unlikely(!th)) BUG();
-  new (buf) thread_internal::join_data(func);
-  join_data_ = buf;
-  thread_ready(th);
-}
-
-Thread::Thread(std::function<void()> &&func) {
-  thread_internal::join_data *buf;
-  thread_t *th =
-      thread_create_with_buf(thread_internal::ThreadTrampolineWithJoin,
-                             reinterpret_cast<void **>(&buf), sizeof(*buf));
-  if (unlikely(!th)) BUG();
-  new (buf) thread_internal::join_data(std::move(func));
-  join_data_ = buf;
-  thread_ready(th);
-}
-
 void Thread::Detach() {
   if (unlikely(join_data_ == nullptr)) BUG();
 
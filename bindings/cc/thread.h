@@ -8,48 +8,81 @@ extern "C" {
 }
 
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 namespace rt {
 namespace thread_internal {
 
+// The largest callable a thread can be spawned with. It lives at the top of
+// the new thread's stack, so it must leave plenty of room below.
+constexpr size_t kMaxCallableSize = 64 * 1024;
+
+// Stack buffers are aligned to the stack pointer alignment (16 bytes).
+constexpr size_t kMaxCallableAlign = 16;
+
+template <typename F>
+constexpr void CheckCallable() {
+  static_assert(sizeof(F) <= kMaxCallableSize,
+                "callable too large for a thread's stack buffer");
+  static_assert(alignof(F) <= kMaxCallableAlign,
+                "callable is over-aligned for a thread's stack buffer");
+}
+
+// The join state of a joinable thread, at the top of its stack.
 struct join_data {
-  join_data(std::function<void()>&& func)
-      : done_(false), waiter_(nullptr), func_(std::move(func)) {
-    spin_lock_init(&lock_);
-  }
-  join_data(const std::function<void()>& func)
-      : done_(false), waiter_(nullptr), func_(func) {
-    spin_lock_init(&lock_);
-  }
+  join_data() : done_(false), waiter_(nullptr) { spin_lock_init(&lock_); }
 
   spinlock_t lock_;
   bool done_;
   thread_t* waiter_;
-  std::function<void()> func_;
+};
+
+// The join state followed by the callable it runs.
+template <typename F>
+struct join_data_with_func : join_data {
+  template <typename G>
+  explicit join_data_with_func(G&& func) : func_(std::forward<G>(func)) {}
+
+  F func_;
 };
 
 extern void ThreadTrampoline(void* arg);
-extern void ThreadTrampolineWithJoin(void* arg);
+extern void JoinFinish(join_data* d);
+
+// A helper to jump from a C function to a callable in the stack buffer.
+template <typename F>
+void SpawnTrampoline(void* arg) {
+  F* func = static_cast<F*>(arg);
+  (*func)();
+  func->~F();
+}
+
+// A helper to jump from a C function to a callable in the stack buffer. This
+// variant can wait for the thread to be joined.
+template <typename F>
+void SpawnTrampolineWithJoin(void* arg) {
+  auto* d = static_cast<join_data_with_func<F>*>(arg);
+  d->func_();
+  d->func_.~F();
+  JoinFinish(d);
+}
 
 }  // namespace thread_internal
 
-// Spawns a new thread by copying.
-inline void Spawn(const std::function<void()>& func) {
-  void* buf;
-  thread_t* th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
-                                        sizeof(std::function<void()>));
-  if (unlikely(!th)) BUG();
-  new (buf) std::function<void()>(func);
-  thread_ready(th);
-}
+// Spawns a new thread running @func, which is copied or moved to the top of
+// the new thread's stack (no heap allocation).
+template <typename F>
+void Spawn(F&& func) {
+  using Fn = std::decay_t<F>;
+  thread_internal::CheckCallable<Fn>();
 
-// Spawns a new thread by moving.
-inline void Spawn(std::function<void()>&& func) {
   void* buf;
-  thread_t* th = thread_create_with_buf(thread_internal::ThreadTrampoline, &buf,
-                                        sizeof(std::function<void()>));
+  thread_t* th = thread_create_with_buf(thread_internal::SpawnTrampoline<Fn>,
+                                        &buf, sizeof(Fn));
   if (unlikely(!th)) BUG();
-  new (buf) std::function<void()>(std::move(func));
+  new (buf) Fn(std::forward<F>(func));
   thread_ready(th);
 }
 
@@ -78,11 +111,23 @@ class Thread {
     return *this;
   }
 
-  // Spawns a thread by copying a std::function.
-  Thread(const std::function<void()>& func);
-
-  // Spawns a thread by moving a std::function.
-  Thread(std::function<void()>&& func);
+  // Spawns a thread running @func. The callable and the join state are
+  // copied or moved together to the top of the new thread's stack (no heap
+  // allocation).
+  template <typename F, typename = std::enable_if_t<
+                            !std::is_same_v<std::decay_t<F>, Thread>>>
+  Thread(F&& func) {
+    using Fn = std::decay_t<F>;
+    using Data = thread_internal::join_data_with_func<Fn>;
+    thread_internal::CheckCallable<Data>();
+
+    void* buf;
+    thread_t* th = thread_create_with_buf(
+        thread_internal::SpawnTrampolineWithJoin<Fn>, &buf, sizeof(Data));
+    if (unlikely(!th)) BUG();
+    join_data_ = new (buf) Data(std::forward<F>(func));
+    thread_ready(th);
+  }
 
   // Waits for the thread to exit.
   void Join();
@@ -0,0 +1,188 @@
+// asyncbench.cc - many concurrent Breakwater RPCs from a single uthread with
+// the asynchronous client
+
+extern "C" {
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <breakwater/breakwater.h>
+}
+
+#include "cc/runtime.h"
+#include "cc/sync.h"
+#include "cc/thread.h"
+#include "cc/timer.h"
+#include "breakwater/async++.h"
+#include "breakwater/rpc++.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const struct crpc_ops *crpc_ops;
+const struct srpc_ops *srpc_ops;
+
+namespace {
+
+// <- SERVER ARGUMENTS ->
+// the service time of a request in us.
+uint64_t service_us;
+
+// <- CLIENT ARGUMENTS ->
+// the remote address of the server.
+netaddr raddr;
+// the duration of each run in seconds.
+int seconds;
+// the numbers of concurrent RPCs to sweep.
+std::vector<size_t> depths = {1, 16, 256, 1024, 10000};
+
+struct payload {
+  uint64_t seq;
+};
+
+void RpcServer(struct srpc_ctx *ctx) {
+  if (unlikely(ctx->req_len < sizeof(payload))) {
+    log_err("got invalid RPC len %ld", ctx->req_len);
+    return;
+  }
+
+  delay_us(service_us);
+  memcpy(ctx->resp_buf, ctx->req_buf, sizeof(payload));
+  ctx->resp_len = sizeof(payload);
+}
+
+void ServerHandler(void *arg) {
+  int ret = rpc::RpcServerEnable(RpcServer);
+  if (ret) panic("couldn't enable RPC server");
+  // waits forever.
+  rt::WaitGroup(1).Wait();
+}
+
+void RunOne(size_t depth) {
+  std::unique_ptr<rpc::RpcAsyncClient> c(
+      rpc::RpcAsyncClient::Dial(raddr, 1, false, depth));
+  if (unlikely(c == nullptr)) panic("couldn't connect to server");
+
+  std::vector<rpc::Future<rpc::RpcResponse>> futures(depth);
+  uint64_t ok = 0, dropped = 0, expired = 0, failed = 0, mismatched = 0;
+  uint64_t rounds = 0, max_backlog = 0, seq = 0;
+  uint64_t start = microtime(), end = start + seconds * ONE_SECOND;
+
+  while (microtime() < end) {
+    // issue every call of the round before waiting for any of them
+    for (size_t i = 0; i < depth; i++) {
+      payload req{seq + i};
+      futures[i] = c->Call(&req, sizeof(req));
+    }
+    max_backlog = std::max<uint64_t>(max_backlog, c->Backlog());
+
+    for (size_t i = 0; i < depth; i++) {
+      rpc::RpcResponse &resp = futures[i].Get();
+      if (unlikely(resp.ret < 0)) {
+        failed++;
+      } else if (resp.status == CRPC_DROPPED) {
+        dropped++;
+      } else if (resp.status == CRPC_EXPIRED) {
+        expired++;
+      } else if (resp.buf.size() != sizeof(payload) ||
+                 reinterpret_cast<payload *>(resp.buf.data())->seq !=
+                     seq + i) {
+        mismatched++;
+      } else {
+        ok++;
+      }
+    }
+    seq += depth;
+    rounds++;
+  }
+
+  double elapsed = static_cast<double>(microtime() - start);
+  std::cout << std::setprecision(2) << std::fixed << depth << ", " << rounds
+            << ", " << ok / elapsed * ONE_SECOND << ", " << ok << ", "
+            << dropped << ", " << expired << ", " << failed << ", "
+            << mismatched << ", " << elapsed / rounds << ", " << max_backlog
+            << std::endl;
+}
+
+void ClientHandler(void *arg) {
+  std::cout << "depth, rounds, rps, ok, dropped, expired, failed, "
+               "mismatched, round_us, max_backlog"
+            << std::endl;
+  for (size_t depth : depths) RunOne(depth);
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+int ParseDepths(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  depths.clear();
+  while (std::getline(ss, tok, ',')) {
+    size_t n = std::stoul(tok);
+    if (n == 0) return -EINVAL;
+    depths.push_back(n);
+  }
+  return depths.empty() ? -EINVAL : 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] server [service_us]\n"
+            << "       [cfg_file] client [server_ip] [seconds] [depths]\n"
+            << "\tdepths: optional comma-separated numbers of concurrent "
+               "RPCs"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    Usage();
+    return -EINVAL;
+  }
+
+  crpc_ops = &cbw_ops;
+  srpc_ops = &sbw_ops;
+
+  std::string cmd = argv[2];
+  if (cmd.compare("server") == 0) {
+    if (argc < 4) {
+      Usage();
+      return -EINVAL;
+    }
+    service_us = std::stoul(argv[3], nullptr, 0);
+    ret = runtime_init(argv[1], ServerHandler, NULL);
+  } else if (cmd.compare("client") == 0) {
+    if (argc < 5 || StringToAddr(argv[3], &raddr.ip) ||
+        (argc > 5 && ParseDepths(argv[5]))) {
+      Usage();
+      return -EINVAL;
+    }
+    raddr.port = SRPC_PORT;
+    seconds = std::stoi(argv[4], nullptr, 0);
+    ret = runtime_init(argv[1], ClientHandler, NULL);
+  } else {
+    Usage();
+    return -EINVAL;
+  }
+
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
@@ -0,0 +1,269 @@
+// msgbench.cc - throughput and memory cost of Breakwater RPCs across message
+// sizes, comparing copied responses against pooled and zero-copy buffers
+
+extern "C" {
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <breakwater/breakwater.h>
+}
+
+#include "cc/runtime.h"
+#include "cc/sync.h"
+#include "cc/thread.h"
+#include "cc/timer.h"
+#include "breakwater/rpc++.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const struct crpc_ops *crpc_ops;
+const struct srpc_ops *srpc_ops;
+
+namespace {
+
+// How the server builds its responses.
+enum ResponseMode : uint32_t {
+  kModeCopy = 0,  // into the context, copying from a buffer that fits inline
+  kModePool,      // into a buffer from srpc_resp_alloc()
+  kModeZeroCopy,  // straight from a server-owned buffer
+};
+
+const char *kModeNames[] = {"copy", "pool", "zerocopy"};
+
+struct request_hdr {
+  uint32_t resp_len;
+  uint32_t mode;
+};
+
+// the remote address of the server.
+netaddr raddr;
+// the number of closed-loop client threads.
+int threads;
+// the duration of each run in seconds.
+int seconds;
+// the message sizes to sweep.
+std::vector<size_t> sizes = {64,         256,        1024,      4096,
+                             16 * 1024,  64 * 1024,  256 * 1024,
+                             1024 * 1024};
+
+// the server's response payload, shared by every RPC.
+char *resp_blob;
+
+void RpcServer(struct srpc_ctx *ctx) {
+  if (unlikely(ctx->req_len < sizeof(request_hdr))) {
+    log_err("got invalid RPC len %ld", ctx->req_len);
+    return;
+  }
+  const request_hdr *in = reinterpret_cast<const request_hdr *>(ctx->req_buf);
+  size_t len = std::min<size_t>(in->resp_len, SRPC_MAX_PAYLOAD);
+
+  switch (in->mode) {
+    case kModeCopy:
+      // what a handler without the new API can do
+      len = std::min<size_t>(len, SRPC_BUF_SIZE);
+      memcpy(ctx->resp_buf, resp_blob, len);
+      break;
+    case kModePool: {
+      void *buf = srpc_resp_alloc(ctx, len);
+      if (unlikely(!buf)) return;
+      memcpy(buf, resp_blob, len);
+      break;
+    }
+    case kModeZeroCopy:
+      srpc_resp_set_zc(ctx, resp_blob, len, nullptr, nullptr);
+      break;
+    default:
+      return;
+  }
+  ctx->resp_len = len;
+}
+
+void ServerHandler(void *arg) {
+  resp_blob = static_cast<char *>(malloc(SRPC_MAX_PAYLOAD));
+  BUG_ON(!resp_blob);
+  memset(resp_blob, 0xab, SRPC_MAX_PAYLOAD);
+
+  int ret = rpc::RpcServerEnable(RpcServer);
+  if (ret) panic("couldn't enable RPC server");
+  // waits forever.
+  rt::WaitGroup(1).Wait();
+}
+
+// The bytes one in-flight RPC of this size pins beyond the wire buffers.
+size_t MemoryPerRpc(size_t size, ResponseMode mode) {
+  size_t mem = sizeof(struct sbw_ctx) + sizeof(struct crpc_ctx);
+
+  // the client copies large requests out of its queue entry
+  if (size > SRPC_BUF_SIZE) mem += size;
+  // the server reads requests that don't fit inline into a pooled buffer
+  if (size > SRPC_INLINE_SIZE) mem += size;
+  if (mode == kModePool && size > SRPC_BUF_SIZE) mem += size;
+  return mem;
+}
+
+struct result {
+  uint64_t rpcs;
+  uint64_t bytes;
+  uint64_t failed;
+};
+
+void RunOne(size_t size, ResponseMode mode) {
+  std::vector<std::unique_ptr<rpc::RpcClient>> conns;
+  for (int i = 0; i < threads; ++i) {
+    std::unique_ptr<rpc::RpcClient> c(rpc::RpcClient::Dial(raddr, i + 1));
+    if (unlikely(c == nullptr)) panic("couldn't connect to server");
+    conns.emplace_back(std::move(c));
+  }
+
+  std::vector<result> results(threads);
+  std::atomic<bool> stop{false};
+  std::vector<rt::Thread> ths;
+  for (int i = 0; i < threads; ++i) {
+    ths.emplace_back(rt::Thread([&, i] {
+      std::unique_ptr<char[]> req(new char[size]);
+      std::unique_ptr<char[]> resp(new char[SRPC_MAX_PAYLOAD]);
+      request_hdr *hdr = reinterpret_cast<request_hdr *>(req.get());
+      result &r = results[i];
+
+      memset(req.get(), 0xcd, size);
+      hdr->resp_len = size;
+      hdr->mode = mode;
+      r = {};
+      while (!stop.load(std::memory_order_relaxed)) {
+        ssize_t ret = conns[i]->Send(req.get(), size, i);
+        if (unlikely(ret != static_cast<ssize_t>(size))) {
+          r.failed++;
+          if (ret < 0) break;
+          continue;
+        }
+        int status;
+        ret = conns[i]->RecvWithStatus(resp.get(), SRPC_MAX_PAYLOAD, nullptr,
+                                       &status);
+        if (unlikely(ret < 0)) break;
+        if (status != CRPC_OK) {
+          r.failed++;
+          continue;
+        }
+        r.rpcs++;
+        r.bytes += size + ret;
+      }
+    }));
+  }
+
+  uint64_t start = microtime();
+  rt::Sleep(seconds * ONE_SECOND);
+  stop = true;
+  for (auto &c : conns) c->Shutdown(SHUT_RDWR);
+  for (auto &t : ths) t.Join();
+  double elapsed = static_cast<double>(microtime() - start) / ONE_SECOND;
+  for (auto &c : conns) c->Close();
+
+  result total = {};
+  for (const result &r : results) {
+    total.rpcs += r.rpcs;
+    total.bytes += r.bytes;
+    total.failed += r.failed;
+  }
+
+  std::cout << std::setprecision(4) << std::fixed << size << ", "
+            << kModeNames[mode] << ", " << total.rpcs / elapsed << ", "
+            << total.bytes / elapsed / (1024 * 1024) << ", " << total.failed
+            << ", " << MemoryPerRpc(size, mode) << std::endl;
+}
+
+void ClientHandler(void *arg) {
+  std::cout << "size, mode, rps, mbps, failed, bytes_per_inflight_rpc"
+            << std::endl;
+  for (size_t size : sizes) {
+    size = std::max(size, sizeof(request_hdr));
+    // copying only works while the response fits inline
+    if (size <= SRPC_BUF_SIZE) RunOne(size, kModeCopy);
+    RunOne(size, kModePool);
+    RunOne(size, kModeZeroCopy);
+  }
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+int ParseSizes(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  sizes.clear();
+  while (std::getline(ss, tok, ',')) {
+    size_t n = std::stoul(tok);
+    if (n == 0 || n > SRPC_MAX_PAYLOAD) return -EINVAL;
+    sizes.push_back(n);
+  }
+  return sizes.empty() ? -EINVAL : 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] server [batch]\n"
+            << "       [cfg_file] client [server_ip] [threads] [seconds] "
+               "[sizes]\n"
+            << "\tsizes: optional comma-separated message sizes in bytes (up "
+               "to "
+            << SRPC_MAX_PAYLOAD << ")\n"
+            << "\tbatch: serve with batched dispatch (sbw_batch_ops)"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    Usage();
+    return -EINVAL;
+  }
+
+  crpc_ops = &cbw_ops;
+  srpc_ops = &sbw_ops;
+
+  std::string cmd = argv[2];
+  if (cmd.compare("server") == 0) {
+    if (argc > 3) {
+      if (std::string(argv[3]).compare("batch") != 0) {
+        Usage();
+        return -EINVAL;
+      }
+      srpc_ops = &sbw_batch_ops;
+    }
+    ret = runtime_init(argv[1], ServerHandler, NULL);
+  } else if (cmd.compare("client") == 0) {
+    if (argc < 6 || StringToAddr(argv[3], &raddr.ip) ||
+        (argc > 6 && ParseSizes(argv[6]))) {
+      Usage();
+      return -EINVAL;
+    }
+    raddr.port = SRPC_PORT;
+    threads = std::stoi(argv[4], nullptr, 0);
+    seconds = std::stoi(argv[5], nullptr, 0);
+    ret = runtime_init(argv[1], ClientHandler, NULL);
+  } else {
+    Usage();
+    return -EINVAL;
+  }
+
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
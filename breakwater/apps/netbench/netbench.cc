@@ -54,6 +54,8 @@ int threads;
 netaddr raddr, master;
 // the mean service time in us.
 double st;
+// service time regimes to sweep (the first one is st)
+std::vector<double> service_times;
 // service time distribution type
 // 1: exponential
 // 2: constant
@@ -61,6 +63,19 @@ double st;
 int st_type;
 // RPC service level objective (in us)
 int slo;
+// the number of request classes to spread client sessions over
+int nclasses = 1;
+// client timeout in us (0 = none), and whether to send it as a deadline
+uint64_t timeout_us = 0;
+bool propagate_deadline = true;
+
+// per-class server configuration
+struct class_cfg {
+  unsigned int weight;
+  bool strict;
+  uint64_t drop_thresh_us;
+};
+std::vector<class_cfg> class_cfgs;
 
 std::ofstream json_out;
 std::ofstream csv_out;
@@ -93,6 +108,11 @@ struct sstat_raw {
   uint64_t req_rx;
   uint64_t req_dropped;
   uint64_t resp_tx;
+  uint64_t req_expired;
+  uint64_t class_req_rx[SRPC_NR_CLASSES];
+  uint64_t class_req_dropped[SRPC_NR_CLASSES];
+  bool has_params;
+  struct srpc_params params;
 };
 
 constexpr uint64_t kShenangoStatPort = 40;
@@ -120,6 +140,10 @@ struct sstat {
   double req_rx_pps;
   double req_drop_rate;
   double resp_tx_pps;
+  double class_req_drop_rate[SRPC_NR_CLASSES];
+  double req_expired_rps;
+  bool has_params;
+  struct srpc_params params;
 };
 
 /* client-side stat */
@@ -135,6 +159,7 @@ struct cstat_raw {
   uint64_t req_tx;
   uint64_t win_expired;
   uint64_t req_dropped;
+  uint64_t req_expired;
 };
 
 struct cstat {
@@ -160,6 +185,8 @@ struct work_unit {
   uint64_t server_queue;
   uint64_t server_time;
   bool success;
+  int cls;
+  bool expired;
 };
 
 class NetBarrier {
@@ -184,6 +211,13 @@ class NetBarrier {
       BUG_ON(c->WriteFull(&st_type, sizeof(st_type)) <= 0);
       BUG_ON(c->WriteFull(&slo, sizeof(slo)) <= 0);
       BUG_ON(c->WriteFull(&offered_load, sizeof(offered_load)) <= 0);
+      BUG_ON(c->WriteFull(&nclasses, sizeof(nclasses)) <= 0);
+      BUG_ON(c->WriteFull(&timeout_us, sizeof(timeout_us)) <= 0);
+      BUG_ON(c->WriteFull(&propagate_deadline,
+                          sizeof(propagate_deadline)) <= 0);
+      size_t nst = service_times.size();
+      BUG_ON(c->WriteFull(&nst, sizeof(nst)) <= 0);
+      BUG_ON(c->WriteFull(service_times.data(), sizeof(double) * nst) <= 0);
       for (size_t j = 0; j < npara; j++) {
         rt::TcpConn *c = aggregator_->Accept();
         if (c == nullptr) panic("couldn't accept a connection");
@@ -204,6 +238,14 @@ class NetBarrier {
     BUG_ON(c->ReadFull(&st_type, sizeof(st_type)) <= 0);
     BUG_ON(c->ReadFull(&slo, sizeof(slo)) <= 0);
     BUG_ON(c->ReadFull(&offered_load, sizeof(offered_load)) <= 0);
+    BUG_ON(c->ReadFull(&nclasses, sizeof(nclasses)) <= 0);
+    BUG_ON(c->ReadFull(&timeout_us, sizeof(timeout_us)) <= 0);
+    BUG_ON(c->ReadFull(&propagate_deadline,
+                       sizeof(propagate_deadline)) <= 0);
+    size_t nst;
+    BUG_ON(c->ReadFull(&nst, sizeof(nst)) <= 0);
+    service_times.resize(nst);
+    BUG_ON(c->ReadFull(service_times.data(), sizeof(double) * nst) <= 0);
     for (size_t i = 0; i < npara; i++) {
       auto c = rt::TcpConn::Dial({0, 0}, {master.ip, kBarrierPort + 1});
       BUG_ON(c == nullptr);
@@ -247,6 +289,7 @@ class NetBarrier {
         csr->req_tx += rem_csr.req_tx;
         csr->win_expired += rem_csr.win_expired;
         csr->req_dropped += rem_csr.req_dropped;
+        csr->req_expired += rem_csr.req_expired;
       }
     } else {
       BUG_ON(conns[0]->WriteFull(csr, sizeof(*csr)) <= 0);
@@ -344,7 +387,13 @@ void RPCSStatWorker(std::unique_ptr<rt::TcpConn> c) {
                    rpc::RpcServerStatWinTx(),
                    rpc::RpcServerStatReqRx(),
                    rpc::RpcServerStatReqDropped(),
-                   rpc::RpcServerStatRespTx()};
+                   rpc::RpcServerStatRespTx(),
+                   rpc::RpcServerStatReqExpired()};
+    for (int i = 0; i < SRPC_NR_CLASSES; ++i) {
+      u.class_req_rx[i] = rpc::RpcServerStatClassReqRx(i);
+      u.class_req_dropped[i] = rpc::RpcServerStatClassReqDropped(i);
+    }
+    u.has_params = rpc::RpcServerStatParams(&u.params);
 
     // Send an uptime response.
     ssize_t sret = c->WriteFull(&u, sizeof(u));
@@ -380,8 +429,7 @@ sstat_raw ReadRPCSStat() {
   ret = c->ReadFull(&u, sizeof(u));
   if (ret != static_cast<ssize_t>(sizeof(u)))
     panic("sstat response failed, ret = %ld", ret);
-  return sstat_raw{u.idle,    u.busy,   u.num_cores, u.max_cores,   u.winu_rx,
-                   u.winu_tx, u.win_tx, u.req_rx,    u.req_dropped, u.resp_tx};
+  return u;
 }
 
 shstat_raw ReadShenangoStat() {
@@ -481,6 +529,12 @@ void ServerHandler(void *arg) {
     if (workers[i] == nullptr) panic("cannot create worker");
   }
 
+  for (size_t i = 0; i < class_cfgs.size(); ++i) {
+    const class_cfg &cfg = class_cfgs[i];
+    if (rpc::RpcServerSetClass(i, cfg.weight, cfg.strict, cfg.drop_thresh_us))
+      panic("couldn't configure request class %ld", i);
+  }
+
   int ret = rpc::RpcServerEnable(RpcServer);
   if (ret) panic("couldn't enable RPC server");
   // waits forever.
@@ -530,27 +584,43 @@ std::vector<work_unit> ClientWorker(
   std::vector<uint64_t> timings;
   timings.reserve(w.size());
 
+  // Breakwater reports drops without the request payload, so track requests
+  // by id where the algorithm supports it. The ids of one session are
+  // consecutive, since nothing else allocates them.
+  uint64_t first_id = c->AllocId();
+  std::vector<uint64_t> id_index(first_id ? w.size() : 0);
+
   // Start the receiver thread.
   auto th = rt::Thread([&] {
     payload rp;
-    uint64_t latency;
+    uint64_t latency, id, idx;
+    int status;
 
     while (true) {
-      ssize_t ret = c->Recv(&rp, sizeof(rp), &latency);
-      if (ret != static_cast<ssize_t>(sizeof(rp))) {
-        if (ret == 0 || ret < 0) break;
-	panic("read failed, ret = %ld", ret);
-      }
+      id = 0;
+      ssize_t ret = c->RecvWithId(&rp, sizeof(rp), &latency, &status, &id);
+      if (ret < 0 || (ret == 0 && !id)) break;
 
       uint64_t now = microtime();
-      uint64_t idx = ntoh64(rp.index);
+      if (id) {
+        BUG_ON(id - first_id >= id_index.size());
+        idx = id_index[id - first_id];
+      } else if (ret == static_cast<ssize_t>(sizeof(rp))) {
+        idx = ntoh64(rp.index);
+      } else {
+	panic("read failed, ret = %ld", ret);
+      }
 
-      if (!rp.success) {
+      if (status != CRPC_OK ||
+          (ret == static_cast<ssize_t>(sizeof(rp)) && !rp.success)) {
         w[idx].duration_us = latency;
         w[idx].success = false;
+        w[idx].expired = status == CRPC_EXPIRED;
 	continue;
       }
 
+      if (ret != static_cast<ssize_t>(sizeof(rp)))
+	panic("read failed, ret = %ld", ret);
       w[idx].duration_us = now - timings[idx];
       w[idx].window = c->WinAvail();
       w[idx].tsc = ntoh64(rp.tsc_end);
@@ -594,8 +664,21 @@ std::vector<work_unit> ClientWorker(
     p.success = false;
     p.work_iterations = hton64(w[i].work_us * kIterationsPerUS);
     p.index = hton64(i);
-    ssize_t ret = c->Send(&p, sizeof(p), w[i].hash);
-    if (ret == -ENOBUFS) continue;
+    ssize_t ret;
+    if (first_id) {
+      uint64_t id = i ? c->AllocId() : first_id;
+      BUG_ON(id - first_id >= id_index.size());
+      id_index[id - first_id] = i;
+      ret = c->SendWithId(&p, sizeof(p), id,
+                          timeout_us && propagate_deadline
+                              ? timings[i] + timeout_us
+                              : 0);
+    } else if (timeout_us && propagate_deadline)
+      ret = c->SendWithDeadline(&p, sizeof(p), w[i].hash,
+                                timings[i] + timeout_us);
+    else
+      ret = c->Send(&p, sizeof(p), w[i].hash);
+    if (ret == -ENOBUFS || ret == -ETIMEDOUT) continue;
     if (ret != static_cast<ssize_t>(sizeof(p)))
       panic("write failed, ret = %ld", ret);
   }
@@ -619,6 +702,8 @@ std::vector<work_unit> RunExperiment(
   for (int i = 0; i < threads; ++i) {
     std::unique_ptr<rpc::RpcClient> outc(rpc::RpcClient::Dial(raddr, i + 1));
     if (unlikely(outc == nullptr)) panic("couldn't connect to raddr.");
+    if (nclasses > 1 && outc->SetClass(i % nclasses))
+      panic("couldn't set the request class.");
     conns.emplace_back(std::move(outc));
   }
 
@@ -631,6 +716,7 @@ std::vector<work_unit> RunExperiment(
   for (int i = 0; i < threads; ++i) {
     th.emplace_back(rt::Thread([&, i] {
       auto v = ClientWorker(conns[i].get(), &starter, &starter2, wf);
+      for (auto &u : v) u.cls = i % nclasses;
       samples[i].reset(new std::vector<work_unit>(std::move(v)));
     }));
   }
@@ -681,6 +767,7 @@ std::vector<work_unit> RunExperiment(
       csr->req_tx += c->StatReqTx();
       csr->win_expired += c->StatWinExpired();
       csr->req_dropped += c->StatReqDropped();
+      csr->req_expired += c->StatReqExpired();
       c->Close();
     }
   }
@@ -756,6 +843,17 @@ std::vector<work_unit> RunExperiment(
     ss->req_drop_rate =
         static_cast<double>(req_drop_pkts) / static_cast<double>(req_rx_pkts);
     ss->resp_tx_pps = static_cast<double>(resp_tx_pkts) / elapsed_ * 1000000;
+    for (int i = 0; i < SRPC_NR_CLASSES; ++i) {
+      uint64_t rx = s2.class_req_rx[i] - s1.class_req_rx[i];
+      uint64_t drop = s2.class_req_dropped[i] - s1.class_req_dropped[i];
+      ss->class_req_drop_rate[i] =
+          rx ? static_cast<double>(drop) / static_cast<double>(rx) : 0.0;
+    }
+    ss->req_expired_rps =
+        static_cast<double>(s2.req_expired - s1.req_expired) / elapsed_ *
+        1000000;
+    ss->has_params = s2.has_params;
+    ss->params = s2.params;
 
     uint64_t rx_pkts = sh2.rx_pkts - sh1.rx_pkts;
     uint64_t tx_pkts = sh2.tx_pkts - sh1.tx_pkts;
@@ -1054,6 +1152,75 @@ void PrintStatResults(std::vector<work_unit> w, struct cstat *cs,
            << std::flush;
 }
 
+// Prints goodput and latency broken down by request class.
+void PrintClassResults(const std::vector<work_unit> &w, struct sstat *ss,
+                       double elapsed) {
+  std::cout << "class,sessions,throughput,goodput,rejects,p50,p99,"
+            << "server:req_drop_rate" << std::endl;
+
+  for (int cls = 0; cls < nclasses; ++cls) {
+    std::vector<double> lat;
+    uint64_t good = 0, rejects = 0;
+
+    for (const work_unit &u : w) {
+      if (u.cls != cls) continue;
+      if (!u.success) {
+        rejects++;
+        continue;
+      }
+      lat.push_back(u.duration_us);
+      if (u.duration_us < slo) good++;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    double p50 = lat.empty() ? 0.0 : lat[(lat.size() - 1) * 0.5];
+    double p99 = lat.empty() ? 0.0 : lat[(lat.size() - 1) * 0.99];
+    int sessions = threads * total_agents / nclasses +
+                   (cls < threads * total_agents % nclasses ? 1 : 0);
+
+    std::cout << std::setprecision(4) << std::fixed << cls << ","
+              << sessions << ","
+              << static_cast<double>(lat.size()) / elapsed * 1000000 << ","
+              << static_cast<double>(good) / elapsed * 1000000 << ","
+              << static_cast<double>(rejects) / elapsed * 1000000 << ","
+              << p50 << "," << p99 << ","
+              << (cls < SRPC_NR_CLASSES ? ss->class_req_drop_rate[cls] : 0.0)
+              << std::endl;
+  }
+}
+
+// Prints the server's control parameters at the end of an experiment.
+void PrintParams(struct sstat *ss) {
+  if (!ss->has_params) return;
+
+  const struct srpc_params &p = ss->params;
+  std::cout << std::setprecision(4) << std::fixed
+            << "params:service_us=" << st
+            << ",est_service_us=" << p.est_service_us
+            << ",est_rtt_us=" << p.est_rtt_us
+            << ",min_delay_us=" << p.min_delay_us
+            << ",drop_thresh_us=" << p.drop_thresh_us
+            << ",rtt_us=" << p.rtt_us
+            << ",ai=" << p.ai << ",md=" << p.md << std::endl;
+}
+
+// Prints how many requests missed their deadline.
+void PrintDeadlineResults(const std::vector<work_unit> &w,
+                          struct cstat_raw *csr, struct sstat *ss,
+                          double elapsed) {
+  uint64_t expired = std::count_if(w.begin(), w.end(), [](const work_unit &u) {
+    return !u.success && u.expired;
+  });
+
+  std::cout << std::setprecision(4) << std::fixed
+            << "deadline:timeout_us=" << timeout_us
+            << ",propagated=" << propagate_deadline
+            << ",expired_rps=" << static_cast<double>(expired) / elapsed * 1000000
+            << ",client:req_expired_rps="
+            << static_cast<double>(csr->req_expired) / elapsed * 1000000
+            << ",server:req_expired_rps=" << ss->req_expired_rps << std::endl;
+}
+
 void SteadyStateExperiment(int threads, double offered_rps,
                            double service_time) {
   struct sstat ss;
@@ -1092,6 +1259,46 @@ void SteadyStateExperiment(int threads, double offered_rps,
 
   // Print the results.
   PrintStatResults(w, &cs, &ss);
+  if (nclasses > 1) PrintClassResults(w, &ss, elapsed);
+  if (service_times.size() > 1) PrintParams(&ss);
+  if (timeout_us) PrintDeadlineResults(w, &csr, &ss, elapsed);
+}
+
+// Runs every offered load in every service time regime. The load is scaled
+// so that each regime sees the same utilization as the first one.
+void RunRegimes(bool pause) {
+  for (double regime : service_times) {
+    st = regime;
+    for (double i : offered_loads) {
+      SteadyStateExperiment(threads, i * service_times[0] / regime, st);
+      if (pause) rt::Sleep(1000000);
+    }
+  }
+}
+
+int ParseClassConfig(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  while (std::getline(ss, tok, ',')) {
+    class_cfg cfg = {1, false, 0};
+    size_t pos = tok.find(':');
+
+    if (pos != std::string::npos) {
+      cfg.drop_thresh_us = std::stoull(tok.substr(pos + 1));
+      tok = tok.substr(0, pos);
+    }
+    if (tok.compare("s") == 0)
+      cfg.strict = true;
+    else
+      cfg.weight = std::stoi(tok);
+    if (cfg.weight == 0) return -EINVAL;
+    class_cfgs.push_back(cfg);
+  }
+
+  if (class_cfgs.empty() || class_cfgs.size() > SRPC_NR_CLASSES)
+    return -EINVAL;
+  return 0;
 }
 
 int StringToAddr(const char *str, uint32_t *addr) {
@@ -1114,9 +1321,7 @@ void AgentHandler(void *arg) {
 
   calculate_rates();
 
-  for (double i : offered_loads) {
-    SteadyStateExperiment(threads, i, st);
-  }
+  RunRegimes(false);
 }
 
 void ClientHandler(void *arg) {
@@ -1136,10 +1341,7 @@ void ClientHandler(void *arg) {
   /* Print Header */
   PrintHeader(std::cout);
 
-  for (double i : offered_loads) {
-    SteadyStateExperiment(threads, i, st);
-    rt::Sleep(1000000);
-  }
+  RunRegimes(true);
 
   pos = json_out.tellp();
   json_out.seekp(pos - 2);
@@ -1155,7 +1357,7 @@ int main(int argc, char *argv[]) {
 
   if (argc < 4) {
     std::cerr << "usage: [alg] [cfg_file] [cmd] ...\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tcmd: netbenchd command (server/client/agent)" << std::endl;
     return -EINVAL;
@@ -1165,6 +1367,12 @@ int main(int argc, char *argv[]) {
   if (olc.compare("breakwater") == 0) {
     crpc_ops = &cbw_ops;
     srpc_ops = &sbw_ops;
+  } else if (olc.compare("breakwater_udp") == 0) {
+    crpc_ops = &cbw_udp_ops;
+    srpc_ops = &sbw_udp_ops;
+  } else if (olc.compare("breakwater_batch") == 0) {
+    crpc_ops = &cbw_ops;
+    srpc_ops = &sbw_batch_ops;
   } else if (olc.compare("seda") == 0) {
     crpc_ops = &csd_ops;
     srpc_ops = &ssd_ops;
@@ -1177,7 +1385,7 @@ int main(int argc, char *argv[]) {
   } else {
     std::cerr << "invalid algorithm: " << olc << std::endl;
     std::cerr << "usage: [alg] [cfg_file] [cmd] ...\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tcmd: netbenchd command (server/client/agent)" << std::endl;
     return -EINVAL;
@@ -1185,6 +1393,16 @@ int main(int argc, char *argv[]) {
 
   std::string cmd = argv[3];
   if (cmd.compare("server") == 0) {
+    // optional per-class config, e.g. "s,4,1:500" (strict, weight 4,
+    // weight 1 with a 500 us drop threshold)
+    if (argc > 4 && ParseClassConfig(argv[4])) {
+      std::cerr << "usage: [alg] [cfg_file] server [classes]\n"
+                << "\tclasses: comma-separated class list, each 's' (strict) "
+                   "or a weight, optionally followed by ':drop_thresh_us'"
+                << std::endl;
+      return -EINVAL;
+    }
+
     ret = runtime_init(argv[2], ServerHandler, NULL);
     if (ret) {
       printf("failed to start runtime\n");
@@ -1193,7 +1411,7 @@ int main(int argc, char *argv[]) {
   } else if (cmd.compare("agent") == 0) {
     if (argc < 5 || StringToAddr(argv[4], &master.ip)) {
     std::cerr << "usage: [alg] [cfg_file] agent [client_ip]\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tclient_ip: Client IP address" << std::endl;
       return -EINVAL;
@@ -1207,7 +1425,7 @@ int main(int argc, char *argv[]) {
   } else if (cmd.compare("client") != 0) {
     std::cerr << "invalid command: " << cmd << std::endl;
     std::cerr << "usage: [alg] [cfg_file] [cmd] ...\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tcmd: netbenchd command (server/client/agent)" << std::endl;
     return -EINVAL;
@@ -1216,16 +1434,20 @@ int main(int argc, char *argv[]) {
   if (argc < 11) {
     std::cerr << "usage: [alg] [cfg_file] client [nclients] "
 		 "[server_ip] [service_us] [service_dist] [slo] [nagents] "
-		 "[offered_load]\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+		 "[offered_load] [nclasses] [timeout_us] [nopropagate]\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tnclients: the number of client connections\n"
 	      << "\tserver_ip: server IP address\n"
-	      << "\tservice_us: average request processing time (in us)\n"
+	      << "\tservice_us: average request processing time (in us), or a\n"
+	      << "\t\tcolon-separated list of regimes to sweep (e.g. 1:10:100)\n"
 	      << "\tservice_dist: request processing time distribution (exp/const/bimod)\n"
 	      << "\tslo: RPC service level objective (in us)\n"
 	      << "\tnagents: the number of agents\n"
-	      << "\toffered_load: load geneated by client and agents in requests per second"
+	      << "\toffered_load: load geneated by client and agents in requests per second\n"
+	      << "\tnclasses: optional, spread sessions over this many request classes\n"
+	      << "\ttimeout_us: optional client timeout, sent as a deadline unless\n"
+	      << "\t\tfollowed by 'nopropagate'"
 	      << std::endl;
     return -EINVAL;
   }
@@ -1236,7 +1458,13 @@ int main(int argc, char *argv[]) {
   if (ret) return -EINVAL;
   raddr.port = kNetbenchPort;
 
-  st = std::stod(argv[6], nullptr);
+  // a colon-separated list sweeps several service time regimes
+  std::stringstream st_list(argv[6]);
+  std::string st_tok;
+  while (std::getline(st_list, st_tok, ':'))
+    service_times.push_back(std::stod(st_tok, nullptr));
+  if (service_times.empty()) return -EINVAL;
+  st = service_times[0];
 
   std::string st_dist = argv[7];
   if (st_dist.compare("exp") == 0) {
@@ -1249,22 +1477,36 @@ int main(int argc, char *argv[]) {
     std::cerr << "invalid service time distribution: " << st_dist << std::endl;
     std::cerr << "usage: [alg] [cfg_file] client [nclients] "
 		 "[server_ip] [service_us] [service_dist] [slo] [nagents] "
-		 "[offered_load]\n"
-	      << "\talg: overload control algorithms (breakwater/seda/dagor)\n"
+		 "[offered_load] [nclasses] [timeout_us] [nopropagate]\n"
+	      << "\talg: overload control algorithms (breakwater/breakwater_udp/breakwater_batch/seda/dagor)\n"
 	      << "\tcfg_file: Shenango configuration file\n"
 	      << "\tnclients: the number of client connections\n"
 	      << "\tserver_ip: server IP address\n"
-	      << "\tservice_us: average request processing time (in us)\n"
+	      << "\tservice_us: average request processing time (in us), or a\n"
+	      << "\t\tcolon-separated list of regimes to sweep (e.g. 1:10:100)\n"
 	      << "\tservice_dist: request processing time distribution (exp/const/bimod)\n"
 	      << "\tslo: RPC service level objective (in us)\n"
 	      << "\tnagents: the number of agents\n"
-	      << "\toffered_load: load generated by client and agents in requests per second"
+	      << "\toffered_load: load generated by client and agents in requests per second\n"
+	      << "\tnclasses: optional, spread sessions over this many request classes\n"
+	      << "\ttimeout_us: optional client timeout, sent as a deadline unless\n"
+	      << "\t\tfollowed by 'nopropagate'"
 	      << std::endl;
   }
 
   slo = std::stoi(argv[8], nullptr, 0);
   total_agents += std::stoi(argv[9], nullptr, 0);
   offered_load = std::stod(argv[10], nullptr);
+  if (argc > 11) nclasses = std::stoi(argv[11], nullptr, 0);
+  if (argc > 12) timeout_us = std::stoull(argv[12], nullptr, 0);
+  if (argc > 13) propagate_deadline = std::string(argv[13]) != "nopropagate";
+  // a response after the client timed out is useless
+  if (timeout_us) slo = MIN(static_cast<uint64_t>(slo), timeout_us);
+  if (nclasses < 1 || nclasses > SRPC_NR_CLASSES) {
+    std::cerr << "invalid number of request classes: " << nclasses
+              << std::endl;
+    return -EINVAL;
+  }
 
   ret = runtime_init(argv[2], ClientHandler, NULL);
   if (ret) {
@@ -0,0 +1,226 @@
+// replbench.cc - tail latency of replica selection and hedging across
+// heterogeneous Breakwater replicas
+
+extern "C" {
+#include <base/hash.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <net/ip.h>
+#include <breakwater/breakwater.h>
+}
+
+#include "cc/runtime.h"
+#include "cc/sync.h"
+#include "cc/thread.h"
+#include "cc/timer.h"
+#include "breakwater/rpc++.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const struct crpc_ops *crpc_ops;
+const struct srpc_ops *srpc_ops;
+
+namespace {
+
+// <- SERVER ARGUMENTS ->
+// the service time of a request in us.
+uint64_t service_us;
+// the percentage of requests that stall (e.g. a GC pause or a busy core).
+double stall_pct;
+// the service time of a stalled request in us.
+uint64_t stall_us;
+
+// <- CLIENT ARGUMENTS ->
+// the replicas.
+std::vector<netaddr> raddrs;
+// the number of closed-loop client threads.
+int threads;
+// the duration of each run in seconds.
+int seconds;
+
+struct payload {
+  uint64_t seq;
+};
+
+void RpcServer(struct srpc_ctx *ctx) {
+  if (unlikely(ctx->req_len < sizeof(payload))) {
+    log_err("got invalid RPC len %ld", ctx->req_len);
+    return;
+  }
+
+  const payload *in = reinterpret_cast<const payload *>(ctx->req_buf);
+  double r = static_cast<double>(rand_crc32c(in->seq) % 10000) / 100;
+  delay_us(r < stall_pct ? stall_us : service_us);
+
+  memcpy(ctx->resp_buf, ctx->req_buf, sizeof(payload));
+  ctx->resp_len = sizeof(payload);
+}
+
+void ServerHandler(void *arg) {
+  int ret = rpc::RpcServerEnable(RpcServer);
+  if (ret) panic("couldn't enable RPC server");
+  // waits forever.
+  rt::WaitGroup(1).Wait();
+}
+
+const char *kPolicyNames[] = {"random", "credit", "latency"};
+
+uint64_t Percentile(const std::vector<uint64_t> &v, double p) {
+  if (v.empty()) return 0;
+  size_t idx = std::min(v.size() - 1, static_cast<size_t>(v.size() * p / 100));
+  return v[idx];
+}
+
+void RunOne(int policy, double hedge_pct) {
+  crpc_rset_cfg cfg = {};
+  cfg.policy = policy;
+  cfg.hedge_pct = hedge_pct;
+  cfg.hedge_budget = 5;
+
+  std::unique_ptr<rpc::RpcReplicaSet> rs(
+      rpc::RpcReplicaSet::Dial(raddrs, cfg));
+  if (unlikely(rs == nullptr)) panic("couldn't connect to replicas");
+
+  std::vector<std::vector<uint64_t>> lats(threads);
+  std::vector<uint64_t> failed(threads);
+  std::atomic<bool> stop{false};
+  std::vector<rt::Thread> ths;
+  for (int i = 0; i < threads; ++i) {
+    ths.emplace_back(rt::Thread([&, i] {
+      payload req, resp;
+      int status;
+
+      req.seq = static_cast<uint64_t>(i) << 40;
+      while (!stop.load(std::memory_order_relaxed)) {
+        req.seq++;
+        uint64_t start = microtime();
+        ssize_t ret =
+            rs->Call(&req, sizeof(req), &resp, sizeof(resp), &status);
+        if (unlikely(ret < 0)) break;
+        if (status != CRPC_OK) {
+          failed[i]++;
+          continue;
+        }
+        lats[i].push_back(microtime() - start);
+      }
+    }));
+  }
+
+  uint64_t start = microtime();
+  rt::Sleep(seconds * ONE_SECOND);
+  stop = true;
+  for (auto &t : ths) t.Join();
+  double elapsed = static_cast<double>(microtime() - start) / ONE_SECOND;
+  crpc_rset_stats st = rs->Stats();
+  rs.reset();
+
+  std::vector<uint64_t> all;
+  uint64_t nfailed = 0;
+  for (int i = 0; i < threads; ++i) {
+    all.insert(all.end(), lats[i].begin(), lats[i].end());
+    nfailed += failed[i];
+  }
+  std::sort(all.begin(), all.end());
+
+  // the extra load is the requests sent beyond one per call
+  double extra = st.calls ? 100.0 * (st.sends - st.calls) / st.calls : 0;
+  std::cout << std::setprecision(2) << std::fixed << kPolicyNames[policy]
+            << ", " << hedge_pct << ", " << all.size() / elapsed << ", "
+            << nfailed << ", " << Percentile(all, 50) << ", "
+            << Percentile(all, 99) << ", " << Percentile(all, 99.9) << ", "
+            << extra << ", " << st.hedge_wins << ", " << st.hedge_skipped
+            << ", " << st.cancelled << ", " << st.wasted << ", "
+            << st.hedge_delay_us << std::endl;
+}
+
+void ClientHandler(void *arg) {
+  std::cout << "policy, hedge_pct, rps, failed, p50, p99, p999, "
+               "extra_load_pct, hedge_wins, hedge_skipped, cancelled, "
+               "wasted, hedge_delay_us"
+            << std::endl;
+  for (int policy : {CRPC_RSET_RANDOM, CRPC_RSET_CREDIT, CRPC_RSET_LATENCY}) {
+    RunOne(policy, 0);
+    RunOne(policy, 95);
+  }
+}
+
+int StringToAddr(const char *str, uint32_t *addr) {
+  uint8_t a, b, c, d;
+
+  if (sscanf(str, "%hhu.%hhu.%hhu.%hhu", &a, &b, &c, &d) != 4) return -EINVAL;
+
+  *addr = MAKE_IP_ADDR(a, b, c, d);
+  return 0;
+}
+
+int ParseAddrs(const std::string &spec) {
+  std::stringstream ss(spec);
+  std::string tok;
+
+  while (std::getline(ss, tok, ',')) {
+    netaddr addr;
+    if (StringToAddr(tok.c_str(), &addr.ip)) return -EINVAL;
+    addr.port = SRPC_PORT;
+    raddrs.push_back(addr);
+  }
+  if (raddrs.empty() || raddrs.size() > CRPC_RSET_MAX_REPLICAS)
+    return -EINVAL;
+  return 0;
+}
+
+void Usage() {
+  std::cerr << "usage: [cfg_file] server [service_us] [stall_pct] "
+               "[stall_us]\n"
+            << "       [cfg_file] client [ip,ip,...] [threads] [seconds]"
+            << std::endl;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  int ret;
+
+  if (argc < 3) {
+    Usage();
+    return -EINVAL;
+  }
+
+  crpc_ops = &cbw_ops;
+  srpc_ops = &sbw_ops;
+
+  std::string cmd = argv[2];
+  if (cmd.compare("server") == 0) {
+    if (argc < 6) {
+      Usage();
+      return -EINVAL;
+    }
+    service_us = std::stoul(argv[3], nullptr, 0);
+    stall_pct = std::stod(argv[4], nullptr);
+    stall_us = std::stoul(argv[5], nullptr, 0);
+    ret = runtime_init(argv[1], ServerHandler, NULL);
+  } else if (cmd.compare("client") == 0) {
+    if (argc < 6 || ParseAddrs(argv[3])) {
+      Usage();
+      return -EINVAL;
+    }
+    threads = std::stoi(argv[4], nullptr, 0);
+    seconds = std::stoi(argv[5], nullptr, 0);
+    ret = runtime_init(argv[1], ClientHandler, NULL);
+  } else {
+    Usage();
+    return -EINVAL;
+  }
+
+  if (ret) {
+    printf("failed to start runtime\n");
+    return ret;
+  }
+  return 0;
+}
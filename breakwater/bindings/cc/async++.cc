@@ -0,0 +1,242 @@
+#include <breakwater/async++.h>
+
+#include <algorithm>
+
+namespace rpc {
+
+namespace {
+
+// No request id (cbw_recv_one_id() leaves the id alone on failure).
+constexpr uint64_t kNoId = ~0UL;
+
+}  // namespace
+
+RpcAsyncClient::RpcAsyncClient(crpc_session *s, size_t max_inflight)
+    : s_(s), max_inflight_(max_inflight), closing_(false), failed_(false),
+      nr_inflight_(0), completions_(0) {
+  cbw_session *bs = reinterpret_cast<cbw_session *>(s_);
+  bs->drop_arg = this;
+  bs->drop_fn = OnGiveUp;
+
+  receiver_ = rt::Thread([this] { ReceiveLoop(); });
+  sender_ = rt::Thread([this] { SendLoop(); });
+}
+
+RpcAsyncClient::~RpcAsyncClient() {
+  lock_.Lock();
+  closing_ = true;
+  send_cv_.Signal();
+  lock_.Unlock();
+
+  cbw_shutdown(s_, SHUT_RDWR);
+  receiver_.Join();
+  sender_.Join();
+  FailAll(-ECONNABORTED);
+  cbw_close(s_);
+}
+
+RpcAsyncClient *RpcAsyncClient::Dial(netaddr raddr, int id, bool udp,
+                                     size_t max_inflight) {
+  crpc_session *s;
+  raddr.port = SRPC_PORT;
+  int ret = udp ? cbw_udp_open(raddr, &s, id) : cbw_open(raddr, &s, id);
+  if (ret) return nullptr;
+  return new RpcAsyncClient(s, std::max<size_t>(max_inflight, 1));
+}
+
+size_t RpcAsyncClient::Limit() {
+  cbw_session *bs = reinterpret_cast<cbw_session *>(s_);
+  return std::min<size_t>(max_inflight_,
+                          rt::read_once(bs->win_avail) + CRPC_QLEN);
+}
+
+size_t RpcAsyncClient::InFlight() {
+  rt::ScopedLock<rt::Mutex> l(&lock_);
+  return nr_inflight_;
+}
+
+size_t RpcAsyncClient::Backlog() {
+  rt::ScopedLock<rt::Mutex> l(&lock_);
+  return backlog_.size();
+}
+
+Future<RpcResponse> RpcAsyncClient::Call(const void *req, size_t len,
+                                         uint64_t deadline) {
+  auto st = std::make_shared<State>();
+  Future<RpcResponse> f(st);
+
+  if (unlikely(len > SRPC_MAX_PAYLOAD)) {
+    st->Set(RpcResponse{-E2BIG, CRPC_OK, {}});
+    return f;
+  }
+
+  lock_.Lock();
+  if (unlikely(failed_)) {
+    lock_.Unlock();
+    st->Set(RpcResponse{-ECONNABORTED, CRPC_OK, {}});
+    return f;
+  }
+
+  // there's room and nothing queued ahead, send without copying
+  if (backlog_.empty() && nr_inflight_ < Limit()) {
+    nr_inflight_++;
+    lock_.Unlock();
+
+    // the session lock can't be taken while holding ours (see OnGiveUp)
+    uint64_t id = cbw_alloc_id(s_);
+    lock_.Lock();
+    if (unlikely(failed_)) {
+      lock_.Unlock();
+      st->Set(RpcResponse{-ECONNABORTED, CRPC_OK, {}});
+      return f;
+    }
+    inflight_[id] = st;
+    lock_.Unlock();
+
+    ssize_t ret = cbw_send_one_id(s_, req, len, id, deadline);
+    if (ret == -ETIMEDOUT)
+      Complete(id, RpcResponse{0, CRPC_EXPIRED, {}});
+    else if (unlikely(ret < 0))
+      Complete(id, RpcResponse{ret, CRPC_OK, {}});
+    return f;
+  }
+
+  const char *p = static_cast<const char *>(req);
+  backlog_.push_back(
+      PendingCall{kNoId, deadline, std::vector<char>(p, p + len), st});
+  send_cv_.Signal();
+  lock_.Unlock();
+  return f;
+}
+
+void RpcAsyncClient::Complete(uint64_t id, RpcResponse &&resp) {
+  std::shared_ptr<State> st;
+
+  lock_.Lock();
+  auto it = inflight_.find(id);
+  if (unlikely(it == inflight_.end())) {
+    lock_.Unlock();
+    return;
+  }
+  st = std::move(it->second);
+  inflight_.erase(it);
+  nr_inflight_--;
+  completions_++;
+  if (!backlog_.empty()) send_cv_.Signal();
+  lock_.Unlock();
+
+  st->Set(std::move(resp));
+}
+
+void RpcAsyncClient::OnGiveUp(void *arg, uint64_t id, int status) {
+  // called with the session lock held
+  static_cast<RpcAsyncClient *>(arg)->Complete(
+      id, RpcResponse{0, status, {}});
+}
+
+void RpcAsyncClient::FailAll(ssize_t ret) {
+  std::unordered_map<uint64_t, std::shared_ptr<State>> inflight;
+  std::deque<PendingCall> backlog;
+
+  lock_.Lock();
+  failed_ = true;
+  inflight.swap(inflight_);
+  backlog.swap(backlog_);
+  nr_inflight_ = 0;
+  send_cv_.Signal();
+  lock_.Unlock();
+
+  for (auto &e : inflight) e.second->Set(RpcResponse{ret, CRPC_OK, {}});
+  for (auto &c : backlog) c.st->Set(RpcResponse{ret, CRPC_OK, {}});
+}
+
+void RpcAsyncClient::ReceiveLoop() {
+  std::unique_ptr<char[]> buf(new char[SRPC_MAX_PAYLOAD]);
+
+  while (true) {
+    uint64_t id = kNoId;
+    int status;
+    ssize_t ret = cbw_recv_one_id(s_, buf.get(), SRPC_MAX_PAYLOAD, nullptr,
+                                  &status, &id);
+    // an empty response is valid, end of stream leaves the id unset
+    if (ret < 0 || id == kNoId) {
+      FailAll(ret < 0 && !rt::read_once(closing_) ? ret : -ECONNABORTED);
+      return;
+    }
+    Complete(id, RpcResponse{ret, status,
+                             std::vector<char>(buf.get(), buf.get() + ret)});
+  }
+}
+
+void RpcAsyncClient::SendLoop() {
+  std::vector<PendingCall> batch;
+  std::vector<cbw_req> reqs;
+  batch.reserve(kSendBatch);
+  reqs.reserve(kSendBatch);
+
+  while (true) {
+    lock_.Lock();
+    while (!closing_ &&
+           (failed_ || backlog_.empty() || nr_inflight_ >= Limit()))
+      send_cv_.Wait(&lock_);
+    if (closing_) {
+      lock_.Unlock();
+      return;
+    }
+
+    size_t n = std::min({backlog_.size(), Limit() - nr_inflight_, kSendBatch});
+    for (size_t i = 0; i < n; i++) {
+      batch.push_back(std::move(backlog_.front()));
+      backlog_.pop_front();
+    }
+    nr_inflight_ += n;
+    lock_.Unlock();
+
+    // ids are taken in send order, so datagram sessions see them in order
+    for (PendingCall &c : batch) c.id = cbw_alloc_id(s_);
+
+    lock_.Lock();
+    if (unlikely(failed_)) {
+      lock_.Unlock();
+      for (PendingCall &c : batch)
+        c.st->Set(RpcResponse{-ECONNABORTED, CRPC_OK, {}});
+      batch.clear();
+      continue;
+    }
+    for (PendingCall &c : batch) inflight_[c.id] = c.st;
+    uint64_t completions = completions_;
+    lock_.Unlock();
+
+    for (PendingCall &c : batch)
+      reqs.push_back(cbw_req{c.req.data(), c.req.size(), c.id, c.deadline});
+    int ret = cbw_send_many(s_, reqs.data(), reqs.size());
+    size_t taken = ret > 0 ? ret : 0;
+
+    if (taken < batch.size()) {
+      std::shared_ptr<State> too_big;
+
+      lock_.Lock();
+      for (size_t i = batch.size(); i-- > taken;) {
+        // FailAll() may have taken (and failed) the call already
+        if (failed_ || !inflight_.erase(batch[i].id)) continue;
+        nr_inflight_--;
+        if (i == taken && ret == -E2BIG)
+          too_big = std::move(batch[i].st);
+        else
+          backlog_.push_front(std::move(batch[i]));
+      }
+      // the session's queue is full, wait for a response to make room
+      while (taken == 0 && !too_big && !closing_ && !failed_ &&
+             completions_ == completions)
+        send_cv_.Wait(&lock_);
+      lock_.Unlock();
+
+      if (too_big) too_big->Set(RpcResponse{-E2BIG, CRPC_OK, {}});
+    }
+
+    batch.clear();
+    reqs.clear();
+  }
+}
+
+}  // namespace rpc
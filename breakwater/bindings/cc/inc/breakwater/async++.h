@@ -0,0 +1,173 @@
+// async++.h - asynchronous Breakwater RPCs with futures
+
+#pragma once
+
+extern "C" {
+#include <base/stddef.h>
+#include <breakwater/breakwater.h>
+}
+
+#include "cc/sync.h"
+#include "cc/thread.h"
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace rpc {
+
+namespace detail {
+
+// The state shared by a Future and the thread that completes it.
+template <typename T>
+class FutureState {
+ public:
+  FutureState() : ready_(false) {}
+
+  // Stores the value and wakes the waiter, if any.
+  void Set(T &&val) {
+    rt::ScopedLock<rt::Spin> l(&lock_);
+    val_ = std::move(val);
+    ready_ = true;
+    waker_.Wake();
+  }
+
+  bool Ready() {
+    rt::ScopedLock<rt::Spin> l(&lock_);
+    return ready_;
+  }
+
+  // Blocks until the value is set.
+  T &Wait() {
+    lock_.Lock();
+    while (!ready_) {
+      waker_.Arm();
+      lock_.UnlockAndPark();
+      lock_.Lock();
+    }
+    lock_.Unlock();
+    return val_;
+  }
+
+ private:
+  rt::Spin lock_;
+  rt::ThreadWaker waker_;
+  bool ready_;
+  T val_;
+};
+
+}  // namespace detail
+
+// A value that becomes available later. Only one thread may wait on it.
+template <typename T>
+class Future {
+ public:
+  Future() {}
+  explicit Future(std::shared_ptr<detail::FutureState<T>> st)
+      : st_(std::move(st)) {}
+
+  // Returns true if the future refers to a value (i.e. isn't default built).
+  bool Valid() const { return st_ != nullptr; }
+
+  // Returns true if the value is available, so Get() won't block.
+  bool Ready() const { return st_->Ready(); }
+
+  // Blocks until the value is available, then returns it.
+  T &Get() { return st_->Wait(); }
+
+ private:
+  std::shared_ptr<detail::FutureState<T>> st_;
+};
+
+// The outcome of an asynchronous RPC.
+struct RpcResponse {
+  // The response length, or < 0 if the session failed before a response.
+  ssize_t ret;
+  // CRPC_OK, CRPC_DROPPED or CRPC_EXPIRED.
+  int status;
+  // The response payload.
+  std::vector<char> buf;
+};
+
+// A Breakwater client session that lets one thread keep many RPCs in flight.
+// Calls are matched to responses by request id, so they may complete in any
+// order. At most the session's credit (plus what its request queue holds)
+// is handed to Breakwater; further calls wait in a backlog and are sent in
+// batches as responses free up room.
+class RpcAsyncClient {
+ public:
+  // Disable move and copy.
+  RpcAsyncClient(const RpcAsyncClient&) = delete;
+  RpcAsyncClient& operator=(const RpcAsyncClient&) = delete;
+
+  // Closes the session. Calls still in flight complete with -ECONNABORTED.
+  ~RpcAsyncClient();
+
+  // Creates a session (over UDP if @udp). @max_inflight caps the calls
+  // handed to Breakwater at once. Returns nullptr on failure.
+  static RpcAsyncClient *Dial(netaddr raddr, int id, bool udp = false,
+                              size_t max_inflight = kDefaultMaxInflight);
+
+  // Starts an RPC. @req is copied if the call has to wait in the backlog.
+  // Never blocks; safe to call from many threads.
+  Future<RpcResponse> Call(const void *req, size_t len,
+                           uint64_t deadline = 0);
+
+  // The calls handed to Breakwater but not yet answered.
+  size_t InFlight();
+
+  // The calls waiting in the backlog.
+  size_t Backlog();
+
+  // The underlying session (e.g. for its stats).
+  crpc_session *Session() { return s_; }
+
+  static constexpr size_t kDefaultMaxInflight = 1024;
+  // The most backlogged calls handed to Breakwater at once.
+  static constexpr size_t kSendBatch = 64;
+
+ private:
+  using State = detail::FutureState<RpcResponse>;
+
+  struct PendingCall {
+    uint64_t id;
+    uint64_t deadline;
+    std::vector<char> req;
+    std::shared_ptr<State> st;
+  };
+
+  RpcAsyncClient(crpc_session *s, size_t max_inflight);
+
+  // The most calls that may be in flight right now.
+  size_t Limit();
+  // Completes a call that was handed to Breakwater.
+  void Complete(uint64_t id, RpcResponse &&resp);
+  // Fails every call, in flight or not.
+  void FailAll(ssize_t ret);
+  // Reads responses until the session fails.
+  void ReceiveLoop();
+  // Hands backlogged calls to Breakwater in batches.
+  void SendLoop();
+  // Called by Breakwater for calls given up without a response.
+  static void OnGiveUp(void *arg, uint64_t id, int status);
+
+  crpc_session *s_;
+  const size_t max_inflight_;
+
+  rt::Mutex lock_;
+  rt::CondVar send_cv_;
+  bool closing_;
+  bool failed_;
+  // calls handed (or being handed) to Breakwater
+  size_t nr_inflight_;
+  // bumped by every completion, so the sender can wait for room
+  uint64_t completions_;
+  std::unordered_map<uint64_t, std::shared_ptr<State>> inflight_;
+  std::deque<PendingCall> backlog_;
+
+  rt::Thread receiver_;
+  rt::Thread sender_;
+};
+
+}  // namespace rpc
@@ -5,16 +5,19 @@
 extern "C" {
 #include <base/stddef.h>
 #include <breakwater/rpc.h>
+#include <breakwater/replica.h>
 }
 
 #include <functional>
+#include <vector>
 
 namespace rpc {
 
 class RpcClient {
  public:
-  // The maximum size of an RPC request payload.
-  static constexpr size_t kMaxPayloadSize = SRPC_BUF_SIZE;
+  // The maximum size of an RPC request payload (DAGOR and SEDA clients are
+  // limited to SRPC_BUF_SIZE).
+  static constexpr size_t kMaxPayloadSize = SRPC_MAX_PAYLOAD;
 
   // Disable move and copy.
   RpcClient(const RpcClient&) = delete;
@@ -29,6 +32,35 @@ class RpcClient {
   // Receives an RPC request.
   ssize_t Recv(void *buf, size_t len, uint64_t *latency);
 
+  // Sends an RPC request that is useless after @deadline (in microtime()).
+  // Falls back to Send() if the algorithm has no deadlines.
+  ssize_t SendWithDeadline(const void *buf, size_t len, int hash,
+                           uint64_t deadline);
+
+  // Receives an RPC response and its outcome (CRPC_OK, CRPC_DROPPED or
+  // CRPC_EXPIRED).
+  ssize_t RecvWithStatus(void *buf, size_t len, uint64_t *latency,
+                         int *status);
+
+  // Reserves a request id for SendWithId(), or returns 0 if the algorithm
+  // doesn't track requests by id (only Breakwater does).
+  uint64_t AllocId();
+
+  // Sends an RPC request with an id from AllocId(). Breakwater responses to
+  // dropped requests carry no payload, so their id is the only way to tell
+  // which request was dropped.
+  ssize_t SendWithId(const void *buf, size_t len, uint64_t id,
+                     uint64_t deadline);
+
+  // Like RecvWithStatus(), also reporting the request id (left alone if the
+  // algorithm has no request ids).
+  ssize_t RecvWithId(void *buf, size_t len, uint64_t *latency, int *status,
+                     uint64_t *id);
+
+  // Selects the request class of all requests sent on this session.
+  // Returns -ENOTSUP if the algorithm has no request classes.
+  int SetClass(int cls);
+
   uint32_t WinAvail();
 
   void StatClear();
@@ -45,6 +77,8 @@ class RpcClient {
 
   uint64_t StatReqDropped();
 
+  uint64_t StatReqExpired();
+
   // Shuts down the RPC connection.
   int Shutdown(int how);
   // Aborts the RPC connection.
@@ -59,6 +93,40 @@ class RpcClient {
   struct crpc_session *s_;
 };
 
+// A set of Breakwater sessions to replicas of the same service, with replica
+// selection and optional hedging (see breakwater/replica.h).
+class RpcReplicaSet {
+ public:
+  // Disable move and copy.
+  RpcReplicaSet(const RpcReplicaSet&) = delete;
+  RpcReplicaSet& operator=(const RpcReplicaSet&) = delete;
+
+  ~RpcReplicaSet() { crpc_rset_close(rs_); }
+
+  // Connects to every replica. Returns nullptr on failure.
+  static RpcReplicaSet *Dial(const std::vector<netaddr> &raddrs,
+                             const crpc_rset_cfg &cfg);
+
+  // Makes an RPC, returning the response length and its outcome (CRPC_OK,
+  // CRPC_DROPPED or CRPC_EXPIRED). Safe to call from many threads.
+  ssize_t Call(const void *req, size_t req_len, void *resp, size_t resp_len,
+               int *status, uint64_t deadline = 0) {
+    return crpc_rset_call(rs_, req, req_len, resp, resp_len, deadline,
+                          status);
+  }
+
+  crpc_rset_stats Stats() {
+    crpc_rset_stats st;
+    crpc_rset_stat(rs_, &st);
+    return st;
+  }
+
+ private:
+  RpcReplicaSet(crpc_rset *rs) : rs_(rs) { }
+
+  crpc_rset *rs_;
+};
+
 // Enables the RPC server, listening for new sessions.
 // Can only be called once.
 int RpcServerEnable(std::function<void(struct srpc_ctx *)> f);
@@ -69,4 +137,18 @@ uint64_t RpcServerStatWinTx();
 uint64_t RpcServerStatReqRx();
 uint64_t RpcServerStatReqDropped();
 uint64_t RpcServerStatRespTx();
+uint64_t RpcServerStatReqExpired();
+
+// Configures how a request class shares the server's credits (see
+// srpc_ops::srpc_set_class). Returns -ENOTSUP if the algorithm has no
+// request classes.
+int RpcServerSetClass(int cls, unsigned int weight, bool strict,
+                      uint64_t drop_thresh_us = 0);
+uint64_t RpcServerStatClassReqRx(int cls);
+uint64_t RpcServerStatClassReqDropped(int cls);
+uint64_t RpcServerStatClassRespTx(int cls);
+
+// Reports the server's current (possibly self-tuned) control parameters.
+// Returns false if the algorithm doesn't expose them.
+bool RpcServerStatParams(struct srpc_params *p);
 } // namespace rpc
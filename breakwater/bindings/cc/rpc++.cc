@@ -1,3 +1,7 @@
+extern "C" {
+#include <breakwater/breakwater.h>
+}
+
 #include <breakwater/rpc++.h>
 
 namespace rpc {
@@ -10,6 +14,9 @@ void RpcServerTrampoline(struct srpc_ctx *arg) {
   handler(arg);
 }
 
+// Only Breakwater clients track requests by id.
+bool HasIds() { return crpc_ops == &cbw_ops || crpc_ops == &cbw_udp_ops; }
+
 } // namespace
 
 RpcClient *RpcClient::Dial(netaddr raddr, int id) {
@@ -29,6 +36,44 @@ ssize_t RpcClient::Recv(void *buf, size_t len,
   return crpc_ops->crpc_recv_one(s_, buf, len, latency);
 }
 
+int RpcClient::SetClass(int cls) {
+  if (!crpc_ops->crpc_set_class) return -ENOTSUP;
+  return crpc_ops->crpc_set_class(s_, cls);
+}
+
+ssize_t RpcClient::SendWithDeadline(const void *buf, size_t len, int hash,
+                                    uint64_t deadline) {
+  if (!crpc_ops->crpc_send_one_deadline)
+    return crpc_ops->crpc_send_one(s_, buf, len, hash);
+  return crpc_ops->crpc_send_one_deadline(s_, buf, len, hash, deadline);
+}
+
+ssize_t RpcClient::RecvWithStatus(void *buf, size_t len, uint64_t *latency,
+                                  int *status) {
+  if (!crpc_ops->crpc_recv_one_status) {
+    *status = CRPC_OK;
+    return crpc_ops->crpc_recv_one(s_, buf, len, latency);
+  }
+  return crpc_ops->crpc_recv_one_status(s_, buf, len, latency, status);
+}
+
+uint64_t RpcClient::AllocId() {
+  if (!HasIds()) return 0;
+  return cbw_alloc_id(s_);
+}
+
+ssize_t RpcClient::SendWithId(const void *buf, size_t len, uint64_t id,
+                              uint64_t deadline) {
+  if (!HasIds()) return -ENOTSUP;
+  return cbw_send_one_id(s_, buf, len, id, deadline);
+}
+
+ssize_t RpcClient::RecvWithId(void *buf, size_t len, uint64_t *latency,
+                              int *status, uint64_t *id) {
+  if (!HasIds()) return RecvWithStatus(buf, len, latency, status);
+  return cbw_recv_one_id(s_, buf, len, latency, status, id);
+}
+
 uint32_t RpcClient::WinAvail() {
   return crpc_ops->crpc_win_avail(s_);
 }
@@ -61,11 +106,22 @@ uint64_t RpcClient::StatReqDropped() {
   return crpc_ops->crpc_stat_req_dropped(s_);
 }
 
+uint64_t RpcClient::StatReqExpired() {
+  if (!crpc_ops->crpc_stat_req_expired) return 0;
+  return crpc_ops->crpc_stat_req_expired(s_);
+}
+
 int RpcClient::Shutdown(int how) {
+  if (crpc_ops->crpc_shutdown) return crpc_ops->crpc_shutdown(s_, how);
   return tcp_shutdown(s_->c, how);
 }
 
 void RpcClient::Abort() {
+  // datagram sessions have no connection to reset
+  if (!s_->c) {
+    Shutdown(SHUT_RDWR);
+    return;
+  }
   tcp_abort(s_->c);
 }
 
@@ -73,6 +129,16 @@ void RpcClient::Close() {
   crpc_ops->crpc_close(s_);
 }
 
+RpcReplicaSet *RpcReplicaSet::Dial(const std::vector<netaddr> &raddrs,
+                                   const crpc_rset_cfg &cfg) {
+  std::vector<netaddr> addrs(raddrs);
+  for (netaddr &a : addrs) a.port = SRPC_PORT;
+  crpc_rset *rs;
+  int ret = crpc_rset_open(addrs.data(), addrs.size(), &cfg, &rs);
+  if (ret) return nullptr;
+  return new RpcReplicaSet(rs);
+}
+
 int RpcServerEnable(std::function<void(struct srpc_ctx *)> f) {
   handler = f;
   int ret = srpc_ops->srpc_enable(RpcServerTrampoline);
@@ -104,4 +170,36 @@ uint64_t RpcServerStatRespTx() {
   return srpc_ops->srpc_stat_resp_tx();
 }
 
+uint64_t RpcServerStatReqExpired() {
+  if (!srpc_ops->srpc_stat_req_expired) return 0;
+  return srpc_ops->srpc_stat_req_expired();
+}
+
+int RpcServerSetClass(int cls, unsigned int weight, bool strict,
+                      uint64_t drop_thresh_us) {
+  if (!srpc_ops->srpc_set_class) return -ENOTSUP;
+  return srpc_ops->srpc_set_class(cls, weight, strict, drop_thresh_us);
+}
+
+uint64_t RpcServerStatClassReqRx(int cls) {
+  if (!srpc_ops->srpc_stat_class_req_rx) return 0;
+  return srpc_ops->srpc_stat_class_req_rx(cls);
+}
+
+uint64_t RpcServerStatClassReqDropped(int cls) {
+  if (!srpc_ops->srpc_stat_class_req_dropped) return 0;
+  return srpc_ops->srpc_stat_class_req_dropped(cls);
+}
+
+uint64_t RpcServerStatClassRespTx(int cls) {
+  if (!srpc_ops->srpc_stat_class_resp_tx) return 0;
+  return srpc_ops->srpc_stat_class_resp_tx(cls);
+}
+
+bool RpcServerStatParams(struct srpc_params *p) {
+  if (!srpc_ops->srpc_stat_params) return false;
+  srpc_ops->srpc_stat_params(p);
+  return true;
+}
+
 } // namespace rpc
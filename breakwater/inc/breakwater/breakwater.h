@@ -15,12 +15,21 @@
 struct sbw_ctx {
 	struct srpc_ctx		cmn;
 	uint64_t		ts_sent;
+	/* server microtime() by which the request must finish (0 = none) */
+	uint64_t		deadline;
 	bool			drop;
+	bool			expired;
+	/* in a dispatch queue (batched dispatch only) */
+	struct list_node	dispatch_link;
 };
 
 /* for RPC client */
+struct cbw_udp;
+
 struct cbw_session {
 	struct crpc_session	cmn;
+	/* the datagram transport state, or NULL for TCP sessions */
+	struct cbw_udp		*udp;
 	uint64_t		id;
 	uint64_t		req_id;
 	mutex_t			lock;
@@ -30,9 +39,14 @@ struct cbw_session {
 	uint32_t		win_used;
 	bool			running;
 	bool			demand_sync;
+	uint8_t			cls;
 	condvar_t		timer_cv;
 	bool			init;
 
+	/* called under @lock for each request given up without a response */
+	void			(*drop_fn)(void *arg, uint64_t id, int status);
+	void			*drop_arg;
+
 	/* a queue of pending RPC requests */
 	uint32_t		head;
 	uint32_t		tail;
@@ -45,4 +59,29 @@ struct cbw_session {
 	uint64_t		req_tx_;
 	uint64_t		win_expired_;
 	uint64_t		req_dropped_;
+	uint64_t		req_expired_;
+	uint64_t		req_retx_;
+};
+
+/* a request for cbw_send_many() */
+struct cbw_req {
+	const void		*buf;
+	size_t			len;
+	uint64_t		id;
+	uint64_t		deadline;
 };
+
+/* lower-level client API, for tracking individual requests (see replica.h) */
+extern uint64_t cbw_alloc_id(struct crpc_session *s_);
+extern ssize_t cbw_send_one_id(struct crpc_session *s_, const void *buf,
+			       size_t len, uint64_t id, uint64_t deadline);
+extern ssize_t cbw_recv_one_id(struct crpc_session *s_, void *buf, size_t len,
+			       uint64_t *latency, int *status, uint64_t *id);
+extern int cbw_send_many(struct crpc_session *s_, const struct cbw_req *reqs,
+			 int nr);
+extern bool cbw_cancel(struct crpc_session *s_, uint64_t id);
+extern int cbw_open(struct netaddr raddr, struct crpc_session **sout, int id);
+extern int cbw_udp_open(struct netaddr raddr, struct crpc_session **sout,
+			int id);
+extern int cbw_shutdown(struct crpc_session *s_, int how);
+extern void cbw_close(struct crpc_session *s_);
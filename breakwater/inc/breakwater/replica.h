@@ -0,0 +1,102 @@
+/*
+ * replica.h - spreading Breakwater RPCs across server replicas
+ *
+ * A replica set holds one Breakwater session per server and sends each call
+ * to the replica with the most unused credit (or the lowest recent latency).
+ * Optionally, a call that hasn't been answered after a percentile of recent
+ * latencies is hedged: sent again to a second replica that has credit to
+ * spare. The first response wins; the loser is withdrawn if it is still
+ * waiting for credit, or its response is discarded.
+ */
+
+#pragma once
+
+#include <base/types.h>
+#include <breakwater/rpc.h>
+
+#define CRPC_RSET_MAX_REPLICAS	16
+
+/* how a replica set picks the replica for a call */
+enum {
+	CRPC_RSET_RANDOM = 0,	/* uniformly at random */
+	CRPC_RSET_CREDIT,	/* the most unused credit, then lowest latency */
+	CRPC_RSET_LATENCY,	/* the lowest recent latency */
+};
+
+struct crpc_rset_cfg {
+	int		policy;		/* a CRPC_RSET_* policy */
+	double		hedge_pct;	/* hedge after this latency percentile
+					   (e.g. 95, 0 = never hedge) */
+	uint64_t	hedge_min_us;	/* never hedge sooner than this */
+	double		hedge_budget;	/* hedges allowed, in percent of calls */
+	bool		udp;		/* use the UDP transport */
+};
+
+struct crpc_rset_stats {
+	uint64_t	calls;		/* calls made */
+	uint64_t	sends;		/* requests sent, including hedges */
+	uint64_t	hedges;		/* hedged requests sent */
+	uint64_t	hedge_wins;	/* calls answered by the hedge */
+	uint64_t	hedge_skipped;	/* hedges due but over budget or with
+					   no replica to spare */
+	uint64_t	cancelled;	/* losers withdrawn before being sent */
+	uint64_t	wasted;		/* loser responses discarded */
+	uint64_t	hedge_delay_us;	/* the current hedge delay (0 = none) */
+};
+
+struct crpc_rset;
+
+/**
+ * crpc_rset_open - connects to a set of replicas
+ * @raddrs: the replicas' addresses (ports must be SRPC_PORT)
+ * @nr: the number of replicas (up to CRPC_RSET_MAX_REPLICAS)
+ * @cfg: the replica selection and hedging configuration
+ * @rsout: the replica set that was created
+ *
+ * WARNING: This function could block.
+ *
+ * Returns 0 if successful.
+ */
+extern int crpc_rset_open(const struct netaddr *raddrs, int nr,
+			  const struct crpc_rset_cfg *cfg,
+			  struct crpc_rset **rsout);
+
+/**
+ * crpc_rset_call - makes an RPC on one (or, if hedged, two) replicas
+ * @rs: the replica set
+ * @req: the request payload
+ * @req_len: the length of @req
+ * @resp: a buffer for the response payload
+ * @resp_len: the length of @resp
+ * @deadline: the microtime() by which the response is needed (0 = none)
+ * @status: set to CRPC_OK, CRPC_DROPPED or CRPC_EXPIRED
+ *
+ * Many threads may call concurrently. WARNING: This function blocks.
+ *
+ * Returns the length of the response, or standard socket errors (< 0).
+ */
+extern ssize_t crpc_rset_call(struct crpc_rset *rs, const void *req,
+			      size_t req_len, void *resp, size_t resp_len,
+			      uint64_t deadline, int *status);
+
+/**
+ * crpc_rset_stat - reports the replica set's counters
+ * @rs: the replica set
+ * @st: filled with the counters since crpc_rset_open()
+ */
+extern void crpc_rset_stat(struct crpc_rset *rs, struct crpc_rset_stats *st);
+
+/**
+ * crpc_rset_replica - gets the session of one replica (e.g. for its stats)
+ * @rs: the replica set
+ * @idx: the replica's index in the addresses passed to crpc_rset_open()
+ */
+extern struct crpc_session *crpc_rset_replica(struct crpc_rset *rs, int idx);
+
+/**
+ * crpc_rset_close - closes all sessions of a replica set
+ * @rs: the replica set, with no calls in progress
+ *
+ * WARNING: This function could block.
+ */
+extern void crpc_rset_close(struct crpc_rset *rs);
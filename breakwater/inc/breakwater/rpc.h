@@ -11,27 +11,94 @@
  * Stats data structures
  */
 
+/* the control parameters currently in use by a server */
+struct srpc_params {
+	double		est_service_us;	/* estimated mean service time */
+	double		est_rtt_us;	/* estimated network round trip time */
+	uint64_t	min_delay_us;	/* queueing delay target */
+	uint64_t	drop_thresh_us;	/* AQM drop threshold */
+	uint64_t	rtt_us;		/* control period */
+	double		ai;		/* additive increase (per session) */
+	double		md;		/* multiplicative decrease */
+};
+
 /*
  * Server API
  */
 
 #define SRPC_PORT	8123
+/* the payload size that fits in a client's request queue entry */
 #define SRPC_BUF_SIZE	4096
+/* the request payload size that fits in a server context without allocating
+   (responses up to SRPC_BUF_SIZE always fit) */
+#define SRPC_INLINE_SIZE	256
+/* the largest request or response payload */
+#define SRPC_MAX_PAYLOAD	(1024 * 1024)
+/* the number of request classes (class 0 is the default) */
+#define SRPC_NR_CLASSES	4
 
 struct srpc_session {
 	tcpconn_t		*c;
 };
 
+/* where a payload buffer lives */
+enum {
+	SRPC_BUF_INLINE = 0,	/* in the context itself */
+	SRPC_BUF_POOL,		/* a pooled (smalloc) buffer */
+	SRPC_BUF_HEAP,		/* a heap buffer, too large for the pools */
+	SRPC_BUF_USER,		/* owned by the handler (zero-copy) */
+};
+
+/*
+ * A server-side RPC context. @req_buf holds @req_len bytes of request.
+ * Handlers may write up to SRPC_BUF_SIZE bytes of response into @resp_buf
+ * directly; larger responses need srpc_resp_alloc() or srpc_resp_set_zc().
+ */
 struct srpc_ctx {
 	struct srpc_session	*s;
 	int			idx;
 	uint64_t		id;
 	size_t			req_len;
 	size_t			resp_len;
-	char			req_buf[SRPC_BUF_SIZE];
-	char			resp_buf[SRPC_BUF_SIZE];
+	char			*req_buf;
+	char			*resp_buf;
+
+	/* private to the RPC layer */
+	uint8_t			req_buf_type;
+	uint8_t			resp_buf_type;
+	void			(*resp_release)(void *arg);
+	void			*resp_release_arg;
+	char			req_inline[SRPC_INLINE_SIZE];
+	char			resp_inline[SRPC_BUF_SIZE];
 };
 
+/**
+ * srpc_resp_alloc - gets a response buffer of at least @len bytes
+ * @ctx: the RPC context
+ * @len: the size of the response (up to SRPC_MAX_PAYLOAD)
+ *
+ * The buffer is the inline one if @len fits, otherwise a pooled buffer that is
+ * freed once the response has been sent. Also sets @ctx->resp_buf; the
+ * handler still sets @ctx->resp_len.
+ *
+ * Returns the buffer, or NULL if @len is too large or out of memory.
+ */
+extern void *srpc_resp_alloc(struct srpc_ctx *ctx, size_t len);
+
+/**
+ * srpc_resp_set_zc - responds with a handler-owned buffer without copying
+ * @ctx: the RPC context
+ * @buf: the response payload, must stay valid until @release is called
+ * @len: the length of @buf (up to SRPC_MAX_PAYLOAD)
+ * @release: called with @arg once @buf has been sent (may be NULL)
+ * @arg: the argument for @release
+ *
+ * The payload is handed to tcp_writev() straight from @buf.
+ */
+extern void srpc_resp_set_zc(struct srpc_ctx *ctx, const void *buf,
+			     size_t len, void (*release)(void *arg),
+			     void *arg);
+
 typedef void (*srpc_fn_t)(struct srpc_ctx *ctx);
 
 struct srpc_ops {
@@ -49,6 +116,34 @@ struct srpc_ops {
 	uint64_t (*srpc_stat_req_rx)();
 	uint64_t (*srpc_stat_req_dropped)();
 	uint64_t (*srpc_stat_resp_tx)();
+	uint64_t (*srpc_stat_req_expired)();
+
+	/**
+	 * srpc_set_class - configures how a request class shares the window
+	 * @cls: the class (< SRPC_NR_CLASSES)
+	 * @weight: the class's share of the window relative to other classes
+	 * @strict: if true, the class is served before all weighted classes
+	 *          (strict classes are ordered by class number)
+	 * @drop_thresh_us: the queueing delay at which requests of this class
+	 *                  are dropped (0 selects the default)
+	 *
+	 * Optional, may be NULL if the implementation has no request classes.
+	 *
+	 * Returns 0 if successful, -EINVAL if the class is out of range.
+	 */
+	int (*srpc_set_class)(int cls, unsigned int weight, bool strict,
+			      uint64_t drop_thresh_us);
+	uint64_t (*srpc_stat_class_req_rx)(int cls);
+	uint64_t (*srpc_stat_class_req_dropped)(int cls);
+	uint64_t (*srpc_stat_class_resp_tx)(int cls);
+
+	/**
+	 * srpc_stat_params - reports the control parameters in use
+	 * @p: filled with the current estimates and parameters
+	 *
+	 * Optional, may be NULL if the implementation has no such parameters.
+	 */
+	void (*srpc_stat_params)(struct srpc_params *p);
 };
 
 /*
@@ -65,16 +160,28 @@ struct crpc_ctx {
 	size_t			len;
 	uint64_t		id;
 	uint64_t		ts;
+	uint64_t		deadline;
+	/* holds payloads larger than @buf, or NULL */
+	char			*ext;
+	uint8_t			ext_type;
 	char			buf[SRPC_BUF_SIZE];
 };
 
+/* the outcome of an RPC (see crpc_recv_one_status) */
+enum {
+	CRPC_OK = 0,
+	CRPC_DROPPED,	/* rejected by overload control */
+	CRPC_EXPIRED,	/* dropped because it couldn't meet its deadline */
+};
+
 struct crpc_ops {
 	/**
 	 * crpc_send_one - sends one RPC request
 	 * @s: the RPC session to send to
 	 * @ident: the unique identifier associated with the request
 	 * @buf: the payload buffer to send
-	 * @len: the length of @buf (up to SRPC_BUF_SIZE)
+	 * @len: the length of @buf (up to SRPC_MAX_PAYLOAD, or SRPC_BUF_SIZE
+	 *       if the implementation doesn't support large payloads)
 	 *
 	 * WARNING: This function could block.
 	 *
@@ -88,7 +195,7 @@ struct crpc_ops {
 	 * crpc_recv_one - receive one RPC request
 	 * @s: the RPC session to receive from
 	 * @buf: a buffer to store the received payload
-	 * @len: the length of @buf (up to SRPC_BUF_SIZE)
+	 * @len: the length of @buf
 	 *
 	 * WARNING: This function could block.
 	 *
@@ -98,6 +205,36 @@ struct crpc_ops {
 	ssize_t (*crpc_recv_one)(struct crpc_session *s,
 				 void *buf, size_t len, uint64_t *latency);
 
+	/**
+	 * crpc_send_one_deadline - sends one RPC request with a deadline
+	 * @s: the RPC session to send to
+	 * @buf: the payload buffer to send
+	 * @len: the length of @buf (up to SRPC_MAX_PAYLOAD)
+	 * @hash: the request hash
+	 * @deadline: the microtime() by which the caller needs the response
+	 *
+	 * The server drops the request instead of running it if it can't finish
+	 * in time. Optional, may be NULL if the implementation has no deadlines.
+	 *
+	 * Returns the length sent, -ETIMEDOUT if @deadline has already passed,
+	 * or the same errors as crpc_send_one.
+	 */
+	ssize_t (*crpc_send_one_deadline)(struct crpc_session *s,
+					  const void *buf, size_t len,
+					  int hash, uint64_t deadline);
+
+	/**
+	 * crpc_recv_one_status - like crpc_recv_one, also reporting the outcome
+	 * @status: set to CRPC_OK, CRPC_DROPPED or CRPC_EXPIRED
+	 *
+	 * Breakwater responses to dropped requests carry no payload.
+	 *
+	 * Optional, may be NULL.
+	 */
+	ssize_t (*crpc_recv_one_status)(struct crpc_session *s,
+					void *buf, size_t len,
+					uint64_t *latency, int *status);
+
 	/**
 	 * crpc_open - creates an RPC session
 	 * @raddr: the remote address to connect to (port must be SRPC_PORT)
@@ -118,6 +255,28 @@ struct crpc_ops {
 	 */
 	void (*crpc_close)(struct crpc_session *s);
 
+	/**
+	 * crpc_shutdown - disables further sends and receives on a session
+	 * @s: the RPC session
+	 * @how: SHUT_RD, SHUT_WR, or SHUT_RDWR
+	 *
+	 * Optional, the TCP connection is shut down directly if NULL.
+	 */
+	int (*crpc_shutdown)(struct crpc_session *s, int how);
+
+	/**
+	 * crpc_set_class - selects the request class of an RPC session
+	 * @s: the RPC session
+	 * @cls: the class (< SRPC_NR_CLASSES)
+	 *
+	 * All requests on the session are sent in @cls and consume that class's
+	 * credits; open one session per class to mix classes. Optional, may be
+	 * NULL if the implementation has no request classes.
+	 *
+	 * Returns 0 if successful, -EINVAL if the class is out of range.
+	 */
+	int (*crpc_set_class)(struct crpc_session *s, int cls);
+
 	uint32_t (*crpc_win_avail)(struct crpc_session *s);
 	void (*crpc_stat_clear)(struct crpc_session *s);
 	uint64_t (*crpc_stat_winu_rx)(struct crpc_session *s);
@@ -126,6 +285,7 @@ struct crpc_ops {
 	uint64_t (*crpc_stat_resp_rx)(struct crpc_session *s);
 	uint64_t (*crpc_stat_req_tx)(struct crpc_session *s);
 	uint64_t (*crpc_stat_req_dropped)(struct crpc_session *s);
+	uint64_t (*crpc_stat_req_expired)(struct crpc_session *s);
 };
 
 /*
@@ -136,6 +296,11 @@ extern const struct srpc_ops *srpc_ops;
 extern const struct crpc_ops *crpc_ops;
 extern struct srpc_ops sbw_ops;
 extern struct crpc_ops cbw_ops;
+/* Breakwater over UDP */
+extern struct srpc_ops sbw_udp_ops;
+extern struct crpc_ops cbw_udp_ops;
+/* Breakwater with batched dispatch to long-lived workers (use cbw_ops) */
+extern struct srpc_ops sbw_batch_ops;
 extern struct srpc_ops ssd_ops;
 extern struct crpc_ops csd_ops;
 extern struct srpc_ops sdg_ops;
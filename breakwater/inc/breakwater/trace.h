@@ -0,0 +1,76 @@
+/*
+ * trace.h - control-loop telemetry for the RPC servers
+ *
+ * When enabled, the servers record their control decisions (window changes,
+ * drops, drained-session wakeups and queueing-delay samples) into per-core
+ * rings. Recording is off by default and costs a single branch while off.
+ *
+ * The rings can be read with srpc_trace_read(), queried over the runtime's
+ * stat server ("bwtrace on|off|dump [n]" on port 40), or dumped as CSV to
+ * SRPC_TRACE_PATH by sending the process SIGHUP.
+ */
+
+#pragma once
+
+#include <base/types.h>
+
+/* event types */
+enum {
+	SRPC_EV_CC = 0,		/* a control period: @delay_us is the queueing
+				   delay sample, @win the new window (or the
+				   admission threshold for DAGOR) */
+	SRPC_EV_SESS_WIN,	/* a session's window changed to @win, with
+				   @used credits outstanding */
+	SRPC_EV_DROP,		/* a request was dropped after queueing for
+				   @delay_us (0 = no free slot) */
+	SRPC_EV_EXPIRE,		/* a request missed its deadline before it ran */
+	SRPC_EV_WAKE,		/* a drained session was given credit again */
+	SRPC_EV_NR,
+};
+
+struct srpc_event {
+	uint64_t	ts;		/* microtime() of the event */
+	uint8_t		type;		/* an SRPC_EV_* type */
+	uint8_t		cls;		/* the request class, if any */
+	uint16_t	core;		/* the core that recorded the event */
+	uint32_t	sess;		/* the session id (0 = none) */
+	int32_t		win;		/* a window or threshold */
+	int32_t		used;		/* credits in use */
+	uint64_t	delay_us;	/* a queueing delay */
+};
+
+/**
+ * srpc_trace_enable - starts or stops recording events
+ * @on: true to record
+ *
+ * Returns 0 if successful.
+ */
+extern int srpc_trace_enable(bool on);
+
+/**
+ * srpc_trace_enabled - returns true if events are being recorded
+ */
+extern bool srpc_trace_enabled(void);
+
+/**
+ * srpc_trace_read - copies out the most recent events of every core
+ * @ev: the buffer to fill
+ * @max: the number of events @ev can hold
+ *
+ * Events still being written or overwritten while copying are skipped.
+ *
+ * Returns the number of events copied, oldest first.
+ */
+extern int srpc_trace_read(struct srpc_event *ev, int max);
+
+/**
+ * srpc_trace_dump - writes the most recent events to a CSV file
+ * @path: the file to write
+ *
+ * WARNING: This function blocks.
+ *
+ * Returns 0 if successful.
+ */
+extern int srpc_trace_dump(const char *path);
+
+extern const char *srpc_trace_names[SRPC_EV_NR];
@@ -10,6 +10,7 @@
 #include <runtime/smalloc.h>
 #include <runtime/sync.h>
 #include <runtime/timer.h>
+#include <runtime/udp.h>
 
 #include <breakwater/breakwater.h>
 
@@ -21,6 +22,34 @@
 #define CBW_TRACK_FLOW			false
 #define CBW_TRACK_FLOW_ID		1
 
+/* a request sent over UDP, kept for retransmission until it is answered */
+struct cbw_udp_req {
+	uint64_t		id;
+	/* the client microtime() deadline (0 = none) */
+	uint64_t		deadline;
+	/* when to retransmit next */
+	uint64_t		retx_ts;
+	unsigned int		retries;
+	/* the datagram (header and payload), or NULL if the entry is free */
+	char			*buf;
+	size_t			len;
+};
+
+/* per-session state of the datagram transport */
+struct cbw_udp {
+	udpconn_t		*c;
+	bool			shut;
+	/* when the last window update was sent */
+	uint64_t		winu_ts;
+	/* ask the server to resend its window with the next update */
+	bool			resync;
+	/* the number of requests awaiting a response (equals win_used) */
+	int			nr_inflight;
+	struct cbw_udp_req	reqs[CBW_UDP_MAX_INFLIGHT];
+	/* the last datagram received */
+	char			*rx_buf;
+};
+
 /**
  * crpc_send_winupdate - send WINUPDATE message to update window size
  * @s: the RPC session to update the window
@@ -39,17 +68,27 @@ ssize_t crpc_send_winupdate(struct cbw_session *s)
 	chdr.op = BW_OP_WINUPDATE;
 	chdr.id = 0;
 	chdr.len = 0;
+	chdr.deadline = 0;
 	chdr.demand = s->head - s->tail;
 	chdr.flags = 0;
+	chdr.cls = s->cls;
 	if (s->demand_sync)
 		chdr.flags |= BW_CFLAG_DSYNC;
 
-	/* send the request */
-	ret = tcp_write_full(s->cmn.c, &chdr, sizeof(chdr));
-	if (unlikely(ret < 0))
-		return ret;
+	/* send the request (lost datagrams are handled by crpc_timer()) */
+	if (s->udp) {
+		if (s->udp->resync)
+			chdr.flags |= BW_CFLAG_RESYNC;
+		s->udp->resync = false;
+		s->udp->winu_ts = microtime();
+		udp_write(s->udp->c, &chdr, sizeof(chdr));
+	} else {
+		ret = tcp_write_full(s->cmn.c, &chdr, sizeof(chdr));
+		if (unlikely(ret < 0))
+			return ret;
+		assert(ret == sizeof(chdr));
+	}
 
-	assert(ret == sizeof(chdr));
 	s->winu_tx_++;
 
 #if CBW_TRACK_FLOW
@@ -61,12 +100,180 @@ ssize_t crpc_send_winupdate(struct cbw_session *s)
 	return 0;
 }
 
+static void crpc_drain_queue(struct cbw_session *s);
+
+/* accounts for a request that was given up without a response */
+static void crpc_give_up(struct cbw_session *s, uint64_t id, int status)
+{
+	assert_mutex_held(&s->lock);
+
+	if (status == CRPC_EXPIRED)
+		s->req_expired_++;
+	else
+		s->req_dropped_++;
+	if (s->drop_fn)
+		s->drop_fn(s->drop_arg, id, status);
+}
+
+/*
+ * crpc_udp_send - sends a request datagram and tracks it until answered
+ *
+ * Returns the payload length. A lost datagram is not an error, crpc_timer()
+ * retransmits it.
+ */
+static ssize_t crpc_udp_send(struct cbw_session *s, const struct cbw_hdr *chdr,
+			     const void *payload, uint64_t deadline)
+{
+	struct cbw_udp *u = s->udp;
+	struct cbw_udp_req *r = NULL;
+	int i;
+
+	assert_mutex_held(&s->lock);
+
+	for (i = 0; i < CBW_UDP_MAX_INFLIGHT; i++) {
+		if (!u->reqs[i].buf) {
+			r = &u->reqs[i];
+			break;
+		}
+	}
+	if (unlikely(!r))
+		return -ENOBUFS;
+
+	r->len = sizeof(*chdr) + chdr->len;
+	r->buf = smalloc(r->len);
+	if (unlikely(!r->buf))
+		return -ENOMEM;
+	memcpy(r->buf, chdr, sizeof(*chdr));
+	memcpy(r->buf + sizeof(*chdr), payload, chdr->len);
+	r->id = chdr->id;
+	r->deadline = deadline;
+	r->retries = 0;
+	r->retx_ts = microtime() + CBW_UDP_RTO_US;
+
+	udp_write(u->c, r->buf, r->len);
+
+	/* start the retransmission timer */
+	if (u->nr_inflight++ == 0)
+		condvar_signal(&s->timer_cv);
+
+	return chdr->len;
+}
+
+static void crpc_udp_put_req(struct cbw_session *s, struct cbw_udp_req *r)
+{
+	sfree(r->buf);
+	r->buf = NULL;
+	s->udp->nr_inflight--;
+	assert(s->win_used > 0);
+	s->win_used--;
+}
+
+/* finds the request of a response and stops tracking it */
+static bool crpc_udp_complete(struct cbw_session *s, uint64_t id)
+{
+	struct cbw_udp_req *r;
+	int i;
+
+	assert_mutex_held(&s->lock);
+
+	for (i = 0; i < CBW_UDP_MAX_INFLIGHT; i++) {
+		r = &s->udp->reqs[i];
+		if (r->buf && r->id == id) {
+			sfree(r->buf);
+			r->buf = NULL;
+			s->udp->nr_inflight--;
+			return true;
+		}
+	}
+
+	/* a duplicate response */
+	return false;
+}
+
+/*
+ * crpc_udp_retransmit - resends requests and window updates that were not
+ * answered in time
+ *
+ * Requests are given up after CBW_UDP_MAX_RETX retries or once past their
+ * deadline, returning their credit. Returns when to check again (0 = idle).
+ */
+static uint64_t crpc_udp_retransmit(struct cbw_session *s, uint64_t now)
+{
+	struct cbw_udp *u = s->udp;
+	struct cbw_udp_req *r;
+	uint64_t next = 0;
+	bool gave_up = false;
+	int i;
+
+	assert_mutex_held(&s->lock);
+
+	for (i = 0; i < CBW_UDP_MAX_INFLIGHT && u->nr_inflight > 0; i++) {
+		r = &u->reqs[i];
+		if (!r->buf)
+			continue;
+
+		if (r->deadline && now >= r->deadline) {
+			crpc_udp_put_req(s, r);
+			crpc_give_up(s, r->id, CRPC_EXPIRED);
+			gave_up = true;
+			continue;
+		}
+
+		if (now >= r->retx_ts) {
+			if (r->retries >= CBW_UDP_MAX_RETX) {
+				crpc_udp_put_req(s, r);
+				crpc_give_up(s, r->id, CRPC_DROPPED);
+				gave_up = true;
+				continue;
+			}
+
+			/* the time budget shrank while waiting */
+			if (r->deadline)
+				((struct cbw_hdr *)r->buf)->deadline =
+					r->deadline - now;
+			udp_write(u->c, r->buf, r->len);
+			r->retries++;
+			r->retx_ts = now + (CBW_UDP_RTO_US << r->retries);
+			s->req_retx_++;
+		}
+
+		if (!next || r->retx_ts < next)
+			next = r->retx_ts;
+	}
+
+	/* the window update or the server's answer to it was lost */
+	if (s->waiting_winupdate && s->head != s->tail) {
+		if (now - u->winu_ts >= CBW_UDP_RTO_US) {
+			u->resync = true;
+			crpc_send_winupdate(s);
+		}
+		if (!next || u->winu_ts + CBW_UDP_RTO_US < next)
+			next = u->winu_ts + CBW_UDP_RTO_US;
+	}
+
+	if (gave_up)
+		crpc_drain_queue(s);
+
+	return next;
+}
+
+/* frees the external payload buffer of a queued request, if any */
+static void crpc_ctx_put(struct crpc_ctx *c)
+{
+	if (c->ext) {
+		srpc_buf_free(c->ext, c->ext_type);
+		c->ext = NULL;
+	}
+}
+
 static ssize_t crpc_send_request_vector(struct cbw_session *s)
 {
 	struct cbw_hdr chdr[CRPC_QLEN];
 	struct iovec v[CRPC_QLEN * 2];
+	struct crpc_ctx *sent[CRPC_QLEN];
 	int nriov = 0;
 	int nrhdr = 0;
+	int i;
 	ssize_t ret;
 	uint64_t now = microtime();
 
@@ -78,23 +285,48 @@ static ssize_t crpc_send_request_vector(struct cbw_session *s)
 	while (s->head != s->tail && s->win_used < s->win_avail) {
 		struct crpc_ctx *c = s->qreq[s->tail++ % CRPC_QLEN];
 
+		/* don't spend a credit on a request nobody waits for */
+		if (c->deadline && now >= c->deadline) {
+			crpc_give_up(s, c->id, CRPC_EXPIRED);
+			crpc_ctx_put(c);
+			continue;
+		}
+
 		chdr[nrhdr].magic = BW_REQ_MAGIC;
 		chdr[nrhdr].op = BW_OP_CALL;
 		chdr[nrhdr].id = c->id;
 		chdr[nrhdr].len = c->len;
 		chdr[nrhdr].demand = s->head - s->tail;
 		chdr[nrhdr].ts_sent = now;
+		chdr[nrhdr].deadline = c->deadline ? c->deadline - now : 0;
 		chdr[nrhdr].flags = 0;
+		chdr[nrhdr].cls = s->cls;
 		if (s->demand_sync)
 			chdr[nrhdr].flags |= BW_CFLAG_DSYNC;
 
+		/* datagram sessions send one request per datagram */
+		if (s->udp) {
+			ret = crpc_udp_send(s, &chdr[nrhdr],
+					    c->ext ? c->ext : c->buf,
+					    c->deadline);
+			crpc_ctx_put(c);
+			if (unlikely(ret < 0)) {
+				crpc_give_up(s, c->id, CRPC_DROPPED);
+				continue;
+			}
+			nrhdr++;
+			s->win_used++;
+			continue;
+		}
+
 		v[nriov].iov_base = &chdr[nrhdr];
 		v[nriov].iov_len = sizeof(struct cbw_hdr);
+		sent[nrhdr] = c;
 		nrhdr++;
 		nriov++;
 
 		if (c->len > 0) {
-			v[nriov].iov_base = c->buf;
+			v[nriov].iov_base = c->ext ? c->ext : c->buf;
 			v[nriov++].iov_len = c->len;
 		}
 
@@ -106,7 +338,12 @@ static ssize_t crpc_send_request_vector(struct cbw_session *s)
 		s->tail = 0;
 	}
 
-	ret = tcp_writev_full(s->cmn.c, v, nriov);
+	if (nrhdr == 0)
+		return 0;
+
+	ret = nriov > 0 ? tcp_writev_full(s->cmn.c, v, nriov) : 0;
+	for (i = 0; i < nrhdr; i++)
+		crpc_ctx_put(sent[i]);
 
 	s->req_tx_ += nrhdr;
 
@@ -124,7 +361,7 @@ static ssize_t crpc_send_request_vector(struct cbw_session *s)
 
 static ssize_t crpc_send_raw(struct cbw_session *s,
 			     const void *buf, size_t len,
-			     uint64_t id)
+			     uint64_t id, uint64_t deadline)
 {
 	struct iovec vec[2];
 	struct cbw_hdr chdr;
@@ -138,10 +375,23 @@ static ssize_t crpc_send_raw(struct cbw_session *s,
 	chdr.len = len;
 	chdr.demand = s->head - s->tail;
 	chdr.ts_sent = now;
+	chdr.deadline = deadline ? deadline - now : 0;
 	chdr.flags = 0;
+	chdr.cls = s->cls;
 	if (s->demand_sync)
 		chdr.flags |= BW_CFLAG_DSYNC;
 
+	if (s->udp) {
+		ret = crpc_udp_send(s, &chdr, buf, deadline);
+		if (unlikely(ret < 0)) {
+			/* the credit was not used */
+			s->win_used--;
+			return ret;
+		}
+		s->req_tx_++;
+		return len;
+	}
+
 	/* initialize the SG vector */
 	vec[0].iov_base = &chdr;
 	vec[0].iov_len = sizeof(chdr);
@@ -188,7 +438,8 @@ static void crpc_drain_queue(struct cbw_session *s)
 			break;
 
 		s->tail++;
-		s->req_dropped_++;
+		crpc_give_up(s, c->id, CRPC_DROPPED);
+		crpc_ctx_put(c);
 #if CBW_TRACK_FLOW
 		if (s->id == CBW_TRACK_FLOW_ID) {
 			printf("[%lu] request dropped: id=%lu, qlen = %d\n",
@@ -200,8 +451,8 @@ static void crpc_drain_queue(struct cbw_session *s)
 	crpc_send_request_vector(s);
 }
 
-static bool crpc_enqueue_one(struct cbw_session *s,
-			     const void *buf, size_t len)
+static bool crpc_enqueue_one(struct cbw_session *s, const void *buf,
+			     size_t len, uint64_t id, uint64_t deadline)
 {
 	int pos;
 	struct crpc_ctx *c;
@@ -211,8 +462,10 @@ static bool crpc_enqueue_one(struct cbw_session *s,
 
 	/* if the queue is full, drop tail */
 	if (s->head - s->tail >= CRPC_QLEN) {
+		c = s->qreq[s->tail % CRPC_QLEN];
 		s->tail++;
-		s->req_dropped_++;
+		crpc_give_up(s, c->id, CRPC_DROPPED);
+		crpc_ctx_put(c);
 #if CBW_TRACK_FLOW
 		if (s->id == CBW_TRACK_FLOW_ID) {
 			printf("[%lu] queue full. drop the request\n",
@@ -221,11 +474,20 @@ static bool crpc_enqueue_one(struct cbw_session *s,
 #endif
 	}
 
-	pos = s->head++ % CRPC_QLEN;
+	pos = s->head % CRPC_QLEN;
 	c = s->qreq[pos];
-	memcpy(c->buf, buf, len);
-	c->id = s->req_id++;
+	if (len > SRPC_BUF_SIZE) {
+		c->ext = srpc_buf_alloc(len, &c->ext_type);
+		if (unlikely(!c->ext))
+			return false;
+		memcpy(c->ext, buf, len);
+	} else {
+		memcpy(c->buf, buf, len);
+	}
+	s->head++;
+	c->id = id;
 	c->ts = now;
+	c->deadline = deadline;
 	c->len = len;
 
 #if CBW_TRACK_FLOW
@@ -249,28 +511,43 @@ static bool crpc_enqueue_one(struct cbw_session *s,
 	return true;
 }
 
-ssize_t cbw_send_one(struct crpc_session *s_,
-		      const void *buf, size_t len, int hash)
+/*
+ * crpc_send_one - sends or enqueues a request
+ * @id: the request id from cbw_alloc_id(), or 0 to allocate one
+ */
+static ssize_t crpc_send_one(struct cbw_session *s, const void *buf,
+			     size_t len, uint64_t id, uint64_t deadline)
 {
-	struct cbw_session *s = (struct cbw_session *)s_;
 	ssize_t ret;
 
-	/* implementation is currently limited to a maximum payload size */
-	if (unlikely(len > SRPC_BUF_SIZE))
+	if (unlikely(len > SRPC_MAX_PAYLOAD))
+		return -E2BIG;
+	/* datagram requests must fit in one datagram */
+	if (unlikely(s->udp &&
+		     sizeof(struct cbw_hdr) + len > udp_get_payload_size()))
 		return -E2BIG;
 
 	mutex_lock(&s->lock);
 
+	if (unlikely(deadline && microtime() >= deadline)) {
+		s->req_expired_++;
+		mutex_unlock(&s->lock);
+		return -ETIMEDOUT;
+	}
+
+	if (!id)
+		id = s->req_id++;
+
 	/* hot path, just send */
 	if (s->win_used < s->win_avail && s->head == s->tail) {
 		s->win_used++;
-		ret = crpc_send_raw(s, buf, len, s->req_id++);
+		ret = crpc_send_raw(s, buf, len, id, deadline);
 		mutex_unlock(&s->lock);
 		return ret;
 	}
 
 	/* cold path, enqueue request and drain the queue */
-	if (!crpc_enqueue_one(s, buf, len)) {
+	if (!crpc_enqueue_one(s, buf, len, id, deadline)) {
 		crpc_drain_queue(s);
 		mutex_unlock(&s->lock);
 		return -ENOBUFS;
@@ -281,8 +558,175 @@ ssize_t cbw_send_one(struct crpc_session *s_,
 	return len;
 }
 
-ssize_t cbw_recv_one(struct crpc_session *s_, void *buf, size_t len,
-		     uint64_t *latency)
+ssize_t cbw_send_one_deadline(struct crpc_session *s_,
+			      const void *buf, size_t len, int hash,
+			      uint64_t deadline)
+{
+	return crpc_send_one((struct cbw_session *)s_, buf, len, 0, deadline);
+}
+
+/**
+ * cbw_alloc_id - reserves a request id on a session
+ * @s_: the RPC session
+ *
+ * Lets the caller track the request before it is sent (see cbw_send_one_id).
+ */
+uint64_t cbw_alloc_id(struct crpc_session *s_)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+	uint64_t id;
+
+	mutex_lock(&s->lock);
+	id = s->req_id++;
+	mutex_unlock(&s->lock);
+
+	return id;
+}
+
+/**
+ * cbw_send_one_id - sends a request with a reserved id
+ * @s_: the RPC session
+ * @buf: the payload buffer to send
+ * @len: the length of @buf
+ * @id: the id from cbw_alloc_id()
+ * @deadline: the microtime() by which the response is needed (0 = none)
+ *
+ * Returns the same as crpc_send_one_deadline.
+ */
+ssize_t cbw_send_one_id(struct crpc_session *s_, const void *buf, size_t len,
+			uint64_t id, uint64_t deadline)
+{
+	return crpc_send_one((struct cbw_session *)s_, buf, len, id, deadline);
+}
+
+/**
+ * cbw_send_many - sends several requests with reserved ids at once
+ * @s_: the RPC session
+ * @reqs: the requests (ids from cbw_alloc_id())
+ * @nr: the number of requests
+ *
+ * Requests are queued under one lock acquisition and sent with a single
+ * writev() as far as credit allows. Unlike crpc_send_one, a full queue
+ * doesn't drop its oldest request; the requests that don't fit are left to
+ * the caller, as are those after a request that is too large. Requests
+ * already past their deadline are given up (see cbw_session::drop_fn) and
+ * count as taken.
+ *
+ * Returns the number of requests taken, -E2BIG if the first request is too
+ * large, or -ENOBUFS if no request could be queued.
+ */
+int cbw_send_many(struct crpc_session *s_, const struct cbw_req *reqs, int nr)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+	uint64_t now = microtime();
+	int i, ret = -ENOBUFS;
+
+	mutex_lock(&s->lock);
+	for (i = 0; i < nr; i++) {
+		if (unlikely(reqs[i].len > SRPC_MAX_PAYLOAD ||
+			     (s->udp && sizeof(struct cbw_hdr) + reqs[i].len >
+					udp_get_payload_size()))) {
+			ret = -E2BIG;
+			break;
+		}
+
+		if (unlikely(reqs[i].deadline && now >= reqs[i].deadline)) {
+			crpc_give_up(s, reqs[i].id, CRPC_EXPIRED);
+			continue;
+		}
+
+		/* send what has credit to make room in the queue */
+		if (s->head - s->tail >= CRPC_QLEN) {
+			crpc_drain_queue(s);
+			if (s->head - s->tail >= CRPC_QLEN)
+				break;
+		}
+
+		if (!crpc_enqueue_one(s, reqs[i].buf, reqs[i].len, reqs[i].id,
+				      reqs[i].deadline))
+			break;
+	}
+	crpc_drain_queue(s);
+	mutex_unlock(&s->lock);
+
+	return i > 0 ? i : ret;
+}
+
+/**
+ * cbw_cancel - withdraws a request that is still waiting for credit
+ * @s_: the RPC session
+ * @id: the request id
+ *
+ * Returns true if the request was removed before being sent, false if it
+ * was already sent (its response will still arrive) or given up.
+ */
+bool cbw_cancel(struct crpc_session *s_, uint64_t id)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+	struct crpc_ctx *c;
+	uint32_t i;
+
+	mutex_lock(&s->lock);
+	for (i = s->tail; i != s->head; i++) {
+		if (s->qreq[i % CRPC_QLEN]->id == id)
+			break;
+	}
+	if (i == s->head) {
+		mutex_unlock(&s->lock);
+		return false;
+	}
+
+	/* close the gap, keeping the queue in order */
+	c = s->qreq[i % CRPC_QLEN];
+	for (; i != s->tail; i--)
+		s->qreq[i % CRPC_QLEN] = s->qreq[(i - 1) % CRPC_QLEN];
+	s->qreq[s->tail % CRPC_QLEN] = c;
+	s->tail++;
+	crpc_ctx_put(c);
+	mutex_unlock(&s->lock);
+
+	return true;
+}
+
+ssize_t cbw_send_one(struct crpc_session *s_,
+		      const void *buf, size_t len, int hash)
+{
+	return cbw_send_one_deadline(s_, buf, len, hash, 0);
+}
+
+/* reads the next datagram, skipping duplicate responses */
+static ssize_t crpc_udp_read(struct cbw_session *s, struct sbw_hdr *shdr)
+{
+	struct cbw_udp *u = s->udp;
+	ssize_t ret;
+	bool fresh;
+
+	while (true) {
+		ret = udp_read(u->c, u->rx_buf, udp_get_payload_size());
+		if (unlikely(ret <= 0))
+			return ret;
+		if (unlikely(ret < sizeof(*shdr)))
+			continue;
+		memcpy(shdr, u->rx_buf, sizeof(*shdr));
+		if (unlikely(shdr->len != ret - sizeof(*shdr)))
+			continue;
+		if (shdr->op != BW_OP_CALL)
+			return sizeof(*shdr);
+
+		mutex_lock(&s->lock);
+		fresh = crpc_udp_complete(s, shdr->id);
+		mutex_unlock(&s->lock);
+		if (fresh)
+			return sizeof(*shdr);
+	}
+}
+
+/**
+ * cbw_recv_one_id - like crpc_recv_one_status, also reporting the request id
+ * @id: set to the id of the request the response belongs to (may be NULL)
+ */
+ssize_t cbw_recv_one_id(struct crpc_session *s_, void *buf, size_t len,
+			uint64_t *latency, int *status, uint64_t *id)
 {
 	struct cbw_session *s = (struct cbw_session *)s_;
 	struct sbw_hdr shdr;
@@ -291,7 +735,10 @@ ssize_t cbw_recv_one(struct crpc_session *s_, void *buf, size_t len,
 
 again:
 	/* read the server header */
-	ret = tcp_read_full(s->cmn.c, &shdr, sizeof(shdr));
+	if (s->udp)
+		ret = crpc_udp_read(s, &shdr);
+	else
+		ret = tcp_read_full(s->cmn.c, &shdr, sizeof(shdr));
 	if (unlikely(ret <= 0))
 		return ret;
 	assert(ret == sizeof(shdr));
@@ -301,9 +748,9 @@ again:
 		log_warn("crpc: got invalid magic %x", shdr.magic);
 		return -EINVAL;
 	}
-	if (unlikely(shdr.len > MIN(SRPC_BUF_SIZE, len))) {
+	if (unlikely(shdr.len > MIN(SRPC_MAX_PAYLOAD, len))) {
 		log_warn("crpc: request len %ld too large (limit %ld)",
-			 shdr.len, MIN(SRPC_BUF_SIZE, len));
+			 shdr.len, MIN(SRPC_MAX_PAYLOAD, len));
 		return -EINVAL;
 	}
 
@@ -311,7 +758,10 @@ again:
 	switch (shdr.op) {
 	case BW_OP_CALL:
 		/* read the payload */
-		if (shdr.len > 0) {
+		if (shdr.len > 0 && s->udp) {
+			memcpy(buf, s->udp->rx_buf + sizeof(shdr), shdr.len);
+			s->resp_rx_++;
+		} else if (shdr.len > 0) {
 			ret = tcp_read_full(s->cmn.c, buf, shdr.len);
 			if (unlikely(ret <= 0))
 				return ret;
@@ -341,6 +791,21 @@ again:
 			*latency = now - shdr.ts_sent;
 		}
 
+		if (shdr.flags & BW_SFLAG_EXPIRED)
+			s->req_expired_++;
+
+		if (id)
+			*id = shdr.id;
+
+		if (status) {
+			if (shdr.flags & BW_SFLAG_EXPIRED)
+				*status = CRPC_EXPIRED;
+			else if (shdr.flags & BW_SFLAG_DROP)
+				*status = CRPC_DROPPED;
+			else
+				*status = CRPC_OK;
+		}
+
 		mutex_unlock(&s->lock);
 
 		break;
@@ -378,17 +843,30 @@ again:
 	return shdr.len;
 }
 
+ssize_t cbw_recv_one_status(struct crpc_session *s_, void *buf, size_t len,
+			    uint64_t *latency, int *status)
+{
+	return cbw_recv_one_id(s_, buf, len, latency, status, NULL);
+}
+
+ssize_t cbw_recv_one(struct crpc_session *s_, void *buf, size_t len,
+		     uint64_t *latency)
+{
+	return cbw_recv_one_status(s_, buf, len, latency, NULL);
+}
+
 static void crpc_timer(void *arg)
 {
 	struct cbw_session *s = (struct cbw_session *)arg;
-	uint64_t now;
+	uint64_t now, wake, retx;
 	int pos;
 	struct crpc_ctx *c;
 	int num_drops;
 
 	mutex_lock(&s->lock);
 	while(true) {
-		while (s->running && s->head == s->tail)
+		while (s->running && s->head == s->tail &&
+		       !(s->udp && s->udp->nr_inflight > 0))
 			condvar_wait(&s->timer_cv, &s->lock);
 
 		if (!s->running)
@@ -405,8 +883,9 @@ static void crpc_timer(void *arg)
 				break;
 
 			s->tail++;
-			s->req_dropped_++;
+			crpc_give_up(s, c->id, CRPC_DROPPED);
 			num_drops++;
+			crpc_ctx_put(c);
 #if CBW_TRACK_FLOW
 			if (s->id == CBW_TRACK_FLOW_ID) {
 				printf("[%lu] request dropped: id=%lu, qlen = %d\n",
@@ -415,20 +894,29 @@ static void crpc_timer(void *arg)
 #endif
 		}
 
+		// Retransmit lost datagrams
+		retx = s->udp ? crpc_udp_retransmit(s, now) : 0;
+
 		// If queue becomes empty
 		if (s->head == s->tail) {
 			if (num_drops > 0 && s->demand_sync) {
 				s->waiting_winupdate = false;
 				crpc_send_winupdate(s);
 			}
-			continue;
+			if (!retx)
+				continue;
+			wake = retx;
+		} else {
+			// caculate next wake up time
+			pos = (s->head - 1) % CRPC_QLEN;
+			c = s->qreq[pos];
+			wake = c->ts + CBW_MAX_CLIENT_DELAY_US;
+			if (retx && retx < wake)
+				wake = retx;
 		}
 
-		// caculate next wake up time
-		pos = (s->head - 1) % CRPC_QLEN;
-		c = s->qreq[pos];
 		mutex_unlock(&s->lock);
-		timer_sleep_until(c->ts + CBW_MAX_CLIENT_DELAY_US);
+		timer_sleep_until(wake);
 		mutex_lock(&s->lock);
 	}
 done:
@@ -436,38 +924,26 @@ done:
 	waitgroup_done(&s->timer_waiter);
 }
 
-int cbw_open(struct netaddr raddr, struct crpc_session **sout, int id)
+static int crpc_session_create(tcpconn_t *c, struct cbw_udp *udp,
+			       struct crpc_session **sout, int id)
 {
-	struct netaddr laddr;
 	struct cbw_session *s;
-	tcpconn_t *c;
 	int i, ret;
 
-	/* set up ephemeral IP and port */
-	laddr.ip = 0;
-	laddr.port = 0;
-
-	if (raddr.port != SRPC_PORT)
-		return -EINVAL;
-
-	ret = tcp_dial(laddr, raddr, &c);
-	if (ret)
-		return ret;
-
 	s = smalloc(sizeof(*s));
-	if (!s) {
-		tcp_close(c);
+	if (!s)
 		return -ENOMEM;
-	}
 	memset(s, 0, sizeof(*s));
 
 	for (i = 0; i < CRPC_QLEN; ++i) {
 		s->qreq[i] = smalloc(sizeof(struct crpc_ctx));
 		if (!s->qreq[i])
 			goto fail;
+		s->qreq[i]->ext = NULL;
 	}
 
 	s->cmn.c = c;
+	s->udp = udp;
 	mutex_init(&s->lock);
 	condvar_init(&s->timer_cv);
 	waitgroup_init(&s->timer_waiter);
@@ -485,13 +961,108 @@ int cbw_open(struct netaddr raddr, struct crpc_session **sout, int id)
 	return 0;
 
 fail:
-	tcp_close(c);
 	for (i = i - 1; i >= 0; i--)
 		sfree(s->qreq[i]);
 	sfree(s);
 	return -ENOMEM;
 }
 
+int cbw_open(struct netaddr raddr, struct crpc_session **sout, int id)
+{
+	struct netaddr laddr;
+	tcpconn_t *c;
+	int ret;
+
+	/* set up ephemeral IP and port */
+	laddr.ip = 0;
+	laddr.port = 0;
+
+	if (raddr.port != SRPC_PORT)
+		return -EINVAL;
+
+	ret = tcp_dial(laddr, raddr, &c);
+	if (ret)
+		return ret;
+
+	ret = crpc_session_create(c, NULL, sout, id);
+	if (ret)
+		tcp_close(c);
+	return ret;
+}
+
+static void crpc_udp_free(struct cbw_udp *u)
+{
+	int i;
+
+	for (i = 0; i < CBW_UDP_MAX_INFLIGHT; i++) {
+		if (u->reqs[i].buf)
+			sfree(u->reqs[i].buf);
+	}
+	if (u->rx_buf)
+		sfree(u->rx_buf);
+	sfree(u);
+}
+
+int cbw_udp_open(struct netaddr raddr, struct crpc_session **sout, int id)
+{
+	struct netaddr laddr;
+	struct cbw_udp *u;
+	int ret;
+
+	/* set up ephemeral IP and port */
+	laddr.ip = 0;
+	laddr.port = 0;
+
+	if (raddr.port != SRPC_PORT)
+		return -EINVAL;
+
+	u = smalloc(sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+	memset(u, 0, sizeof(*u));
+	u->rx_buf = smalloc(udp_get_payload_size());
+	if (!u->rx_buf) {
+		crpc_udp_free(u);
+		return -ENOMEM;
+	}
+
+	ret = udp_dial(laddr, raddr, &u->c);
+	if (ret) {
+		crpc_udp_free(u);
+		return ret;
+	}
+
+	ret = crpc_session_create(NULL, u, sout, id);
+	if (ret) {
+		udp_close(u->c);
+		crpc_udp_free(u);
+	}
+	return ret;
+}
+
+int cbw_shutdown(struct crpc_session *s_, int how)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+	struct cbw_hdr chdr;
+
+	if (!s->udp)
+		return tcp_shutdown(s->cmn.c, how);
+
+	mutex_lock(&s->lock);
+	if (!s->udp->shut) {
+		/* let the server release the session (best effort) */
+		memset(&chdr, 0, sizeof(chdr));
+		chdr.magic = BW_REQ_MAGIC;
+		chdr.op = BW_OP_CLOSE;
+		udp_write(s->udp->c, &chdr, sizeof(chdr));
+		udp_shutdown(s->udp->c);
+		s->udp->shut = true;
+	}
+	mutex_unlock(&s->lock);
+
+	return 0;
+}
+
 void cbw_close(struct crpc_session *s_)
 {
 	struct cbw_session *s = (struct cbw_session *)s_;
@@ -504,12 +1075,42 @@ void cbw_close(struct crpc_session *s_)
 
 	waitgroup_wait(&s->timer_waiter);
 
-	tcp_close(s->cmn.c);
-	for(i = 0; i < CRPC_QLEN; ++i)
+	if (s->udp) {
+		cbw_shutdown(s_, SHUT_RDWR);
+		udp_close(s->udp->c);
+		crpc_udp_free(s->udp);
+	} else {
+		tcp_close(s->cmn.c);
+	}
+	for(i = 0; i < CRPC_QLEN; ++i) {
+		crpc_ctx_put(s->qreq[i]);
 		sfree(s->qreq[i]);
+	}
 	sfree(s);
 }
 
+int cbw_set_class(struct crpc_session *s_, int cls)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+
+	if (cls < 0 || cls >= SRPC_NR_CLASSES)
+		return -EINVAL;
+
+	mutex_lock(&s->lock);
+	if (s->cls == cls) {
+		mutex_unlock(&s->lock);
+		return 0;
+	}
+	s->cls = cls;
+
+	/* let the server move the session's credits to the new class */
+	if (s->init)
+		crpc_send_winupdate(s);
+	mutex_unlock(&s->lock);
+
+	return 0;
+}
+
 /* client-side stats */
 uint32_t cbw_win_avail(struct crpc_session *s_)
 {
@@ -558,11 +1159,41 @@ uint64_t cbw_stat_req_dropped(struct crpc_session *s_)
 	return s->req_dropped_;
 }
 
+uint64_t cbw_stat_req_expired(struct crpc_session *s_)
+{
+	struct cbw_session *s = (struct cbw_session *)s_;
+	return s->req_expired_;
+}
+
 struct crpc_ops cbw_ops = {
 	.crpc_send_one		= cbw_send_one,
 	.crpc_recv_one		= cbw_recv_one,
+	.crpc_send_one_deadline	= cbw_send_one_deadline,
+	.crpc_recv_one_status	= cbw_recv_one_status,
 	.crpc_open		= cbw_open,
 	.crpc_close		= cbw_close,
+	.crpc_shutdown		= cbw_shutdown,
+	.crpc_set_class		= cbw_set_class,
+	.crpc_win_avail		= cbw_win_avail,
+	.crpc_stat_clear	= cbw_stat_clear,
+	.crpc_stat_winu_rx	= cbw_stat_winu_rx,
+	.crpc_stat_win_expired	= cbw_stat_win_expired,
+	.crpc_stat_winu_tx	= cbw_stat_winu_tx,
+	.crpc_stat_resp_rx	= cbw_stat_resp_rx,
+	.crpc_stat_req_tx	= cbw_stat_req_tx,
+	.crpc_stat_req_dropped	= cbw_stat_req_dropped,
+	.crpc_stat_req_expired	= cbw_stat_req_expired,
+};
+
+struct crpc_ops cbw_udp_ops = {
+	.crpc_send_one		= cbw_send_one,
+	.crpc_recv_one		= cbw_recv_one,
+	.crpc_send_one_deadline	= cbw_send_one_deadline,
+	.crpc_recv_one_status	= cbw_recv_one_status,
+	.crpc_open		= cbw_udp_open,
+	.crpc_close		= cbw_close,
+	.crpc_shutdown		= cbw_shutdown,
+	.crpc_set_class		= cbw_set_class,
 	.crpc_win_avail		= cbw_win_avail,
 	.crpc_stat_clear	= cbw_stat_clear,
 	.crpc_stat_winu_rx	= cbw_stat_winu_rx,
@@ -571,4 +1202,5 @@ struct crpc_ops cbw_ops = {
 	.crpc_stat_resp_rx	= cbw_stat_resp_rx,
 	.crpc_stat_req_tx	= cbw_stat_req_tx,
 	.crpc_stat_req_dropped	= cbw_stat_req_dropped,
+	.crpc_stat_req_expired	= cbw_stat_req_expired,
 };
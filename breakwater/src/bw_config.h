@@ -18,6 +18,11 @@
 * #define SBW_DROP_THRESH		1000
 */
 
+/*
+ * The values below are the initial (and, without SBW_AUTOTUNE, fixed)
+ * parameters.
+ */
+
 /* delay threshold to detect congestion */
 #define SBW_MIN_DELAY_US		80
 /* delay threshold for AQM */
@@ -29,3 +34,73 @@
 #define SBW_AI				0.001
 #define SBW_MD				0.02
 #define CBW_MAX_CLIENT_DELAY_US		10
+
+/*
+ * Self-tuning: the server estimates the mean service time and the network
+ * RTT online and derives the parameters above from them, following the
+ * recommendations (delay target ~ 35us + 4.5 x service time + RTT, drop
+ * threshold = 2 x delay target, AIMD gains scaled with the control period).
+ */
+#define SBW_AUTOTUNE			true
+/* how often the estimates are folded in and the parameters recomputed */
+#define SBW_TUNE_INTERVAL_US		10000
+/* EWMA weight of a new estimate */
+#define SBW_TUNE_EWMA			0.2
+#define SBW_TUNE_DELAY_BASE_US		35
+#define SBW_TUNE_DELAY_ST_MULT		4.5
+#define SBW_TUNE_DROP_MULT		2
+
+/* bounds for the tuned parameters */
+#define SBW_MIN_DELAY_LO_US		20
+#define SBW_MIN_DELAY_HI_US		2000
+#define SBW_RTT_LO_US			5
+#define SBW_RTT_HI_US			100
+#define SBW_AI_LO			0.0005
+#define SBW_AI_HI			0.01
+#define SBW_MD_LO			0.01
+#define SBW_MD_HI			0.1
+
+/* default share of the window for a request class */
+#define SBW_CLASS_WEIGHT		1
+
+/*
+ * Datagram (UDP) transport
+ */
+
+/* the first client retransmission timeout (doubles with each retry) */
+#define CBW_UDP_RTO_US			1000
+/* retransmissions before the client gives up on a request */
+#define CBW_UDP_MAX_RETX		5
+/* requests a UDP client tracks for retransmission */
+#define CBW_UDP_MAX_INFLIGHT		64
+/* responses a UDP session keeps to answer retransmissions */
+#define SBW_UDP_CACHE_SIZE		64
+/* request IDs a UDP session remembers for duplicate suppression */
+#define SBW_UDP_SEEN_WINDOW		1024
+/* UDP sessions that hear nothing from the client for this long are closed */
+#define SBW_UDP_IDLE_US			(10 * ONE_SECOND)
+/* how often UDP sessions check for idleness */
+#define SBW_UDP_POLL_US			(100 * ONE_MS)
+#define SBW_UDP_HASH_SIZE		256
+
+/*
+ * Batched dispatch (sbw_batch_ops)
+ */
+
+/* long-lived worker threads per core */
+#define SBW_BATCH_WORKERS		4
+/* the most requests a worker takes from a queue at once */
+#define SBW_BATCH_SIZE			16
+
+/*
+ * Replica sets
+ */
+
+/* recent latencies kept for choosing the hedge delay */
+#define CBW_RSET_LAT_SAMPLES		1024
+/* the hedge delay is recomputed after this many new latencies */
+#define CBW_RSET_LAT_RECALC		128
+/* weight of a new latency in a replica's moving average */
+#define CBW_RSET_LAT_EWMA		0.1
+/* the most hedges that can be saved up while none are needed */
+#define CBW_RSET_HEDGE_BURST		8.0
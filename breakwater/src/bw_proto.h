@@ -12,12 +12,17 @@
 enum {
 	BW_OP_CALL = 0,  /* performs a procedure call */
 	BW_OP_WINUPDATE, /* just updates the window (no call) */
+	BW_OP_CLOSE,	 /* closes a datagram session */
 	BW_OP_MAX,	  /* maximum number of opcodes */
 };
 
 #define BW_CFLAG_DSYNC	0x01
+/* the client lost a window update (datagram sessions), resend the window */
+#define BW_CFLAG_RESYNC	0x02
 
 #define BW_SFLAG_DROP	0x01
+/* dropped because it could not finish before its deadline (with DROP) */
+#define BW_SFLAG_EXPIRED	0x02
 
 /* header used for CLIENT -> SERVER */
 struct cbw_hdr {
@@ -27,7 +32,9 @@ struct cbw_hdr {
 	uint64_t	id;    /* Request / Response ID */
 	uint64_t	demand;/* the demanded window size */
 	uint64_t	ts_sent;
+	uint64_t	deadline; /* us left until the deadline (0 = none) */
 	uint8_t		flags;
+	uint8_t		cls;   /* the request class (< SRPC_NR_CLASSES) */
 };
 
 /* header used for SERVER -> CLIENT */
@@ -39,4 +46,5 @@ struct sbw_hdr {
 	uint64_t	win;   /* the offered window size */
 	uint64_t	ts_sent;
 	uint8_t		flags;
+	uint8_t		cls;   /* the class the window belongs to */
 };
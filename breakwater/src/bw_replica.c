@@ -0,0 +1,597 @@
+/*
+ * bw_replica.c - replica selection and hedged requests for Breakwater clients
+ */
+
+#include <stdlib.h>
+
+#include <base/hash.h>
+#include <base/list.h>
+#include <base/log.h>
+#include <base/stddef.h>
+#include <base/time.h>
+#include <runtime/smalloc.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include <breakwater/breakwater.h>
+#include <breakwater/replica.h>
+
+#include "bw_config.h"
+
+struct rset_call;
+struct rset_replica;
+
+/* one request of a call, sent to one replica */
+struct rset_req {
+	struct list_node	link;
+	struct rset_call	*call;
+	struct rset_replica	*r;
+	uint64_t		id;
+	uint64_t		ts;
+	/* awaiting a response (linked in the replica's list) */
+	bool			pending;
+};
+
+/* a call in progress, lives on the caller's stack */
+struct rset_call {
+	/* waiting for the hedge time (linked in the set's list) */
+	struct list_node	link;
+	bool			hedge_wait;
+	uint64_t		hedge_ts;
+
+	const void		*req;
+	size_t			req_len;
+	void			*resp;
+	size_t			resp_len;
+	uint64_t		deadline;
+
+	condvar_t		cv;
+	/* requests that may still be answered */
+	int			nr_out;
+	bool			done;
+	/* the hedger is sending the hedge */
+	bool			hedging;
+	ssize_t			ret;
+	int			status;
+
+	/* the primary and the hedge */
+	struct rset_req		reqs[2];
+	/* the request that lost, to withdraw if it hasn't been sent */
+	struct rset_req		*loser;
+};
+
+struct rset_replica {
+	struct crpc_rset	*rs;
+	struct crpc_session	*s;
+	bool			dead;
+	/* moving average of the response latency */
+	double			lat_us;
+	/* requests awaiting a response (bounded by the credits) */
+	struct list_head	reqs;
+	char			*rx_buf;
+};
+
+struct crpc_rset {
+	mutex_t			lock;
+	bool			running;
+	struct crpc_rset_cfg	cfg;
+	int			nr;
+	struct rset_replica	replicas[CRPC_RSET_MAX_REPLICAS];
+	waitgroup_t		waiter;
+
+	/* calls waiting for their hedge time, oldest first */
+	struct list_head	hedges;
+	condvar_t		hedge_cv;
+	double			hedge_tokens;
+	uint64_t		hedge_delay_us;
+
+	/* recent latencies, to choose the hedge delay */
+	uint64_t		lat[CBW_RSET_LAT_SAMPLES];
+	uint64_t		lat_sorted[CBW_RSET_LAT_SAMPLES];
+	unsigned int		nr_lat;
+	unsigned int		lat_pos;
+	unsigned int		lat_new;
+
+	struct crpc_rset_stats	st;
+};
+
+/* the credits a replica has left (a hint, read without the session lock) */
+static uint32_t rset_credit(struct rset_replica *r)
+{
+	struct cbw_session *s = (struct cbw_session *)r->s;
+	uint32_t avail = ACCESS_ONCE(s->win_avail);
+	uint32_t used = ACCESS_ONCE(s->win_used);
+
+	return avail > used ? avail - used : 0;
+}
+
+/*
+ * rset_pick - chooses a replica for a request
+ * @rs: the replica set
+ * @skip: a replica not to choose (may be NULL)
+ * @need_credit: only choose a replica that can send right away
+ *
+ * Returns the replica, or NULL if none qualifies.
+ */
+static struct rset_replica *rset_pick(struct crpc_rset *rs,
+				      struct rset_replica *skip,
+				      bool need_credit)
+{
+	struct rset_replica *r, *best = NULL;
+	uint32_t credit, best_credit = 0;
+	int i, start;
+
+	/* break ties at random */
+	start = rand_crc32c((uintptr_t)&r) % rs->nr;
+	for (i = 0; i < rs->nr; i++) {
+		r = &rs->replicas[(start + i) % rs->nr];
+		if (r == skip || ACCESS_ONCE(r->dead))
+			continue;
+		credit = rset_credit(r);
+		if (need_credit && credit == 0)
+			continue;
+
+		if (!best) {
+			best = r;
+			best_credit = credit;
+			if (rs->cfg.policy == CRPC_RSET_RANDOM)
+				break;
+			continue;
+		}
+
+		switch (rs->cfg.policy) {
+		case CRPC_RSET_CREDIT:
+			if (credit < best_credit ||
+			    (credit == best_credit && r->lat_us >= best->lat_us))
+				continue;
+			break;
+		case CRPC_RSET_LATENCY:
+			if (r->lat_us >= best->lat_us)
+				continue;
+			break;
+		}
+		best = r;
+		best_credit = credit;
+	}
+
+	return best;
+}
+
+static struct rset_req *rset_find(struct rset_replica *r, uint64_t id)
+{
+	struct rset_req *req;
+
+	assert_mutex_held(&r->rs->lock);
+
+	list_for_each(&r->reqs, req, link) {
+		if (req->id == id)
+			return req;
+	}
+	return NULL;
+}
+
+static void rset_track(struct crpc_rset *rs, struct rset_req *req,
+		       struct rset_call *call, struct rset_replica *r,
+		       uint64_t id)
+{
+	assert_mutex_held(&rs->lock);
+
+	req->call = call;
+	req->r = r;
+	req->id = id;
+	req->ts = microtime();
+	req->pending = true;
+	list_add_tail(&r->reqs, &req->link);
+	rs->st.sends++;
+}
+
+static int rset_cmp_lat(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* records the latency of a successful request */
+static void rset_add_latency(struct crpc_rset *rs, struct rset_replica *r,
+			     uint64_t lat)
+{
+	unsigned int idx;
+
+	assert_mutex_held(&rs->lock);
+
+	r->lat_us = r->lat_us ? (1 - CBW_RSET_LAT_EWMA) * r->lat_us +
+				CBW_RSET_LAT_EWMA * lat : lat;
+
+	if (rs->cfg.hedge_pct <= 0)
+		return;
+
+	rs->lat[rs->lat_pos] = lat;
+	rs->lat_pos = (rs->lat_pos + 1) % CBW_RSET_LAT_SAMPLES;
+	if (rs->nr_lat < CBW_RSET_LAT_SAMPLES)
+		rs->nr_lat++;
+	if (++rs->lat_new < CBW_RSET_LAT_RECALC)
+		return;
+
+	/* hedge once a call is slower than the percentile */
+	rs->lat_new = 0;
+	memcpy(rs->lat_sorted, rs->lat, rs->nr_lat * sizeof(uint64_t));
+	qsort(rs->lat_sorted, rs->nr_lat, sizeof(uint64_t), rset_cmp_lat);
+	idx = MIN(rs->nr_lat - 1,
+		  (unsigned int)(rs->nr_lat * rs->cfg.hedge_pct / 100));
+	rs->hedge_delay_us = MAX(rs->lat_sorted[idx], rs->cfg.hedge_min_us);
+}
+
+/* completes a call with its current outcome */
+static void rset_finish(struct crpc_rset *rs, struct rset_call *call,
+			struct rset_req *winner)
+{
+	struct rset_req *other;
+
+	assert_mutex_held(&rs->lock);
+
+	call->done = true;
+	if (call->hedge_wait) {
+		list_del_from(&rs->hedges, &call->link);
+		call->hedge_wait = false;
+	}
+
+	if (winner == &call->reqs[1])
+		rs->st.hedge_wins++;
+
+	/* forget the loser, its response will be discarded */
+	other = winner == &call->reqs[0] ? &call->reqs[1] : &call->reqs[0];
+	if (other->pending) {
+		list_del_from(&other->r->reqs, &other->link);
+		other->pending = false;
+		call->loser = other;
+	}
+
+	condvar_signal(&call->cv);
+}
+
+/*
+ * rset_req_done - accounts for the outcome of one request of a call
+ * @ret: the response length or an error
+ * @status: the RPC status
+ *
+ * A call completes with the first successful response, or once neither of
+ * its requests can be answered anymore.
+ */
+static void rset_req_done(struct crpc_rset *rs, struct rset_req *req,
+			  ssize_t ret, int status)
+{
+	struct rset_call *call = req->call;
+
+	assert_mutex_held(&rs->lock);
+
+	list_del_from(&req->r->reqs, &req->link);
+	req->pending = false;
+	call->nr_out--;
+
+	/* prefer reporting a response over an error */
+	if (ret >= 0 || call->ret < 0) {
+		call->ret = ret;
+		call->status = status;
+	}
+
+	if (ret >= 0 && status == CRPC_OK) {
+		rset_finish(rs, call, req);
+		return;
+	}
+	if (call->nr_out == 0)
+		rset_finish(rs, call, NULL);
+}
+
+/* called by the session for requests it gave up on without a response */
+static void rset_drop(void *arg, uint64_t id, int status)
+{
+	struct rset_replica *r = arg;
+	struct crpc_rset *rs = r->rs;
+	struct rset_req *req;
+
+	mutex_lock(&rs->lock);
+	req = rset_find(r, id);
+	if (req)
+		rset_req_done(rs, req, 0, status);
+	mutex_unlock(&rs->lock);
+}
+
+/* dispatches a replica's responses to the calls waiting for them */
+static void rset_rx(void *arg)
+{
+	struct rset_replica *r = arg;
+	struct crpc_rset *rs = r->rs;
+	struct rset_req *req, *nxt;
+	struct rset_call *call;
+	uint64_t id;
+	ssize_t ret;
+	int status;
+
+	while (true) {
+		/* the status is only set for a response */
+		status = -1;
+		ret = cbw_recv_one_id(r->s, r->rx_buf, SRPC_MAX_PAYLOAD, NULL,
+				      &status, &id);
+		if (unlikely(ret < 0 || status < 0))
+			break;
+
+		mutex_lock(&rs->lock);
+		req = rset_find(r, id);
+		if (!req) {
+			/* a hedge (or primary) that lost */
+			rs->st.wasted++;
+			mutex_unlock(&rs->lock);
+			continue;
+		}
+
+		call = req->call;
+		if (status == CRPC_OK) {
+			rset_add_latency(rs, r, microtime() - req->ts);
+			if (unlikely((size_t)ret > call->resp_len))
+				ret = -EMSGSIZE;
+			else
+				memcpy(call->resp, r->rx_buf, ret);
+		}
+		rset_req_done(rs, req, ret, status);
+		mutex_unlock(&rs->lock);
+	}
+
+	/* the session is gone, fail everything still waiting on it */
+	mutex_lock(&rs->lock);
+	r->dead = true;
+	list_for_each_safe(&r->reqs, req, nxt, link)
+		rset_req_done(rs, req, -ECONNRESET, CRPC_DROPPED);
+	mutex_unlock(&rs->lock);
+
+	waitgroup_done(&rs->waiter);
+}
+
+/* sends hedges for calls that weren't answered within the hedge delay */
+static void rset_hedger(void *arg)
+{
+	struct crpc_rset *rs = arg;
+	struct rset_replica *r;
+	struct rset_call *call;
+	struct rset_req *req;
+	uint64_t now, id, hedge_ts;
+	ssize_t ret;
+
+	mutex_lock(&rs->lock);
+	while (true) {
+		while (rs->running && list_empty(&rs->hedges))
+			condvar_wait(&rs->hedge_cv, &rs->lock);
+
+		if (!rs->running)
+			break;
+
+		call = list_top(&rs->hedges, struct rset_call, link);
+		now = microtime();
+		if (call->hedge_ts > now) {
+			/* the call lives on its caller's stack, which may be
+			 * gone once the lock is dropped */
+			hedge_ts = call->hedge_ts;
+			mutex_unlock(&rs->lock);
+			timer_sleep_until(hedge_ts);
+			mutex_lock(&rs->lock);
+			continue;
+		}
+		list_del_from(&rs->hedges, &call->link);
+		call->hedge_wait = false;
+
+		/*
+		 * Only hedge to a replica with credit to spare, so hedges never
+		 * queue behind (or add to) an overload.
+		 */
+		r = rset_pick(rs, call->reqs[0].r, true);
+		if (!r || rs->hedge_tokens < 1.0 ||
+		    (call->deadline && now >= call->deadline)) {
+			rs->st.hedge_skipped++;
+			continue;
+		}
+		rs->hedge_tokens -= 1.0;
+
+		/* keep the call alive while the lock is dropped */
+		call->hedging = true;
+		call->nr_out++;
+		mutex_unlock(&rs->lock);
+
+		id = cbw_alloc_id(r->s);
+
+		mutex_lock(&rs->lock);
+		if (call->done) {
+			call->hedging = false;
+			condvar_signal(&call->cv);
+			continue;
+		}
+		req = &call->reqs[1];
+		rset_track(rs, req, call, r, id);
+		rs->st.hedges++;
+		mutex_unlock(&rs->lock);
+
+		ret = cbw_send_one_id(r->s, call->req, call->req_len, id,
+				      call->deadline);
+
+		mutex_lock(&rs->lock);
+		if (unlikely(ret < 0) && req->pending)
+			rset_req_done(rs, req, ret, CRPC_DROPPED);
+		call->hedging = false;
+		if (call->done)
+			condvar_signal(&call->cv);
+	}
+	mutex_unlock(&rs->lock);
+
+	waitgroup_done(&rs->waiter);
+}
+
+ssize_t crpc_rset_call(struct crpc_rset *rs, const void *req, size_t req_len,
+		       void *resp, size_t resp_len, uint64_t deadline,
+		       int *status)
+{
+	struct rset_call call;
+	struct rset_replica *r;
+	struct rset_req *loser;
+	uint64_t id;
+	ssize_t ret;
+
+	r = rset_pick(rs, NULL, false);
+	if (unlikely(!r))
+		return -ENOTCONN;
+
+	memset(&call, 0, sizeof(call));
+	call.req = req;
+	call.req_len = req_len;
+	call.resp = resp;
+	call.resp_len = resp_len;
+	call.deadline = deadline;
+	call.ret = -ECONNRESET;
+	call.nr_out = 1;
+	condvar_init(&call.cv);
+
+	id = cbw_alloc_id(r->s);
+
+	mutex_lock(&rs->lock);
+	rs->st.calls++;
+	rset_track(rs, &call.reqs[0], &call, r, id);
+	rs->hedge_tokens = MIN(rs->hedge_tokens + rs->cfg.hedge_budget / 100,
+			       CBW_RSET_HEDGE_BURST);
+	if (rs->hedge_delay_us && rs->nr > 1) {
+		call.hedge_ts = call.reqs[0].ts + rs->hedge_delay_us;
+		call.hedge_wait = true;
+		list_add_tail(&rs->hedges, &call.link);
+		condvar_signal(&rs->hedge_cv);
+	}
+	mutex_unlock(&rs->lock);
+
+	ret = cbw_send_one_id(r->s, req, req_len, id, deadline);
+
+	mutex_lock(&rs->lock);
+	if (unlikely(ret < 0) && call.reqs[0].pending)
+		rset_req_done(rs, &call.reqs[0], ret, CRPC_DROPPED);
+	while (!call.done || call.hedging)
+		condvar_wait(&call.cv, &rs->lock);
+	loser = call.loser;
+	mutex_unlock(&rs->lock);
+
+	/* withdraw the loser if it is still waiting for credit */
+	if (loser && cbw_cancel(loser->r->s, loser->id)) {
+		mutex_lock(&rs->lock);
+		rs->st.cancelled++;
+		mutex_unlock(&rs->lock);
+	}
+
+	*status = call.status;
+	return call.ret;
+}
+
+void crpc_rset_stat(struct crpc_rset *rs, struct crpc_rset_stats *st)
+{
+	mutex_lock(&rs->lock);
+	*st = rs->st;
+	st->hedge_delay_us = rs->hedge_delay_us;
+	mutex_unlock(&rs->lock);
+}
+
+struct crpc_session *crpc_rset_replica(struct crpc_rset *rs, int idx)
+{
+	BUG_ON(idx < 0 || idx >= rs->nr);
+	return rs->replicas[idx].s;
+}
+
+static void rset_free(struct crpc_rset *rs)
+{
+	struct rset_replica *r;
+	int i;
+
+	for (i = 0; i < rs->nr; i++) {
+		r = &rs->replicas[i];
+		if (r->s)
+			cbw_close(r->s);
+		free(r->rx_buf);
+	}
+	sfree(rs);
+}
+
+int crpc_rset_open(const struct netaddr *raddrs, int nr,
+		   const struct crpc_rset_cfg *cfg, struct crpc_rset **rsout)
+{
+	struct crpc_rset *rs;
+	struct rset_replica *r;
+	struct cbw_session *s;
+	int i, ret;
+
+	if (nr <= 0 || nr > CRPC_RSET_MAX_REPLICAS)
+		return -EINVAL;
+	if (cfg->hedge_pct < 0 || cfg->hedge_pct >= 100)
+		return -EINVAL;
+
+	rs = smalloc(sizeof(*rs));
+	if (!rs)
+		return -ENOMEM;
+	memset(rs, 0, sizeof(*rs));
+
+	mutex_init(&rs->lock);
+	condvar_init(&rs->hedge_cv);
+	list_head_init(&rs->hedges);
+	waitgroup_init(&rs->waiter);
+	rs->cfg = *cfg;
+	rs->nr = nr;
+	rs->running = true;
+	rs->hedge_tokens = 1.0;
+
+	for (i = 0; i < nr; i++) {
+		r = &rs->replicas[i];
+		r->rs = rs;
+		list_head_init(&r->reqs);
+		r->rx_buf = malloc(SRPC_MAX_PAYLOAD);
+		if (!r->rx_buf) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		if (cfg->udp)
+			ret = cbw_udp_open(raddrs[i], &r->s, -1);
+		else
+			ret = cbw_open(raddrs[i], &r->s, -1);
+		if (ret) {
+			r->s = NULL;
+			goto fail;
+		}
+
+		s = (struct cbw_session *)r->s;
+		s->drop_fn = rset_drop;
+		s->drop_arg = r;
+	}
+
+	waitgroup_add(&rs->waiter, nr + 1);
+	for (i = 0; i < nr; i++) {
+		ret = thread_spawn(rset_rx, &rs->replicas[i]);
+		BUG_ON(ret);
+	}
+	ret = thread_spawn(rset_hedger, rs);
+	BUG_ON(ret);
+
+	*rsout = rs;
+	return 0;
+
+fail:
+	rset_free(rs);
+	return ret;
+}
+
+void crpc_rset_close(struct crpc_rset *rs)
+{
+	int i;
+
+	mutex_lock(&rs->lock);
+	rs->running = false;
+	condvar_signal(&rs->hedge_cv);
+	mutex_unlock(&rs->lock);
+
+	for (i = 0; i < rs->nr; i++)
+		cbw_shutdown(rs->replicas[i].s, SHUT_RDWR);
+	waitgroup_wait(&rs->waiter);
+
+	rset_free(rs);
+}
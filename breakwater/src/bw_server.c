@@ -2,14 +2,17 @@
  * RPC server-side support
  */
 
+#include <limits.h>
 #include <stdio.h>
 
 #include <base/atomic.h>
+#include <base/hash.h>
 #include <base/stddef.h>
 #include <base/time.h>
 #include <base/list.h>
 #include <base/log.h>
 #include <runtime/tcp.h>
+#include <runtime/udp.h>
 #include <runtime/sync.h>
 #include <runtime/smalloc.h>
 #include <runtime/thread.h>
@@ -21,12 +24,7 @@
 #include "util.h"
 #include "bw_proto.h"
 #include "bw_config.h"
-
-/* time-series output */
-#define SBW_TS_OUT		false
-#define TS_BUF_SIZE_EXP		15
-#define TS_BUF_SIZE		(1 << TS_BUF_SIZE_EXP)
-#define TS_BUF_MASK		(TS_BUF_SIZE - 1)
+#include "trace.h"
 
 /* the maximum supported window size */
 #define SBW_MAX_WINDOW_EXP	6
@@ -39,47 +37,98 @@
 
 BUILD_ASSERT((1 << SBW_MAX_WINDOW_EXP) == SBW_MAX_WINDOW);
 
-#if SBW_TS_OUT
-int nextIndex = 0;
-FILE *ts_out = NULL;
-
-struct Event {
-	uint64_t timestamp;
-	int win_avail;
-	int win_used;
-	int num_pending;
-	int num_drained;
-	int num_active;
-	int num_sess;
-	uint64_t delay;
-	int num_cores;
-};
-
-static struct Event events[TS_BUF_SIZE];
-#endif
-
 /* the handler function for each RPC */
 static srpc_fn_t srpc_handler;
 
 /* total number of session */
 atomic_t srpc_num_sess;
-
-/* the number of drained session */
-atomic_t srpc_num_drained;
-
-/* the number of active sessions */
-atomic_t srpc_num_active;
+/* the number of sessions ever created, spreads sessions over cores */
+static atomic_t srpc_sess_seq;
 
 /* global window available */
 atomic_t srpc_win_avail;
 
-/* global window used */
-atomic_t srpc_win_used;
+double win_carry;
 
-/* the number of pending requests */
-atomic_t srpc_num_pending;
+/*
+ * Per-core credit accounting. Every session is homed on a core and keeps its
+ * counters there, so requests and responses only touch the cache lines of
+ * their home core. The cc worker sums the cores up every control period and
+ * splits each class's window into per-core budgets, which the sessions of a
+ * core draw from when their windows are updated.
+ */
+struct srpc_pcpu_ {
+	/* the core's budget of each class's window (written by the cc worker) */
+	atomic_t		win_avail[SRPC_NR_CLASSES];
+	/* window issued to the core's sessions */
+	atomic_t		win_used[SRPC_NR_CLASSES];
+	/* the number of pending requests of the core's sessions */
+	atomic_t		num_pending[SRPC_NR_CLASSES];
+	/* the sum of the demand of the core's sessions */
+	atomic_t		demand[SRPC_NR_CLASSES];
+	/* the number of the core's sessions on its drained list */
+	atomic_t		num_drained[SRPC_NR_CLASSES];
+	/* the number of sessions homed on the core */
+	atomic_t		num_sess[SRPC_NR_CLASSES];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct srpc_pcpu_ srpc_pcpu[NCPU];
+
+/* per-class credit pool (a slice of the global window) */
+struct sbw_class {
+	/* the number of sessions bound to the class */
+	atomic_t		num_sess;
+	/* the class's share of the global window */
+	atomic_t		win_avail;
+
+	/* sums over all cores (approximate, updated by the cc worker) */
+	int			num_drained;
+	int			win_used;
+	int			num_pending;
+	int			demand;
+
+	/* configuration */
+	unsigned int		weight;
+	bool			strict;
+	uint64_t		drop_thresh;
+
+	/* per-class stats */
+	atomic64_t		stat_req_rx;
+	atomic64_t		stat_req_dropped;
+	atomic64_t		stat_resp_tx;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct sbw_class srpc_classes[SRPC_NR_CLASSES] = {
+	[0 ... SRPC_NR_CLASSES - 1] = {
+		.weight		= SBW_CLASS_WEIGHT,
+	},
+};
 
-double win_carry;
+/* control parameters (written only by the cc worker) */
+static struct srpc_params srpc_params = {
+	.est_service_us	= 0.0,
+	.est_rtt_us	= SBW_RTT_US,
+	.min_delay_us	= SBW_MIN_DELAY_US,
+	.drop_thresh_us	= SBW_DROP_THRESH,
+	.rtt_us		= SBW_RTT_US,
+	.ai		= SBW_AI,
+	.md		= SBW_MD,
+};
+
+/* per-core service time samples */
+struct srpc_st_acc_ {
+	atomic64_t cycles;
+	atomic64_t count;
+	void *pad[6];
+};
+
+BUILD_ASSERT(sizeof(struct srpc_st_acc_) == CACHE_LINE_SIZE);
+
+static struct srpc_st_acc_ srpc_st_acc[NCPU]
+		__attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* the smallest RTT sample since the last tuning interval */
+static atomic64_t srpc_rtt_min;
 
 /* drained session list */
 struct srpc_drained_ {
@@ -90,13 +139,62 @@ struct srpc_drained_ {
 
 BUILD_ASSERT(sizeof(struct srpc_drained_) == CACHE_LINE_SIZE);
 
-static struct srpc_drained_ srpc_drained[NCPU]
+static struct srpc_drained_ srpc_drained[SRPC_NR_CLASSES][NCPU]
 		__attribute__((aligned(CACHE_LINE_SIZE)));
 
+/* per-core queue of admitted requests (batched dispatch) */
+struct srpc_dispatch_ {
+	spinlock_t		lock;
+	struct list_head	reqs;
+	/* the queue's parked workers */
+	int			nr_idle;
+	thread_t		*idle[SBW_BATCH_WORKERS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct srpc_dispatch_ srpc_dispatch[NCPU];
+static int srpc_nr_dispatch;
+/* run requests on long-lived workers instead of a new thread each */
+static bool srpc_batch;
+
+
+/* a response kept to answer a retransmitted request */
+struct sbw_udp_resp {
+	uint64_t		id;
+	/* the datagram, or NULL while the request is in progress */
+	void			*buf;
+	size_t			len;
+};
+
+/* per-session state of the datagram transport */
+struct sbw_udp {
+	struct sbw_session	*s;
+	struct netaddr		laddr;
+	struct netaddr		raddr;
+	struct list_node	link;
+	/* serializes the datagram handlers of the session */
+	mutex_t			rx_lock;
+	/* handlers holding a reference to the session */
+	waitgroup_t		rx_waiter;
+	uint64_t		last_rx;
+	bool			closing;
+
+	/* duplicate suppression (protected by rx_lock) */
+	uint64_t		seen_base;
+	DEFINE_BITMAP(seen, SBW_UDP_SEEN_WINDOW);
+
+	spinlock_t		cache_lock;
+	struct sbw_udp_resp	cache[SBW_UDP_CACHE_SIZE];
+};
 
 struct sbw_session {
 	struct srpc_session	cmn;
 	int			id;
+	/* the datagram transport state, or NULL for TCP sessions */
+	struct sbw_udp		*udp;
+	/* the request class the session is bound to */
+	int			cls;
+	/* the core the session's credits are accounted on */
+	int			core;
 	struct list_node	drained_link;
 	/* drained_list's core number. -1 if not in the drained list */
 	int			drained_core;
@@ -131,46 +229,40 @@ atomic64_t srpc_stat_win_tx_;
 atomic64_t srpc_stat_req_rx_;
 atomic64_t srpc_stat_req_dropped_;
 atomic64_t srpc_stat_resp_tx_;
+atomic64_t srpc_stat_req_expired_;
 
-#if SBW_TS_OUT
-static void printRecord()
+/* returns the AQM drop threshold of a class */
+static uint64_t srpc_drop_thresh(struct sbw_class *cl)
 {
-	int i;
+	uint64_t thresh = ACCESS_ONCE(cl->drop_thresh);
 
-	if (!ts_out)
-		ts_out = fopen("timeseries.csv", "w");
+	return thresh ? thresh : ACCESS_ONCE(srpc_params.drop_thresh_us);
+}
 
-	for (i = 0; i < TS_BUF_SIZE; ++i) {
-		struct Event *event = &events[i];
-		fprintf(ts_out, "%lu,%d,%d,%d,%d,%d,%d,%lu,%d\n",
-			event->timestamp, event->win_avail,
-			event->win_used, event->num_pending,
-			event->num_drained, event->num_active,
-			event->num_sess, event->delay,
-			event->num_cores);
-	}
-	fflush(ts_out);
+/* adjusts the window issued to a session's class on its home core */
+static void srpc_win_used_add(struct sbw_session *s, int diff)
+{
+	assert_spin_lock_held(&s->lock);
+
+	atomic_fetch_and_add(&srpc_pcpu[s->core].win_used[s->cls], diff);
 }
 
-static void record(int win_avail, uint64_t delay)
+static void srpc_num_pending_add(struct sbw_session *s, int diff)
 {
-	struct Event *event = &events[nextIndex];
-	nextIndex = (nextIndex + 1) & TS_BUF_MASK;
+	assert_spin_lock_held(&s->lock);
+
+	s->num_pending += diff;
+	atomic_fetch_and_add(&srpc_pcpu[s->core].num_pending[s->cls], diff);
+}
 
-	event->timestamp = microtime();
-	event->win_avail = win_avail;
-	event->win_used = atomic_read(&srpc_win_used);
-	event->num_pending = atomic_read(&srpc_num_pending);
-	event->num_drained = atomic_read(&srpc_num_drained);
-	event->num_active = atomic_read(&srpc_num_active);
-	event->num_sess = atomic_read(&srpc_num_sess);
-	event->delay = delay;
-	event->num_cores = runtime_active_cores();
+static void srpc_set_demand(struct sbw_session *s, uint64_t demand)
+{
+	assert_spin_lock_held(&s->lock);
 
-	if (nextIndex == 0)
-		printRecord();
+	atomic_fetch_and_add(&srpc_pcpu[s->core].demand[s->cls],
+			     (int)demand - (int)s->demand);
+	s->demand = demand;
 }
-#endif
 
 static int srpc_get_slot(struct sbw_session *s)
 {
@@ -180,12 +272,14 @@ static int srpc_get_slot(struct sbw_session *s)
 		s->slots[slot] = smalloc(sizeof(struct sbw_ctx));
 		s->slots[slot]->cmn.s = (struct srpc_session *)s;
 		s->slots[slot]->cmn.idx = slot;
+		srpc_ctx_init(&s->slots[slot]->cmn);
 	}
 	return slot;
 }
 
 static void srpc_put_slot(struct sbw_session *s, int slot)
 {
+	srpc_ctx_release(&s->slots[slot]->cmn);
 	sfree(s->slots[slot]);
 	s->slots[slot] = NULL;
 	bitmap_atomic_set(s->avail_slots, slot);
@@ -201,11 +295,16 @@ static int srpc_winupdate(struct sbw_session *s)
 	shdr.op = BW_OP_WINUPDATE;
 	shdr.len = 0;
 	shdr.win = (uint64_t)s->win;
-
-	/* send the packet */
-	ret = tcp_write_full(s->cmn.c, &shdr, sizeof(shdr));
-	if (unlikely(ret < 0))
-		return ret;
+	shdr.cls = s->cls;
+
+	/* send the packet (the client asks again if a datagram is lost) */
+	if (s->udp) {
+		udp_send(&shdr, sizeof(shdr), s->udp->laddr, s->udp->raddr);
+	} else {
+		ret = tcp_write_full(s->cmn.c, &shdr, sizeof(shdr));
+		if (unlikely(ret < 0))
+			return ret;
+	}
 
 	atomic64_inc(&srpc_stat_winu_tx_);
 	atomic64_fetch_and_add(&srpc_stat_win_tx_, shdr.win);
@@ -220,6 +319,57 @@ static int srpc_winupdate(struct sbw_session *s)
 	return 0;
 }
 
+/* reserves the cache entry of a request, marking it in progress */
+static void srpc_udp_cache_reserve(struct sbw_udp *u, uint64_t id)
+{
+	struct sbw_udp_resp *e = &u->cache[id % SBW_UDP_CACHE_SIZE];
+
+	spin_lock_np(&u->cache_lock);
+	if (e->buf)
+		sfree(e->buf);
+	e->id = id;
+	e->buf = NULL;
+	e->len = 0;
+	spin_unlock_np(&u->cache_lock);
+}
+
+/* sends a response datagram and keeps it until the entry is reused */
+static void srpc_udp_send_resp(struct sbw_session *s, struct sbw_hdr *shdr,
+			       const void *payload)
+{
+	struct sbw_udp *u = s->udp;
+	struct sbw_udp_resp *e = &u->cache[shdr->id % SBW_UDP_CACHE_SIZE];
+	size_t len;
+	char *buf;
+
+	/* responses must fit in one datagram, report the rest as dropped */
+	if (unlikely(sizeof(*shdr) + shdr->len > udp_get_payload_size())) {
+		log_warn_ratelimited("srpc: response len %ld too large for UDP",
+				     shdr->len);
+		shdr->flags |= BW_SFLAG_DROP;
+		shdr->len = 0;
+	}
+
+	len = sizeof(*shdr) + shdr->len;
+	buf = smalloc(len);
+	if (unlikely(!buf))
+		return;
+	memcpy(buf, shdr, sizeof(*shdr));
+	memcpy(buf + sizeof(*shdr), payload, shdr->len);
+
+	udp_send(buf, len, u->laddr, u->raddr);
+
+	spin_lock_np(&u->cache_lock);
+	if (e->id == shdr->id && !e->buf) {
+		e->buf = buf;
+		e->len = len;
+		buf = NULL;
+	}
+	spin_unlock_np(&u->cache_lock);
+	if (buf)
+		sfree(buf);
+}
+
 static int srpc_send_completion_vector(struct sbw_session *s,
 				       unsigned long *slots)
 {
@@ -240,9 +390,12 @@ static int srpc_send_completion_vector(struct sbw_session *s,
 			len = c->cmn.resp_len;
 			buf = c->cmn.resp_buf;
 		} else {
-			len = c->cmn.req_len;
-			buf = c->cmn.req_buf;
+			/* the header identifies the request, don't echo it */
+			len = 0;
+			buf = NULL;
 			flags |= BW_SFLAG_DROP;
+			if (c->expired)
+				flags |= BW_SFLAG_EXPIRED;
 		}
 
 		shdr[nrhdr].magic = BW_RESP_MAGIC;
@@ -252,6 +405,17 @@ static int srpc_send_completion_vector(struct sbw_session *s,
 		shdr[nrhdr].win = (uint64_t)s->win;
 		shdr[nrhdr].ts_sent = c->ts_sent;
 		shdr[nrhdr].flags = flags;
+		shdr[nrhdr].cls = s->cls;
+
+		/*
+		 * datagram sessions send one response per datagram, the client
+		 * recovers lost ones by retransmitting the request
+		 */
+		if (s->udp) {
+			srpc_udp_send_resp(s, &shdr[nrhdr], buf);
+			nrhdr++;
+			continue;
+		}
 
 		v[nriov].iov_base = &shdr[nrhdr];
 		v[nriov].iov_len = sizeof(struct sbw_hdr);
@@ -265,9 +429,10 @@ static int srpc_send_completion_vector(struct sbw_session *s,
 	}
 
 	/* send the completion(s) */
-	if (nriov == 0)
+	if (nrhdr == 0)
 		return 0;
-	ret = tcp_writev_full(s->cmn.c, v, nriov);
+	if (nriov > 0)
+		ret = tcp_writev_full(s->cmn.c, v, nriov);
 	bitmap_for_each_set(slots, SBW_MAX_WINDOW, i)
 		srpc_put_slot(s, i);
 
@@ -277,8 +442,8 @@ static int srpc_send_completion_vector(struct sbw_session *s,
 			microtime(), nrhdr, s->win);
 	}
 #endif
-	atomic_sub_and_fetch(&srpc_num_pending, nrhdr);
 	atomic64_fetch_and_add(&srpc_stat_resp_tx_, nrhdr);
+	atomic64_fetch_and_add(&srpc_classes[s->cls].stat_resp_tx, nrhdr);
 	atomic64_fetch_and_add(&srpc_stat_win_tx_, s->win * nrhdr);
 
 	if (unlikely(ret < 0))
@@ -288,9 +453,10 @@ static int srpc_send_completion_vector(struct sbw_session *s,
 
 static void srpc_update_window(struct sbw_session *s, bool req_dropped)
 {
-	int win_avail = atomic_read(&srpc_win_avail);
-	int win_used = atomic_read(&srpc_win_used);
-	int num_sess = atomic_read(&srpc_num_sess);
+	struct srpc_pcpu_ *p = &srpc_pcpu[s->core];
+	int win_avail = atomic_read(&p->win_avail[s->cls]);
+	int win_used = atomic_read(&p->win_used[s->cls]);
+	int num_sess = MAX(atomic_read(&p->num_sess[s->cls]), 1);
 	int old_win = s->win;
 	int win_diff;
 	int open_window;
@@ -310,7 +476,7 @@ static void srpc_update_window(struct sbw_session *s, bool req_dropped)
 		s->win--;
 	}
 
-	if (s->wake_up || num_sess <= runtime_max_cores())
+	if (s->wake_up || atomic_read(&srpc_num_sess) <= runtime_max_cores())
 		s->win = MAX(s->win, max_overprovision);
 
 	// prioritize the session
@@ -328,7 +494,10 @@ static void srpc_update_window(struct sbw_session *s, bool req_dropped)
 		s->win = MIN(s->win, s->num_pending + s->demand + max_overprovision);
 
 	win_diff = s->win - old_win;
-	atomic_fetch_and_add(&srpc_win_used, win_diff);
+	srpc_win_used_add(s, win_diff);
+	if (win_diff)
+		srpc_trace(SRPC_EV_SESS_WIN, s->cls, s->id, s->win,
+			   atomic_read(&p->win_used[s->cls]), 0);
 #if SBW_TRACK_FLOW
 	if (s->id == SBW_TRACK_FLOW_ID) {
 		printf("[%lu] window update: win_avail = %d, win_used = %d, req_dropped = %d, num_pending = %d, demand = %d, num_sess = %d, old_win = %d, new_win = %d\n",
@@ -337,8 +506,9 @@ static void srpc_update_window(struct sbw_session *s, bool req_dropped)
 #endif
 }
 
-static struct sbw_session *srpc_choose_drained_session(int core_id)
+static struct sbw_session *srpc_choose_drained_session(int cls, int core_id)
 {
+	struct srpc_drained_ *d = &srpc_drained[cls][core_id];
 	struct sbw_session *ret;
 
 	assert(core_id >= 0);
@@ -346,26 +516,24 @@ static struct sbw_session *srpc_choose_drained_session(int core_id)
 
 	ret = NULL;
 
-	if (list_empty(&srpc_drained[core_id].list))
+	if (list_empty(&d->list))
 		return NULL;
 
-	spin_lock_np(&srpc_drained[core_id].lock);
-	if (list_empty(&srpc_drained[core_id].list)) {
-		spin_unlock_np(&srpc_drained[core_id].lock);
+	spin_lock_np(&d->lock);
+	if (list_empty(&d->list)) {
+		spin_unlock_np(&d->lock);
 		return NULL;
 	}
 
-	ret = list_pop(&srpc_drained[core_id].list,
-		       struct sbw_session,
-		       drained_link);
+	ret = list_pop(&d->list, struct sbw_session, drained_link);
 
 	assert(ret->is_linked);
 	ret->is_linked = false;
-	spin_unlock_np(&srpc_drained[core_id].lock);
+	spin_unlock_np(&d->lock);
 	spin_lock_np(&ret->lock);
 	ret->drained_core = -1;
 	spin_unlock_np(&ret->lock);
-	atomic_dec(&srpc_num_drained);
+	atomic_dec(&srpc_pcpu[core_id].num_drained[cls]);
 #if SBW_TRACK_FLOW
 	if (ret->id == SBW_TRACK_FLOW_ID) {
 		printf("[%lu] Session waken up\n", microtime());
@@ -377,16 +545,19 @@ static struct sbw_session *srpc_choose_drained_session(int core_id)
 
 static void srpc_remove_from_drained_list(struct sbw_session *s)
 {
+	struct srpc_drained_ *d;
+
 	assert_spin_lock_held(&s->lock);
 
 	if (s->drained_core == -1)
 		return;
 
-	spin_lock_np(&srpc_drained[s->drained_core].lock);
+	d = &srpc_drained[s->cls][s->drained_core];
+	spin_lock_np(&d->lock);
 	if (s->is_linked) {
 		list_del(&s->drained_link);
 		s->is_linked = false;
-		atomic_dec(&srpc_num_drained);
+		atomic_dec(&srpc_pcpu[s->drained_core].num_drained[s->cls]);
 #if SBW_TRACK_FLOW
 		if (s->id == SBW_TRACK_FLOW_ID) {
 			printf("[%lu] Seesion is removed from drained list\n",
@@ -394,73 +565,263 @@ static void srpc_remove_from_drained_list(struct sbw_session *s)
 		}
 #endif
 	}
-	spin_unlock_np(&srpc_drained[s->drained_core].lock);
+	spin_unlock_np(&d->lock);
 	s->drained_core = -1;
 }
 
+/* moves a session and its credits to another request class */
+static void srpc_rebind_session(struct sbw_session *s, int cls)
+{
+	struct srpc_pcpu_ *p = &srpc_pcpu[s->core];
+
+	assert_spin_lock_held(&s->lock);
+
+	srpc_remove_from_drained_list(s);
+
+	atomic_dec(&srpc_classes[s->cls].num_sess);
+	atomic_dec(&p->num_sess[s->cls]);
+	atomic_sub_and_fetch(&p->win_used[s->cls], s->win);
+	atomic_sub_and_fetch(&p->num_pending[s->cls], s->num_pending);
+	atomic_sub_and_fetch(&p->demand[s->cls], (int)s->demand);
+
+	atomic_inc(&srpc_classes[cls].num_sess);
+	atomic_inc(&p->num_sess[cls]);
+	atomic_fetch_and_add(&p->win_used[cls], s->win);
+	atomic_fetch_and_add(&p->num_pending[cls], s->num_pending);
+	atomic_fetch_and_add(&p->demand[cls], (int)s->demand);
+
+	s->cls = cls;
+}
+
+/*
+ * returns true if a request can't finish before its deadline, given the
+ * queueing delay still ahead of it and the estimated service time
+ */
+static bool srpc_deadline_missed(struct sbw_ctx *c, uint64_t queue_us)
+{
+	if (!c->deadline)
+		return false;
+
+	return microtime() + queue_us +
+	       (uint64_t)ACCESS_ONCE(srpc_params.est_service_us) > c->deadline;
+}
+
+/* runs the handler of an admitted request */
+static void srpc_run(struct sbw_ctx *c)
+{
+	struct sbw_session *s;
+	struct srpc_st_acc_ *acc;
+	uint64_t start_tsc;
+
+	/* the deadline may have passed while waiting to run */
+	if (unlikely(srpc_deadline_missed(c, 0))) {
+		c->drop = true;
+		c->expired = true;
+		atomic64_inc(&srpc_stat_req_expired_);
+		s = (struct sbw_session *)c->cmn.s;
+		srpc_trace(SRPC_EV_EXPIRE, s->cls, s->id, 0, 0, 0);
+		return;
+	}
+
+	start_tsc = rdtsc();
+	srpc_handler((struct srpc_ctx *)c);
+
+	if (SBW_AUTOTUNE) {
+		acc = &srpc_st_acc[get_current_affinity()];
+		atomic64_fetch_and_add(&acc->cycles, rdtsc() - start_tsc);
+		atomic64_inc(&acc->count);
+	}
+}
+
+/*
+ * srpc_complete - hands finished requests to their sessions' senders
+ * @cs: the requests (entries are cleared as they are handed over)
+ * @n: the number of requests
+ *
+ * Each session's sender is woken once, so it answers all of the session's
+ * requests in @cs with a single tcp_writev().
+ */
+static void srpc_complete(struct sbw_ctx **cs, int n)
+{
+	struct sbw_session *s;
+	thread_t *th;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (!cs[i])
+			continue;
+		s = (struct sbw_session *)cs[i]->cmn.s;
+
+		spin_lock_np(&s->lock);
+		/* the sender may free a context as soon as the lock drops */
+		for (j = i; j < n; j++) {
+			if (!cs[j] || cs[j]->cmn.s != &s->cmn)
+				continue;
+			bitmap_set(s->completed_slots, cs[j]->cmn.idx);
+			cs[j] = NULL;
+		}
+		th = s->sender_th;
+		s->sender_th = NULL;
+		spin_unlock_np(&s->lock);
+		if (th)
+			thread_ready(th);
+	}
+}
+
 static void srpc_worker(void *arg)
 {
 	struct sbw_ctx *c = (struct sbw_ctx *)arg;
-	struct sbw_session *s = (struct sbw_session *)c->cmn.s;
-	thread_t *th;
 
-	c->drop = false;
-	srpc_handler((struct srpc_ctx *)c);
+	srpc_run(c);
+	srpc_complete(&c, 1);
+}
 
-	spin_lock_np(&s->lock);
-	bitmap_set(s->completed_slots, c->cmn.idx);
-	th = s->sender_th;
-	s->sender_th = NULL;
-	spin_unlock_np(&s->lock);
-	if (th)
+/* queues an admitted request for the worker pool */
+static void srpc_dispatch_one(struct sbw_ctx *c)
+{
+	struct srpc_dispatch_ *q;
+	thread_t *th = NULL;
+	int i, core;
+
+	core = get_current_affinity() % srpc_nr_dispatch;
+	q = &srpc_dispatch[core];
+	spin_lock_np(&q->lock);
+	list_add_tail(&q->reqs, &c->dispatch_link);
+	if (q->nr_idle > 0)
+		th = q->idle[--q->nr_idle];
+	spin_unlock_np(&q->lock);
+	if (th) {
 		thread_ready(th);
+		return;
+	}
+
+	/* the local workers are busy, let an idle one elsewhere steal it */
+	for (i = 1; i < srpc_nr_dispatch; i++) {
+		q = &srpc_dispatch[(core + i) % srpc_nr_dispatch];
+		if (!ACCESS_ONCE(q->nr_idle))
+			continue;
+		spin_lock_np(&q->lock);
+		if (q->nr_idle > 0)
+			th = q->idle[--q->nr_idle];
+		spin_unlock_np(&q->lock);
+		if (th) {
+			thread_ready(th);
+			return;
+		}
+	}
 }
 
-static int srpc_recv_one(struct sbw_session *s)
+/*
+ * srpc_batch_worker - a long-lived worker for batched dispatch
+ * @arg: the worker's home queue
+ *
+ * Takes up to SBW_BATCH_SIZE requests at a time from the home queue (or
+ * steals them from another queue), runs them and then answers them together.
+ */
+static void srpc_batch_worker(void *arg)
+{
+	struct srpc_dispatch_ *home = (struct srpc_dispatch_ *)arg;
+	struct srpc_dispatch_ *q;
+	struct sbw_ctx *cs[SBW_BATCH_SIZE];
+	int i, n, start = home - srpc_dispatch;
+
+	while (true) {
+		n = 0;
+		for (i = 0; i < srpc_nr_dispatch && n == 0; i++) {
+			q = &srpc_dispatch[(start + i) % srpc_nr_dispatch];
+			if (list_empty_volatile(&q->reqs))
+				continue;
+			spin_lock_np(&q->lock);
+			while (n < SBW_BATCH_SIZE && !list_empty(&q->reqs)) {
+				cs[n++] = list_pop(&q->reqs, struct sbw_ctx,
+						   dispatch_link);
+			}
+			spin_unlock_np(&q->lock);
+		}
+
+		if (n == 0) {
+			spin_lock_np(&home->lock);
+			if (!list_empty(&home->reqs)) {
+				spin_unlock_np(&home->lock);
+				continue;
+			}
+			home->idle[home->nr_idle++] = thread_self();
+			thread_park_and_unlock_np(&home->lock);
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			srpc_run(cs[i]);
+		srpc_complete(cs, n);
+	}
+}
+
+static void srpc_rtt_sample(uint64_t us)
+{
+	long old;
+
+	do {
+		old = atomic64_read(&srpc_rtt_min);
+		if ((long)us >= old)
+			return;
+	} while (!atomic64_cmpxchg(&srpc_rtt_min, old, us));
+}
+
+/*
+ * srpc_handle_msg - processes one message from the client
+ * @s: the session
+ * @chdr: the client header
+ * @payload: the payload of a datagram, or NULL to read it from the TCP stream
+ *
+ * Returns 0 if successful, otherwise the session should be closed.
+ */
+static int srpc_handle_msg(struct sbw_session *s, const struct cbw_hdr *chdr,
+			   const void *payload)
 {
-	struct cbw_hdr chdr;
 	int idx, ret;
-	thread_t *th;
-	uint64_t old_demand;
+	thread_t *th = NULL;
+	uint64_t old_demand, queue_us;
 	int win_diff;
-	char buf_tmp[SRPC_BUF_SIZE];
+	struct sbw_class *cl;
 	struct sbw_ctx *c;
 
-again:
-	th = NULL;
-	/* read the client header */
-	ret = tcp_read_full(s->cmn.c, &chdr, sizeof(chdr));
-	if (unlikely(ret <= 0)) {
-		if (ret == 0)
-			return -EIO;
-		return ret;
-	}
-
 	/* parse the client header */
-	if (unlikely(chdr.magic != BW_REQ_MAGIC)) {
-		log_warn("srpc: got invalid magic %x", chdr.magic);
+	if (unlikely(chdr->magic != BW_REQ_MAGIC)) {
+		log_warn("srpc: got invalid magic %x", chdr->magic);
 		return -EINVAL;
 	}
-	if (unlikely(chdr.len > SRPC_BUF_SIZE)) {
+	if (unlikely(chdr->len > SRPC_MAX_PAYLOAD)) {
 		log_warn("srpc: request len %ld too large (limit %d)",
-			 chdr.len, SRPC_BUF_SIZE);
+			 chdr->len, SRPC_MAX_PAYLOAD);
+		return -EINVAL;
+	}
+	if (unlikely(chdr->cls >= SRPC_NR_CLASSES)) {
+		log_warn("srpc: got invalid class %d", chdr->cls);
 		return -EINVAL;
 	}
+	cl = &srpc_classes[chdr->cls];
 
-	switch (chdr.op) {
+	switch (chdr->op) {
 	case BW_OP_CALL:
 		atomic64_inc(&srpc_stat_req_rx_);
+		atomic64_inc(&cl->stat_req_rx);
 		/* reserve a slot */
 		idx = srpc_get_slot(s);
 		if (unlikely(idx < 0)) {
-			tcp_read_full(s->cmn.c, buf_tmp, chdr.len);
+			if (!payload)
+				tcp_read_discard(s->cmn.c, chdr->len);
 			atomic64_inc(&srpc_stat_req_dropped_);
+			atomic64_inc(&cl->stat_req_dropped);
+			srpc_trace(SRPC_EV_DROP, chdr->cls, s->id, 0, 0, 0);
 			return 0;
 		}
 		c = s->slots[idx];
 
 		/* retrieve the payload */
-		ret = tcp_read_full(s->cmn.c, c->cmn.req_buf, chdr.len);
+		if (payload)
+			ret = srpc_ctx_copy_req(&c->cmn, payload, chdr->len);
+		else
+			ret = srpc_ctx_read_req(&c->cmn, s->cmn.c, chdr->len);
 		if (unlikely(ret <= 0)) {
 			srpc_put_slot(s, idx);
 			if (ret == 0)
@@ -468,27 +829,41 @@ again:
 			return ret;
 		}
 
-		c->cmn.req_len = chdr.len;
+		c->cmn.req_len = chdr->len;
 		c->cmn.resp_len = 0;
-		c->cmn.id = chdr.id;
-		c->ts_sent = chdr.ts_sent;
+		c->cmn.id = chdr->id;
+		c->ts_sent = chdr->ts_sent;
+		c->deadline = chdr->deadline ? microtime() + chdr->deadline : 0;
+		c->drop = false;
+		c->expired = false;
+		if (s->udp)
+			srpc_udp_cache_reserve(s->udp, chdr->id);
 
 		spin_lock_np(&s->lock);
+		if (unlikely(chdr->cls != s->cls))
+			srpc_rebind_session(s, chdr->cls);
 		old_demand = s->demand;
-		s->demand = chdr.demand;
-		s->demand_sync = (chdr.flags & BW_CFLAG_DSYNC);
+		srpc_set_demand(s, chdr->demand);
+		s->demand_sync = (chdr->flags & BW_CFLAG_DSYNC);
 		srpc_remove_from_drained_list(s);
-		s->num_pending++;
+		srpc_num_pending_add(s, 1);
+		/* a request answering a window update samples the RTT */
+		if (SBW_AUTOTUNE && s->last_winupdate_timestamp) {
+			srpc_rtt_sample(microtime() -
+					s->last_winupdate_timestamp);
+			s->last_winupdate_timestamp = 0;
+		}
 		/* adjust window if demand changed */
 		if (s->win > s->num_pending + s->demand) {
 			win_diff = s->win - (s->num_pending + s->demand);
 			s->win = s->num_pending + s->demand;
-			atomic_sub_and_fetch(&srpc_win_used, win_diff);
+			srpc_win_used_add(s, -win_diff);
 		}
 
-		atomic_inc(&srpc_num_pending);
-
-		if (runtime_queue_us() >= SBW_DROP_THRESH) {
+		/* class-aware AQM and deadline-aware admission */
+		queue_us = runtime_queue_us();
+		c->expired = srpc_deadline_missed(c, queue_us);
+		if (c->expired || queue_us >= srpc_drop_thresh(cl)) {
 			thread_t *th;
 
 			c->drop = true;
@@ -498,34 +873,51 @@ again:
 			spin_unlock_np(&s->lock);
 			if (th)
 				thread_ready(th);
-			atomic64_inc(&srpc_stat_req_dropped_);
-			goto again;
+			if (c->expired) {
+				atomic64_inc(&srpc_stat_req_expired_);
+				srpc_trace(SRPC_EV_EXPIRE, chdr->cls, s->id, 0,
+					   0, queue_us);
+			} else {
+				atomic64_inc(&srpc_stat_req_dropped_);
+				atomic64_inc(&cl->stat_req_dropped);
+				srpc_trace(SRPC_EV_DROP, chdr->cls, s->id, 0,
+					   0, queue_us);
+			}
+			return 0;
 		}
 
 		spin_unlock_np(&s->lock);
 
-		ret = thread_spawn(srpc_worker, c);
-		BUG_ON(ret);
+		if (srpc_batch) {
+			srpc_dispatch_one(c);
+			/* ret still holds the payload length */
+			ret = 0;
+		} else {
+			ret = thread_spawn(srpc_worker, c);
+			BUG_ON(ret);
+		}
 
 #if SBW_TRACK_FLOW
 		uint64_t now = microtime();
 		if (s->id == SBW_TRACK_FLOW_ID) {
 			printf("[%lu] ===> Request: id=%lu, demand=%lu, delay=%lu\n",
-			       now, chdr.id, chdr.demand, now - s->last_winupdate_timestamp);
+			       now, chdr->id, chdr->demand, now - s->last_winupdate_timestamp);
 		}
 #endif
 		break;
 	case BW_OP_WINUPDATE:
-		if (unlikely(chdr.len != 0)) {
+		if (unlikely(chdr->len != 0)) {
 			log_warn("srpc: winupdate has nonzero len");
 			return -EINVAL;
 		}
-		assert(chdr.len == 0);
+		assert(chdr->len == 0);
 
 		spin_lock_np(&s->lock);
+		if (unlikely(chdr->cls != s->cls))
+			srpc_rebind_session(s, chdr->cls);
 		old_demand = s->demand;
-		s->demand = chdr.demand;
-		s->demand_sync = (chdr.flags & BW_CFLAG_DSYNC);
+		srpc_set_demand(s, chdr->demand);
+		s->demand_sync = (chdr->flags & BW_CFLAG_DSYNC);
 
 		if (old_demand > 0 && s->demand == 0) {
 			srpc_remove_from_drained_list(s);
@@ -540,11 +932,19 @@ again:
 		if (s->demand == 0)
 			s->advertised_win = 0;
 
+		/* a datagram client lost our window update, send it again */
+		if ((chdr->flags & BW_CFLAG_RESYNC) && s->num_pending == 0) {
+			th = s->sender_th;
+			s->sender_th = NULL;
+			s->need_winupdate = true;
+			s->advertised_win = 0;
+		}
+
 		/* adjust window if demand changed */
 		if (s->win > s->num_pending + s->demand) {
 			win_diff = s->win - (s->num_pending + s->demand);
 			s->win = s->num_pending + s->demand;
-			atomic_sub_and_fetch(&srpc_win_used, win_diff);
+			srpc_win_used_add(s, -win_diff);
 		}
 		spin_unlock_np(&s->lock);
 
@@ -555,18 +955,34 @@ again:
 #if SBW_TRACK_FLOW
 		if (s->id == SBW_TRACK_FLOW_ID) {
 			printf("[%lu] ===> Winupdate: demand=%lu, \n",
-			       microtime(), chdr.demand);
+			       microtime(), chdr->demand);
 		}
 #endif
-		goto again;
+		return 0;
 	default:
-		log_warn("srpc: got invalid op %d", chdr.op);
+		log_warn("srpc: got invalid op %d", chdr->op);
 		return -EINVAL;
 	}
 
 	return ret;
 }
 
+static int srpc_recv_one(struct sbw_session *s)
+{
+	struct cbw_hdr chdr;
+	ssize_t ret;
+
+	/* read the client header */
+	ret = tcp_read_full(s->cmn.c, &chdr, sizeof(chdr));
+	if (unlikely(ret <= 0)) {
+		if (ret == 0)
+			return -EIO;
+		return ret;
+	}
+
+	return srpc_handle_msg(s, &chdr, NULL);
+}
+
 static void srpc_sender(void *arg)
 {
 	DEFINE_BITMAP(tmp, SBW_MAX_WINDOW);
@@ -574,7 +990,6 @@ static void srpc_sender(void *arg)
 	int ret, i;
 	bool sleep;
 	int num_resp;
-	unsigned int core_id;
 	bool send_winupdate;
 	int drained_core;
 	int win;
@@ -605,7 +1020,8 @@ static void srpc_sender(void *arg)
 
 		bitmap_for_each_set(tmp, SBW_MAX_WINDOW, i) {
 			struct sbw_ctx *c = s->slots[i];
-			if (c->drop) {
+			/* missed deadlines are not a congestion signal */
+			if (c->drop && !c->expired) {
 				req_dropped = true;
 				break;
 			}
@@ -616,7 +1032,7 @@ static void srpc_sender(void *arg)
 
 		drained_core = s->drained_core;
 		num_resp = bitmap_popcount(tmp, SBW_MAX_WINDOW);
-		s->num_pending -= num_resp;
+		srpc_num_pending_add(s, -num_resp);
 		srpc_update_window(s, req_dropped);
 
 		win = s->win;
@@ -644,7 +1060,6 @@ static void srpc_sender(void *arg)
 
 		/* send a response for each completed slot */
 		ret = srpc_send_completion_vector(s, tmp);
-		core_id = get_current_affinity();
 
 		/* add to the drained list if (1) window becomes zero,
 		 * (2) s is not in the list already,
@@ -654,20 +1069,17 @@ static void srpc_sender(void *arg)
 		    SBW_MAX_WINDOW) {
 			spin_lock_np(&s->lock);
 			if (!s->demand_sync || s->demand > 0) {
-				spin_lock_np(&srpc_drained[core_id].lock);
+				struct srpc_drained_ *d =
+					&srpc_drained[s->cls][s->core];
+
+				spin_lock_np(&d->lock);
 				assert(!s->is_linked);
 				BUG_ON(s->win > 0);
-				if (!s->demand_sync) {
-					list_add_tail(&srpc_drained[core_id].list,
-						      &s->drained_link);
-				} else if (s->demand > 0) {
-					list_add_tail(&srpc_drained[core_id].list,
-						      &s->drained_link);
-				}
+				list_add_tail(&d->list, &s->drained_link);
 				s->is_linked = true;
-				spin_unlock_np(&srpc_drained[core_id].lock);
-				s->drained_core = core_id;
-				atomic_inc(&srpc_num_drained);
+				spin_unlock_np(&d->lock);
+				s->drained_core = s->core;
+				atomic_inc(&srpc_pcpu[s->core].num_drained[s->cls]);
 			}
 			spin_unlock_np(&s->lock);
 #if SBW_TRACK_FLOW
@@ -706,20 +1118,25 @@ close:
 	waitgroup_done(&s->send_waiter);
 }
 
-static void srpc_server(void *arg)
+static struct sbw_session *srpc_session_create(tcpconn_t *c,
+						struct sbw_udp *udp)
 {
-	tcpconn_t *c = (tcpconn_t *)arg;
 	struct sbw_session *s;
-	thread_t *th;
 	int ret;
 
 	s = smalloc(sizeof(*s));
-	BUG_ON(!s);
+	if (unlikely(!s))
+		return NULL;
 	memset(s, 0, sizeof(*s));
 
 	s->cmn.c = c;
+	s->udp = udp;
 	s->drained_core = -1;
 	s->id = atomic_fetch_and_add(&srpc_num_sess, 1) + 1;
+	s->core = (unsigned int)atomic_fetch_and_add(&srpc_sess_seq, 1) %
+		  runtime_max_cores();
+	atomic_inc(&srpc_classes[0].num_sess);
+	atomic_inc(&srpc_pcpu[s->core].num_sess[0]);
 	bitmap_init(s->avail_slots, SBW_MAX_WINDOW, true);
 
 	waitgroup_init(&s->send_waiter);
@@ -735,11 +1152,13 @@ static void srpc_server(void *arg)
 	ret = thread_spawn(srpc_sender, s);
 	BUG_ON(ret);
 
-	while (true) {
-		ret = srpc_recv_one(s);
-		if (ret)
-			break;
-	}
+	return s;
+}
+
+static void srpc_session_destroy(struct sbw_session *s)
+{
+	thread_t *th;
+	int i, j;
 
 	spin_lock_np(&s->lock);
 	th = s->sender_th;
@@ -747,11 +1166,12 @@ static void srpc_server(void *arg)
 	s->closed = true;
 	if (s->is_linked)
 		srpc_remove_from_drained_list(s);
-	atomic_sub_and_fetch(&srpc_win_used, s->win);
-	atomic_sub_and_fetch(&srpc_num_pending, s->num_pending);
-	s->num_pending = 0;
-	s->demand = 0;
+	srpc_win_used_add(s, -s->win);
+	srpc_num_pending_add(s, -s->num_pending);
+	srpc_set_demand(s, 0);
 	s->win = 0;
+	atomic_dec(&srpc_classes[s->cls].num_sess);
+	atomic_dec(&srpc_pcpu[s->core].num_sess[s->cls]);
 	spin_unlock_np(&s->lock);
 
 	if (th)
@@ -759,47 +1179,573 @@ static void srpc_server(void *arg)
 
 	atomic_dec(&srpc_num_sess);
 	waitgroup_wait(&s->send_waiter);
-	tcp_close(c);
+	if (s->cmn.c)
+		tcp_close(s->cmn.c);
 	sfree(s);
 
 	/* initialize windows */
 	if (atomic_read(&srpc_num_sess) == 0) {
-		assert(atomic_read(&srpc_win_used) == 0);
-		assert(atomic_read(&srpc_num_drained) == 0);
-		atomic_write(&srpc_win_used, 0);
 		atomic_write(&srpc_win_avail, runtime_max_cores());
+		for (i = 0; i < runtime_max_cores(); i++) {
+			for (j = 0; j < SRPC_NR_CLASSES; j++) {
+				assert(atomic_read(&srpc_pcpu[i].win_used[j]) == 0);
+				assert(atomic_read(&srpc_pcpu[i].num_drained[j]) == 0);
+				atomic_write(&srpc_pcpu[i].win_used[j], 0);
+			}
+		}
 		fflush(stdout);
 	}
 }
 
+static void srpc_server(void *arg)
+{
+	tcpconn_t *c = (tcpconn_t *)arg;
+	struct sbw_session *s;
+	int ret;
+
+	s = srpc_session_create(c, NULL);
+	BUG_ON(!s);
+
+	while (true) {
+		ret = srpc_recv_one(s);
+		if (ret)
+			break;
+	}
+
+	srpc_session_destroy(s);
+}
+
+/*
+ * Datagram transport: one session per client address. Datagrams are handled
+ * by spawned threads, serialized per session; credits work as over TCP.
+ */
+
+static DEFINE_SPINLOCK(srpc_udp_lock);
+static struct list_head srpc_udp_sessions[SBW_UDP_HASH_SIZE];
+/* serializes session creation */
+static mutex_t srpc_udp_create_lock;
+
+static struct list_head *srpc_udp_bucket(struct netaddr raddr)
+{
+	return &srpc_udp_sessions[hash_crc32c_one(0,
+			((uint64_t)raddr.ip << 16) | raddr.port) %
+			SBW_UDP_HASH_SIZE];
+}
+
+/* finds the session of a client and takes a reference (must be released) */
+static struct sbw_session *srpc_udp_get(struct netaddr raddr)
+{
+	struct list_head *h = srpc_udp_bucket(raddr);
+	struct sbw_udp *u;
+
+	spin_lock_np(&srpc_udp_lock);
+	list_for_each(h, u, link) {
+		if (u->raddr.ip == raddr.ip && u->raddr.port == raddr.port &&
+		    !u->closing) {
+			waitgroup_add(&u->rx_waiter, 1);
+			spin_unlock_np(&srpc_udp_lock);
+			return u->s;
+		}
+	}
+	spin_unlock_np(&srpc_udp_lock);
+
+	return NULL;
+}
+
+static void srpc_udp_put(struct sbw_session *s)
+{
+	waitgroup_done(&s->udp->rx_waiter);
+}
+
+/* runs for the lifetime of a datagram session */
+static void srpc_udp_server(void *arg)
+{
+	struct sbw_session *s = (struct sbw_session *)arg;
+	struct sbw_udp *u = s->udp;
+	int i;
+
+	/* there is no connection, wait for a close message or idleness */
+	while (!ACCESS_ONCE(u->closing) &&
+	       microtime() - ACCESS_ONCE(u->last_rx) < SBW_UDP_IDLE_US)
+		timer_sleep(SBW_UDP_POLL_US);
+
+	spin_lock_np(&srpc_udp_lock);
+	u->closing = true;
+	list_del_from(srpc_udp_bucket(u->raddr), &u->link);
+	spin_unlock_np(&srpc_udp_lock);
+
+	/* wait for handlers that already found the session */
+	waitgroup_wait(&u->rx_waiter);
+	srpc_session_destroy(s);
+
+	for (i = 0; i < SBW_UDP_CACHE_SIZE; i++) {
+		if (u->cache[i].buf)
+			sfree(u->cache[i].buf);
+	}
+	sfree(u);
+}
+
+/* creates the session of a new client and takes a reference */
+static struct sbw_session *srpc_udp_create(struct netaddr laddr,
+					   struct netaddr raddr)
+{
+	struct sbw_session *s;
+	struct sbw_udp *u;
+	int ret;
+
+	mutex_lock(&srpc_udp_create_lock);
+
+	/* another datagram may have created it in the meantime */
+	s = srpc_udp_get(raddr);
+	if (s)
+		goto out;
+
+	u = smalloc(sizeof(*u));
+	if (unlikely(!u))
+		goto out;
+	memset(u, 0, sizeof(*u));
+	u->laddr = laddr;
+	u->raddr = raddr;
+	u->last_rx = microtime();
+	mutex_init(&u->rx_lock);
+	waitgroup_init(&u->rx_waiter);
+	waitgroup_add(&u->rx_waiter, 1);
+	spin_lock_init(&u->cache_lock);
+
+	s = srpc_session_create(NULL, u);
+	if (unlikely(!s)) {
+		sfree(u);
+		goto out;
+	}
+	u->s = s;
+
+	spin_lock_np(&srpc_udp_lock);
+	list_add_tail(srpc_udp_bucket(raddr), &u->link);
+	spin_unlock_np(&srpc_udp_lock);
+
+	ret = thread_spawn(srpc_udp_server, s);
+	BUG_ON(ret);
+
+out:
+	mutex_unlock(&srpc_udp_create_lock);
+	return s;
+}
+
+/*
+ * srpc_udp_dup - suppresses a retransmitted request
+ *
+ * Returns true if the request was seen before. Its response is sent again if
+ * it is still cached, nothing is sent while it is in progress, and if its
+ * response is gone, the client is told that it was dropped.
+ */
+static bool srpc_udp_dup(struct sbw_session *s, const struct cbw_hdr *chdr)
+{
+	struct sbw_udp *u = s->udp;
+	struct sbw_udp_resp *e;
+	struct sbw_hdr shdr;
+	uint64_t id = chdr->id, base, i;
+
+	if (unlikely(id < u->seen_base))
+		goto gone;
+
+	/* slide the window forward, forgetting the oldest IDs */
+	if (id >= u->seen_base + SBW_UDP_SEEN_WINDOW) {
+		base = id - SBW_UDP_SEEN_WINDOW + 1;
+		for (i = u->seen_base;
+		     i < MIN(base, u->seen_base + SBW_UDP_SEEN_WINDOW); i++)
+			bitmap_clear(u->seen, i % SBW_UDP_SEEN_WINDOW);
+		u->seen_base = base;
+	}
+
+	if (!bitmap_test(u->seen, id % SBW_UDP_SEEN_WINDOW)) {
+		bitmap_set(u->seen, id % SBW_UDP_SEEN_WINDOW);
+		return false;
+	}
+
+	e = &u->cache[id % SBW_UDP_CACHE_SIZE];
+	spin_lock_np(&u->cache_lock);
+	if (e->id == id) {
+		if (e->buf)
+			udp_send(e->buf, e->len, u->laddr, u->raddr);
+		spin_unlock_np(&u->cache_lock);
+		return true;
+	}
+	spin_unlock_np(&u->cache_lock);
+
+gone:
+	shdr.magic = BW_RESP_MAGIC;
+	shdr.op = BW_OP_CALL;
+	shdr.len = 0;
+	shdr.id = id;
+	shdr.win = (uint64_t)ACCESS_ONCE(s->win);
+	shdr.ts_sent = chdr->ts_sent;
+	shdr.flags = BW_SFLAG_DROP;
+	shdr.cls = s->cls;
+
+	udp_send(&shdr, sizeof(shdr), u->laddr, u->raddr);
+	return true;
+}
+
+static void srpc_udp_handler(struct udp_spawn_data *d)
+{
+	const char *payload = (const char *)d->buf + sizeof(struct cbw_hdr);
+	struct cbw_hdr chdr;
+	struct sbw_session *s;
+	struct sbw_udp *u;
+
+	if (unlikely(d->len < sizeof(chdr)))
+		goto done;
+	memcpy(&chdr, d->buf, sizeof(chdr));
+	if (unlikely(chdr.magic != BW_REQ_MAGIC ||
+		     chdr.len != d->len - sizeof(chdr))) {
+		log_warn_ratelimited("srpc: got invalid datagram");
+		goto done;
+	}
+
+	s = srpc_udp_get(d->raddr);
+	if (!s) {
+		if (chdr.op == BW_OP_CLOSE)
+			goto done;
+		s = srpc_udp_create(d->laddr, d->raddr);
+		if (unlikely(!s))
+			goto done;
+	}
+	u = s->udp;
+
+	mutex_lock(&u->rx_lock);
+	u->last_rx = microtime();
+	if (chdr.op == BW_OP_CLOSE) {
+		u->closing = true;
+	} else if (chdr.op != BW_OP_CALL || !srpc_udp_dup(s, &chdr)) {
+		if (unlikely(srpc_handle_msg(s, &chdr, payload)))
+			u->closing = true;
+	}
+	mutex_unlock(&u->rx_lock);
+	srpc_udp_put(s);
+
+done:
+	udp_spawn_data_release(d->release_data);
+}
+
+/*
+ * srpc_tune - folds in new service time and RTT estimates and derives the
+ * control parameters from them
+ */
+static void srpc_tune(void)
+{
+	struct srpc_params p = srpc_params;
+	uint64_t cycles = 0, count = 0;
+	double delay, scale;
+	long v, rtt;
+	int i;
+
+	for (i = 0; i < runtime_max_cores(); i++) {
+		v = atomic64_read(&srpc_st_acc[i].cycles);
+		atomic64_fetch_and_sub(&srpc_st_acc[i].cycles, v);
+		cycles += v;
+		v = atomic64_read(&srpc_st_acc[i].count);
+		atomic64_fetch_and_sub(&srpc_st_acc[i].count, v);
+		count += v;
+	}
+
+	if (count > 0) {
+		double st = (double)cycles / count / cycles_per_us;
+
+		if (p.est_service_us == 0.0)
+			p.est_service_us = st;
+		else
+			p.est_service_us += SBW_TUNE_EWMA *
+					    (st - p.est_service_us);
+	}
+
+	rtt = atomic64_read(&srpc_rtt_min);
+	atomic64_write(&srpc_rtt_min, LONG_MAX);
+	if (rtt != LONG_MAX)
+		p.est_rtt_us += SBW_TUNE_EWMA * ((double)rtt - p.est_rtt_us);
+
+	/* no requests yet, keep the initial parameters */
+	if (p.est_service_us == 0.0)
+		return;
+
+	delay = SBW_TUNE_DELAY_BASE_US +
+		SBW_TUNE_DELAY_ST_MULT * p.est_service_us + p.est_rtt_us;
+	delay = MIN(MAX(delay, SBW_MIN_DELAY_LO_US), SBW_MIN_DELAY_HI_US);
+	p.min_delay_us = (uint64_t)delay;
+	p.drop_thresh_us = p.min_delay_us * SBW_TUNE_DROP_MULT;
+
+	p.rtt_us = MIN(MAX((uint64_t)p.est_rtt_us, SBW_RTT_LO_US),
+		       SBW_RTT_HI_US);
+
+	/* keep the increase and decrease rates per unit time constant */
+	scale = (double)p.rtt_us / SBW_RTT_US;
+	p.ai = MIN(MAX(SBW_AI * scale, SBW_AI_LO), SBW_AI_HI);
+	p.md = MIN(MAX(SBW_MD * scale, SBW_MD_LO), SBW_MD_HI);
+
+	srpc_params = p;
+}
+
+/* sums the per-core counters of each class (not atomically) */
+static void srpc_sum_cores(void)
+{
+	int i, j;
+
+	for (i = 0; i < SRPC_NR_CLASSES; i++) {
+		struct sbw_class *cl = &srpc_classes[i];
+
+		cl->win_used = 0;
+		cl->num_pending = 0;
+		cl->demand = 0;
+		cl->num_drained = 0;
+		for (j = 0; j < runtime_max_cores(); j++) {
+			struct srpc_pcpu_ *p = &srpc_pcpu[j];
+
+			cl->win_used += atomic_read(&p->win_used[i]);
+			cl->num_pending += atomic_read(&p->num_pending[i]);
+			cl->demand += atomic_read(&p->demand[i]);
+			cl->num_drained += atomic_read(&p->num_drained[i]);
+		}
+	}
+}
+
+/*
+ * srpc_split_class - splits a class's window into per-core budgets
+ *
+ * Each core with sessions of the class gets a share in proportion to what
+ * they need, counted as in srpc_allot_classes(). The rounding remainder
+ * rotates among the cores so none is favored over time.
+ */
+static void srpc_split_class(int cls)
+{
+	static unsigned int rotor;
+	struct sbw_class *cl = &srpc_classes[cls];
+	int need[NCPU], budget[NCPU];
+	int max_cores = runtime_max_cores();
+	int total = atomic_read(&cl->win_avail);
+	int sum = 0, left = total;
+	int i, j;
+
+	for (i = 0; i < max_cores; i++) {
+		struct srpc_pcpu_ *p = &srpc_pcpu[i];
+
+		need[i] = 0;
+		budget[i] = 0;
+		if (atomic_read(&p->num_sess[cls]) <= 0)
+			continue;
+		need[i] = MAX(atomic_read(&p->win_used[cls]),
+			      atomic_read(&p->num_pending[cls]) +
+			      atomic_read(&p->demand[cls]));
+		need[i] = MAX(need[i] + atomic_read(&p->num_drained[cls]), 1);
+		sum += need[i];
+	}
+
+	if (sum > 0) {
+		for (i = 0; i < max_cores; i++) {
+			budget[i] = (int64_t)total * need[i] / sum;
+			left -= budget[i];
+		}
+		for (i = 0; left > 0 && i < max_cores; i++) {
+			j = (rotor + i) % max_cores;
+			if (need[j] == 0)
+				continue;
+			budget[j]++;
+			left--;
+		}
+		rotor++;
+	}
+
+	for (i = 0; i < max_cores; i++)
+		atomic_write(&srpc_pcpu[i].win_avail[cls], budget[i]);
+}
+
+/*
+ * srpc_allot_classes - splits the global window among the request classes
+ *
+ * Strict classes are served first, in class order, up to what they need.
+ * What is left is water-filled among the weighted classes in proportion to
+ * their weights, so no class holds credits it can't use while another is
+ * short, and any surplus is spread by weight for overprovisioning.
+ */
+static void srpc_allot_classes(int total)
+{
+	int need[SRPC_NR_CLASSES], alloc[SRPC_NR_CLASSES];
+	int left = total;
+	int pool, give, first = -1;
+	unsigned int weight;
+	bool progress;
+	int i;
+
+	for (i = 0; i < SRPC_NR_CLASSES; i++) {
+		struct sbw_class *cl = &srpc_classes[i];
+
+		alloc[i] = 0;
+		need[i] = 0;
+		if (atomic_read(&cl->num_sess) == 0)
+			continue;
+		if (first == -1)
+			first = i;
+		need[i] = MAX(cl->win_used, cl->num_pending + cl->demand);
+		need[i] = MAX(need[i] + cl->num_drained, 1);
+	}
+
+	/* strict priority classes */
+	for (i = 0; i < SRPC_NR_CLASSES && left > 0; i++) {
+		if (!srpc_classes[i].strict)
+			continue;
+		give = MIN(need[i], left);
+		alloc[i] += give;
+		left -= give;
+	}
+
+	/* weighted classes */
+	do {
+		weight = 0;
+		for (i = 0; i < SRPC_NR_CLASSES; i++) {
+			if (!srpc_classes[i].strict && alloc[i] < need[i])
+				weight += srpc_classes[i].weight;
+		}
+		if (weight == 0 || left <= 0)
+			break;
+
+		progress = false;
+		pool = left;
+		for (i = 0; i < SRPC_NR_CLASSES && left > 0; i++) {
+			if (srpc_classes[i].strict || alloc[i] >= need[i])
+				continue;
+			give = MAX(pool * srpc_classes[i].weight / weight, 1);
+			give = MIN(give, need[i] - alloc[i]);
+			give = MIN(give, left);
+			alloc[i] += give;
+			left -= give;
+			progress = true;
+		}
+	} while (progress);
+
+	/* surplus */
+	weight = 0;
+	for (i = 0; i < SRPC_NR_CLASSES; i++) {
+		if (atomic_read(&srpc_classes[i].num_sess) > 0)
+			weight += srpc_classes[i].weight;
+	}
+	if (weight > 0 && left > 0) {
+		pool = left;
+		for (i = 0; i < SRPC_NR_CLASSES; i++) {
+			if (atomic_read(&srpc_classes[i].num_sess) == 0)
+				continue;
+			give = pool * srpc_classes[i].weight / weight;
+			alloc[i] += give;
+			left -= give;
+		}
+		if (first >= 0)
+			alloc[first] += left;
+	}
+
+	for (i = 0; i < SRPC_NR_CLASSES; i++)
+		atomic_write(&srpc_classes[i].win_avail, alloc[i]);
+}
+
+/* gives a drained session of a core one credit, returns false if none */
+static bool srpc_wake_one(int cls, int core_id)
+{
+	struct sbw_session *ds;
+	thread_t *th;
+
+	ds = srpc_choose_drained_session(cls, core_id);
+	if (!ds)
+		return false;
+
+	spin_lock_np(&ds->lock);
+	BUG_ON(ds->win > 0);
+	th = ds->sender_th;
+	ds->sender_th = NULL;
+	ds->wake_up = true;
+	ds->win = 1;
+	srpc_win_used_add(ds, 1);
+	spin_unlock_np(&ds->lock);
+
+	if (th)
+		thread_ready(th);
+	srpc_trace(SRPC_EV_WAKE, cls, ds->id, 1,
+		   atomic_read(&srpc_pcpu[core_id].win_used[cls]), 0);
+	return true;
+}
+
+/*
+ * srpc_wake_drained - gives credit back to drained sessions
+ *
+ * Each core's drained sessions are woken with what is left of the core's
+ * budget. Budget that a core has no drained sessions for is then moved to
+ * cores that still have some.
+ */
+static void srpc_wake_drained(int cls)
+{
+	struct srpc_pcpu_ *p;
+	int max_cores = runtime_max_cores();
+	int open[NCPU];
+	int spare = 0, donor = 0;
+	int i;
+
+	for (i = 0; i < max_cores; i++) {
+		p = &srpc_pcpu[i];
+		open[i] = atomic_read(&p->win_avail[cls]) -
+			  atomic_read(&p->win_used[cls]);
+		while (open[i] > 0 && atomic_read(&p->num_drained[cls]) > 0 &&
+		       srpc_wake_one(cls, i))
+			open[i]--;
+		spare += MAX(open[i], 0);
+	}
+
+	for (i = 0; i < max_cores && spare > 0; i++) {
+		p = &srpc_pcpu[i];
+		while (spare > 0 && atomic_read(&p->num_drained[cls]) > 0) {
+			while (open[donor] <= 0)
+				donor++;
+			/* move the credit first so the wakeup can use it */
+			atomic_dec(&srpc_pcpu[donor].win_avail[cls]);
+			atomic_inc(&p->win_avail[cls]);
+			if (!srpc_wake_one(cls, i)) {
+				atomic_inc(&srpc_pcpu[donor].win_avail[cls]);
+				atomic_dec(&p->win_avail[cls]);
+				break;
+			}
+			open[donor]--;
+			spare--;
+		}
+	}
+}
+
 static void srpc_cc_worker(void *arg)
 {
 	uint64_t us;
 	float alpha;
         int new_win;
-	int win_used;
-	int win_open;
 	int num_sess;
-	struct sbw_session *ds;
 	unsigned int max_cores = runtime_max_cores();
-	unsigned int core_id, i;
-	thread_t *th;
+	uint64_t min_delay, last_tune = microtime();
+	int i, win_used;
 
 	while (true) {
-		timer_sleep(SBW_RTT_US);
+		timer_sleep(srpc_params.rtt_us);
+
+		if (SBW_AUTOTUNE &&
+		    microtime() - last_tune >= SBW_TUNE_INTERVAL_US) {
+			srpc_tune();
+			last_tune = microtime();
+		}
+
+		min_delay = srpc_params.min_delay_us;
 		us = runtime_queue_us();
 		new_win = atomic_read(&srpc_win_avail);
 		num_sess = atomic_read(&srpc_num_sess);
 
-		if (us >= SBW_MIN_DELAY_US) {
-			alpha = (us - SBW_MIN_DELAY_US) / (float)SBW_MIN_DELAY_US;
-			alpha = alpha * SBW_MD;
+		if (us >= min_delay) {
+			alpha = (us - min_delay) / (float)min_delay;
+			alpha = alpha * srpc_params.md;
 			alpha = MAX(1.0 - alpha, 0.5);
 
 			new_win = (int)(new_win * alpha);
 			win_carry = 0.0;
 		} else {
-			win_carry += num_sess * SBW_AI;
+			win_carry += num_sess * srpc_params.ai;
 			if (win_carry >= 1.0) {
 				int new_win_int = (int)win_carry;
 				new_win += new_win_int;
@@ -810,73 +1756,79 @@ static void srpc_cc_worker(void *arg)
 		new_win = MAX(new_win, max_cores);
 		new_win = MIN(new_win, atomic_read(&srpc_num_sess) << SBW_MAX_WINDOW_EXP);
 
-		// Wake up threads from drained list
-		win_used = atomic_read(&srpc_win_used);
-		win_open = new_win - win_used;
-		core_id = get_current_affinity();
-
-		while (win_open > 0) {
-			ds = srpc_choose_drained_session(core_id);
-
-			i = (core_id + 1) % max_cores;
-			while (!ds && i != core_id) {
-				ds = srpc_choose_drained_session(i);
-				i = (i + 1) % max_cores;
-			}
-
-			if (!ds)
-				break;
-
-			spin_lock_np(&ds->lock);
-			BUG_ON(ds->win > 0);
-			th = ds->sender_th;
-			ds->sender_th = NULL;
-			ds->wake_up = true;
-			ds->win = 1;
-			spin_unlock_np(&ds->lock);
-
-			atomic_inc(&srpc_win_used);
+		// Split the window among classes, then among cores
+		srpc_sum_cores();
+		srpc_allot_classes(new_win);
+		for (i = 0; i < SRPC_NR_CLASSES; i++)
+			srpc_split_class(i);
 
-			if (th)
-				thread_ready(th);
-			win_open--;
-		}
+		// Wake up threads from drained list
+		for (i = 0; i < SRPC_NR_CLASSES; i++)
+			srpc_wake_drained(i);
 
 		atomic_write(&srpc_win_avail, new_win);
 
-#if SBW_TS_OUT
-		record(new_win, us);
-#endif
+		win_used = 0;
+		for (i = 0; i < SRPC_NR_CLASSES; i++)
+			win_used += srpc_classes[i].win_used;
+		srpc_trace(SRPC_EV_CC, 0, 0, new_win, win_used, us);
 	}
 }
 
-static void srpc_listener(void *arg)
+/* resets the global state before the server starts */
+static void srpc_init(void)
 {
-	struct netaddr laddr;
-	tcpconn_t *c;
-	tcpqueue_t *q;
-	int ret;
-	int i;
+	int i, j;
 
-	for (i = 0 ; i < NCPU ; ++i) {
-		spin_lock_init(&srpc_drained[i].lock);
-		list_head_init(&srpc_drained[i].list);
+	for (i = 0; i < SRPC_NR_CLASSES; ++i) {
+		for (j = 0 ; j < NCPU ; ++j) {
+			spin_lock_init(&srpc_drained[i][j].lock);
+			list_head_init(&srpc_drained[i][j].list);
+		}
 	}
 
 	atomic_write(&srpc_num_sess, 0);
-	atomic_write(&srpc_num_drained, 0);
-
 	atomic_write(&srpc_win_avail, runtime_max_cores());
-	atomic_write(&srpc_win_used, 0);
-	atomic_write(&srpc_num_pending, 0);
+
+	/* until the cc worker runs, each core's sessions may use one credit */
+	memset(srpc_pcpu, 0, sizeof(srpc_pcpu));
+	for (j = 0; j < runtime_max_cores(); ++j)
+		atomic_write(&srpc_pcpu[j].win_avail[0], 1);
 
 	/* init stats */
 	atomic64_write(&srpc_stat_winu_rx_, 0);
 	atomic64_write(&srpc_stat_winu_tx_, 0);
 	atomic64_write(&srpc_stat_req_rx_, 0);
 	atomic64_write(&srpc_stat_resp_tx_, 0);
+	atomic64_write(&srpc_stat_req_expired_, 0);
+
+	for (i = 0; i < SRPC_NR_CLASSES; ++i) {
+		struct sbw_class *cl = &srpc_classes[i];
+
+		atomic_write(&cl->num_sess, 0);
+		atomic_write(&cl->win_avail, i == 0 ? runtime_max_cores() : 0);
+		cl->num_drained = 0;
+		cl->win_used = 0;
+		cl->num_pending = 0;
+		cl->demand = 0;
+		atomic64_write(&cl->stat_req_rx, 0);
+		atomic64_write(&cl->stat_req_dropped, 0);
+		atomic64_write(&cl->stat_resp_tx, 0);
+	}
 
 	win_carry = 0.0;
+	atomic64_write(&srpc_rtt_min, LONG_MAX);
+	srpc_trace_init();
+}
+
+static void srpc_listener(void *arg)
+{
+	struct netaddr laddr;
+	tcpconn_t *c;
+	tcpqueue_t *q;
+	int ret;
+
+	srpc_init();
 
 	laddr.ip = 0;
 	laddr.port = SRPC_PORT;
@@ -896,10 +1848,9 @@ static void srpc_listener(void *arg)
 	}
 }
 
-int sbw_enable(srpc_fn_t handler)
+static int srpc_set_handler(srpc_fn_t handler)
 {
 	static DEFINE_SPINLOCK(l);
-	int ret;
 
 	spin_lock_np(&l);
 	if (srpc_handler) {
@@ -909,11 +1860,73 @@ int sbw_enable(srpc_fn_t handler)
 	srpc_handler = handler;
 	spin_unlock_np(&l);
 
+	return 0;
+}
+
+int sbw_enable(srpc_fn_t handler)
+{
+	int ret;
+
+	ret = srpc_set_handler(handler);
+	if (ret)
+		return ret;
+
+	ret = thread_spawn(srpc_listener, NULL);
+	BUG_ON(ret);
+	return 0;
+}
+
+int sbw_batch_enable(srpc_fn_t handler)
+{
+	int ret, i, j;
+
+	ret = srpc_set_handler(handler);
+	if (ret)
+		return ret;
+
+	srpc_nr_dispatch = runtime_max_cores();
+	for (i = 0; i < srpc_nr_dispatch; i++) {
+		spin_lock_init(&srpc_dispatch[i].lock);
+		list_head_init(&srpc_dispatch[i].reqs);
+		for (j = 0; j < SBW_BATCH_WORKERS; j++) {
+			ret = thread_spawn(srpc_batch_worker,
+					   &srpc_dispatch[i]);
+			BUG_ON(ret);
+		}
+	}
+	srpc_batch = true;
+
 	ret = thread_spawn(srpc_listener, NULL);
 	BUG_ON(ret);
 	return 0;
 }
 
+int sbw_udp_enable(srpc_fn_t handler)
+{
+	static udpspawner_t *spawner;
+	struct netaddr laddr;
+	int ret, i;
+
+	ret = srpc_set_handler(handler);
+	if (ret)
+		return ret;
+
+	srpc_init();
+	for (i = 0; i < SBW_UDP_HASH_SIZE; i++)
+		list_head_init(&srpc_udp_sessions[i]);
+	mutex_init(&srpc_udp_create_lock);
+
+	laddr.ip = 0;
+	laddr.port = SRPC_PORT;
+	ret = udp_create_spawner(laddr, srpc_udp_handler, &spawner);
+	if (ret)
+		return ret;
+
+	ret = thread_spawn(srpc_cc_worker, NULL);
+	BUG_ON(ret);
+	return 0;
+}
+
 uint64_t sbw_stat_winu_rx()
 {
 	return atomic64_read(&srpc_stat_winu_rx_);
@@ -944,6 +1957,46 @@ uint64_t sbw_stat_resp_tx()
 	return atomic64_read(&srpc_stat_resp_tx_);
 }
 
+uint64_t sbw_stat_req_expired()
+{
+	return atomic64_read(&srpc_stat_req_expired_);
+}
+
+int sbw_set_class(int cls, unsigned int weight, bool strict,
+		  uint64_t drop_thresh_us)
+{
+	struct sbw_class *cl;
+
+	if (cls < 0 || cls >= SRPC_NR_CLASSES || weight == 0)
+		return -EINVAL;
+
+	cl = &srpc_classes[cls];
+	ACCESS_ONCE(cl->weight) = weight;
+	ACCESS_ONCE(cl->strict) = strict;
+	ACCESS_ONCE(cl->drop_thresh) = drop_thresh_us;
+	return 0;
+}
+
+uint64_t sbw_stat_class_req_rx(int cls)
+{
+	return atomic64_read(&srpc_classes[cls].stat_req_rx);
+}
+
+uint64_t sbw_stat_class_req_dropped(int cls)
+{
+	return atomic64_read(&srpc_classes[cls].stat_req_dropped);
+}
+
+uint64_t sbw_stat_class_resp_tx(int cls)
+{
+	return atomic64_read(&srpc_classes[cls].stat_resp_tx);
+}
+
+void sbw_stat_params(struct srpc_params *p)
+{
+	*p = srpc_params;
+}
+
 struct srpc_ops sbw_ops = {
 	.srpc_enable		= sbw_enable,
 	.srpc_stat_winu_rx	= sbw_stat_winu_rx,
@@ -952,4 +2005,42 @@ struct srpc_ops sbw_ops = {
 	.srpc_stat_req_rx	= sbw_stat_req_rx,
 	.srpc_stat_req_dropped	= sbw_stat_req_dropped,
 	.srpc_stat_resp_tx	= sbw_stat_resp_tx,
+	.srpc_stat_req_expired	= sbw_stat_req_expired,
+	.srpc_set_class		= sbw_set_class,
+	.srpc_stat_class_req_rx	= sbw_stat_class_req_rx,
+	.srpc_stat_class_req_dropped = sbw_stat_class_req_dropped,
+	.srpc_stat_class_resp_tx = sbw_stat_class_resp_tx,
+	.srpc_stat_params	= sbw_stat_params,
+};
+
+struct srpc_ops sbw_udp_ops = {
+	.srpc_enable		= sbw_udp_enable,
+	.srpc_stat_winu_rx	= sbw_stat_winu_rx,
+	.srpc_stat_winu_tx	= sbw_stat_winu_tx,
+	.srpc_stat_win_tx	= sbw_stat_win_tx,
+	.srpc_stat_req_rx	= sbw_stat_req_rx,
+	.srpc_stat_req_dropped	= sbw_stat_req_dropped,
+	.srpc_stat_resp_tx	= sbw_stat_resp_tx,
+	.srpc_stat_req_expired	= sbw_stat_req_expired,
+	.srpc_set_class		= sbw_set_class,
+	.srpc_stat_class_req_rx	= sbw_stat_class_req_rx,
+	.srpc_stat_class_req_dropped = sbw_stat_class_req_dropped,
+	.srpc_stat_class_resp_tx = sbw_stat_class_resp_tx,
+	.srpc_stat_params	= sbw_stat_params,
+};
+
+struct srpc_ops sbw_batch_ops = {
+	.srpc_enable		= sbw_batch_enable,
+	.srpc_stat_winu_rx	= sbw_stat_winu_rx,
+	.srpc_stat_winu_tx	= sbw_stat_winu_tx,
+	.srpc_stat_win_tx	= sbw_stat_win_tx,
+	.srpc_stat_req_rx	= sbw_stat_req_rx,
+	.srpc_stat_req_dropped	= sbw_stat_req_dropped,
+	.srpc_stat_resp_tx	= sbw_stat_resp_tx,
+	.srpc_stat_req_expired	= sbw_stat_req_expired,
+	.srpc_set_class		= sbw_set_class,
+	.srpc_stat_class_req_rx	= sbw_stat_class_req_rx,
+	.srpc_stat_class_req_dropped = sbw_stat_class_req_dropped,
+	.srpc_stat_class_resp_tx = sbw_stat_class_resp_tx,
+	.srpc_stat_params	= sbw_stat_params,
 };
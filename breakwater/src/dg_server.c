@@ -22,6 +22,7 @@
 #include "util.h"
 #include "dg_proto.h"
 #include "dg_config.h"
+#include "trace.h"
 
 /* the maximum supported window size */
 #define SDG_MAX_WINDOW_EXP	6
@@ -30,34 +31,10 @@
 #define SDG_TRACK_FLOW		false
 #define SDG_TRACK_FLOW_ID	1
 
-#define SDG_TS_OUT		false
-#define TS_BUF_SIZE_EXP		15
-#define TS_BUF_SIZE		(1 << TS_BUF_SIZE_EXP)
-#define TS_BUF_MASK		(TS_BUF_SIZE - 1)
-
 #define EWMA_WEIGHT		0.1f
 
 BUILD_ASSERT((1 << SDG_MAX_WINDOW_EXP) == SDG_MAX_WINDOW);
 
-#if SDG_TS_OUT
-int nextIndex = 0;
-FILE *signal_out = NULL;
-
-struct Event {
-	uint64_t timestamp;
-	int win_avail;
-	int win_used;
-	int num_pending;
-	int num_drained;
-	int num_active;
-	int num_sess;
-	uint64_t delay;
-	int num_cores;
-};
-
-static struct Event events[TS_BUF_SIZE];
-#endif
-
 /* the handler function for each RPC */
 static srpc_fn_t srpc_handler;
 
@@ -108,46 +85,6 @@ atomic64_t srpc_stat_req_rx_;
 atomic64_t srpc_stat_req_dropped_;
 atomic64_t srpc_stat_resp_tx_;
 
-#if SDG_TS_OUT
-static void printRecord()
-{
-	int i;
-
-	if (!signal_out)
-		signal_out = fopen("signal.csv", "w");
-
-	for (i = 0; i < TS_BUF_SIZE; ++i) {
-		struct Event *event = &events[i];
-		fprintf(signal_out, "%lu,%d,%d,%d,%d,%d,%d,%lu,%d\n",
-			event->timestamp, event->win_avail,
-			event->win_used, event->num_pending,
-			event->num_drained, event->num_active,
-			event->num_sess, event->delay,
-			event->num_cores);
-	}
-	fflush(signal_out);
-}
-
-static void record(int win_avail, uint64_t delay)
-{
-	struct Event *event = &events[nextIndex];
-	nextIndex = (nextIndex + 1) & TS_BUF_MASK;
-
-	event->timestamp = microtime();
-	event->win_avail = win_avail;
-	event->win_used = 0;
-	event->num_pending = atomic_read(&srpc_num_pending);
-	event->num_drained = 0;
-	event->num_active = atomic_read(&srpc_num_active);
-	event->num_sess = atomic_read(&srpc_num_sess);
-	event->delay = delay;
-	event->num_cores = runtime_active_cores();
-
-	if (nextIndex == 0)
-		printRecord();
-}
-#endif
-
 static int srpc_get_slot(struct sdg_session *s)
 {
 	int slot = __builtin_ffsl(s->avail_slots[0]) - 1;
@@ -156,12 +93,14 @@ static int srpc_get_slot(struct sdg_session *s)
 		s->slots[slot] = smalloc(sizeof(struct sdg_ctx));
 		s->slots[slot]->cmn.s = (struct srpc_session *)s;
 		s->slots[slot]->cmn.idx = slot;
+		srpc_ctx_init(&s->slots[slot]->cmn);
 	}
 	return slot;
 }
 
 static void srpc_put_slot(struct sdg_session *s, int slot)
 {
+	srpc_ctx_release(&s->slots[slot]->cmn);
 	sfree(s->slots[slot]);
 	s->slots[slot] = NULL;
 	bitmap_atomic_set(s->avail_slots, slot);
@@ -259,7 +198,6 @@ static int srpc_recv_one(struct sdg_session *s)
 {
 	struct cdg_hdr chdr;
 	int idx, ret;
-	char buf_tmp[SRPC_BUF_SIZE];
 
 again:
 	/* read the client header */
@@ -275,9 +213,9 @@ again:
 		log_warn("srpc: got invalid magic %x", chdr.magic);
 		return -EINVAL;
 	}
-	if (unlikely(chdr.len > SRPC_BUF_SIZE)) {
+	if (unlikely(chdr.len > SRPC_MAX_PAYLOAD)) {
 		log_warn("srpc: request len %ld too large (limit %d)",
-			 chdr.len, SRPC_BUF_SIZE);
+			 chdr.len, SRPC_MAX_PAYLOAD);
 		return -EINVAL;
 	}
 
@@ -289,13 +227,14 @@ again:
 		/* reserve a slot */
 		idx = srpc_get_slot(s);
 		if (idx < 0) {
-			ret = tcp_read_full(s->cmn.c, buf_tmp, chdr.len);
+			ret = tcp_read_discard(s->cmn.c, chdr.len);
 			atomic64_inc(&srpc_stat_req_dropped_);
+			srpc_trace(SRPC_EV_DROP, 0, s->id, 0, 0, 0);
 			goto again;
 		}
 
 		/* retrieve the payload */
-		ret = tcp_read_full(s->cmn.c, s->slots[idx]->cmn.req_buf, chdr.len);
+		ret = srpc_ctx_read_req(&s->slots[idx]->cmn, s->cmn.c, chdr.len);
 		if (unlikely(ret <= 0)) {
 			srpc_put_slot(s, idx);
 			if (ret == 0)
@@ -320,6 +259,8 @@ again:
 			if (th)
 				thread_ready(th);
 			atomic64_inc(&srpc_stat_req_dropped_);
+			srpc_trace(SRPC_EV_DROP, 0, s->id, chdr.prio, 0,
+				   dagor_delay);
 			return 0;
 		}
 
@@ -495,6 +436,8 @@ static void dagor_prio_update(void *arg)
 
 		atomic_write(&dagor_prio_thresh, (int)dagor_prio_);
 		atomic_write(&dagor_num_reqs, 0);
+		srpc_trace(SRPC_EV_CC, 0, 0, (int)dagor_prio_, nreqs,
+			   dagor_delay);
 	}
 }
 
@@ -505,6 +448,7 @@ static void srpc_listener(void *arg)
 	tcpqueue_t *q;
 	int ret;
 
+	srpc_trace_init();
 	dagor_prio_ = 32.0;
 	atomic_write(&dagor_prio_thresh, 32);
 
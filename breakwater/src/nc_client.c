@@ -107,8 +107,7 @@ ssize_t cnc_send_one(struct crpc_session *s_,
 	struct cnc_session *s = (struct cnc_session *)s_;
 	ssize_t ret;
 
-	/* implementation is currently limited to a maximum payload size */
-	if (unlikely(len > SRPC_BUF_SIZE))
+	if (unlikely(len > SRPC_MAX_PAYLOAD))
 		return -E2BIG;
 
 	mutex_lock(&s->lock);
@@ -138,9 +137,9 @@ again:
 		log_warn("crpc: got invalid magic %x", shdr.magic);
 		return -EINVAL;
 	}
-	if (unlikely(shdr.len > MIN(SRPC_BUF_SIZE, len))) {
+	if (unlikely(shdr.len > MIN(SRPC_MAX_PAYLOAD, len))) {
 		log_warn("crpc: request len %ld too large (limit %ld)",
-			 shdr.len, MIN(SRPC_BUF_SIZE, len));
+			 shdr.len, MIN(SRPC_MAX_PAYLOAD, len));
 		return -EINVAL;
 	}
 
@@ -279,9 +279,9 @@ ssize_t csd_recv_one(struct crpc_session *s_, void *buf, size_t len,
 		log_warn("crpc: got invalid magic %x", shdr.magic);
 		return -EINVAL;
 	}
-	if (unlikely(shdr.len > MIN(SRPC_BUF_SIZE, len))) {
+	if (unlikely(shdr.len > MIN(SRPC_MAX_PAYLOAD, len))) {
 		log_warn("crpc: request len %ld too large (limit %ld)",
-			 shdr.len, MIN(SRPC_BUF_SIZE, len));
+			 shdr.len, MIN(SRPC_MAX_PAYLOAD, len));
 		return -EINVAL;
 	}
 
@@ -0,0 +1,331 @@
+/*
+ * trace.c - per-core rings of control-loop events
+ *
+ * Each core owns a ring and is its only writer (preemption is disabled while
+ * an event is written), so recording takes no locks or atomics. A ring's head
+ * counts every event ever written to it; readers copy the ring and then
+ * re-read the head to find out which slots may have been overwritten.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/preempt.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+
+#include "trace.h"
+
+BUILD_ASSERT(is_power_of_two(SRPC_TRACE_RING_SIZE));
+
+struct srpc_trace_ring {
+	uint64_t		head;
+	struct srpc_event	ev[SRPC_TRACE_RING_SIZE];
+} __aligned(CACHE_LINE_SIZE);
+
+const char *srpc_trace_names[SRPC_EV_NR] = {
+	"cc", "sess_win", "drop", "expire", "wake",
+};
+
+bool srpc_trace_on;
+
+static struct srpc_trace_ring *rings[NCPU];
+static mutex_t trace_lock;
+/* set once srpc_trace_init() has started (1) and finished (2) */
+static atomic_t trace_init_state;
+static volatile sig_atomic_t trace_dump_pending;
+
+void __srpc_trace(uint8_t type, uint8_t cls, uint32_t sess,
+		  int32_t win, int32_t used, uint64_t delay_us)
+{
+	struct srpc_trace_ring *r;
+	struct srpc_event *e;
+	unsigned int core;
+	uint64_t head;
+
+	preempt_disable();
+	core = get_current_affinity();
+	r = ACCESS_ONCE(rings[core]);
+	if (unlikely(!r))
+		goto out;
+
+	head = r->head;
+	e = &r->ev[head & (SRPC_TRACE_RING_SIZE - 1)];
+	e->ts = microtime();
+	e->type = type;
+	e->cls = cls;
+	e->core = core;
+	e->sess = sess;
+	e->win = win;
+	e->used = used;
+	e->delay_us = delay_us;
+	store_release(&r->head, head + 1);
+
+out:
+	preempt_enable();
+}
+
+int srpc_trace_enable(bool on)
+{
+	struct srpc_trace_ring *r;
+	int i, ret = 0;
+
+	srpc_trace_init();
+	mutex_lock(&trace_lock);
+	for (i = 0; on && i < runtime_max_cores(); i++) {
+		if (rings[i])
+			continue;
+		r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+		if (!r) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memset(r, 0, sizeof(*r));
+		store_release(&rings[i], r);
+	}
+	ACCESS_ONCE(srpc_trace_on) = on;
+
+out:
+	mutex_unlock(&trace_lock);
+	return ret;
+}
+
+bool srpc_trace_enabled(void)
+{
+	return ACCESS_ONCE(srpc_trace_on);
+}
+
+static int srpc_event_cmp(const void *a, const void *b)
+{
+	const struct srpc_event *ea = a, *eb = b;
+
+	if (ea->ts != eb->ts)
+		return ea->ts < eb->ts ? -1 : 1;
+	return 0;
+}
+
+/* copies the events of one ring that weren't overwritten while copying */
+static int srpc_trace_copy_ring(struct srpc_trace_ring *r,
+				struct srpc_event *ev)
+{
+	uint64_t head, start, valid, i;
+	int n = 0;
+
+	head = load_acquire(&r->head);
+	start = head > SRPC_TRACE_RING_SIZE ? head - SRPC_TRACE_RING_SIZE : 0;
+	for (i = start; i < head; i++)
+		ev[n++] = r->ev[i & (SRPC_TRACE_RING_SIZE - 1)];
+
+	/*
+	 * The writer overwrites the slot of event (head - RING_SIZE) before it
+	 * publishes head + 1, so only events after that one are intact.
+	 */
+	barrier();
+	head = load_acquire(&r->head);
+	valid = head >= SRPC_TRACE_RING_SIZE ?
+		head - SRPC_TRACE_RING_SIZE + 1 : 0;
+	if (valid <= start)
+		return n;
+	if (valid >= start + n)
+		return 0;
+	memmove(ev, ev + (valid - start), (n - (valid - start)) * sizeof(*ev));
+	return n - (valid - start);
+}
+
+int srpc_trace_read(struct srpc_event *ev, int max)
+{
+	struct srpc_event *all;
+	struct srpc_trace_ring *r;
+	int i, n = 0;
+
+	if (max <= 0)
+		return 0;
+
+	all = malloc(sizeof(*all) * SRPC_TRACE_RING_SIZE * runtime_max_cores());
+	if (!all)
+		return -ENOMEM;
+
+	for (i = 0; i < runtime_max_cores(); i++) {
+		r = load_acquire(&rings[i]);
+		if (r)
+			n += srpc_trace_copy_ring(r, all + n);
+	}
+
+	qsort(all, n, sizeof(*all), srpc_event_cmp);
+	if (n > max) {
+		memcpy(ev, all + n - max, sizeof(*ev) * max);
+		n = max;
+	} else {
+		memcpy(ev, all, sizeof(*ev) * n);
+	}
+
+	free(all);
+	return n;
+}
+
+static int srpc_trace_format(const struct srpc_event *e, char *buf, size_t len)
+{
+	return snprintf(buf, len, "%lu,%s,%u,%u,%u,%d,%d,%lu\n", e->ts,
+			srpc_trace_names[e->type], e->core, e->cls, e->sess,
+			e->win, e->used, e->delay_us);
+}
+
+static const char srpc_trace_header[] =
+	"timestamp,type,core,class,session,win,used,delay_us\n";
+
+int srpc_trace_dump(const char *path)
+{
+	struct srpc_event *ev;
+	char line[128];
+	FILE *f;
+	int i, n, max, ret = 0;
+
+	max = SRPC_TRACE_RING_SIZE * runtime_max_cores();
+	ev = malloc(sizeof(*ev) * max);
+	if (!ev)
+		return -ENOMEM;
+
+	n = srpc_trace_read(ev, max);
+	if (n < 0) {
+		ret = n;
+		goto out;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		ret = -errno;
+		goto out;
+	}
+
+	fputs(srpc_trace_header, f);
+	for (i = 0; i < n; i++) {
+		srpc_trace_format(&ev[i], line, sizeof(line));
+		fputs(line, f);
+	}
+	fclose(f);
+
+out:
+	free(ev);
+	return ret;
+}
+
+/* "bwtrace [on|off|dump [n]]" on the stat server */
+static ssize_t srpc_trace_cmd(const char *args, char *buf, size_t len)
+{
+	struct srpc_event *ev;
+	char line[128];
+	size_t pos, need;
+	int i, n, first, ret;
+
+	if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+		ret = srpc_trace_enable(args[1] == 'n');
+		if (ret)
+			return ret;
+	} else if (strcmp(args, "dump") == 0 ||
+		   strncmp(args, "dump ", 5) == 0) {
+		n = args[4] ? atoi(&args[5]) : SRPC_TRACE_CMD_EVENTS;
+		if (n <= 0)
+			n = SRPC_TRACE_CMD_EVENTS;
+		ev = malloc(sizeof(*ev) * n);
+		if (!ev)
+			return -ENOMEM;
+		n = srpc_trace_read(ev, n);
+		if (n < 0) {
+			free(ev);
+			return n;
+		}
+
+		/* keep the most recent events that fit in the response */
+		need = sizeof(srpc_trace_header) - 1;
+		for (first = n; first > 0; first--) {
+			ret = srpc_trace_format(&ev[first - 1], line,
+						sizeof(line));
+			if (need + ret > len)
+				break;
+			need += ret;
+		}
+
+		pos = snprintf(buf, len, "%s", srpc_trace_header);
+		for (i = first; i < n; i++)
+			pos += srpc_trace_format(&ev[i], buf + pos, len - pos);
+		free(ev);
+		return pos;
+	} else if (args[0] != '\0') {
+		return snprintf(buf, len, "usage: bwtrace [on|off|dump [n]]\n");
+	}
+
+	return snprintf(buf, len, "%s\n", srpc_trace_enabled() ? "on" : "off");
+}
+
+static void srpc_trace_sighandler(int sig)
+{
+	trace_dump_pending = 1;
+}
+
+/* signal handlers can't block, so the dump happens on a runtime thread */
+static void srpc_trace_poller(void *arg)
+{
+	int ret;
+
+	while (true) {
+		timer_sleep(SRPC_TRACE_POLL_US);
+		if (!trace_dump_pending)
+			continue;
+		trace_dump_pending = 0;
+
+		ret = srpc_trace_dump(SRPC_TRACE_PATH);
+		if (ret)
+			log_err("trace: couldn't write %s, ret = %d",
+				SRPC_TRACE_PATH, ret);
+		else
+			log_info("trace: wrote %s", SRPC_TRACE_PATH);
+	}
+}
+
+/**
+ * srpc_trace_init - makes the trace reachable over the stat server and by
+ * signal; safe to call more than once
+ */
+void srpc_trace_init(void)
+{
+	struct sigaction act;
+	int ret;
+
+	if (load_acquire(&trace_init_state.cnt) == 2)
+		return;
+	if (!atomic_cmpxchg(&trace_init_state, 0, 1)) {
+		/* another thread got here first, wait until it's done */
+		while (load_acquire(&trace_init_state.cnt) != 2)
+			thread_yield();
+		return;
+	}
+
+	mutex_init(&trace_lock);
+
+	ret = stat_register_cmd("bwtrace", srpc_trace_cmd);
+	if (ret)
+		log_warn("trace: couldn't register stat command, ret = %d",
+			 ret);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = srpc_trace_sighandler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	if (sigaction(SRPC_TRACE_SIGNAL, &act, NULL) == -1) {
+		log_warn("trace: couldn't install signal handler");
+		goto out;
+	}
+
+	ret = thread_spawn(srpc_trace_poller, NULL);
+	if (ret)
+		log_warn("trace: couldn't spawn poller, ret = %d", ret);
+
+out:
+	store_release(&trace_init_state.cnt, 2);
+}
@@ -0,0 +1,40 @@
+/*
+ * trace.h - recording control-loop events (see breakwater/trace.h)
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <breakwater/trace.h>
+
+/* events kept per core (must be a power of two) */
+#define SRPC_TRACE_RING_SIZE	4096
+/* the signal that dumps the rings to SRPC_TRACE_PATH */
+#define SRPC_TRACE_SIGNAL	SIGHUP
+#define SRPC_TRACE_PATH		"bwtrace.csv"
+/* how often a pending signal is checked for */
+#define SRPC_TRACE_POLL_US	(100 * ONE_MS)
+/* events returned by "bwtrace dump" without a count */
+#define SRPC_TRACE_CMD_EVENTS	100
+
+extern bool srpc_trace_on;
+
+extern void __srpc_trace(uint8_t type, uint8_t cls, uint32_t sess,
+			 int32_t win, int32_t used, uint64_t delay_us);
+extern void srpc_trace_init(void);
+
+/**
+ * srpc_trace - records an event if tracing is enabled
+ * @type: an SRPC_EV_* type
+ * @cls: the request class
+ * @sess: the session id (0 = none)
+ * @win: a window or threshold
+ * @used: credits in use
+ * @delay_us: a queueing delay
+ */
+static inline void srpc_trace(uint8_t type, uint8_t cls, uint32_t sess,
+			      int32_t win, int32_t used, uint64_t delay_us)
+{
+	if (unlikely(ACCESS_ONCE(srpc_trace_on)))
+		__srpc_trace(type, cls, sess, win, used, delay_us);
+}
@@ -2,8 +2,15 @@
  * util.c - utility functions for RPC
  */
 
+#include <stdlib.h>
+
+#include <runtime/smalloc.h>
+
 #include "util.h"
 
+/* buffers larger than this come from the heap instead of smalloc */
+#define SRPC_POOL_MAX_SIZE	(256 * 1024)
+
 /**
  * tcp_read_full - reads exactly the requested bytes or fails
  * @c: the TCP connection to read from
@@ -98,3 +105,183 @@ ssize_t tcp_writev_full(tcpconn_t *c, struct iovec *iov, int iovcnt)
 
 	return len;
 }
+
+/**
+ * tcp_read_discard - reads and throws away exactly the requested bytes
+ * @c: the TCP connection to read from
+ * @len: the number of bytes to discard
+ *
+ * Returns @len bytes or <= 0 if there was an error.
+ */
+ssize_t tcp_read_discard(tcpconn_t *c, size_t len)
+{
+	char buf[SRPC_INLINE_SIZE];
+	size_t n = 0;
+
+	while (n < len) {
+		ssize_t ret = tcp_read(c, buf, MIN(len - n, sizeof(buf)));
+		if (ret <= 0)
+			return ret;
+		n += ret;
+	}
+
+	return n;
+}
+
+/**
+ * srpc_buf_alloc - allocates a payload buffer
+ * @len: the size of the buffer
+ * @type: set to the kind of buffer (SRPC_BUF_POOL or SRPC_BUF_HEAP)
+ *
+ * Returns the buffer, or NULL if out of memory.
+ */
+void *srpc_buf_alloc(size_t len, uint8_t *type)
+{
+	if (len <= SRPC_POOL_MAX_SIZE) {
+		*type = SRPC_BUF_POOL;
+		return smalloc(len);
+	}
+
+	*type = SRPC_BUF_HEAP;
+	return malloc(len);
+}
+
+/**
+ * srpc_buf_free - frees a payload buffer
+ * @buf: the buffer
+ * @type: the kind of buffer (inline buffers are ignored)
+ */
+void srpc_buf_free(void *buf, uint8_t type)
+{
+	if (type == SRPC_BUF_POOL)
+		sfree(buf);
+	else if (type == SRPC_BUF_HEAP)
+		free(buf);
+}
+
+/**
+ * srpc_ctx_init - prepares an RPC context to use its inline buffers
+ * @ctx: the RPC context
+ */
+void srpc_ctx_init(struct srpc_ctx *ctx)
+{
+	ctx->req_buf = ctx->req_inline;
+	ctx->resp_buf = ctx->resp_inline;
+	ctx->req_buf_type = SRPC_BUF_INLINE;
+	ctx->resp_buf_type = SRPC_BUF_INLINE;
+	ctx->resp_release = NULL;
+}
+
+/**
+ * srpc_ctx_read_req - reads a request payload into an RPC context
+ * @ctx: the RPC context
+ * @c: the TCP connection to read from
+ * @len: the length of the payload (up to SRPC_MAX_PAYLOAD)
+ *
+ * Payloads that don't fit inline are read into a pooled buffer, which is freed
+ * by srpc_ctx_release().
+ *
+ * Returns @len bytes, -ENOMEM, or <= 0 if there was an error.
+ */
+ssize_t srpc_ctx_read_req(struct srpc_ctx *ctx, tcpconn_t *c, size_t len)
+{
+	if (len > SRPC_INLINE_SIZE) {
+		ctx->req_buf = srpc_buf_alloc(len, &ctx->req_buf_type);
+		if (unlikely(!ctx->req_buf)) {
+			ctx->req_buf = ctx->req_inline;
+			ctx->req_buf_type = SRPC_BUF_INLINE;
+			return -ENOMEM;
+		}
+	}
+
+	return tcp_read_full(c, ctx->req_buf, len);
+}
+
+/**
+ * srpc_ctx_copy_req - copies a request payload into an RPC context
+ * @ctx: the RPC context
+ * @buf: the payload
+ * @len: the length of the payload (up to SRPC_MAX_PAYLOAD)
+ *
+ * Like srpc_ctx_read_req(), but for payloads that were already received.
+ *
+ * Returns @len, or -ENOMEM.
+ */
+ssize_t srpc_ctx_copy_req(struct srpc_ctx *ctx, const void *buf, size_t len)
+{
+	if (len > SRPC_INLINE_SIZE) {
+		ctx->req_buf = srpc_buf_alloc(len, &ctx->req_buf_type);
+		if (unlikely(!ctx->req_buf)) {
+			ctx->req_buf = ctx->req_inline;
+			ctx->req_buf_type = SRPC_BUF_INLINE;
+			return -ENOMEM;
+		}
+	}
+
+	memcpy(ctx->req_buf, buf, len);
+	return len;
+}
+
+/**
+ * srpc_ctx_release - frees the external buffers of an RPC context
+ * @ctx: the RPC context
+ *
+ * Also hands zero-copy response buffers back to their owner.
+ */
+void srpc_ctx_release(struct srpc_ctx *ctx)
+{
+	srpc_buf_free(ctx->req_buf, ctx->req_buf_type);
+	if (ctx->resp_buf_type == SRPC_BUF_USER) {
+		if (ctx->resp_release)
+			ctx->resp_release(ctx->resp_release_arg);
+	} else {
+		srpc_buf_free(ctx->resp_buf, ctx->resp_buf_type);
+	}
+	srpc_ctx_init(ctx);
+}
+
+static void srpc_resp_reset(struct srpc_ctx *ctx)
+{
+	void *req_buf = ctx->req_buf;
+	uint8_t req_buf_type = ctx->req_buf_type;
+
+	/* a handler may replace its response, drop the previous one */
+	ctx->req_buf_type = SRPC_BUF_INLINE;
+	srpc_ctx_release(ctx);
+	ctx->req_buf = req_buf;
+	ctx->req_buf_type = req_buf_type;
+}
+
+void *srpc_resp_alloc(struct srpc_ctx *ctx, size_t len)
+{
+	void *buf;
+	uint8_t type;
+
+	if (unlikely(len > SRPC_MAX_PAYLOAD))
+		return NULL;
+
+	srpc_resp_reset(ctx);
+	if (len <= SRPC_BUF_SIZE)
+		return ctx->resp_buf;
+
+	buf = srpc_buf_alloc(len, &type);
+	if (unlikely(!buf))
+		return NULL;
+
+	ctx->resp_buf = buf;
+	ctx->resp_buf_type = type;
+	return buf;
+}
+
+void srpc_resp_set_zc(struct srpc_ctx *ctx, const void *buf, size_t len,
+		      void (*release)(void *arg), void *arg)
+{
+	BUG_ON(len > SRPC_MAX_PAYLOAD);
+
+	srpc_resp_reset(ctx);
+	ctx->resp_buf = (char *)buf;
+	ctx->resp_buf_type = SRPC_BUF_USER;
+	ctx->resp_release = release;
+	ctx->resp_release_arg = arg;
+	ctx->resp_len = len;
+}
@@ -6,7 +6,18 @@
 
 #include <base/stddef.h>
 #include <runtime/tcp.h>
+#include <breakwater/rpc.h>
 
 extern ssize_t tcp_read_full(tcpconn_t *c, void *buf, size_t len);
 extern ssize_t tcp_write_full(tcpconn_t *c, const void *buf, size_t len);
 extern ssize_t tcp_writev_full(tcpconn_t *c, struct iovec *iov, int iovcnt);
+extern ssize_t tcp_read_discard(tcpconn_t *c, size_t len);
+
+extern void *srpc_buf_alloc(size_t len, uint8_t *type);
+extern void srpc_buf_free(void *buf, uint8_t type);
+extern void srpc_ctx_init(struct srpc_ctx *ctx);
+extern ssize_t srpc_ctx_read_req(struct srpc_ctx *ctx, tcpconn_t *c,
+				 size_t len);
+extern ssize_t srpc_ctx_copy_req(struct srpc_ctx *ctx, const void *buf,
+				 size_t len);
+extern void srpc_ctx_release(struct srpc_ctx *ctx);
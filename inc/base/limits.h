@@ -8,3 +8,4 @@
 #define NTHREAD		512	/* max number of threads */
 #define NNUMA		4	/* max number of numa zones */
 #define NSTAT		1024	/* max number of stat counters */
+#define NSTORAGEDEV	8	/* max number of storage devices */
@@ -16,7 +16,7 @@
  * struct control_hdr, please increment the version number!
  */
 
-#define CONTROL_HDR_VERSION 5
+#define CONTROL_HDR_VERSION 8
 
 /* The abstract namespace path for the control socket. */
 #define CONTROL_SOCK_PATH	"\0/control/iokernel.sock"
@@ -29,10 +29,11 @@ struct q_ptrs {
 	uint32_t		directpath_rx_tail;
 	uint64_t		next_timer_tsc;
 	uint32_t		storage_tail;
-	uint32_t		pad;
+	uint32_t		storage_inflight;
 	uint64_t		oldest_tsc;
 	uint64_t		rcu_gen;
 	uint64_t		run_start_tsc;
+	uint64_t		storage_ready_tsc; /* oldest emulated completion */
 };
 
 BUILD_ASSERT(sizeof(struct q_ptrs) <= CACHE_LINE_SIZE);
@@ -75,7 +76,7 @@ struct thread_spec {
 	int32_t			park_efd;
 
 	struct hardware_queue_spec	direct_rxq;
-	struct hardware_queue_spec	storage_hwq;
+	struct hardware_queue_spec	storage_hwq[NSTORAGEDEV];
 	struct timer_spec		timer_heap;
 };
 
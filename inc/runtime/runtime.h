@@ -72,3 +72,15 @@ static inline int runtime_guaranteed_cores(void)
 {
 	return guaranteedks;
 }
+
+
+/* stat server commands */
+
+/*
+ * Generates the response to a stat server command into @buf (at most @len
+ * bytes). @args holds the rest of the request line after the command name.
+ * Returns the length of the response, or < 0 on failure.
+ */
+typedef ssize_t (*stat_cmd_fn_t)(const char *args, char *buf, size_t len);
+
+extern int stat_register_cmd(const char *name, stat_cmd_fn_t fn);
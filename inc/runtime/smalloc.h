@@ -10,6 +10,9 @@
 
 #define __smalloc_attr __malloc __assume_aligned(16)
 
+/* the largest item smalloc() can allocate */
+#define SMALLOC_MAX_SIZE	(256 * 1024)
+
 extern void *smalloc(size_t size) __smalloc_attr;
 extern void *__szalloc(size_t size) __smalloc_attr;
 extern void sfree(void *item);
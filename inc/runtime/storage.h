@@ -5,14 +5,65 @@
 #pragma once
 
 #include <base/stddef.h>
+#include <runtime/thread.h>
 
+/*
+ * The default volume is either device 0, or, if storage_stripe_blocks is
+ * configured, a RAID-0 stripe across all attached devices.
+ */
 extern int storage_write(const void *payload, uint64_t lba, uint32_t lba_count);
 extern int storage_read(void *dest, uint64_t lba, uint32_t lba_count);
+extern int storage_flush(void);
+
+/* access to individual devices, identified by index */
+extern unsigned int storage_num_devices(void);
+extern uint32_t storage_dev_block_size(unsigned int dev);
+extern uint64_t storage_dev_num_blocks(unsigned int dev);
+extern int storage_dev_write(unsigned int dev, const void *payload,
+			     uint64_t lba, uint32_t lba_count);
+extern int storage_dev_read(unsigned int dev, void *dest, uint64_t lba,
+			    uint32_t lba_count);
+extern int storage_dev_flush(unsigned int dev);
+
+/*
+ * Asynchronous reads and writes of the default volume: rather than block,
+ * these start a thread once the request completes (e.g. to resume a
+ * coroutine).
+ */
+extern int storage_read_async(void *dest, uint64_t lba, uint32_t lba_count,
+			      int *status, thread_fn_t fn, void *arg);
+extern int storage_write_async(const void *payload, uint64_t lba,
+			       uint32_t lba_count, int *status,
+			       thread_fn_t fn, void *arg);
+
+
+/*
+ * Streams
+ *
+ * A stream detects sequential reads and adaptively reads ahead into
+ * device buffers, and can coalesce writes to adjacent blocks into a single
+ * command. Coalesced writes are not submitted (and not visible to other
+ * streams) until the buffer fills, a non-adjacent write arrives, or
+ * storage_stream_flush() is called. A stream must only be used by one thread
+ * at a time.
+ */
+
+struct storage_stream;
+typedef struct storage_stream storage_stream_t;
+
+extern int storage_stream_create(int dev, uint32_t ra_max_blocks,
+				 uint32_t wb_blocks, storage_stream_t **s_out);
+extern int storage_stream_read(storage_stream_t *s, void *dest, uint64_t lba,
+			       uint32_t lba_count);
+extern int storage_stream_write(storage_stream_t *s, const void *payload,
+				uint64_t lba, uint32_t lba_count);
+extern int storage_stream_flush(storage_stream_t *s);
+extern void storage_stream_destroy(storage_stream_t *s);
 
 
 
 /*
- * storage_block_size - get the size of a block from the nvme device
+ * storage_block_size - get the size of a block of the default volume
  */
 static inline uint32_t storage_block_size(void)
 {
@@ -21,7 +72,7 @@ static inline uint32_t storage_block_size(void)
 }
 
 /*
- * storage_num_blocks - gets the number of blocks from the nvme device
+ * storage_num_blocks - gets the number of blocks of the default volume
  */
 static inline uint64_t storage_num_blocks(void)
 {
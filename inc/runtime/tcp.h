@@ -5,6 +5,7 @@
 #pragma once
 
 #include <runtime/net.h>
+#include <runtime/thread.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
 
@@ -29,6 +30,8 @@ extern ssize_t tcp_read(tcpconn_t *c, void *buf, size_t len);
 extern ssize_t tcp_write(tcpconn_t *c, const void *buf, size_t len);
 extern ssize_t tcp_readv(tcpconn_t *c, const struct iovec *iov, int iovcnt);
 extern ssize_t tcp_writev(tcpconn_t *c, const struct iovec *iov, int iovcnt);
+extern int tcp_read_notify(tcpconn_t *c, thread_fn_t fn, void *arg);
+extern int tcp_write_notify(tcpconn_t *c, thread_fn_t fn, void *arg);
 extern int tcp_shutdown(tcpconn_t *c, int how);
 extern void tcp_abort(tcpconn_t *c);
 extern void tcp_close(tcpconn_t *c);
@@ -9,6 +9,7 @@
 #include <net/ip.h>
 #include <net/udp.h>
 #include <runtime/net.h>
+#include <runtime/thread.h>
 #include <sys/uio.h>
 
 /* the maximum possible payload size (for the largest possible MTU) */
@@ -45,6 +46,8 @@ extern ssize_t udp_write_to(udpconn_t *c, const void *buf, size_t len,
 			    const struct netaddr *raddr);
 extern ssize_t udp_read(udpconn_t *c, void *buf, size_t len);
 extern ssize_t udp_write(udpconn_t *c, const void *buf, size_t len);
+extern int udp_read_notify(udpconn_t *c, thread_fn_t fn, void *arg);
+extern int udp_write_notify(udpconn_t *c, thread_fn_t fn, void *arg);
 extern void udp_shutdown(udpconn_t *c);
 extern void udp_close(udpconn_t *c);
 
@@ -104,7 +104,7 @@ static struct proc *control_create_proc(mem_key_t key, size_t len,
 	struct thread_spec *threads = NULL;
 	unsigned long *overflow_queue = NULL;
 	void *shbuf;
-	int i, ret;
+	int i, j, ret;
 
 	/* attach the shared memory region */
 	if (len < sizeof(hdr))
@@ -198,11 +198,15 @@ static struct proc *control_create_proc(mem_key_t key, size_t len,
 		if (ret)
 			goto fail;
 
-		ret = control_init_hwq(&reg, &s->storage_hwq, &th->storage_hwq);
-		if (ret)
-			goto fail;
+		for (j = 0; j < NSTORAGEDEV; j++) {
+			ret = control_init_hwq(&reg, &s->storage_hwq[j],
+					       &th->storage_hwq[j]);
+			if (ret)
+				goto fail;
+		}
 
 		p->has_directpath |= th->directpath_hwq.enabled;
+		p->has_storage |= th->storage_hwq[0].enabled;
 	}
 
 	/* initialize the table of physical page addresses */
@@ -95,9 +95,9 @@ struct thread {
 	union {
 		struct {
 			struct hwq	directpath_hwq;
-			struct hwq	storage_hwq;
+			struct hwq	storage_hwq[NSTORAGEDEV];
 		};
-		struct hwq	hwqs[2];
+		struct hwq	hwqs[1 + NSTORAGEDEV];
 	};
 	struct timer		timer_heap;
 	struct list_node	idle_link;
@@ -121,6 +121,7 @@ struct proc {
 	struct shm_region	region;
 	bool			removed;
 	bool			has_directpath;
+	bool			has_storage;
 	struct ref		ref;
 	unsigned int		kill:1;       /* the proc is being torn down */
 	unsigned int		attach_fail:1;
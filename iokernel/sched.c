@@ -318,6 +318,7 @@ sched_measure_kthread_delay(struct thread *th,
 	uint32_t cur_tail, cur_head, last_head, last_tail;
 	uint64_t tmp;
 	bool busy = false;
+	int i;
 
 	/* UTHREAD: measure delay */
 	last_tail = th->last_rq_tail;
@@ -383,10 +384,24 @@ sched_measure_kthread_delay(struct thread *th,
 	else
 		*rxq_tsc = MAX(*rxq_tsc, calc_delay_tsc(th->directpath_hwq.busy_since));
 
-	/* STORAGE: measure delay and update signals */
-	if (sched_measure_hardware_delay(th, &th->storage_hwq, true))
+	/* STORAGE: measure delay and update signals (worst device) */
+	*storage_tsc = 0;
+	for (i = 0; i < NSTORAGEDEV; i++) {
+		struct hwq *h = &th->storage_hwq[i];
+
+		if (!h->enabled)
+			break;
+		if (sched_measure_hardware_delay(th, h, true))
+			busy = true;
+		*storage_tsc = MAX(*storage_tsc, calc_delay_tsc(h->busy_since));
+	}
+
+	/* STORAGE: emulated completions that are due but not yet reaped */
+	tmp = ACCESS_ONCE(th->q_ptrs->storage_ready_tsc);
+	if (tmp && tmp <= cur_tsc) {
 		busy = true;
-	*storage_tsc = calc_delay_tsc(th->storage_hwq.busy_since);
+		*storage_tsc = MAX(*storage_tsc, calc_delay_tsc(tmp));
+	}
 
 	return busy;
 }
@@ -443,7 +458,8 @@ static void sched_measure_delay(struct proc *p)
 static void sched_detect_io_for_idle_runtime(struct proc *p)
 {
 	struct thread *th;
-	int i;
+	struct hwq *h;
+	int i, j;
 
 	if (cfg.noidlefastwake)
 		return;
@@ -456,8 +472,20 @@ static void sched_detect_io_for_idle_runtime(struct proc *p)
 			return;
 		}
 
-		/* no need to check storage queues because kthreads with pending
-		   storage I/Os don't park */
+		/* kthreads park with storage I/Os in flight once their polling
+		   budget expires, so watch their completion queues */
+		if (!ACCESS_ONCE(th->q_ptrs->storage_inflight))
+			continue;
+
+		for (j = 0; j < NSTORAGEDEV; j++) {
+			h = &th->storage_hwq[j];
+			if (!h->enabled)
+				break;
+			if (hwq_busy(h, ACCESS_ONCE(*h->consumer_idx))) {
+				sched_add_core(p);
+				return;
+			}
+		}
 	}
 }
 
@@ -516,10 +544,11 @@ void sched_poll(void)
 		for (i = 0; i < dp.nr_clients; i++)
 			sched_measure_delay(dp.clients[i]);
 	} else {
-		/* check if any idle directpath runtimes have received I/Os */
+		/* check if any idle runtimes have received I/Os */
 		for (i = 0; i < dp.nr_clients; i++) {
 			p = dp.clients[i];
-			if (p->has_directpath && sched_threads_active(p) == 0)
+			if ((p->has_directpath || p->has_storage) &&
+			    sched_threads_active(p) == 0)
 				sched_detect_io_for_idle_runtime(p);
 		}
 	}
@@ -310,6 +310,118 @@ static int parse_enable_storage(const char *name, const char *val)
 #endif
 }
 
+static int parse_storage_max_devices(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > NSTORAGEDEV) {
+		log_err("storage_max_devices must be >= 1 and <= %d, got %ld",
+			NSTORAGEDEV, tmp);
+		return -EINVAL;
+	}
+
+	cfg_storage_max_devs = tmp;
+	return 0;
+}
+
+static int parse_storage_stripe_blocks(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0 || tmp > UINT_MAX) {
+		log_err("invalid storage stripe size, '%ld'", tmp);
+		return -EINVAL;
+	}
+
+	cfg_storage_stripe_blocks = tmp;
+	return 0;
+}
+
+static int parse_storage_emulated_devices(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 1 || tmp > NSTORAGEDEV) {
+		log_err("storage_emulated_devices must be >= 1 and <= %d, "
+			"got %ld", NSTORAGEDEV, tmp);
+		return -EINVAL;
+	}
+
+	cfg_storage_emu_devs = tmp;
+	cfg_storage_enabled = true;
+	return 0;
+}
+
+static int parse_storage_emulated_blocks(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp <= 0) {
+		log_err("storage_emulated_blocks must be positive");
+		return -EINVAL;
+	}
+
+	cfg_storage_emu_blocks = tmp;
+	return 0;
+}
+
+static int parse_storage_emulated_latency_us(const char *name,
+					     const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("storage_emulated_latency_us must be >= 0");
+		return -EINVAL;
+	}
+
+	cfg_storage_emu_latency_us = tmp;
+	return 0;
+}
+
+static int parse_storage_poll_us(const char *name, const char *val)
+{
+	long tmp;
+	int ret;
+
+	ret = str_to_long(val, &tmp);
+	if (ret)
+		return ret;
+
+	if (tmp < 0) {
+		log_err("storage_poll_us must be >= 0");
+		return -EINVAL;
+	}
+
+	cfg_storage_poll_us = tmp;
+	return 0;
+}
+
 static int parse_enable_directpath(const char *name, const char *val)
 {
 #ifdef DIRECTPATH
@@ -367,6 +479,13 @@ static const struct cfg_handler cfg_handlers[] = {
 	{ "disable_watchdog", parse_watchdog_flag, false },
 	{ "preferred_socket", parse_preferred_socket, false },
 	{ "enable_storage", parse_enable_storage, false },
+	{ "storage_max_devices", parse_storage_max_devices, false },
+	{ "storage_stripe_blocks", parse_storage_stripe_blocks, false },
+	{ "storage_emulated_devices", parse_storage_emulated_devices, false },
+	{ "storage_emulated_blocks", parse_storage_emulated_blocks, false },
+	{ "storage_emulated_latency_us", parse_storage_emulated_latency_us,
+			false },
+	{ "storage_poll_us", parse_storage_poll_us, false },
 	{ "enable_directpath", parse_enable_directpath, false },
 	{ "enable_gc", parse_enable_gc, false },
 
@@ -468,11 +587,8 @@ int cfg_load(const char *path)
 	log_info("cfg: THRESH_QD: %ld, THRESH_HT: %ld",
 		 cfg_qdelay_us, cfg_ht_punish_us);
 	log_info("cfg: storage %s, directpath %s",
-#ifdef DIRECT_STORAGE
-		 cfg_storage_enabled ? "enabled" : "disabled",
-#else
-		"disabled",
-#endif
+		 cfg_storage_emu_devs ? "emulated" :
+		 (cfg_storage_enabled ? "enabled" : "disabled"),
 #ifdef DIRECTPATH
 		 cfg_directpath_enabled ? "enabled" : "disabled");
 #else
@@ -264,50 +264,102 @@ static inline bool hardware_q_pending(struct hardware_q *q)
  * Storage support
  */
 
-#ifdef DIRECT_STORAGE
-
 extern bool cfg_storage_enabled;
-extern unsigned long storage_device_latency_us;
+extern unsigned int cfg_storage_max_devs;
+extern unsigned int cfg_storage_stripe_blocks;
+extern unsigned int cfg_storage_emu_devs;
+extern uint64_t cfg_storage_emu_blocks;
+extern unsigned long cfg_storage_emu_latency_us;
+extern long cfg_storage_poll_us;
+
+/* a block device backing the storage subsystem */
+struct storage_dev {
+	bool			emulated;
+	uint32_t		block_size;
+	uint64_t		num_blocks;
+	unsigned long		latency_us;
+	/* cycles to poll for completions before parking (UINT64_MAX = forever) */
+	uint64_t		poll_tsc;
+
+	/* NVMe devices */
+	void			*spdk_ctrlr;
+	void			*spdk_ns;
+
+	/* emulated devices */
+	unsigned char		*emu_base;
+	uint64_t		emu_latency_tsc;
+};
 
-struct storage_q {
+extern unsigned int nr_storage_devs;
+extern struct storage_dev storage_devs[NSTORAGEDEV];
 
-	spinlock_t lock;
+enum {
+	STORAGE_OP_READ = 0,
+	STORAGE_OP_WRITE,
+	STORAGE_OP_FLUSH,
+};
 
-	unsigned int outstanding_reqs;
-	void *spdk_qp_handle;
+/* tracks a request until all of its (possibly striped) commands complete */
+struct storage_cmd {
+	spinlock_t		lock;
+	int			pending;
+	int			status;
+	thread_t		*waiter;
+};
 
-	struct hardware_q hq;
+extern void storage_cmd_init(struct storage_cmd *cmd);
+extern int storage_cmd_wait(struct storage_cmd *cmd);
+extern int storage_issue(int dev, int op, void *payload, uint64_t lba,
+			 uint32_t lba_count, struct storage_cmd *cmd);
+extern void *storage_buf_alloc(size_t len);
+extern void storage_buf_free(void *buf);
+
+/* a request queued on an emulated device, completed in FIFO order */
+struct storage_emu_req {
+	uint64_t		deadline_tsc;
+	void			*buf;
+	uint64_t		lba;
+	uint32_t		lba_count;
+	int			op;
+	struct storage_cmd	*cmd;
+};
+
+#define STORAGE_EMU_QLEN	4096
 
-	unsigned long pad[1];
+struct storage_emu_q {
+	uint32_t		head;
+	uint32_t		tail;
+	struct storage_emu_req	reqs[STORAGE_EMU_QLEN];
 };
 
-static inline bool storage_available_completions(struct storage_q *q)
-{
-	return cfg_storage_enabled && hardware_q_pending(&q->hq);
-}
+/* a per-kthread submission/completion queue for one device */
+struct storage_q {
+	spinlock_t		lock;
+	unsigned int		outstanding_reqs;
+	void			*spdk_qp_handle;
 
-static inline bool storage_pending_completions(struct storage_q *q)
-{
-	return cfg_storage_enabled && q->outstanding_reqs > 0 &&
-	       storage_device_latency_us <= 10;
-}
+	struct hardware_q	hq;
 
-#else
+	struct storage_emu_q	*emu_q;
+};
 
-struct storage_q {};
+BUILD_ASSERT(sizeof(struct storage_q) == CACHE_LINE_SIZE);
 
-static inline bool storage_available_completions(struct storage_q *q)
+static inline bool storage_emu_pending(struct storage_emu_q *eq)
 {
-	return false;
+	uint32_t head = ACCESS_ONCE(eq->head);
+
+	return head != ACCESS_ONCE(eq->tail) &&
+	       eq->reqs[head % STORAGE_EMU_QLEN].deadline_tsc <= rdtsc();
 }
 
-static inline bool storage_pending_completions(struct storage_q *q)
+static inline bool storage_q_available(struct storage_q *q)
 {
-	return false;
+	if (q->emu_q)
+		return storage_emu_pending(q->emu_q);
+	return hardware_q_pending(&q->hq);
 }
 
-#endif
-
 #ifdef GC
 extern bool cfg_gc_enabled;
 #endif
@@ -340,6 +392,7 @@ enum {
 	STAT_LOCAL_WAKES,
 	STAT_REMOTE_WAKES,
 	STAT_RQ_OVERFLOW,
+	STAT_STORAGE_POLL_CYCLES,
 
 	/* network stack counters */
 	STAT_RX_BYTES,
@@ -408,17 +461,19 @@ struct kthread {
 	bool			directpath_busy;
 	bool			timer_busy;
 	bool			storage_busy;
-	unsigned int		pad2[3];
+	unsigned int		pad2;
+	/* wake a parked kthread by this time for emulated completions */
+	uint64_t		storage_wake_tsc;
 
-	/* 9th cache-line, storage nvme queues */
-	struct storage_q	storage_q;
+	/* 9th-16th cache-lines, storage queues (one per device) */
+	struct storage_q	storage_q[NSTORAGEDEV];
 
-	/* 10th cache-line, direct path queues */
+	/* 17th cache-line, direct path queues */
 	struct hardware_q	*directpath_rxq;
 	struct direct_txq	*directpath_txq;
 	unsigned long		pad3[6];
 
-	/* 11th cache-line, statistics counters */
+	/* 18th cache-line, statistics counters */
 	uint64_t		stats[STAT_NR];
 };
 
@@ -432,6 +487,65 @@ BUILD_ASSERT(offsetof(struct kthread, storage_q) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, directpath_rxq) % CACHE_LINE_SIZE == 0);
 BUILD_ASSERT(offsetof(struct kthread, stats) % CACHE_LINE_SIZE == 0);
 
+extern uint64_t storage_emu_deadline(struct kthread *k);
+
+/**
+ * storage_available_completions - are completions ready on any device queue?
+ */
+static inline bool storage_available_completions(struct kthread *k)
+{
+	int i;
+
+	if (!cfg_storage_enabled)
+		return false;
+
+	for (i = 0; i < nr_storage_devs; i++) {
+		if (storage_q_available(&k->storage_q[i]))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * storage_inflight - the number of requests in flight on all device queues
+ */
+static inline unsigned int storage_inflight(struct kthread *k)
+{
+	unsigned int i, cnt = 0;
+
+	if (!cfg_storage_enabled)
+		return 0;
+
+	for (i = 0; i < nr_storage_devs; i++)
+		cnt += k->storage_q[i].outstanding_reqs;
+
+	return cnt;
+}
+
+/**
+ * storage_poll_budget - how long an idle kthread should poll for storage
+ * completions before parking
+ *
+ * Returns the budget in cycles, 0 if nothing is in flight, or UINT64_MAX if
+ * the kthread must poll until all requests complete.
+ */
+static inline uint64_t storage_poll_budget(struct kthread *k)
+{
+	uint64_t budget = 0;
+	int i;
+
+	if (!cfg_storage_enabled)
+		return 0;
+
+	for (i = 0; i < nr_storage_devs; i++) {
+		if (k->storage_q[i].outstanding_reqs > 0)
+			budget = MAX(budget, storage_devs[i].poll_tsc);
+	}
+
+	return budget;
+}
+
 extern __thread struct kthread *mykthread;
 
 /**
@@ -472,6 +586,7 @@ extern uint64_t cfg_qdelay_us;
 
 extern void kthread_park(bool voluntary);
 extern void kthread_wait_to_attach(void);
+extern void timer_set_wake_tsc(struct kthread *k, uint64_t tsc);
 
 struct cpu_record {
 	struct kthread *recent_kthread;
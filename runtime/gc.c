@@ -165,7 +165,9 @@ void gc_discover_all_stacks(stack_bounds_cb discover_cb)
 				top = (uint64_t)&th;
 			else
 				discover_cb(sizeof(th->tf) + (uintptr_t)&th->tf, (uintptr_t)&th->tf); // scan trapframes also
-			discover_cb((uintptr_t)&th->stack->usable[STACK_PTR_SIZE], top);
+			/* lazy threads that haven't run yet have no stack */
+			if (th->stack)
+				discover_cb((uintptr_t)&th->stack->usable[STACK_PTR_SIZE], top);
 		}
 		spin_unlock(&all_threads[i].lock);
 	}
@@ -110,9 +110,11 @@ static size_t estimate_shm_space(void)
 
 #ifdef DIRECT_STORAGE
 	// SPDK completion queue memory
-	if (cfg_storage_enabled) {
-		/* sizeof(spdk_nvme_cpl) * default queue len * threads */
-		ret += 16 * 4096 * maxks;
+	if (cfg_storage_enabled && !cfg_storage_emu_devs) {
+		/* (sizeof(spdk_nvme_cpl) * default queue len + shadow tail)
+		 * * devices * threads */
+		ret += (16 * 4096 + CACHE_LINE_SIZE) * cfg_storage_max_devs *
+		       maxks;
 	}
 #endif
 	return ret;
@@ -779,6 +779,33 @@ static void tcp_read_finish(tcpconn_t *c, struct mbuf *m)
 	waitq_release_finish(&waiters);
 }
 
+/**
+ * tcp_read_notify - starts a thread once a TCP connection has data to read
+ * @c: the TCP connection
+ * @fn: the function the thread runs
+ * @arg: an argument passed to @fn
+ *
+ * The thread is lazily stacked and waits on the connection's wake queue, so
+ * a pending read costs no stack. Once @fn runs, tcp_read() won't block
+ * unless another reader took the data first.
+ *
+ * Returns 0 if a thread was queued, 1 if data (or the end of the stream) is
+ * already there and nothing was queued, or -ENOMEM.
+ */
+int tcp_read_notify(tcpconn_t *c, thread_fn_t fn, void *arg)
+{
+	int ret;
+
+	spin_lock_np(&c->lock);
+	if (c->rx_closed || (!c->rx_exclusive && !list_empty(&c->rxq))) {
+		spin_unlock_np(&c->lock);
+		return 1;
+	}
+	ret = waitq_add_lazy(&c->rx_wq, &c->lock, fn, arg);
+	spin_unlock_np(&c->lock);
+	return ret;
+}
+
 /**
  * tcp_read - reads data from a TCP connection
  * @c: the TCP connection
@@ -989,6 +1016,42 @@ static void tcp_write_finish(tcpconn_t *c)
 	mbuf_list_free(&q);
 }
 
+/**
+ * tcp_write_notify - starts a thread once a TCP connection has room to write
+ * @c: the TCP connection
+ * @fn: the function the thread runs
+ * @arg: an argument passed to @fn
+ *
+ * The thread is lazily stacked and waits on the connection's wake queue, so
+ * a pending write costs no stack. Once @fn runs, tcp_write() won't block
+ * unless another writer filled the window first.
+ *
+ * Returns 0 if a thread was queued, 1 if the send window is already open (or
+ * the connection is closed) and nothing was queued, or -ENOMEM.
+ */
+int tcp_write_notify(tcpconn_t *c, thread_fn_t fn, void *arg)
+{
+	int ret;
+
+	spin_lock_np(&c->lock);
+	if (c->tx_closed ||
+	    (c->pcb.state >= TCP_STATE_ESTABLISHED && !c->tx_exclusive &&
+	     !tcp_is_snd_full(c))) {
+		spin_unlock_np(&c->lock);
+		return 1;
+	}
+
+	/* arm window probing if needed, as tcp_write_wait() would */
+	if (!c->zero_wnd && tcp_is_snd_full(c)) {
+		c->zero_wnd = true;
+		c->zero_wnd_ts = microtime();
+		tcp_timer_update(c);
+	}
+	ret = waitq_add_lazy(&c->tx_wq, &c->lock, fn, arg);
+	spin_unlock_np(&c->lock);
+	return ret;
+}
+
 /**
  * tcp_write - writes data to a TCP connection
  * @c: the TCP connection
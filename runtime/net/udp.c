@@ -278,6 +278,33 @@ int udp_set_buffers(udpconn_t *c, int read_mbufs, int write_mbufs)
 	return 0;
 }
 
+/**
+ * udp_read_notify - starts a thread once a UDP socket has a datagram to read
+ * @c: the UDP socket
+ * @fn: the function the thread runs
+ * @arg: an argument passed to @fn
+ *
+ * The thread is lazily stacked and waits on the socket's wake queue. Once @fn
+ * runs, udp_read_from() won't block unless another reader took the datagram
+ * first.
+ *
+ * Returns 0 if a thread was queued, 1 if a datagram, an error, or a shutdown
+ * is already pending and nothing was queued, or -ENOMEM.
+ */
+int udp_read_notify(udpconn_t *c, thread_fn_t fn, void *arg)
+{
+	int ret;
+
+	spin_lock_np(&c->inq_lock);
+	if (!mbufq_empty(&c->inq) || c->inq_err || c->shutdown) {
+		spin_unlock_np(&c->inq_lock);
+		return 1;
+	}
+	ret = waitq_add_lazy(&c->inq_wq, &c->inq_lock, fn, arg);
+	spin_unlock_np(&c->inq_lock);
+	return ret;
+}
+
 /**
  * udp_read_from - reads from a UDP socket
  * @c: the UDP socket
@@ -355,6 +382,33 @@ static void udp_tx_release_mbuf(struct mbuf *m)
 		udp_conn_put(c);
 }
 
+/**
+ * udp_write_notify - starts a thread once a UDP socket has room to write
+ * @c: the UDP socket
+ * @fn: the function the thread runs
+ * @arg: an argument passed to @fn
+ *
+ * The thread is lazily stacked and waits on the socket's wake queue. Once @fn
+ * runs, udp_write_to() won't block unless another writer filled the queue
+ * first.
+ *
+ * Returns 0 if a thread was queued, 1 if the output queue has room (or the
+ * socket is shutdown) and nothing was queued, or -ENOMEM.
+ */
+int udp_write_notify(udpconn_t *c, thread_fn_t fn, void *arg)
+{
+	int ret;
+
+	spin_lock_np(&c->outq_lock);
+	if (c->outq_len < c->outq_cap || c->shutdown) {
+		spin_unlock_np(&c->outq_lock);
+		return 1;
+	}
+	ret = waitq_add_lazy(&c->outq_wq, &c->outq_lock, fn, arg);
+	spin_unlock_np(&c->outq_lock);
+	return ret;
+}
+
 /**
  * udp_write_to - writes to a UDP socket
  * @c: the UDP socket
@@ -26,6 +26,32 @@ static inline void waitq_wait(waitq_t *q, spinlock_t *l)
 	spin_lock_np(l);
 }
 
+/**
+ * waitq_add_lazy - queues a new thread, rather than the caller, for the next
+ * signal
+ * @q: the wake queue
+ * @l: a held spinlock protecting the wake queue and the condition
+ * @fn: the function the new thread runs
+ * @arg: an argument passed to @fn
+ *
+ * The thread comes from thread_create_lazy(), so it holds no stack while it
+ * waits.
+ *
+ * Returns 0 if successful, otherwise -ENOMEM.
+ */
+static inline int waitq_add_lazy(waitq_t *q, spinlock_t *l, thread_fn_t fn,
+				 void *arg)
+{
+	thread_t *th;
+
+	assert_spin_lock_held(l);
+	th = thread_create_lazy(fn, arg);
+	if (unlikely(!th))
+		return -ENOMEM;
+	list_add_tail(&q->waiters, &th->link);
+	return 0;
+}
+
 /**
  * waitq_signal - wakes up to one waiter on the wake queue
  * @q: the wake queue
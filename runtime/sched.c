@@ -70,6 +70,41 @@ static inline bool cores_have_affinity(unsigned int cpua, unsigned int cpub)
 	       cpu_map[cpua].sibling_core == cpub;
 }
 
+/**
+ * attach_stack - gives a thread created by thread_create_lazy() its stack
+ * @th: the thread, about to run for the first time
+ *
+ * Returns false if no stack is free, in which case @th can't run yet.
+ */
+static __always_inline bool attach_stack(thread_t *th)
+{
+	if (likely(th->stack))
+		return true;
+
+	th->stack = stack_alloc();
+	if (unlikely(!th->stack))
+		return false;
+	th->tf.rsp = stack_init_to_rsp(th->stack, thread_exit);
+	return true;
+}
+
+/**
+ * requeue_stackless - puts a thread that couldn't get a stack back at the
+ * end of the runqueue
+ * @l: the local kthread, with its lock held
+ * @th: the thread, just popped from @l's runqueue
+ */
+static void requeue_stackless(struct kthread *l, thread_t *th)
+{
+	assert_spin_lock_held(&l->lock);
+
+	if (list_empty(&l->rq_overflow))
+		l->rq[l->rq_head++ % RUNTIME_RQ_SIZE] = th;
+	else
+		list_add_tail(&l->rq_overflow, &th->link);
+	ACCESS_ONCE(l->q_ptrs->rq_head)++;
+}
+
 /**
  * jmp_thread - runs a thread, popping its trap frame
  * @th: the thread to run
@@ -281,14 +316,55 @@ static __noinline bool do_watchdog(struct kthread *l)
 	return work;
 }
 
+/*
+ * storage_poll - cheaply waits for local storage completions before parking
+ *
+ * Only the local queues are checked, so an idle kthread with I/O in flight
+ * doesn't keep hammering other kthreads' locks. Returns true if there may be
+ * new work, or false if the polling budget expired and the kthread should
+ * park (the iokernel wakes it when the completion queue becomes busy).
+ */
+static bool storage_poll(struct kthread *l, uint64_t start_tsc)
+{
+	uint64_t budget, now, poll_start;
+	bool work = false;
+
+	assert_spin_lock_held(&l->lock);
+
+	budget = storage_poll_budget(l);
+	poll_start = rdtsc();
+	if (!budget || poll_start - start_tsc >= budget)
+		return false;
+
+	/* drop the lock so other kthreads can steal from (or wake onto) us */
+	spin_unlock(&l->lock);
+	while (true) {
+		if (softirq_pending(l) ||
+		    ACCESS_ONCE(l->rq_head) != ACCESS_ONCE(l->rq_tail) ||
+		    preempt_cede_needed() || !storage_inflight(l)) {
+			work = true;
+			break;
+		}
+
+		now = rdtsc();
+		if (now - start_tsc >= budget)
+			break;
+		cpu_relax();
+	}
+	spin_lock(&l->lock);
+
+	STAT(STORAGE_POLL_CYCLES) += rdtsc() - poll_start;
+	return work;
+}
+
 /* the main scheduler routine, decides what to run next */
 static __noreturn __noinline void schedule(void)
 {
 	struct kthread *r = NULL, *l = myk();
-	uint64_t start_tsc, end_tsc;
+	uint64_t start_tsc, end_tsc, emu_deadline;
 	thread_t *th = NULL;
 	unsigned int start_idx;
-	unsigned int iters = 0;
+	unsigned int iters = 0, stack_waits = 0;
 	int i, sibling;
 
 	assert_spin_lock_held(&l->lock);
@@ -376,14 +452,24 @@ again:
 	/* keep trying to find work until the polling timeout expires */
 	if (!preempt_cede_needed() &&
 	    (++iters < RUNTIME_SCHED_POLL_ITERS ||
-	     rdtsc() - start_tsc < cycles_per_us * RUNTIME_SCHED_MIN_POLL_US ||
-	     storage_pending_completions(&l->storage_q))) {
+	     rdtsc() - start_tsc < cycles_per_us * RUNTIME_SCHED_MIN_POLL_US)) {
 		goto again;
 	}
 
+	/* with I/O in flight, wait a little longer for completions */
+	if (!preempt_cede_needed() && storage_poll(l, start_tsc))
+		goto again;
+
 	l->parked = true;
+	/* tell the iokernel to watch our storage queues while parked */
+	ACCESS_ONCE(l->q_ptrs->storage_inflight) = storage_inflight(l);
 	spin_unlock(&l->lock);
 
+	/* emulated queues are invisible to the iokernel, wake up on time */
+	emu_deadline = cfg_storage_emu_devs ? storage_emu_deadline(l) : 0;
+	if (emu_deadline)
+		timer_set_wake_tsc(l, emu_deadline);
+
 	/* did not find anything to run, park this kthread */
 	STAT(SCHED_CYCLES) += rdtsc() - start_tsc;
 	/* we may have got a preempt signal before voluntarily yielding */
@@ -391,6 +477,9 @@ again:
 	start_tsc = rdtsc();
 	iters = 0;
 
+	if (emu_deadline)
+		timer_set_wake_tsc(l, 0);
+
 	spin_lock(&l->lock);
 	l->parked = false;
 	goto again;
@@ -401,6 +490,26 @@ done:
 	th = l->rq[l->rq_tail++ % RUNTIME_RQ_SIZE];
 	ACCESS_ONCE(l->q_ptrs->rq_tail)++;
 
+	/* a lazy thread can't start until a stack is free, run others first */
+	if (unlikely(!attach_stack(th))) {
+		requeue_stackless(l, th);
+		if (++stack_waits < l->rq_head - l->rq_tail)
+			goto done;
+
+		/* every queued thread is waiting, give others a chance to free
+		 * stacks or steal our threads */
+		stack_waits = 0;
+		spin_unlock(&l->lock);
+		cpu_relax();
+		spin_lock(&l->lock);
+		if (unlikely(!list_empty(&l->rq_overflow)))
+			drain_overflow(l);
+		if (l->rq_head != l->rq_tail)
+			goto done;
+		l->rq_head = l->rq_tail = 0;
+		goto again;
+	}
+
 	/* move overflow tasks into the runqueue */
 	if (unlikely(!list_empty(&l->rq_overflow)))
 		drain_overflow(l);
@@ -447,6 +556,7 @@ static __always_inline void enter_schedule(thread_t *curth)
 
 	/* slow path: switch from the uthread stack to the runtime stack */
 	if (k->rq_head == k->rq_tail ||
+	    unlikely(!k->rq[k->rq_tail % RUNTIME_RQ_SIZE]->stack) ||
 #ifdef GC
 	    get_gc_gen() != k->local_gc_gen ||
 #endif
@@ -744,10 +854,10 @@ void thread_cede(void)
 	jmp_runtime(thread_finish_cede);
 }
 
-static __always_inline thread_t *__thread_create(void)
+static __always_inline thread_t *__thread_create(bool with_stack)
 {
 	struct thread *th;
-	struct stack *s;
+	struct stack *s = NULL;
 
 	preempt_disable();
 	th = tcache_alloc(&perthread_get(thread_pt));
@@ -756,11 +866,13 @@ static __always_inline thread_t *__thread_create(void)
 		return NULL;
 	}
 
-	s = stack_alloc();
-	if (unlikely(!s)) {
-		tcache_free(&perthread_get(thread_pt), th);
-		preempt_enable();
-		return NULL;
+	if (with_stack) {
+		s = stack_alloc();
+		if (unlikely(!s)) {
+			tcache_free(&perthread_get(thread_pt), th);
+			preempt_enable();
+			return NULL;
+		}
 	}
 	th->last_cpu = myk()->curr_cpu;
 	preempt_enable();
@@ -774,6 +886,33 @@ static __always_inline thread_t *__thread_create(void)
 	return th;
 }
 
+/**
+ * thread_create_lazy - creates a new thread that gets its stack when it
+ * first runs
+ * @fn: a function pointer to the starting method of the thread
+ * @arg: an argument passed to @fn
+ *
+ * Until it is scheduled, the thread costs only its struct thread, so many of
+ * them can wait on wake queues (e.g. to resume a suspended coroutine) without
+ * each pinning a stack. If no stack is free when it is scheduled, it waits in
+ * the runqueue until one is.
+ *
+ * Returns the new thread, or NULL if out of memory.
+ */
+thread_t *thread_create_lazy(thread_fn_t fn, void *arg)
+{
+	thread_t *th = __thread_create(false);
+	if (unlikely(!th))
+		return NULL;
+
+	th->tf.rsp = 0;
+	th->tf.rdi = (uint64_t)arg;
+	th->tf.rbp = (uint64_t)0; /* just in case base pointers are enabled */
+	th->tf.rip = (uint64_t)fn;
+	gc_register_thread(th);
+	return th;
+}
+
 /**
  * thread_create - creates a new thread
  * @fn: a function pointer to the starting method of the thread
@@ -783,7 +922,7 @@ static __always_inline thread_t *__thread_create(void)
  */
 thread_t *thread_create(thread_fn_t fn, void *arg)
 {
-	thread_t *th = __thread_create();
+	thread_t *th = __thread_create(true);
 	if (unlikely(!th))
 		return NULL;
 
@@ -807,7 +946,7 @@ thread_t *thread_create(thread_fn_t fn, void *arg)
 thread_t *thread_create_with_buf(thread_fn_t fn, void **buf, size_t buf_len)
 {
 	void *ptr;
-	thread_t *th = __thread_create();
+	thread_t *th = __thread_create(true);
 	if (unlikely(!th))
 		return NULL;
 
@@ -14,8 +14,8 @@
 #define SMALLOC_MAG_SIZE	8
 #define SMALLOC_BITS            15
 #define SMALLOC_MIN_SIZE	SLAB_MIN_SIZE
-#define SMALLOC_MAX_SIZE        (SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1))
 BUILD_ASSERT(SMALLOC_MIN_SIZE >= SLAB_MIN_SIZE);
+BUILD_ASSERT(SMALLOC_MAX_SIZE == SMALLOC_MIN_SIZE << (SMALLOC_BITS - 1));
 
 static struct slab smalloc_slabs[SMALLOC_BITS];
 static struct tcache *smalloc_tcaches[SMALLOC_BITS];
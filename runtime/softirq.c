@@ -27,7 +27,7 @@ static bool softirq_timer_pending(struct kthread *k)
 
 static bool softirq_storage_pending(struct kthread *k)
 {
-	return storage_available_completions(&k->storage_q);
+	return storage_available_completions(k);
 }
 
 /**
@@ -10,6 +10,8 @@
 #include <base/time.h>
 #include <base/tcache.h>
 #include <base/thread.h>
+#include <runtime/runtime.h>
+#include <runtime/sync.h>
 #include <runtime/thread.h>
 #include <runtime/udp.h>
 #include <runtime/tcp.h>
@@ -19,6 +21,20 @@
 /* port 40 is permanently reserved, so should be fine for now */
 #define STAT_PORT	40
 
+/* the most commands that can be registered with stat_register_cmd() */
+#define STAT_MAX_CMDS	8
+/* the longest command name (and arguments) that is recognized */
+#define STAT_CMD_LEN	64
+
+struct stat_cmd {
+	char		name[STAT_CMD_LEN];
+	stat_cmd_fn_t	fn;
+};
+
+static DEFINE_SPINLOCK(stat_cmd_lock);
+static struct stat_cmd stat_cmds[STAT_MAX_CMDS];
+static int stat_nr_cmds;
+
 static const char *stat_names[] = {
 	/* scheduler counters */
 	"reschedules",
@@ -35,6 +51,7 @@ static const char *stat_names[] = {
 	"local_wakes",
 	"remote_wakes",
 	"rq_overflow",
+	"storage_poll_cycles",
 
 	/* network stack counters */
 	"rx_bytes",
@@ -123,6 +140,83 @@ static ssize_t stat_write_buf(char *buf, size_t len)
 	return pos - buf;
 }
 
+/**
+ * stat_register_cmd - adds a command to the stat server
+ * @name: the command name (the first word of a request)
+ * @fn: generates the response; receives the rest of the request line
+ *
+ * Requests that don't start with a registered command name still get the
+ * runtime counters, so existing stat clients are unaffected.
+ *
+ * Returns 0 if successful.
+ */
+int stat_register_cmd(const char *name, stat_cmd_fn_t fn)
+{
+	int i, ret = 0;
+
+	if (strlen(name) == 0 || strlen(name) >= STAT_CMD_LEN ||
+	    strcmp(name, "stat") == 0)
+		return -EINVAL;
+
+	spin_lock_np(&stat_cmd_lock);
+	for (i = 0; i < stat_nr_cmds; i++) {
+		if (strcmp(stat_cmds[i].name, name) == 0) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	if (stat_nr_cmds >= STAT_MAX_CMDS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	strcpy(stat_cmds[stat_nr_cmds].name, name);
+	stat_cmds[stat_nr_cmds].fn = fn;
+	store_release(&stat_nr_cmds, stat_nr_cmds + 1);
+
+out:
+	spin_unlock_np(&stat_cmd_lock);
+	return ret;
+}
+
+/*
+ * Runs a registered command if the request names one. Returns the length of
+ * the response, or -ENOENT if the request is for the runtime counters. A
+ * command that fails gets an error line as its response.
+ */
+static ssize_t stat_run_cmd(const char *req, size_t req_len, char *buf,
+			    size_t len)
+{
+	char line[STAT_CMD_LEN];
+	const char *args;
+	ssize_t ret;
+	size_t n;
+	int i, nr;
+
+	/* copy out the first line, the response may overwrite the request */
+	n = MIN(req_len, sizeof(line) - 1);
+	memcpy(line, req, n);
+	line[n] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+
+	n = strcspn(line, " ");
+	args = line[n] ? &line[n + 1] : &line[n];
+
+	nr = load_acquire(&stat_nr_cmds);
+	for (i = 0; i < nr; i++) {
+		if (strlen(stat_cmds[i].name) == n &&
+		    strncmp(stat_cmds[i].name, line, n) == 0) {
+			ret = stat_cmds[i].fn(args, buf, len);
+			if (ret < 0)
+				ret = snprintf(buf, len, "error: %s\n",
+					       strerror(-ret));
+			return MIN(ret, len);
+		}
+	}
+
+	return -ENOENT;
+}
+
 static void stat_tcp_worker(void *arg)
 {
 	struct {
@@ -137,7 +231,9 @@ static void stat_tcp_worker(void *arg)
 		if (ret <= 0)
 			goto done;
 
-		len = stat_write_buf(resp.buf, sizeof(resp.buf));
+		len = stat_run_cmd(resp.buf, ret, resp.buf, sizeof(resp.buf));
+		if (len == -ENOENT)
+			len = stat_write_buf(resp.buf, sizeof(resp.buf));
 		if (len < 0) {
 			WARN();
 			continue;
@@ -205,10 +301,13 @@ static void stat_worker_udp(void *arg)
 		ret = udp_read_from(c, buf, payload_size, &raddr);
 		if (ret < cmd_len)
 			continue;
-		if (strncmp(buf, "stat", cmd_len) != 0)
-			continue;
-
-		len = stat_write_buf(buf, payload_size);
+		if (strncmp(buf, "stat", cmd_len) != 0) {
+			len = stat_run_cmd(buf, ret, buf, payload_size);
+			if (len == -ENOENT)
+				continue;
+		} else {
+			len = stat_write_buf(buf, payload_size);
+		}
 		if (len < 0) {
 			log_err("stat: couldn't generate stat buffer");
 			continue;
@@ -1,290 +1,425 @@
 /*
- * storage.c
+ * storage.c - block storage on NVMe devices (via SPDK) or emulated devices
  */
 
-#include <runtime/storage.h>
-
-
-uint32_t block_size;
-uint64_t num_blocks;
-
-#ifdef DIRECT_STORAGE
 #include <stdio.h>
+#include <sys/mman.h>
+
 #include <base/hash.h>
 #include <base/log.h>
 #include <base/mempool.h>
+#include <runtime/smalloc.h>
+#include <runtime/storage.h>
 #include <runtime/sync.h>
 
+#ifdef DIRECT_STORAGE
 // Hack to prevent SPDK from pulling in extra headers here
 #define SPDK_STDINC_H
 struct iovec;
 #include <spdk/nvme.h>
 #include <spdk/env.h>
+#endif
 
 #include "defs.h"
 
-unsigned long storage_device_latency_us = 100;
-bool cfg_storage_enabled;
-
-static struct spdk_nvme_ctrlr *controller;
-static struct spdk_nvme_ns *spdk_namespace;
+/* geometry of the default volume */
+uint32_t block_size;
+uint64_t num_blocks;
 
-/* 4KB storage request buffers */
-#define REQUEST_BUF_POOL_SZ (PGSIZE_2MB * 20)
-#define REQUEST_BUF_SZ (16 * KB)
-struct mempool storage_buf_mp;
-static struct tcache *storage_buf_tcache;
-static DEFINE_PERTHREAD(struct tcache_perthread, storage_buf_pt);
+bool cfg_storage_enabled;
+unsigned int cfg_storage_max_devs = 1;
+unsigned int cfg_storage_stripe_blocks;
+unsigned int cfg_storage_emu_devs;
+uint64_t cfg_storage_emu_blocks = 1UL << 20;
+unsigned long cfg_storage_emu_latency_us = 10;
+/* idle polling budget for NVMe devices, -1 picks one based on latency */
+long cfg_storage_poll_us = -1;
 
-struct nvme_device {
-	const char *name;
-	unsigned long latency_us;
-} known_devices[1] = {
-	{
-		.name = "INTEL SSDPED1D280GA",
-		.latency_us = 10,
-	}
-};
+unsigned int nr_storage_devs;
+struct storage_dev storage_devs[NSTORAGEDEV];
 
-static void seq_complete(void *arg, const struct spdk_nvme_cpl *completion)
-{
-	struct thread *th = arg;
-	thread_ready(th);
-}
+/* is the default volume striped across all devices? */
+static bool storage_striped;
 
 /**
- * probe_cb - callback run after nvme devices have been probed
+ * storage_cmd_init - prepares a command for storage_issue()
  *
+ * The caller holds a reference until it calls storage_cmd_wait().
  */
-static bool probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-		     struct spdk_nvme_ctrlr_opts *opts)
+void storage_cmd_init(struct storage_cmd *cmd)
 {
-	opts->io_queue_size = UINT16_MAX;
-	return true;
+	spin_lock_init(&cmd->lock);
+	cmd->pending = 1;
+	cmd->status = 0;
+	cmd->waiter = NULL;
 }
 
 /**
- * attach_cb - callback run after nvme device has been attached
+ * storage_cmd_wait - drops the caller's reference and waits for completion
  *
+ * Returns 0 if all commands succeeded, otherwise -EIO.
  */
-static void attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-		      struct spdk_nvme_ctrlr *ctrlr,
-		      const struct spdk_nvme_ctrlr_opts *opts)
+int storage_cmd_wait(struct storage_cmd *cmd)
 {
-	int i, num_ns;
-	const struct spdk_nvme_ctrlr_data *ctrlr_data;
-
-	num_ns = spdk_nvme_ctrlr_get_num_ns(ctrlr);
-	if (num_ns > 1) {
-		perror("more than 1 storage devices");
-		exit(1);
-	}
-	if (num_ns == 0) {
-		perror("no storage device");
-		exit(1);
-	}
-	controller = ctrlr;
-	ctrlr_data = spdk_nvme_ctrlr_get_data(ctrlr);
-	spdk_namespace = spdk_nvme_ctrlr_get_ns(ctrlr, 1);
-	block_size = spdk_nvme_ns_get_sector_size(spdk_namespace);
-	num_blocks = spdk_nvme_ns_get_num_sectors(spdk_namespace);
-
-	for (i = 0; i < ARRAY_SIZE(known_devices); i++) {
-		if (!strncmp((char *)ctrlr_data->mn, known_devices[i].name,
-			           strlen(known_devices[i].name))) {
-			log_info("storage: recognized device %s", known_devices[i].name);
-			storage_device_latency_us = known_devices[i].latency_us;
-			break;
-		}
+	spin_lock_np(&cmd->lock);
+	if (--cmd->pending > 0) {
+		cmd->waiter = thread_self();
+		thread_park_and_unlock_np(&cmd->lock);
+	} else {
+		spin_unlock_np(&cmd->lock);
 	}
 
+	return cmd->status;
+}
 
+static void storage_cmd_get(struct storage_cmd *cmd)
+{
+	spin_lock(&cmd->lock);
+	cmd->pending++;
+	spin_unlock(&cmd->lock);
 }
 
-/**
- * storage_write - write a payload to the nvme device
- *                 expects lba_count*storage_block_size() bytes to be allocated in the buffer
- *
- * returns -ENOMEM if no available memory, and -EIO if the write operation failed
- */
-int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+static void storage_cmd_put(struct storage_cmd *cmd, bool error)
 {
-	int rc;
-	struct kthread *k;
-	struct storage_q *q;
-	void *spdk_payload;
+	thread_t *th = NULL;
+
+	spin_lock(&cmd->lock);
+	if (unlikely(error))
+		cmd->status = -EIO;
+	if (--cmd->pending == 0)
+		th = cmd->waiter;
+	spin_unlock(&cmd->lock);
+
+	/* @cmd lives on the waiter's stack, don't touch it after this */
+	if (th)
+		thread_ready(th);
+}
 
-	if (!cfg_storage_enabled)
-		return -ENODEV;
 
-	size_t req_size = lba_count * block_size;
-	bool use_thread_cache = req_size <= REQUEST_BUF_SZ;
+/* devices slower than this park right away (a wakeup is cheaper) */
+#define STORAGE_POLL_MAX_LATENCY_US	10
 
-	k = getk();
-	q = &k->storage_q;
+/*
+ * Idle kthreads with I/O in flight poll for completions for about twice the
+ * device latency, then park and let the iokernel wake them when the
+ * completion queue becomes busy.
+ */
+static uint64_t storage_poll_tsc(unsigned long latency_us)
+{
+	if (cfg_storage_poll_us >= 0)
+		return cfg_storage_poll_us * cycles_per_us;
+	if (latency_us > STORAGE_POLL_MAX_LATENCY_US)
+		return 0;
+	return 2 * latency_us * cycles_per_us;
+}
 
-	if (likely(use_thread_cache)) {
-		spdk_payload = tcache_alloc(&perthread_get(storage_buf_pt));
-	} else {
-		spdk_payload =
-			spdk_zmalloc(req_size, 0, NULL, SPDK_ENV_SOCKET_ID_ANY,
-				     SPDK_MALLOC_DMA);
-	}
 
-	if (unlikely(spdk_payload == NULL)) {
-		putk();
-		return -ENOMEM;
-	}
+/*
+ * Emulated devices
+ *
+ * Emulated devices keep their contents in anonymous memory and complete
+ * requests in FIFO order after a fixed delay. The data copy happens at
+ * completion time in the storage softirq, like a device DMA would.
+ */
 
-	memcpy(spdk_payload, payload, req_size);
+static int storage_emu_submit(struct storage_dev *dev, struct storage_q *q,
+			      int op, void *buf, uint64_t lba,
+			      uint32_t lba_count, struct storage_cmd *cmd)
+{
+	struct storage_emu_q *eq = q->emu_q;
+	struct storage_emu_req *req;
 
-	spin_lock(&q->lock);
-	rc = spdk_nvme_ns_cmd_write(spdk_namespace, q->spdk_qp_handle,
-				    spdk_payload, lba, lba_count, seq_complete,
-				    thread_self(), 0);
+	if (unlikely(eq->tail - eq->head >= STORAGE_EMU_QLEN))
+		return -ENOMEM;
 
-	if (unlikely(rc != 0)) {
-		spin_unlock(&q->lock);
-		rc = -EIO;
-		goto done_np;
-	}
+	req = &eq->reqs[eq->tail % STORAGE_EMU_QLEN];
+	req->deadline_tsc = rdtsc() + dev->emu_latency_tsc;
+	req->buf = buf;
+	req->lba = lba;
+	req->lba_count = lba_count;
+	req->op = op;
+	req->cmd = cmd;
+	store_release(&eq->tail, eq->tail + 1);
 
-	q->outstanding_reqs++;
-	thread_park_and_unlock_np(&q->lock);
+	return 0;
+}
 
-	preempt_disable();
+static int storage_emu_poll(struct storage_dev *dev, struct storage_q *q)
+{
+	struct storage_emu_q *eq = q->emu_q;
+	struct storage_emu_req *req;
+	uint64_t now = rdtsc();
+	unsigned char *addr;
+	size_t len;
+	int n = 0;
+
+	while (n < RUNTIME_RX_BATCH_SIZE && eq->head != eq->tail) {
+		req = &eq->reqs[eq->head % STORAGE_EMU_QLEN];
+		if (req->deadline_tsc > now)
+			break;
 
-done_np:
-	if (likely(use_thread_cache))
-		tcache_free(&perthread_get(storage_buf_pt), spdk_payload);
-	else
-		spdk_free(spdk_payload);
+		addr = dev->emu_base + req->lba * dev->block_size;
+		len = (size_t)req->lba_count * dev->block_size;
+		if (req->op == STORAGE_OP_WRITE)
+			memcpy(addr, req->buf, len);
+		else if (req->op == STORAGE_OP_READ)
+			memcpy(req->buf, addr, len);
 
-	preempt_enable();
+		store_release(&eq->head, eq->head + 1);
+		storage_cmd_put(req->cmd, false);
+		n++;
+	}
 
-	return rc;
+	return n;
 }
 
 /**
- * storage_read - read a payload from the nvme device
- *                expects lba_count*storage_block_size() bytes to be allocated in the buffer
+ * storage_emu_deadline - the earliest completion deadline on a kthread's
+ * emulated device queues
  *
- * returns -ENOMEM if no available memory, and -EIO if the write operation failed
+ * Returns the deadline in cycles, or 0 if nothing is in flight.
  */
-int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+uint64_t storage_emu_deadline(struct kthread *k)
 {
-	int rc;
-	struct kthread *k;
-	struct storage_q *q;
-	void *spdk_payload;
-
-	if (!cfg_storage_enabled)
-		return -ENODEV;
+	struct storage_emu_q *eq;
+	uint64_t deadline = 0, tsc;
+	uint32_t head;
+	int i;
+
+	for (i = 0; i < nr_storage_devs; i++) {
+		if (!storage_devs[i].emulated)
+			continue;
+		eq = k->storage_q[i].emu_q;
+		head = ACCESS_ONCE(eq->head);
+		if (head == ACCESS_ONCE(eq->tail))
+			continue;
+		tsc = eq->reqs[head % STORAGE_EMU_QLEN].deadline_tsc;
+		if (!deadline || tsc < deadline)
+			deadline = tsc;
+	}
 
-	size_t req_size = lba_count * block_size;
-	bool use_thread_cache = req_size <= REQUEST_BUF_SZ;
+	return deadline;
+}
 
-	k = getk();
-	q = &k->storage_q;
+/*
+ * storage_emu_publish - tells the iokernel when the oldest emulated completion
+ * on @k's queues is due
+ *
+ * Emulated queues are invisible to the iokernel, so this is how completions
+ * that are due but not yet reaped count toward the kthread's queueing delay,
+ * like a busy NVMe completion queue does. It's a hint: racing updates may
+ * leave it briefly stale.
+ */
+static void storage_emu_publish(struct kthread *k)
+{
+	ACCESS_ONCE(k->q_ptrs->storage_ready_tsc) = storage_emu_deadline(k);
+}
 
-	if (likely(use_thread_cache)) {
-		spdk_payload = tcache_alloc(&perthread_get(storage_buf_pt));
-	} else {
-		spdk_payload =
-			spdk_zmalloc(req_size, 0, NULL, SPDK_ENV_SOCKET_ID_ANY,
-				     SPDK_MALLOC_DMA);
-	}
+static int storage_emu_init_thread(struct kthread *k, unsigned int idx)
+{
+	struct storage_q *q = &k->storage_q[idx];
 
-	if (unlikely(spdk_payload == NULL)) {
-		putk();
+	q->emu_q = aligned_alloc(CACHE_LINE_SIZE, sizeof(*q->emu_q));
+	if (!q->emu_q)
 		return -ENOMEM;
+
+	q->emu_q->head = q->emu_q->tail = 0;
+	return 0;
+}
+
+static int storage_emu_init(void)
+{
+	struct storage_dev *dev;
+	size_t len;
+	int i;
+
+	for (i = 0; i < cfg_storage_emu_devs; i++) {
+		dev = &storage_devs[i];
+		dev->emulated = true;
+		/* the iokernel can't see emulated queues, so parked kthreads
+		   are woken by the earliest completion deadline instead */
+		dev->poll_tsc = storage_poll_tsc(cfg_storage_emu_latency_us);
+		dev->block_size = 512;
+		dev->num_blocks = cfg_storage_emu_blocks;
+		dev->latency_us = cfg_storage_emu_latency_us;
+		dev->emu_latency_tsc = cfg_storage_emu_latency_us * cycles_per_us;
+
+		len = dev->num_blocks * dev->block_size;
+		dev->emu_base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS |
+				     MAP_NORESERVE, -1, 0);
+		if (dev->emu_base == MAP_FAILED) {
+			log_err("storage: couldn't map %zu bytes for emulated "
+				"device %d", len, i);
+			return -ENOMEM;
+		}
+
+		nr_storage_devs++;
 	}
 
-	spin_lock(&q->lock);
-	rc = spdk_nvme_ns_cmd_read(spdk_namespace, q->spdk_qp_handle,
-				   spdk_payload, lba, lba_count, seq_complete,
-				   thread_self(), 0);
+	log_info("storage: %u emulated devices, %lu blocks each, latency %lu us",
+		 nr_storage_devs, cfg_storage_emu_blocks,
+		 cfg_storage_emu_latency_us);
+	return 0;
+}
 
-	if (unlikely(rc != 0)) {
-		spin_unlock(&q->lock);
-		rc = -EIO;
-		goto done_np;
+
+/*
+ * NVMe devices
+ */
+
+#ifdef DIRECT_STORAGE
+
+/* 4KB storage request buffers */
+#define REQUEST_BUF_POOL_SZ (PGSIZE_2MB * 20)
+#define REQUEST_BUF_SZ (16 * KB)
+struct mempool storage_buf_mp;
+static struct tcache *storage_buf_tcache;
+static DEFINE_PERTHREAD(struct tcache_perthread, storage_buf_pt);
+
+struct nvme_device {
+	const char *name;
+	unsigned long latency_us;
+} known_devices[1] = {
+	{
+		.name = "INTEL SSDPED1D280GA",
+		.latency_us = 10,
 	}
+};
 
-	q->outstanding_reqs++;
-	thread_park_and_unlock_np(&q->lock);
-	memcpy(dest, spdk_payload, req_size);
-	preempt_disable();
+static void *storage_dma_alloc(size_t len)
+{
+	if (likely(len <= REQUEST_BUF_SZ))
+		return tcache_alloc(&perthread_get(storage_buf_pt));
+
+	return spdk_zmalloc(len, 0, NULL, SPDK_ENV_SOCKET_ID_ANY,
+			    SPDK_MALLOC_DMA);
+}
 
-done_np:
-	if (likely(use_thread_cache))
-		tcache_free(&perthread_get(storage_buf_pt), spdk_payload);
+static void storage_dma_free(void *buf, size_t len)
+{
+	if (likely(len <= REQUEST_BUF_SZ))
+		tcache_free(&perthread_get(storage_buf_pt), buf);
 	else
-		spdk_free(spdk_payload);
-	preempt_enable();
+		spdk_free(buf);
+}
 
-	return rc;
+static void storage_nvme_complete(void *arg,
+				  const struct spdk_nvme_cpl *completion)
+{
+	storage_cmd_put(arg, spdk_nvme_cpl_is_error(completion));
 }
 
-static int storage_softirq_one(struct storage_q *q)
+static int storage_nvme_submit(struct storage_dev *dev, struct storage_q *q,
+			       int op, void *buf, uint64_t lba,
+			       uint32_t lba_count, struct storage_cmd *cmd)
 {
-	int ret;
+	switch (op) {
+	case STORAGE_OP_WRITE:
+		return spdk_nvme_ns_cmd_write(dev->spdk_ns, q->spdk_qp_handle,
+					      buf, lba, lba_count,
+					      storage_nvme_complete, cmd, 0);
+	case STORAGE_OP_FLUSH:
+		return spdk_nvme_ns_cmd_flush(dev->spdk_ns, q->spdk_qp_handle,
+					      storage_nvme_complete, cmd);
+	default:
+		return spdk_nvme_ns_cmd_read(dev->spdk_ns, q->spdk_qp_handle,
+					     buf, lba, lba_count,
+					     storage_nvme_complete, cmd, 0);
+	}
+}
 
-	assert_spin_lock_held(&q->lock);
+static int storage_nvme_poll(struct storage_q *q)
+{
+	return spdk_nvme_qpair_process_completions(q->spdk_qp_handle,
+						   RUNTIME_RX_BATCH_SIZE);
+}
 
-	ret = spdk_nvme_qpair_process_completions(q->spdk_qp_handle, RUNTIME_RX_BATCH_SIZE);
-	q->outstanding_reqs -= ret;
-	return ret;
+/**
+ * probe_cb - callback run after nvme devices have been probed
+ *
+ */
+static bool probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+		     struct spdk_nvme_ctrlr_opts *opts)
+{
+	if (nr_storage_devs >= cfg_storage_max_devs)
+		return false;
+
+	opts->io_queue_size = UINT16_MAX;
+	return true;
 }
 
-void storage_softirq(void *arg)
+/**
+ * attach_cb - callback run after nvme device has been attached
+ *
+ * Each active namespace becomes a separate device.
+ */
+static void attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+		      struct spdk_nvme_ctrlr *ctrlr,
+		      const struct spdk_nvme_ctrlr_opts *opts)
 {
-	struct kthread *k = arg;
-	struct storage_q *q = &k->storage_q;
-	int ret;
+	int i, nsid, num_ns;
+	const struct spdk_nvme_ctrlr_data *ctrlr_data;
+	struct spdk_nvme_ns *ns;
+	struct storage_dev *dev;
 
-	if (!cfg_storage_enabled)
-		return;
+	num_ns = spdk_nvme_ctrlr_get_num_ns(ctrlr);
+	ctrlr_data = spdk_nvme_ctrlr_get_data(ctrlr);
 
-	while (true) {
-		preempt_disable();
-		do {
-			spin_lock(&q->lock);
-			ret = storage_softirq_one(q);
-			spin_unlock(&q->lock);
-		} while (!preempt_needed() && ret > 0);
-		k->storage_busy = false;
-		thread_park_and_preempt_enable();
+	for (nsid = 1; nsid <= num_ns; nsid++) {
+		if (nr_storage_devs >= cfg_storage_max_devs) {
+			log_info("storage: ignoring devices beyond "
+				 "storage_max_devices (%u)",
+				 cfg_storage_max_devs);
+			return;
+		}
+
+		ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
+		if (!ns || !spdk_nvme_ns_is_active(ns))
+			continue;
+
+		dev = &storage_devs[nr_storage_devs];
+		dev->spdk_ctrlr = ctrlr;
+		dev->spdk_ns = ns;
+		dev->block_size = spdk_nvme_ns_get_sector_size(ns);
+		dev->num_blocks = spdk_nvme_ns_get_num_sectors(ns);
+		dev->latency_us = 100;
+
+		for (i = 0; i < ARRAY_SIZE(known_devices); i++) {
+			if (!strncmp((char *)ctrlr_data->mn,
+				     known_devices[i].name,
+				     strlen(known_devices[i].name))) {
+				log_info("storage: recognized device %s",
+					 known_devices[i].name);
+				dev->latency_us = known_devices[i].latency_us;
+				break;
+			}
+		}
+
+		dev->poll_tsc = storage_poll_tsc(dev->latency_us);
+		log_info("storage: device %u is %s namespace %d, %lu blocks",
+			 nr_storage_devs, trid->traddr, nsid, dev->num_blocks);
+		nr_storage_devs++;
 	}
 }
 
-/**
- * storage_init_thread - initializes storage (per-thread)
- */
-int storage_init_thread(void)
+static int storage_nvme_init_thread(struct kthread *k, unsigned int idx)
 {
-	struct kthread *k = myk();
-	struct hardware_queue_spec *hs = &iok.threads[k->kthread_idx].storage_hwq;
-	struct storage_q *q = &k->storage_q;
-	thread_t *th;
+	struct hardware_queue_spec *hs =
+		&iok.threads[k->kthread_idx].storage_hwq[idx];
+	struct storage_dev *dev = &storage_devs[idx];
+	struct storage_q *q = &k->storage_q[idx];
 
 	int ret;
-	uint32_t max_xfer_size, entries, depth, *consumer_idx;
-	shmptr_t cq_shm;
+	uint32_t max_xfer_size, entries, depth, *consumer_idx, *shadow_tail;
+	shmptr_t cq_shm, tail_shm;
 	struct spdk_nvme_cpl *cpl;
 	struct spdk_nvme_io_qpair_opts opts;
 	void *qp_handle;
 
-	if (!cfg_storage_enabled)
-		return 0;
-
-	th = thread_create(storage_softirq, k);
-	if (!th)
-		return -ENOMEM;
-
-	k->storage_softirq = th;
-	spdk_nvme_ctrlr_get_default_io_qpair_opts(controller, &opts, sizeof(opts));
-	max_xfer_size = spdk_nvme_ns_get_max_io_xfer_size(spdk_namespace);
+	spdk_nvme_ctrlr_get_default_io_qpair_opts(dev->spdk_ctrlr, &opts,
+						  sizeof(opts));
+	max_xfer_size = spdk_nvme_ns_get_max_io_xfer_size(dev->spdk_ns);
 	entries = (4096 - 1) / max_xfer_size + 2;
 	depth = 64;
 	if (depth * entries > opts.io_queue_size) {
@@ -313,22 +448,30 @@ int storage_init_thread(void)
 		return ret;
 	}
 
-	qp_handle =
-		spdk_nvme_ctrlr_alloc_io_qpair(controller, &opts, sizeof(opts));
+	qp_handle = spdk_nvme_ctrlr_alloc_io_qpair(dev->spdk_ctrlr, &opts,
+						   sizeof(opts));
 	if (qp_handle == NULL) {
 		log_err("ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed");
 		return -1;
 	}
 
-	nvme_setup_shenango(qp_handle, &consumer_idx,  &k->q_ptrs->storage_tail);
+	/* the first device uses the shadow tail in the shared queue pointers */
+	if (idx == 0) {
+		shadow_tail = &k->q_ptrs->storage_tail;
+	} else {
+		shadow_tail = iok_shm_alloc(sizeof(*shadow_tail),
+					    CACHE_LINE_SIZE, &tail_shm);
+		if (!shadow_tail)
+			return -ENOMEM;
+	}
+
+	nvme_setup_shenango(qp_handle, &consumer_idx, shadow_tail);
 
 	/* intialize struct storage_q */
-	spin_lock_init(&q->lock);
-	q->outstanding_reqs = 0;
 	q->spdk_qp_handle = qp_handle;
 	q->hq.descriptor_table = cpl;
 	q->hq.consumer_idx = consumer_idx;
-	q->hq.shadow_tail = &k->q_ptrs->storage_tail;
+	q->hq.shadow_tail = shadow_tail;
 	q->hq.descriptor_log_size = __builtin_ctz(sizeof(*cpl));
 	BUILD_ASSERT(is_power_of_two(sizeof(*cpl)));
 	q->hq.nr_descriptors = opts.io_queue_size;
@@ -338,32 +481,22 @@ int storage_init_thread(void)
 	/* inform iokernel of queue info */
 	hs->descriptor_table = cq_shm;
 	hs->consumer_idx = ptr_to_shmptr(
-		&netcfg.tx_region, &k->q_ptrs->storage_tail, sizeof(uint32_t));
+		&netcfg.tx_region, shadow_tail, sizeof(uint32_t));
 	hs->descriptor_log_size = q->hq.descriptor_log_size;
 	hs->nr_descriptors = q->hq.nr_descriptors;
 	hs->parity_byte_offset = q->hq.parity_byte_offset;
 	hs->parity_bit_mask = q->hq.parity_bit_mask;
 	hs->hwq_type = HWQ_SPDK_NVME;
 
-	tcache_init_perthread(storage_buf_tcache,
-			      &perthread_get(storage_buf_pt));
-
 	return 0;
 }
 
-/**
- * storage_init - initializes storage
- *
- */
-int storage_init(void)
+static int storage_nvme_init(void)
 {
 	int shm_id, rc;
 	struct spdk_env_opts opts;
 	void *buf;
 
-	if (!cfg_storage_enabled)
-		return 0;
-
 	spdk_env_opts_init(&opts);
 	opts.name = "shenango runtime";
 	shm_id = rand_crc32c((uintptr_t)myk());
@@ -382,7 +515,7 @@ int storage_init(void)
 		return 1;
 	}
 
-	if (controller == NULL) {
+	if (nr_storage_devs == 0) {
 		log_err("no NVMe controllers found");
 		return 1;
 	}
@@ -408,25 +541,610 @@ int storage_init(void)
 	return 0;
 }
 
-#else
-int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+#else /* DIRECT_STORAGE */
+
+static void *storage_dma_alloc(size_t len)
+{
+	return NULL;
+}
+
+static void storage_dma_free(void *buf, size_t len)
+{
+}
+
+static int storage_nvme_submit(struct storage_dev *dev, struct storage_q *q,
+			       int op, void *buf, uint64_t lba,
+			       uint32_t lba_count, struct storage_cmd *cmd)
 {
 	return -ENODEV;
 }
 
-int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+static int storage_nvme_poll(struct storage_q *q)
+{
+	return 0;
+}
+
+static int storage_nvme_init_thread(struct kthread *k, unsigned int idx)
 {
 	return -ENODEV;
 }
 
-int storage_init(void)
+static int storage_nvme_init(void)
 {
+	log_err("storage: please recompile with storage support");
+	return -ENODEV;
+}
+
+#endif /* DIRECT_STORAGE */
+
+
+/*
+ * Request submission
+ */
+
+/* maps a striped volume LBA to a device, a device LBA and the blocks left in
+ * the stripe unit */
+static unsigned int storage_stripe_map(uint64_t lba, uint64_t *dev_lba,
+				       uint32_t *max_count)
+{
+	uint64_t stripe = lba / cfg_storage_stripe_blocks;
+	uint64_t off = lba % cfg_storage_stripe_blocks;
+
+	*dev_lba = stripe / nr_storage_devs * cfg_storage_stripe_blocks + off;
+	*max_count = cfg_storage_stripe_blocks - off;
+	return stripe % nr_storage_devs;
+}
+
+static int storage_submit(struct kthread *k, unsigned int idx, int op,
+			  void *buf, uint64_t lba, uint32_t lba_count,
+			  struct storage_cmd *cmd)
+{
+	struct storage_dev *dev = &storage_devs[idx];
+	struct storage_q *q = &k->storage_q[idx];
+	int rc;
+
+	storage_cmd_get(cmd);
+
+	spin_lock(&q->lock);
+	if (dev->emulated)
+		rc = storage_emu_submit(dev, q, op, buf, lba, lba_count, cmd);
+	else
+		rc = storage_nvme_submit(dev, q, op, buf, lba, lba_count, cmd);
+	if (likely(rc == 0))
+		q->outstanding_reqs++;
+	spin_unlock(&q->lock);
+
+	if (dev->emulated && likely(rc == 0))
+		storage_emu_publish(k);
+
+	if (unlikely(rc != 0)) {
+		storage_cmd_put(cmd, true);
+		return -EIO;
+	}
+
 	return 0;
 }
 
-int storage_init_thread(void)
+/**
+ * storage_issue - submits a request without waiting for it
+ * @dev: the device index, or -1 for the default volume
+ * @op: STORAGE_OP_READ, STORAGE_OP_WRITE or STORAGE_OP_FLUSH
+ * @payload: the buffer (must come from storage_buf_alloc() for NVMe)
+ * @cmd: a command set up with storage_cmd_init()
+ *
+ * A striped request is split into one command per stripe unit, all of which
+ * are in flight at the same time on the calling kthread's device queues. A
+ * flush of the striped volume flushes every device. The caller must call
+ * storage_cmd_wait() even if this fails, as part of the request may have been
+ * submitted.
+ *
+ * Returns 0 if successful, -EINVAL if out of range, or -EIO on failure.
+ */
+int storage_issue(int dev, int op, void *payload, uint64_t lba,
+		  uint32_t lba_count, struct storage_cmd *cmd)
+{
+	struct kthread *k;
+	uint64_t dev_lba, nblocks;
+	uint32_t bsize, cnt;
+	unsigned int idx;
+	size_t off = 0;
+	int rc = 0;
+
+	if (!cfg_storage_enabled || nr_storage_devs == 0)
+		return -ENODEV;
+
+	bsize = dev < 0 ? block_size : storage_devs[dev].block_size;
+	nblocks = dev < 0 ? num_blocks : storage_devs[dev].num_blocks;
+	if (unlikely(lba + lba_count > nblocks))
+		return -EINVAL;
+
+	k = getk();
+
+	if (op == STORAGE_OP_FLUSH) {
+		if (dev >= 0 || !storage_striped)
+			rc = storage_submit(k, MAX(dev, 0), op, NULL, 0, 0, cmd);
+		for (idx = 0; storage_striped && dev < 0 &&
+			      idx < nr_storage_devs && !rc; idx++)
+			rc = storage_submit(k, idx, op, NULL, 0, 0, cmd);
+		putk();
+		return rc;
+	}
+
+	while (lba_count > 0) {
+		if (dev >= 0 || !storage_striped) {
+			idx = MAX(dev, 0);
+			dev_lba = lba;
+			cnt = lba_count;
+		} else {
+			idx = storage_stripe_map(lba, &dev_lba, &cnt);
+			cnt = MIN(cnt, lba_count);
+		}
+
+		rc = storage_submit(k, idx, op, (char *)payload + off,
+				    dev_lba, cnt, cmd);
+		if (unlikely(rc))
+			break;
+
+		lba += cnt;
+		lba_count -= cnt;
+		off += (size_t)cnt * bsize;
+	}
+
+	putk();
+	return rc;
+}
+
+/**
+ * storage_buf_alloc - allocates a buffer that devices can transfer to directly
+ */
+void *storage_buf_alloc(size_t len)
+{
+#ifdef DIRECT_STORAGE
+	if (!cfg_storage_emu_devs) {
+		return spdk_zmalloc(len, 0, NULL, SPDK_ENV_SOCKET_ID_ANY,
+				    SPDK_MALLOC_DMA);
+	}
+#endif
+	return aligned_alloc(CACHE_LINE_SIZE, align_up(len, CACHE_LINE_SIZE));
+}
+
+/**
+ * storage_buf_free - frees a buffer from storage_buf_alloc()
+ */
+void storage_buf_free(void *buf)
+{
+#ifdef DIRECT_STORAGE
+	if (!cfg_storage_emu_devs) {
+		spdk_free(buf);
+		return;
+	}
+#endif
+	free(buf);
+}
+
+/* performs a synchronous read or write, staging through DMA memory */
+static int storage_io(int dev, void *buf, uint64_t lba, uint32_t lba_count,
+		      int op)
 {
+	struct storage_cmd cmd;
+	void *payload = buf;
+	uint32_t bsize;
+	size_t req_size;
+	int rc;
+
+	if (!cfg_storage_enabled || nr_storage_devs == 0)
+		return -ENODEV;
+
+	bsize = dev < 0 ? block_size : storage_devs[dev].block_size;
+	req_size = (size_t)lba_count * bsize;
+
+	/* NVMe devices need DMA-able memory, emulated devices do not */
+	if (!cfg_storage_emu_devs) {
+		preempt_disable();
+		payload = storage_dma_alloc(req_size);
+		preempt_enable();
+		if (unlikely(payload == NULL))
+			return -ENOMEM;
+		if (op == STORAGE_OP_WRITE)
+			memcpy(payload, buf, req_size);
+	}
+
+	storage_cmd_init(&cmd);
+	rc = storage_issue(dev, op, payload, lba, lba_count, &cmd);
+	if (!rc)
+		rc = storage_cmd_wait(&cmd);
+	else
+		storage_cmd_wait(&cmd);
+
+	if (!cfg_storage_emu_devs) {
+		if (op == STORAGE_OP_READ && !rc)
+			memcpy(buf, payload, req_size);
+		preempt_disable();
+		storage_dma_free(payload, req_size);
+		preempt_enable();
+	}
+
+	return rc;
+}
+
+/**
+ * storage_write - write a payload to the default volume
+ *                 expects lba_count*storage_block_size() bytes to be allocated in the buffer
+ *
+ * returns -ENOMEM if no available memory, and -EIO if the write operation failed
+ */
+int storage_write(const void *payload, uint64_t lba, uint32_t lba_count)
+{
+	return storage_io(-1, (void *)payload, lba, lba_count,
+			  STORAGE_OP_WRITE);
+}
+
+/**
+ * storage_read - read a payload from the default volume
+ *                expects lba_count*storage_block_size() bytes to be allocated in the buffer
+ *
+ * returns -ENOMEM if no available memory, and -EIO if the write operation failed
+ */
+int storage_read(void *dest, uint64_t lba, uint32_t lba_count)
+{
+	return storage_io(-1, dest, lba, lba_count, STORAGE_OP_READ);
+}
+
+/**
+ * storage_dev_write - write a payload to a specific device
+ *
+ * returns -ENODEV if the device doesn't exist, otherwise see storage_write()
+ */
+int storage_dev_write(unsigned int dev, const void *payload, uint64_t lba,
+		      uint32_t lba_count)
+{
+	if (dev >= nr_storage_devs)
+		return -ENODEV;
+	return storage_io(dev, (void *)payload, lba, lba_count,
+			  STORAGE_OP_WRITE);
+}
+
+/**
+ * storage_dev_read - read a payload from a specific device
+ *
+ * returns -ENODEV if the device doesn't exist, otherwise see storage_read()
+ */
+int storage_dev_read(unsigned int dev, void *dest, uint64_t lba,
+		     uint32_t lba_count)
+{
+	if (dev >= nr_storage_devs)
+		return -ENODEV;
+	return storage_io(dev, dest, lba, lba_count, STORAGE_OP_READ);
+}
+
+/* an asynchronous read or write, see storage_read_async() */
+struct storage_async {
+	struct storage_cmd	cmd;
+	void			*buf;		/* the caller's buffer */
+	void			*payload;	/* DMA staging (or @buf) */
+	size_t			len;
+	int			op;
+	int			rc;		/* storage_issue() failure */
+	int			*status;
+	thread_fn_t		fn;
+	void			*arg;
+};
+
+/* runs on the thread readied by the request's last completion */
+static void storage_async_finish(void *arg)
+{
+	struct storage_async *a = arg;
+	thread_fn_t fn = a->fn;
+	void *fn_arg = a->arg;
+	int rc = a->rc ? a->rc : a->cmd.status;
+
+	if (a->payload != a->buf) {
+		if (a->op == STORAGE_OP_READ && !rc)
+			memcpy(a->buf, a->payload, a->len);
+		preempt_disable();
+		storage_dma_free(a->payload, a->len);
+		preempt_enable();
+	}
+	*a->status = rc;
+	sfree(a);
+
+	fn(fn_arg);
+}
+
+static int storage_io_async(int dev, void *buf, uint64_t lba,
+			    uint32_t lba_count, int op, int *status,
+			    thread_fn_t fn, void *arg)
+{
+	struct storage_async *a;
+	thread_t *th;
+	uint32_t bsize;
+
+	if (!cfg_storage_enabled || nr_storage_devs == 0)
+		return -ENODEV;
+
+	bsize = dev < 0 ? block_size : storage_devs[dev].block_size;
+	a = smalloc(sizeof(*a));
+	if (unlikely(!a))
+		return -ENOMEM;
+	a->buf = a->payload = buf;
+	a->len = (size_t)lba_count * bsize;
+	a->op = op;
+	a->status = status;
+	a->fn = fn;
+	a->arg = arg;
+
+	/* NVMe devices need DMA-able memory, emulated devices do not */
+	if (!cfg_storage_emu_devs) {
+		preempt_disable();
+		a->payload = storage_dma_alloc(a->len);
+		preempt_enable();
+		if (unlikely(!a->payload)) {
+			sfree(a);
+			return -ENOMEM;
+		}
+		if (op == STORAGE_OP_WRITE)
+			memcpy(a->payload, buf, a->len);
+	}
+
+	th = thread_create_lazy(storage_async_finish, a);
+	if (unlikely(!th)) {
+		if (a->payload != buf) {
+			preempt_disable();
+			storage_dma_free(a->payload, a->len);
+			preempt_enable();
+		}
+		sfree(a);
+		return -ENOMEM;
+	}
+
+	/* the caller's reference keeps @th from running until we drop it */
+	storage_cmd_init(&a->cmd);
+	a->cmd.waiter = th;
+	a->rc = storage_issue(dev, op, a->payload, lba, lba_count, &a->cmd);
+	preempt_disable();
+	storage_cmd_put(&a->cmd, false);
+	preempt_enable();
 	return 0;
 }
 
+/**
+ * storage_read_async - starts a read from the default volume without waiting
+ * @dest: the buffer, lba_count*storage_block_size() bytes long
+ * @lba: the first block
+ * @lba_count: the number of blocks
+ * @status: set to the result (0, -EINVAL, -EIO...) before @fn runs
+ * @fn: the function a new thread runs once the read completes
+ * @arg: an argument passed to @fn
+ *
+ * The thread is lazily stacked, so a pending read costs no stack.
+ *
+ * Returns 0 if the read was started (@fn runs exactly once), otherwise
+ * -ENODEV or -ENOMEM (@fn never runs).
+ */
+int storage_read_async(void *dest, uint64_t lba, uint32_t lba_count,
+		       int *status, thread_fn_t fn, void *arg)
+{
+	return storage_io_async(-1, dest, lba, lba_count, STORAGE_OP_READ,
+				status, fn, arg);
+}
+
+/**
+ * storage_write_async - starts a write to the default volume without waiting
+ * @payload: the buffer, lba_count*storage_block_size() bytes long
+ * @lba: the first block
+ * @lba_count: the number of blocks
+ * @status: set to the result (0, -EINVAL, -EIO...) before @fn runs
+ * @fn: the function a new thread runs once the write completes
+ * @arg: an argument passed to @fn
+ *
+ * @payload must stay untouched until @fn runs. See storage_read_async().
+ */
+int storage_write_async(const void *payload, uint64_t lba, uint32_t lba_count,
+			int *status, thread_fn_t fn, void *arg)
+{
+	return storage_io_async(-1, (void *)payload, lba, lba_count,
+				STORAGE_OP_WRITE, status, fn, arg);
+}
+
+/* issues a flush and waits for it */
+static int storage_flush_one(int dev)
+{
+	struct storage_cmd cmd;
+	int rc;
+
+	storage_cmd_init(&cmd);
+	rc = storage_issue(dev, STORAGE_OP_FLUSH, NULL, 0, 0, &cmd);
+	if (!rc)
+		return storage_cmd_wait(&cmd);
+
+	storage_cmd_wait(&cmd);
+	return rc;
+}
+
+/**
+ * storage_flush - makes all completed writes to the default volume durable
+ *
+ * returns -EIO if the flush failed
+ */
+int storage_flush(void)
+{
+	return storage_flush_one(-1);
+}
+
+/**
+ * storage_dev_flush - makes all completed writes to a device durable
+ *
+ * returns -ENODEV if the device doesn't exist, -EIO if the flush failed
+ */
+int storage_dev_flush(unsigned int dev)
+{
+	if (dev >= nr_storage_devs)
+		return -ENODEV;
+	return storage_flush_one(dev);
+}
+
+/**
+ * storage_num_devices - returns the number of attached devices
+ */
+unsigned int storage_num_devices(void)
+{
+	return nr_storage_devs;
+}
+
+/**
+ * storage_dev_block_size - returns the block size of a device (0 if invalid)
+ */
+uint32_t storage_dev_block_size(unsigned int dev)
+{
+	return dev < nr_storage_devs ? storage_devs[dev].block_size : 0;
+}
+
+/**
+ * storage_dev_num_blocks - returns the capacity of a device (0 if invalid)
+ */
+uint64_t storage_dev_num_blocks(unsigned int dev)
+{
+	return dev < nr_storage_devs ? storage_devs[dev].num_blocks : 0;
+}
+
+
+/*
+ * Completion processing
+ */
+
+static int storage_softirq_one(struct storage_dev *dev, struct storage_q *q)
+{
+	int ret;
+
+	assert_spin_lock_held(&q->lock);
+
+	if (dev->emulated)
+		ret = storage_emu_poll(dev, q);
+	else
+		ret = storage_nvme_poll(q);
+	q->outstanding_reqs -= ret;
+	return ret;
+}
+
+void storage_softirq(void *arg)
+{
+	struct kthread *k = arg;
+	struct storage_q *q;
+	int i, ret;
+
+	if (!cfg_storage_enabled)
+		return;
+
+	while (true) {
+		preempt_disable();
+		do {
+			ret = 0;
+			for (i = 0; i < nr_storage_devs; i++) {
+				q = &k->storage_q[i];
+				if (!ACCESS_ONCE(q->outstanding_reqs))
+					continue;
+				spin_lock(&q->lock);
+				ret += storage_softirq_one(&storage_devs[i], q);
+				spin_unlock(&q->lock);
+			}
+		} while (!preempt_needed() && ret > 0);
+		if (cfg_storage_emu_devs)
+			storage_emu_publish(k);
+		k->storage_busy = false;
+		thread_park_and_preempt_enable();
+	}
+}
+
+/**
+ * storage_init_thread - initializes storage (per-thread)
+ *
+ * Creates one queue per device for this kthread.
+ */
+int storage_init_thread(void)
+{
+	struct kthread *k = myk();
+	thread_t *th;
+	int i, ret;
+
+	if (!cfg_storage_enabled)
+		return 0;
+
+	th = thread_create(storage_softirq, k);
+	if (!th)
+		return -ENOMEM;
+
+	k->storage_softirq = th;
+
+	for (i = 0; i < nr_storage_devs; i++) {
+		spin_lock_init(&k->storage_q[i].lock);
+		k->storage_q[i].outstanding_reqs = 0;
+
+		if (storage_devs[i].emulated)
+			ret = storage_emu_init_thread(k, i);
+		else
+			ret = storage_nvme_init_thread(k, i);
+		if (ret)
+			return ret;
+	}
+
+#ifdef DIRECT_STORAGE
+	if (!cfg_storage_emu_devs)
+		tcache_init_perthread(storage_buf_tcache,
+				      &perthread_get(storage_buf_pt));
 #endif
+
+	return 0;
+}
+
+/* sets up the default volume, optionally striped across all devices */
+static int storage_volume_init(void)
+{
+	uint64_t min_blocks;
+	int i;
+
+	block_size = storage_devs[0].block_size;
+	if (!cfg_storage_stripe_blocks || nr_storage_devs == 1) {
+		num_blocks = storage_devs[0].num_blocks;
+		return 0;
+	}
+
+	min_blocks = storage_devs[0].num_blocks;
+	for (i = 1; i < nr_storage_devs; i++) {
+		if (storage_devs[i].block_size != block_size) {
+			log_err("storage: can't stripe devices with different "
+				"block sizes (%u vs %u)",
+				storage_devs[i].block_size, block_size);
+			return -EINVAL;
+		}
+		min_blocks = MIN(min_blocks, storage_devs[i].num_blocks);
+	}
+
+	storage_striped = true;
+	num_blocks = min_blocks / cfg_storage_stripe_blocks *
+		     cfg_storage_stripe_blocks * nr_storage_devs;
+	log_info("storage: striping %u devices, %u blocks per stripe unit, "
+		 "%lu blocks total", nr_storage_devs, cfg_storage_stripe_blocks,
+		 num_blocks);
+	return 0;
+}
+
+/**
+ * storage_init - initializes storage
+ *
+ */
+int storage_init(void)
+{
+	int ret;
+
+	if (!cfg_storage_enabled)
+		return 0;
+
+	if (cfg_storage_emu_devs)
+		ret = storage_emu_init();
+	else
+		ret = storage_nvme_init();
+	if (ret)
+		return ret;
+
+	return storage_volume_init();
+}
@@ -0,0 +1,372 @@
+/*
+ * storage_stream.c - sequential read-ahead and write coalescing
+ */
+
+#include <stdlib.h>
+
+#include <base/log.h>
+#include <runtime/storage.h>
+
+#include "defs.h"
+
+/* the first read-ahead window once a stream looks sequential */
+#define STREAM_RA_MIN_BLOCKS	8
+
+/* a read-ahead buffer, filled synchronously or in the background */
+struct stream_buf {
+	void			*data;
+	uint64_t		lba;
+	uint32_t		lba_count;
+	bool			valid;
+	bool			inflight;
+	struct storage_cmd	cmd;
+};
+
+struct storage_stream {
+	int			dev;
+	uint32_t		block_size;
+	uint64_t		num_blocks;
+
+	/* sequential detection and read-ahead */
+	uint64_t		next_lba;
+	unsigned int		seq_run;
+	uint32_t		ra_max;
+	uint32_t		ra_window;
+	unsigned int		cur;
+	struct stream_buf	bufs[2];
+
+	/* write coalescing */
+	void			*wb;
+	uint64_t		wb_lba;
+	uint32_t		wb_count;
+	uint32_t		wb_max;
+};
+
+static bool ranges_overlap(uint64_t a, uint32_t alen, uint64_t b, uint32_t blen)
+{
+	return a < b + blen && b < a + alen;
+}
+
+static int stream_buf_wait(struct stream_buf *b)
+{
+	int ret;
+
+	if (!b->inflight)
+		return 0;
+
+	ret = storage_cmd_wait(&b->cmd);
+	b->inflight = false;
+	if (ret)
+		b->valid = false;
+	return ret;
+}
+
+static int stream_buf_fill(struct storage_stream *s, struct stream_buf *b,
+			   uint64_t lba, uint32_t lba_count, bool async)
+{
+	int ret;
+
+	lba_count = MIN(lba_count, s->ra_max);
+	lba_count = MIN(lba_count, s->num_blocks - lba);
+
+	b->lba = lba;
+	b->lba_count = lba_count;
+	b->valid = true;
+	b->inflight = true;
+	storage_cmd_init(&b->cmd);
+	ret = storage_issue(s->dev, STORAGE_OP_READ, b->data, lba, lba_count,
+			    &b->cmd);
+	if (ret) {
+		stream_buf_wait(b);
+		b->valid = false;
+		return ret;
+	}
+
+	return async ? 0 : stream_buf_wait(b);
+}
+
+static struct stream_buf *stream_lookup(struct storage_stream *s, uint64_t lba)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s->bufs); i++) {
+		struct stream_buf *b = &s->bufs[(s->cur + i) % 2];
+
+		if (b->valid && lba >= b->lba && lba < b->lba + b->lba_count)
+			return b;
+	}
+
+	return NULL;
+}
+
+static void stream_invalidate(struct storage_stream *s, uint64_t lba,
+			      uint32_t lba_count)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(s->bufs); i++) {
+		struct stream_buf *b = &s->bufs[i];
+
+		if (!b->valid ||
+		    !ranges_overlap(lba, lba_count, b->lba, b->lba_count))
+			continue;
+		stream_buf_wait(b);
+		b->valid = false;
+	}
+}
+
+static int stream_flush_wb(struct storage_stream *s)
+{
+	struct storage_cmd cmd;
+	int ret;
+
+	if (!s->wb_count)
+		return 0;
+
+	storage_cmd_init(&cmd);
+	ret = storage_issue(s->dev, STORAGE_OP_WRITE, s->wb, s->wb_lba,
+			    s->wb_count, &cmd);
+	if (!ret)
+		ret = storage_cmd_wait(&cmd);
+	else
+		storage_cmd_wait(&cmd);
+
+	/* read-ahead may have cached the range before these writes landed */
+	stream_invalidate(s, s->wb_lba, s->wb_count);
+	s->wb_count = 0;
+	return ret;
+}
+
+static int stream_dev_read(struct storage_stream *s, void *dest, uint64_t lba,
+			   uint32_t lba_count)
+{
+	if (s->dev < 0)
+		return storage_read(dest, lba, lba_count);
+	return storage_dev_read(s->dev, dest, lba, lba_count);
+}
+
+static int stream_dev_write(struct storage_stream *s, const void *payload,
+			    uint64_t lba, uint32_t lba_count)
+{
+	if (s->dev < 0)
+		return storage_write(payload, lba, lba_count);
+	return storage_dev_write(s->dev, payload, lba, lba_count);
+}
+
+/**
+ * storage_stream_create - creates a stream over a device or the default volume
+ * @dev: the device index, or -1 for the default volume
+ * @ra_max_blocks: the largest read-ahead window (0 disables read-ahead)
+ * @wb_blocks: the size of the write-coalescing buffer (0 disables coalescing)
+ * @s_out: a pointer to store the new stream
+ *
+ * Returns 0 if successful, -ENODEV if the device doesn't exist, or -ENOMEM.
+ */
+int storage_stream_create(int dev, uint32_t ra_max_blocks, uint32_t wb_blocks,
+			  storage_stream_t **s_out)
+{
+	struct storage_stream *s;
+	int i;
+
+	if (!cfg_storage_enabled || dev >= (int)nr_storage_devs ||
+	    nr_storage_devs == 0)
+		return -ENODEV;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->dev = dev;
+	s->block_size = dev < 0 ? storage_block_size() :
+				  storage_dev_block_size(dev);
+	s->num_blocks = dev < 0 ? storage_num_blocks() :
+				  storage_dev_num_blocks(dev);
+	s->next_lba = UINT64_MAX;
+	s->ra_max = ra_max_blocks;
+	s->ra_window = MIN(STREAM_RA_MIN_BLOCKS, ra_max_blocks);
+	s->wb_max = wb_blocks;
+
+	for (i = 0; ra_max_blocks && i < ARRAY_SIZE(s->bufs); i++) {
+		s->bufs[i].data = storage_buf_alloc((size_t)ra_max_blocks *
+						    s->block_size);
+		if (!s->bufs[i].data)
+			goto fail;
+	}
+
+	if (wb_blocks) {
+		s->wb = storage_buf_alloc((size_t)wb_blocks * s->block_size);
+		if (!s->wb)
+			goto fail;
+	}
+
+	*s_out = s;
+	return 0;
+
+fail:
+	storage_stream_destroy(s);
+	return -ENOMEM;
+}
+
+/**
+ * storage_stream_read - reads blocks through a stream
+ *
+ * Once reads look sequential, the stream reads ahead into a buffer and
+ * prefetches the following window in the background, doubling the window up
+ * to @ra_max_blocks as long as the pattern continues.
+ *
+ * Returns 0 if successful, -EINVAL if out of range, -EIO on failure.
+ */
+int storage_stream_read(storage_stream_t *s, void *dest, uint64_t lba,
+			uint32_t lba_count)
+{
+	struct stream_buf *b, *o;
+	char *pos = dest;
+	uint64_t end;
+	uint32_t n;
+	int ret;
+
+	if (unlikely(lba + lba_count > s->num_blocks))
+		return -EINVAL;
+
+	/* make buffered writes visible to this read */
+	if (s->wb_count &&
+	    ranges_overlap(lba, lba_count, s->wb_lba, s->wb_count)) {
+		ret = stream_flush_wb(s);
+		if (ret)
+			return ret;
+	}
+
+	if (lba == s->next_lba) {
+		s->seq_run++;
+	} else {
+		s->seq_run = 0;
+		s->ra_window = MIN(STREAM_RA_MIN_BLOCKS, s->ra_max);
+	}
+	s->next_lba = lba + lba_count;
+
+	while (lba_count > 0) {
+		b = stream_lookup(s, lba);
+		if (!b) {
+			/* random access, don't pollute the buffers */
+			if (!s->ra_max || !s->seq_run)
+				return stream_dev_read(s, pos, lba, lba_count);
+
+			b = &s->bufs[s->cur ^ 1];
+			stream_buf_wait(b);
+			ret = stream_buf_fill(s, b, lba,
+					      MAX(lba_count, s->ra_window),
+					      false);
+			if (ret)
+				return ret;
+		}
+
+		ret = stream_buf_wait(b);
+		if (ret)
+			return stream_dev_read(s, pos, lba, lba_count);
+
+		n = MIN(lba_count, b->lba + b->lba_count - lba);
+		memcpy(pos, (char *)b->data + (lba - b->lba) * s->block_size,
+		       (size_t)n * s->block_size);
+		pos += (size_t)n * s->block_size;
+		lba += n;
+		lba_count -= n;
+		s->cur = b - s->bufs;
+	}
+
+	/* prefetch the next window once the reader enters the newest buffer */
+	if (s->seq_run > 0 && s->ra_max) {
+		b = &s->bufs[s->cur];
+		o = &s->bufs[s->cur ^ 1];
+		end = b->lba + b->lba_count;
+		if (!o->inflight && !(o->valid && o->lba == end) &&
+		    end < s->num_blocks) {
+			s->ra_window = MIN(s->ra_window * 2, s->ra_max);
+			stream_buf_fill(s, o, end, s->ra_window, true);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * storage_stream_write - writes blocks through a stream
+ *
+ * Writes that extend the buffered range are copied into the coalescing buffer
+ * and return immediately; they are submitted as one command later.
+ *
+ * Returns 0 if successful, -EINVAL if out of range, -EIO on failure (which
+ * may be reported for an earlier buffered write).
+ */
+int storage_stream_write(storage_stream_t *s, const void *payload,
+			 uint64_t lba, uint32_t lba_count)
+{
+	int ret;
+
+	if (unlikely(lba + lba_count > s->num_blocks))
+		return -EINVAL;
+
+	stream_invalidate(s, lba, lba_count);
+
+	if (s->wb_count && (lba != s->wb_lba + s->wb_count ||
+			    s->wb_count + lba_count > s->wb_max)) {
+		ret = stream_flush_wb(s);
+		if (ret)
+			return ret;
+	}
+
+	if (lba_count > s->wb_max)
+		return stream_dev_write(s, payload, lba, lba_count);
+
+	if (!s->wb_count)
+		s->wb_lba = lba;
+	memcpy((char *)s->wb + (size_t)s->wb_count * s->block_size, payload,
+	       (size_t)lba_count * s->block_size);
+	s->wb_count += lba_count;
+
+	if (s->wb_count == s->wb_max)
+		return stream_flush_wb(s);
+
+	return 0;
+}
+
+/**
+ * storage_stream_flush - a durability barrier for writes through the stream
+ *
+ * Submits any buffered writes, waits for them, then flushes the device's
+ * volatile write cache.
+ *
+ * Returns 0 if successful, -EIO on failure.
+ */
+int storage_stream_flush(storage_stream_t *s)
+{
+	int ret;
+
+	ret = stream_flush_wb(s);
+	if (ret)
+		return ret;
+
+	if (s->dev < 0)
+		return storage_flush();
+	return storage_dev_flush(s->dev);
+}
+
+/**
+ * storage_stream_destroy - submits buffered writes and frees a stream
+ */
+void storage_stream_destroy(storage_stream_t *s)
+{
+	int i;
+
+	if (stream_flush_wb(s))
+		log_warn("storage: lost buffered writes at lba %lu", s->wb_lba);
+
+	for (i = 0; i < ARRAY_SIZE(s->bufs); i++) {
+		stream_buf_wait(&s->bufs[i]);
+		if (s->bufs[i].data)
+			storage_buf_free(s->bufs[i].data);
+	}
+
+	if (s->wb)
+		storage_buf_free(s->wb);
+	free(s);
+}
@@ -100,9 +100,28 @@ static void update_q_ptrs(struct kthread *k)
 
 	if (k->timern)
 		next_tsc = k->timers[0].deadline_us * cycles_per_us + start_tsc;
+	if (k->storage_wake_tsc &&
+	    (!next_tsc || k->storage_wake_tsc < next_tsc))
+		next_tsc = k->storage_wake_tsc;
 	ACCESS_ONCE(k->q_ptrs->next_timer_tsc) = next_tsc;
 }
 
+/**
+ * timer_set_wake_tsc - asks the iokernel to wake a parked kthread by @tsc
+ * @k: the kthread
+ * @tsc: the deadline, or 0 to clear it
+ *
+ * The deadline is published along with the earliest timer, so the iokernel
+ * wakes the kthread for whichever comes first.
+ */
+void timer_set_wake_tsc(struct kthread *k, uint64_t tsc)
+{
+	spin_lock(&k->timer_lock);
+	k->storage_wake_tsc = tsc;
+	update_q_ptrs(k);
+	spin_unlock(&k->timer_lock);
+}
+
 /**
  * timer_earliest_deadline - return the first deadline for this kthread or 0 if
  * there are no active timers.
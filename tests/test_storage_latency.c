@@ -0,0 +1,99 @@
+/*
+ * test_storage_latency.c - measures I/O latency at low load, where kthreads
+ * park between requests and must be woken for completions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/timer.h>
+#include <runtime/storage.h>
+
+
+#define SAMPLES		20000
+#define LBA_COUNT	8
+/*
+ * think times between requests, long enough for kthreads to park (for
+ * emulated devices too, unless storage_poll_us is set very high)
+ */
+static const uint64_t think_us[] = {0, 10, 100, 1000};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(uint64_t think, uint64_t *lat)
+{
+	uint64_t nblocks = storage_num_blocks(), lba, start;
+	char *p;
+	int i;
+
+	p = malloc(LBA_COUNT * storage_block_size());
+	BUG_ON(!p);
+
+	for (i = 0; i < SAMPLES; i++) {
+		if (think)
+			timer_sleep(think);
+		lba = (uint64_t)rand() * LBA_COUNT % (nblocks - LBA_COUNT);
+		start = rdtsc();
+		BUG_ON(storage_read(p, lba, LBA_COUNT));
+		lat[i] = rdtsc() - start;
+	}
+
+	free(p);
+	qsort(lat, SAMPLES, sizeof(*lat), cmp_u64);
+}
+
+static double pct(uint64_t *lat, double p)
+{
+	return (double)lat[(int)(SAMPLES * p)] / cycles_per_us;
+}
+
+static void main_handler(void *arg)
+{
+	uint64_t *lat;
+	int i;
+
+	if (storage_num_devices() == 0) {
+		log_info("storage support is disabled, skipping test");
+		return;
+	}
+
+	lat = malloc(SAMPLES * sizeof(*lat));
+	BUG_ON(!lat);
+
+	for (i = 0; i < ARRAY_SIZE(think_us); i++) {
+		run(think_us[i], lat);
+		log_info("think %4lu us: p50 %.1f us, p99 %.1f us, p99.9 %.1f us",
+			 think_us[i], pct(lat, 0.5), pct(lat, 0.99),
+			 pct(lat, 0.999));
+	}
+
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
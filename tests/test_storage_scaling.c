@@ -0,0 +1,113 @@
+/*
+ * test_storage_scaling.c - measures how aggregate IOPS scales with the number
+ * of storage devices (works with NVMe or emulated devices)
+ */
+
+#include <stdio.h>
+
+#include <base/atomic.h>
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/storage.h>
+
+
+#define WORKERS		64
+#define N		20000
+#define LBA_COUNT	8
+
+struct worker_args {
+	waitgroup_t	*wg;
+	int		tid;
+	int		ndevs;	/* 0 means the default volume */
+};
+
+static void work_handler(void *arg)
+{
+	struct worker_args *args = arg;
+	uint64_t nblocks, lba;
+	int i, dev;
+	char *p;
+
+	p = malloc(LBA_COUNT * storage_block_size());
+	BUG_ON(!p);
+
+	for (i = 0; i < N; i++) {
+		if (args->ndevs == 0) {
+			nblocks = storage_num_blocks();
+			lba = (uint64_t)(args->tid * N + i) * LBA_COUNT %
+			      (nblocks - LBA_COUNT);
+			BUG_ON(storage_read(p, lba, LBA_COUNT));
+			continue;
+		}
+
+		dev = (args->tid + i) % args->ndevs;
+		nblocks = storage_dev_num_blocks(dev);
+		lba = (uint64_t)(args->tid * N + i) * LBA_COUNT %
+		      (nblocks - LBA_COUNT);
+		BUG_ON(storage_dev_read(dev, p, lba, LBA_COUNT));
+	}
+
+	free(p);
+	waitgroup_done(args->wg);
+}
+
+static double run(int ndevs)
+{
+	struct worker_args args[WORKERS];
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i, ret;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, WORKERS);
+	start_us = microtime();
+	for (i = 0; i < WORKERS; i++) {
+		args[i].wg = &wg;
+		args[i].tid = i;
+		args[i].ndevs = ndevs;
+		ret = thread_spawn(work_handler, &args[i]);
+		BUG_ON(ret);
+	}
+
+	waitgroup_wait(&wg);
+	return (double)(WORKERS * N) / ((microtime() - start_us) * 0.000001);
+}
+
+static void main_handler(void *arg)
+{
+	unsigned int ndevs = storage_num_devices();
+	int i;
+
+	if (ndevs == 0) {
+		log_info("storage support is disabled, skipping test");
+		return;
+	}
+
+	for (i = 1; i <= ndevs; i++)
+		log_info("%d device(s): %f IOPS", i, run(i));
+
+	log_info("default volume (%lu blocks): %f IOPS", storage_num_blocks(),
+		 run(0));
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}
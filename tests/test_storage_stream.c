@@ -0,0 +1,208 @@
+/*
+ * test_storage_stream.c - compares sequential-scan throughput and small-write
+ * IOPS with and without storage streams (read-ahead and write coalescing)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+#include <runtime/runtime.h>
+#include <runtime/thread.h>
+#include <runtime/sync.h>
+#include <runtime/storage.h>
+
+
+#define WORKERS		8
+#define SCAN_BLOCKS	65536	/* per worker */
+#define READ_BLOCKS	1
+#define WRITES		20000	/* per worker */
+#define FLUSH_EVERY	256
+#define RA_MAX_BLOCKS	256
+#define WB_BLOCKS	64
+#define CHECK_BLOCKS	512
+#define CHECK_WB_LBA	128	/* left buffered while the scan reads ahead */
+#define CHECK_WB_BLOCKS	32
+
+struct worker_args {
+	waitgroup_t	*wg;
+	int		tid;
+	bool		use_stream;
+	bool		write;
+};
+
+static void scan_worker(struct worker_args *args, storage_stream_t *s,
+			char *buf)
+{
+	uint64_t base = (uint64_t)args->tid * SCAN_BLOCKS;
+	uint64_t lba;
+
+	for (lba = base; lba < base + SCAN_BLOCKS; lba += READ_BLOCKS) {
+		if (s)
+			BUG_ON(storage_stream_read(s, buf, lba, READ_BLOCKS));
+		else
+			BUG_ON(storage_read(buf, lba, READ_BLOCKS));
+	}
+}
+
+static void write_worker(struct worker_args *args, storage_stream_t *s,
+			 char *buf)
+{
+	uint64_t base = (uint64_t)args->tid * WRITES;
+	int i;
+
+	for (i = 0; i < WRITES; i++) {
+		if (s) {
+			BUG_ON(storage_stream_write(s, buf, base + i, 1));
+			if ((i + 1) % FLUSH_EVERY == 0)
+				BUG_ON(storage_stream_flush(s));
+		} else {
+			BUG_ON(storage_write(buf, base + i, 1));
+			if ((i + 1) % FLUSH_EVERY == 0)
+				BUG_ON(storage_flush());
+		}
+	}
+
+	if (s)
+		BUG_ON(storage_stream_flush(s));
+}
+
+static void work_handler(void *arg)
+{
+	struct worker_args *args = arg;
+	storage_stream_t *s = NULL;
+	char *buf;
+
+	buf = malloc(READ_BLOCKS * storage_block_size());
+	BUG_ON(!buf);
+
+	if (args->use_stream)
+		BUG_ON(storage_stream_create(-1, RA_MAX_BLOCKS, WB_BLOCKS, &s));
+
+	if (args->write)
+		write_worker(args, s, buf);
+	else
+		scan_worker(args, s, buf);
+
+	if (s)
+		storage_stream_destroy(s);
+	free(buf);
+	waitgroup_done(args->wg);
+}
+
+static double run(bool use_stream, bool write)
+{
+	struct worker_args args[WORKERS];
+	waitgroup_t wg;
+	uint64_t start_us;
+	int i;
+
+	waitgroup_init(&wg);
+	waitgroup_add(&wg, WORKERS);
+	start_us = microtime();
+	for (i = 0; i < WORKERS; i++) {
+		args[i].wg = &wg;
+		args[i].tid = i;
+		args[i].use_stream = use_stream;
+		args[i].write = write;
+		BUG_ON(thread_spawn(work_handler, &args[i]));
+	}
+
+	waitgroup_wait(&wg);
+	return (double)(microtime() - start_us) * 0.000001;
+}
+
+static void fill_block(char *buf, uint64_t lba, char gen)
+{
+	memset(buf, (char)(lba * 7 + gen), storage_block_size());
+}
+
+/*
+ * Writes a range through the stream but leaves it in the coalescing buffer,
+ * then scans across it so that read-ahead fills past it, and checks that
+ * every block reads back with its latest contents.
+ */
+static void check_readback(void)
+{
+	size_t bsize = storage_block_size();
+	storage_stream_t *s;
+	char *buf, *expect;
+	uint64_t lba;
+	char gen;
+
+	buf = malloc(bsize);
+	expect = malloc(bsize);
+	BUG_ON(!buf || !expect);
+
+	for (lba = 0; lba < CHECK_BLOCKS; lba++) {
+		fill_block(buf, lba, 0);
+		BUG_ON(storage_write(buf, lba, 1));
+	}
+
+	BUG_ON(storage_stream_create(-1, RA_MAX_BLOCKS, WB_BLOCKS, &s));
+	for (lba = CHECK_WB_LBA; lba < CHECK_WB_LBA + CHECK_WB_BLOCKS; lba++) {
+		fill_block(buf, lba, 1);
+		BUG_ON(storage_stream_write(s, buf, lba, 1));
+	}
+
+	for (lba = 0; lba < CHECK_BLOCKS; lba++) {
+		gen = lba >= CHECK_WB_LBA &&
+		      lba < CHECK_WB_LBA + CHECK_WB_BLOCKS;
+		fill_block(expect, lba, gen);
+		BUG_ON(storage_stream_read(s, buf, lba, 1));
+		if (memcmp(buf, expect, bsize))
+			panic("stream read stale data at lba %lu", lba);
+	}
+
+	storage_stream_destroy(s);
+	free(expect);
+	free(buf);
+	log_info("stream read-back after buffered writes: ok");
+}
+
+static void main_handler(void *arg)
+{
+	double secs, mb;
+
+	if (storage_num_devices() == 0) {
+		log_info("storage support is disabled, skipping test");
+		return;
+	}
+
+	BUG_ON(storage_num_blocks() < WORKERS * MAX(SCAN_BLOCKS, WRITES));
+
+	check_readback();
+
+	mb = (double)WORKERS * SCAN_BLOCKS * storage_block_size() / MB;
+	secs = run(false, false);
+	log_info("sequential scan, %d-block reads: %f MB/s", READ_BLOCKS,
+		 mb / secs);
+	secs = run(true, false);
+	log_info("sequential scan, %d-block reads, read-ahead: %f MB/s",
+		 READ_BLOCKS, mb / secs);
+
+	secs = run(false, true);
+	log_info("1-block writes: %f IOPS", WORKERS * WRITES / secs);
+	secs = run(true, true);
+	log_info("1-block writes, coalesced: %f IOPS", WORKERS * WRITES / secs);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	if (argc < 2) {
+		printf("arg must be config file\n");
+		return -EINVAL;
+	}
+
+	ret = runtime_init(argv[1], main_handler, NULL);
+	if (ret) {
+		printf("failed to start runtime\n");
+		return ret;
+	}
+
+	return 0;
+}